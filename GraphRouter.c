@@ -35,38 +35,218 @@
 #include "ForwardTable.h"
 #include "Log.h"
 #include "BuildInfo.h"
+#include "lib/Reactor.h"
+#include "lib/Mailbox.h"
+#include "lib/Snapshot.h"
+#include "lib/Resequencer.h"
+#include "lib/Combiner.h"
+#include "lib/Affinity.h"
+#include "lib/FrameBuffer.h"
+#include "lib/ShmLink.h"
+#include "lib/Fanout.h"
+#include "lib/PacketBuffer.h"
+#include "lib/BufferPool.h"
+#include "lib/ZeroCopy.h"
+#include "lib/Histogram.h"
+#ifdef HAVE_IO_URING
+#include "lib/Uring.h"
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
 #include <poll.h>
+#include <time.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <getopt.h>
 #include "lib/klib/khash.h"
 #include "lib/klib/kvec.h"
+#include "lib/klib/kdq.h"
 #include <netinet/tcp.h>
 
-#define MAX_MONITOR_FDS 128
+#define ROUTER_MAX_EVENTS 256
+
+// A shared-memory link offer carries the memfd and both bells
+#define ROUTER_PASSED_FDS 3
+
+// Per-connection output queue bound, in bytes. Sources are paused above the high watermark,
+// and resumed once the queue falls back under the low watermark.
+#define ROUTER_QUEUE_LIMIT (1024 * 1024)
+#define QUEUE_HIGH_WATER(limit) (((limit) / 4) * 3)
+#define QUEUE_LOW_WATER(limit)  ((limit) / 4)
+
+// Largest broadcast frame that can be staged for a zero-copy fan-out (the default pipe-max-size)
+#define ROUTER_SPLICE_CAPACITY (1024 * 1024)
+
+// Frames held back for a connection with a latency budget go out as soon as this many bytes are waiting
+#define ROUTER_COALESCE_BYTES (16 * 1024)
+
+// Buffers held for unfinished zero-copy sends, beyond which the error queue is read on every flush
+#define ROUTER_ZEROCOPY_PINNED 64
+
+// SO_BUSY_POLL budget for each TCP connection in --busy-poll mode
+#define ROUTER_BUSY_POLL_USEC 50
+
+// How often the control thread prints the status, in microseconds
+#define ROUTER_STATUS_INTERVAL (10 * 1000000)
+
+#define ROUTER_MAX_CPUS 64
+
+// Connections accepted from one listen socket per wakeup, before going back to established traffic.
+// Also the burst the admission limiter allows.
+#define ROUTER_ACCEPT_BATCH 32
+
+// Bytes each connection may read per turn of the scheduler, times its weight
+#define ROUTER_READ_QUANTUM (64 * 1024)
+
+// Reads a connection still has waiting when its turn ends, see connection_t.pending
+#define READ_PENDING_SOCKET 0x1
+#define READ_PENDING_LINK   0x2
+
+// How far ahead of a merge's next sequence number frames are held, and how long (us) a missing one is waited for
+#define ROUTER_MERGE_WINDOW  1024
+#define ROUTER_MERGE_TIMEOUT 20000
+
+// How many whole messages each input of a combine can hold, and how long (us) a round waits for a missing input
+#define ROUTER_COMBINE_DEPTH   64
+#define ROUTER_COMBINE_TIMEOUT 20000
 
 #define SYSTEM_ACTIVE 1
 #define SYSTEM_STOP   0
 
 struct _configuration {
     size_t network_mtu;
+    size_t queue_limit;
+    size_t splice_threshold; // Broadcast frames at least this big are fanned out with splice(), 0 to never
+    size_t coalesce_bytes;   // Held frames are flushed once this many bytes are waiting, whatever the deadline
+    size_t zerocopy_threshold; // TCP sends of at least this many bytes use MSG_ZEROCOPY, 0 to never
+    bool busy_poll;          // Spin on readiness rather than sleeping in the reactor
+    int cpus[ROUTER_MAX_CPUS]; // Shard i is pinned to cpus[i % cpu_count]
+    int cpu_count;
+    int backlog;             // listen() backlog for every listen socket
+    uint32_t admit_rate;     // New connections accepted per second at most, 0 for no limit
+    size_t read_quantum;     // Bytes read from each connection per scheduling round, before its weight
+    uint32_t merge_window;   // Sequence numbers each merge target can hold ahead of the one it is waiting for
+    uint32_t merge_timeout;  // Microseconds a merge waits for a missing sequence number before giving up on it
+    uint32_t combine_depth;  // Whole messages each input of a combine target can hold
+    uint32_t combine_timeout; // Microseconds a combine round waits for its missing inputs before going without them
+    int combine_format;      // COMBINE_CONCAT or COMBINE_TUPLE
     int system_state;
     int verbosity;
 
     bool arg_dot;
+    bool arg_io_uring;
+    bool arg_cut_through;
 };
 
 struct _configuration config;
 
+// Room for a burst of full-size frames per connection
+#define INPUT_BUFFER_SIZE (config.network_mtu * 20)
+
+
+// The most queued frames gathered into a single send
+#define ROUTER_FLUSH_IOV 64
+
+/** One queued frame, or the unsent end of one, holding a reference to the buffer it lives in */
 typedef struct {
-    uint8_t * buffer;
-    uint8_t * buffer_tail;
-} local_buffer_t;
+    gnw_buf_t * buf;
+    size_t offset;  // Bytes of this frame already sent
+    int passed_fd;  // A descriptor to send along with the frame's first byte, or -1
+    uint64_t stamp; // When the frame arrived (see router_stamp()), for the hop latency, or 0 if not measured
+} output_entry_t;
+
+KDQ_INIT( output_entry_t );
+
+/** A reference kept on a buffer the kernel is still sending from, until its zero-copy send completes */
+typedef struct {
+    uint32_t send; // The zero-copy send number
+    gnw_buf_t * buf;
+} output_pin_t;
+
+KDQ_INIT( output_pin_t );
+KDQ_INIT( int );
+
+typedef struct {
+    kdq_t( output_entry_t ) * entries; // Created on first use
+    size_t queued;                     // Unsent bytes, over every entry
+    kdq_t( output_pin_t ) * pinned;    // Sent, but not yet released by the kernel, oldest first
+} output_queue_t;
 
 /**
- * Context for a given connection to a running node or subgraph-router.
+ * Per-fd connection state, indexed directly by the fd in the connection table.
  */
 typedef struct {
+    int fd;
+    bool active;
+    framebuffer_t input;
+
+    output_queue_t output;
+    uint32_t interest;      // The reactor flags currently registered for this fd
+    bool paused;            // Reads are suspended until a congested target drains
+    int transport;          // TRANSPORT_* this connection arrived over
+    shmlink_t * link;       // Shared-memory data path, once negotiated over a unix stream connection
+    bool link_settled;      // The socket has been read dry since the link took over, so its ring is next in line
+    zerocopy_t zerocopy;    // MSG_ZEROCOPY state, for TCP connections when enabled
+
+    // Small frames wait up to latency_budget microseconds for others to share their send
+    uint32_t latency_budget;  // 0 to send every frame straight away
+    uint64_t hold_deadline;   // When the frames being held must go, or 0 if nothing is held
+
+    // Deficit round robin over everything with input waiting, so each connection reads its share per round
+    uint32_t read_weight;     // Quanta per round, 1 for an even share
+    int64_t deficit;          // Carried to the next turn, negative if a whole datagram overran the last one
+    uint8_t pending;          // READ_PENDING_* reads left waiting in the run queue when the turn ended
+    uint64_t read_bytes;      // Since the last status
+    uint64_t read_deferred;   // Turns that ended with input still waiting, since the last status
+
+    // A frame too big for the input buffer, passed through as GNW_MORE fragments rather than held whole
+    gnw_stream_t stream;
+
+    // Descriptors received with SCM_RIGHTS, held until the command they came with claims them
+    int passed[ROUTER_PASSED_FDS];
+    int passed_count;
+
+    kvec_t( int ) blocked;  // Sources paused waiting on this connection's output queue
+    gnw_address_t address;  // The address it bound last, whose load it publishes, or GNW_ANY
+    uint32_t socket_queued; // Sent but not yet read by the peer, as of the last sample plus what has gone since
+    bool load_listed;       // Is in the shard's sampling list
+
+#ifdef HAVE_IO_URING
+    uint32_t generation;           // Distinguishes completions for a previous user of this fd
+    size_t send_queued;            // Bytes in the send queue, in flight or not
+    struct uring_send * send_head; // In-order send queue, the head is the one in flight
+    struct uring_send * send_tail;
+#endif
+} connection_t;
+
+struct context;
+
+/** How one edge shares a round-robin source's messages, parallel to the source's 'forward' */
+typedef struct {
+    uint32_t weight;
+    int64_t current;   // Smooth weighted round-robin credit, the edge with the most goes next
+    uint64_t messages; // Sent along this edge since the edges last changed
+} edge_share_t;
+
+/** A forward target, resolved ahead of time so the data path doesn't look it up for every frame */
+typedef struct {
+    gnw_address_t address;
+    int owner;                // The shard that owns the target
+    struct context * context; // The target's context if this shard owns it and it exists, else NULL
+    int fd;                   // The target's bound connection, or -1
+} route_t;
+
+/**
+ * Context for a given connection to a running node or subgraph-router.
+ */
+typedef struct context {
     kvec_t( gnw_address_t ) forward;
+    kvec_t( route_t ) routes; // 'forward', resolved as of routes_epoch
+    uint64_t routes_epoch;    // Stale unless it matches the shard's topology_epoch
 
     int forward_policy;
     int bound_fd;
@@ -76,13 +256,203 @@ typedef struct {
     uint64_t packets_out;
     uint64_t bytes_in;
     uint64_t bytes_out;
+    uint64_t packets_dropped;
+
+    int fragment_route;       // The route taking the rest of a message arriving in GNW_MORE fragments, or -1
+    uint32_t latency_budget;  // Write coalescing budget (us) for whichever connection binds this address
+    uint32_t read_weight;     // Read scheduling weight for whichever connection binds this address
+    uint64_t rotation;        // Round-robin position, advanced once per message rather than per fragment
+    kvec_t( edge_share_t ) shares; // Per edge, as of the last time the edges changed
+    bool weighted;            // Some edge has a weight other than 1, so round-robin has to follow the weights
+    affinity_key_t affinity;  // Where the keys of an affinity source's messages come from
+    uint64_t unkeyed;         // Affinity messages without a key, which went to a target at random
+
+    int cut_state;            // CUT_* state of the direct link for this source's only edge
+    int cut_fd;               // The target's end of the direct link, held until the source switches over
+    gnw_address_t cut_target;
+
+    // Frames merged into this address, put back in sequence order before they are sent
+    reseq_t * merge;          // Created by the first GNW_SEQUENCED frame to arrive over a merge edge
+    uint64_t merge_since;     // When it started waiting on a missing number, or 0
+    bool merge_listed;        // In the shard's 'merging' list
+
+    // Frames combined into this address, one from each upstream per round
+    combiner_t * combine;        // Created by the first frame to arrive over a combine edge
+    uint64_t combine_generation; // The topology its inputs were taken from
+    uint64_t combine_since;      // When the round at the head started waiting on a missing input, or 0
+    bool combine_listed;         // In the shard's 'combining' list
 } context_t;
 
+// Cut-through states, for a source with a single forward target
+#define CUT_NONE      0
+#define CUT_PENDING   1 // The source has its end, the target gets the other once the source's marker comes through
+#define CUT_ACTIVE    2 // Frames flow node-to-node, the router only sees stats
+#define CUT_CANCELLED 3 // Torn down while pending, the target still gets its end so nothing already written is lost
+
 KHASH_MAP_INIT_INT( gnw_address_t, context_t );
-khash_t( gnw_address_t ) * address_table;
+KHASH_MAP_INIT_INT( bell, int ); // Shared-memory link bell -> the fd of the connection it belongs to
+
+/** One address's edges, as the control thread publishes them */
+typedef struct {
+    kvec_t( gnw_address_t ) forward;
+    kvec_t( uint32_t ) weights; // Per edge, parallel to 'forward'
+    int forward_policy;
+    uint32_t latency_budget;
+    uint32_t read_weight;
+    affinity_key_t affinity;
+    uint64_t changed; // The topology generation this was last changed in
+} topology_node_t;
+
+KHASH_MAP_INIT_INT( topology, topology_node_t );
+
+/** The whole graph at one point in time, never changed once published */
+typedef struct {
+    uint64_t generation;
+    khash_t( topology ) * nodes;
+} topology_t;
+
+// Cross-shard message kinds
+#define SHARD_MSG_FRAME  1 // Deliver a data frame to a bound address owned by the receiving shard
+#define SHARD_MSG_PACKET 2 // Run a packet through handle_packet on the shard that owns its subject address
+#define SHARD_MSG_ADOPT  3 // Take over a connection, along with the frame that caused it to move
+#define SHARD_MSG_COMMAND 4 // To the control thread: a topology command to apply
+#define SHARD_MSG_STATUS  5 // To the control thread: a shard's status, as text to print
+#define SHARD_MSG_MERGE   6 // As SHARD_MSG_FRAME, but the frame goes through the target's resequencer
+#define SHARD_MSG_COMBINE 7 // As SHARD_MSG_FRAME, but the frame joins the target's next round
+
+#define SHARD_MAILBOX_SIZE 1024
+
+typedef struct {
+    int kind;
+    gnw_address_t target;
+    int fd;
+    connection_t connection;
+    gnw_buf_t * buf;   // SHARD_MSG_FRAME holds a reference to the frame, rather than a copy
+    uint64_t stamp;    // When the frame arrived, so its hop latency counts the time spent crossing shards
+    size_t length;
+    uint8_t frame[];
+} shard_msg_t;
+
+/**
+ * One reactor thread. Each shard owns the connections bound to its addresses, and the
+ * address_table entries for every address that hashes to it, so the data path never locks.
+ */
+typedef struct {
+    int index;
+    pthread_t thread;
+    reactor_t * reactor;
+    int wake_fd;                                   // eventfd, signalled when our inboxes have work
+    int current_fd;                                // The connection whose frames are being handled, or -1
+
+    khash_t( gnw_address_t ) * address_table;
+    kvec_t( connection_t ) connections;            // Grows to cover the highest fd seen, no fixed cap
+    khash_t( bell ) * bells;                       // Bells of the shared-memory links this shard reads
+    fanout_t fanout;                               // Staging for zero-copy broadcasts
+    bool fanout_ready;
+    uint64_t topology_epoch;                       // Bumped whenever cached routes may have gone stale
+    topology_t * topology;                         // The snapshot our contexts were last synced to
+    uint64_t status_seen;                          // The last status request we answered
+
+    int coalesce_fd;                               // timerfd, fires when the earliest held output is due
+    uint64_t coalesce_armed;                       // The deadline it is set for, or 0
+    kvec_t( int ) holding;                         // Connections holding output back, possibly already flushed
+    kdq_t( int ) * runnable;                       // Connections whose turn ended with input waiting, in turn order
+    kvec_t( gnw_address_t ) merging;               // Merge targets waiting on a missing sequence number, see merge_service()
+    kvec_t( gnw_address_t ) combining;             // Combine targets with a round waiting on a missing input, see combine_service()
+    kvec_t( int ) sampling;                        // Connections with unread bytes in their socket, see load_service()
+    bool sample_load;                              // Some source in the topology picks its targets by load
+
+    struct {                                       // The data frame being routed, see frame_begin()
+        uint8_t * data;
+        size_t length;
+        gnw_buf_t * buf;                           // Its one shared copy, once something has needed it
+        uint64_t stamp;                            // When it arrived
+    } frame;
+
+    uint64_t read_stamp;                           // When the input just read arrived
+    histogram_t hops;                              // Arrival to send, in nanoseconds, since the last status
+
+    mailbox_t * inbox;                             // inbox[from], one SPSC ring per sending shard
+    kvec_t( shard_msg_t * ) * overflow;            // overflow[to], held back while that mailbox is full (overflow[shard_count] is the control thread's)
+    bool * wake;                                   // wake[to], signal that shard at the end of this batch (likewise)
+} shard_t;
+
+shard_t * shards = NULL;
+int shard_count = 1;
+
+__thread shard_t * shard = NULL; // The shard owned by the calling thread
+
+/**
+ * The control plane. Topology commands are handed here by whichever shard reads them, applied
+ * to the control thread's own copy of the graph, and published to every shard as a snapshot,
+ * so reconfiguring never holds up forwarding. The shards' status tables are printed from here
+ * too, so a slow stderr never blocks a data path thread.
+ */
+typedef struct {
+    pthread_t thread;
+    int wake_fd;                   // eventfd, signalled when our inboxes have work
+    mailbox_t * inbox;             // inbox[from], one SPSC ring per shard
+    khash_t( topology ) * nodes;   // The working copy, published whenever it changes
+    bool dirty;                    // The working copy has changed since it was last published
+    snapshot_t topology;           // What the shards read, one reader per shard
+    uint64_t status_generation;    // Bumped to have every shard send in its status
+} control_t;
+
+control_t control;
+
+connection_t * connection_get( int fd );
+void connection_read( connection_t * connection, bool from_link );
+void connection_close( connection_t * connection );
+void shard_control();
+bool shard_flush();
+void load_track( connection_t * connection, size_t sent );
+
+/**
+ * A listen socket, and the transport its connections arrive over.
+ */
+typedef struct {
+    int fd;
+    int transport;
+    const char * path; // Socket path for the local transports, removed on exit
+} listener_t;
+
+#define ROUTER_LISTENERS 3
+
+listener_t listeners[ROUTER_LISTENERS];
+int listener_count = 0;
+
+/**
+ * Admission control for new connections, a token bucket refilled at config.admit_rate. Only
+ * shard 0 accepts, so only shard 0 touches this.
+ */
+typedef struct {
+    double tokens;     // Connections that may be accepted right now
+    uint64_t refilled; // When the bucket was last topped up (see router_clock())
+    int timer_fd;      // timerfd, fires once the next token is due
+    bool paused;       // The listen sockets are out of the reactor until timer_fd fires
+} admission_t;
+
+admission_t admission = { .tokens = ROUTER_ACCEPT_BATCH, .timer_fd = -1 };
+
+/**
+ * How much output each bound address has waiting in the router, published by the shard that owns it so a
+ * least-loaded pick on any shard can see it without a lock. Each slot packs the address (high 32 bits) with
+ * its depth in bytes (low 32 bits), so an address that has lost its slot to another reads as unknown rather
+ * than borrowing the other's load.
+ */
+#define LOAD_BOARD_BITS      12
+#define LOAD_UNBOUND         UINT32_MAX // Nothing is bound to take the address's frames
+#define LOAD_SAMPLE_INTERVAL 1000       // How often socket backlogs are sampled while they drain, in microseconds
 
-KHASH_MAP_INIT_INT( int, local_buffer_t );
-khash_t( int ) * local_buffer;
+uint64_t load_board[1 << LOAD_BOARD_BITS];
+
+#ifdef HAVE_IO_URING
+bool uring_active = false;
+
+void uring_attach( connection_t * connection );
+void uring_detach( connection_t * connection );
+bool uring_emit( int fd, uint8_t * buffer, size_t length, bool limited );
+#endif
 
 /*volatile gnw_address_t nextNodeAddress = 0;
 
@@ -142,6 +512,43 @@ int getListenSocket( struct addrinfo * hints ) {
     return sockfd;
 }
 
+/**
+ * Opens a listening AF_UNIX socket at 'path', replacing any stale socket left there.
+ *
+ * @param path The filesystem path to bind
+ * @param type SOCK_STREAM or SOCK_SEQPACKET
+ * @return The listening socket, or -1 on failure
+ */
+int getLocalListenSocket( const char * path, int type ) {
+    struct sockaddr_un address;
+    memset( &address, 0, sizeof address );
+    address.sun_family = AF_UNIX;
+    strncpy( address.sun_path, path, sizeof(address.sun_path) - 1 );
+
+    int sockfd = socket( AF_UNIX, type, 0 );
+    if( sockfd == -1 ) {
+        perror( "Server: socket" );
+        return -1;
+    }
+
+    unlink( path );
+    if( bind( sockfd, (struct sockaddr *)&address, sizeof address ) == -1 || listen( sockfd, config.backlog ) == -1 ) {
+        log_warn( "Unable to listen on %s: %s", path, strerror(errno) );
+        close( sockfd );
+        return -1;
+    }
+
+    return sockfd;
+}
+
+listener_t * listener_find( int fd ) {
+    for( int i = 0; i < listener_count; i++ ) {
+        if( listeners[i].fd == fd )
+            return &listeners[i];
+    }
+    return NULL;
+}
+
 void printDetails( gnw_address_t address, void * data ) {
     context_t * context = (context_t *)data;
 
@@ -177,6 +584,21 @@ void printDetails( gnw_address_t address, void * data ) {
             case GNW_POLICY_ROUNDROBIN:
                 sprintf(policy_str, "ROUNDROBIN");
                 break;
+            case GNW_POLICY_MERGE:
+                sprintf(policy_str, "MERGE");
+                break;
+            case GNW_POLICY_COMBINE:
+                sprintf(policy_str, "COMBINE");
+                break;
+            case GNW_POLICY_LEASTLOADED:
+                sprintf(policy_str, "LEASTLOADED");
+                break;
+            case GNW_POLICY_TWOCHOICE:
+                sprintf(policy_str, "TWOCHOICE");
+                break;
+            case GNW_POLICY_AFFINITY:
+                sprintf(policy_str, "AFFINITY");
+                break;
             default:
                 sprintf(policy_str, "???");
         }
@@ -243,12 +665,18 @@ void emitStatistics( FILE * stream ) {
 
 void reset_context( context_t * context ) {
     context->packets_in = 0;
+    context->rotation = 0;
     context->packets_out = 0;
     context->bytes_in = 0;
     context->bytes_out = 0;
+    context->packets_dropped = 0;
 
-    if( context->state != -1 )
+    if( context->state != -1 ) {
         kv_destroy( context->forward );
+        kv_destroy( context->routes );
+        kv_destroy( context->shares );
+    }
+    context->routes_epoch = 0;
     
     context->forward_policy = -1; // Intentionally invalid
     context->state = GNW_STATE_CLOSE;
@@ -263,553 +691,4064 @@ void setup_context( context_t * context ) {
     context->bytes_out = 0;
 
     kv_init( context->forward );
+    kv_init( context->routes );
+    kv_init( context->shares );
+    context->routes_epoch = 0; // Resolved on first use
 
     context->forward_policy = GNW_POLICY_BROADCAST;
     context->state = GNW_STATE_OPEN;
     context->bound_fd = -1;
+    context->fragment_route = -1;
+    context->cut_state = CUT_NONE;
+    context->cut_fd = -1;
+    context->read_weight = 1;
+    context->affinity.kind = AFFINITY_RANGE; // The whole message, until told otherwise
 }
 
-void handle_packet( int fd, uint8_t * buffer, size_t length ) {
-    assert( buffer != NULL, "Attempted to parse a null buffer!" );
-    assert( length > 0, "Attempted to parse an empty (zero-length) buffer!" );
+/**
+ * @return The reactor flags this connection should currently be registered for
+ */
+static uint32_t connection_interest( connection_t * connection ) {
+    uint32_t interest = connection->paused ? 0 : REACTOR_READ;
+
+    // A link's output drains into its ring, and the peer rings our bell when there is space. Held
+    // output waits for its deadline, not writability.
+    if( connection->output.queued > 0 && connection->link == NULL && connection->hold_deadline == 0 )
+        interest |= REACTOR_WRITE;
+    return interest;
+}
 
-    gnw_header_t header;
-    uint8_t * payload = gnw_parse_header( buffer, &header );
-    
-    switch( header.type ) {
-        case GNW_COMMAND:
-            if( header.length == 0 ) {
-                log_warn( "Client issued a command with no directive, nothing to do!" );
-                return;
-            }
+void connection_update_interest( connection_t * connection ) {
+    uint32_t interest = connection_interest( connection );
+    if( interest == connection->interest )
+        return;
 
-            uint8_t directive = 0;
-            uint8_t * next = packet_read_u8( payload, &directive );
+    // Nothing rings the bell again for data that arrived in the ring while paused, so ring it ourselves
+    if( connection->link != NULL && (interest & REACTOR_READ) && !(connection->interest & REACTOR_READ) )
+        eventfd_write( connection->link->bell, 1 );
 
-            switch( directive ) {
-                // Handle new address requests - bit of a misnomer, as this actually really 'claims' an address
-                // rather than creating a new one. Essentially 'binds' the address to the fd the request came
-                // from
-                case GNW_CMD_NEW_ADDRESS:
-                    log_debug( "New address request" );
+    // Re-arming read interest reports any data that arrived while paused, so nothing is missed
+    if( reactor_modify( shard->reactor, connection->fd, interest ) == -1 )
+        log_error( "Unable to update fd %d: %s", connection->fd, strerror(errno) );
+    connection->interest = interest;
+}
 
-                    // Generate a random address, else use the requested one.
-                    gnw_address_t address_req = 0xFFFFF000 & rand(); // Random address, default mask
-                    if( header.length == 5 )
-                        packet_read_u32( next, &address_req );
+/**
+ * Close any descriptors received on this connection that nothing has claimed.
+ */
+static void connection_drop_passed( connection_t * connection ) {
+    for( int i = 0; i < connection->passed_count; i++ )
+        close( connection->passed[i] );
+    connection->passed_count = 0;
+}
 
-                    khint_t hint = kh_get( gnw_address_t, address_table, address_req );
-                    context_t * context = &kh_value( address_table, hint );
+/**
+ * Start watching a connection's link bell on this shard. The bell is rung straight away,
+ * so anything already sitting in the ring gets read.
+ */
+static void link_watch( connection_t * connection ) {
+    int status;
+    khint_t hint = kh_put( bell, shard->bells, connection->link->bell, &status );
+    kh_value( shard->bells, hint ) = connection->fd;
+
+    if( reactor_add( shard->reactor, connection->link->bell, REACTOR_READ ) == -1 )
+        log_error( "Unable to monitor the link bell for fd %d: %s", connection->fd, strerror(errno) );
+    eventfd_write( connection->link->bell, 1 );
+}
 
-                    if( hint == kh_end(address_table) || kh_exist( address_table, hint ) == 0 ) {
-                        int status;
-                        hint = kh_put( gnw_address_t, address_table, address_req, &status );
-                        context = &kh_value( address_table, hint );
-                        setup_context( context );
-                    }
-                    context = &kh_value( address_table, hint );
+static void link_unwatch( connection_t * connection ) {
+    khint_t hint = kh_get( bell, shard->bells, connection->link->bell );
+    if( hint != kh_end( shard->bells ) )
+        kh_del( bell, shard->bells, hint );
+    reactor_remove( shard->reactor, connection->link->bell );
+}
 
-                    context->bound_fd = fd; // Bind this fd to this address (or visa-versa)
+/**
+ * Resume every source that was paused waiting on this connection's output queue.
+ */
+void connection_release( connection_t * connection ) {
+    for( size_t i = 0; i < kv_size( connection->blocked ); i++ ) {
+        connection_t * source = connection_get( kv_A( connection->blocked, i ) );
+        if( !source->active || !source->paused )
+            continue;
 
-                    // Reply to the client with their assigned address
-                    uint8_t reply[5] = { 0 };
-                    uint8_t * out = packet_write_u8( reply, GNW_CMD_NEW_ADDRESS );
-                    //next = packet_write_u32( next, 0x1000 );
-                    out = packet_write_u32( out, address_req ); // Just accept _any_ address from the clients for now...
-                    gnw_emitCommandPacket( fd, GNW_REPLY, reply, out - reply );
+        source->paused = false;
+        connection_update_interest( source );
+    }
+    connection->blocked.n = 0;
+}
 
-                    break;
-                
-                case GNW_CMD_CONNECT: {
-                    gnw_address_t source = 0;
-                    gnw_address_t target = 0;
+/**
+ * A non-blocking send over whichever data path the connection is using.
+ *
+ * @return The number of bytes taken, or -1 with errno set (EAGAIN if the socket or ring is full)
+ */
+static ssize_t connection_send( connection_t * connection, uint8_t * buffer, size_t length ) {
+    if( connection->link == NULL )
+        return send( connection->fd, buffer, length, MSG_DONTWAIT | MSG_NOSIGNAL );
+
+    ssize_t written = shmlink_write( connection->link, buffer, length );
+    if( written == 0 )
+        errno = EAGAIN;
+    else if( written == -1 )
+        errno = EPROTO;
+    return written == 0 ? -1 : written;
+}
 
-                    next = packet_read_u32( next, &source );
-                    next = packet_read_u32( next, &target );
+/**
+ * A non-blocking send with a descriptor attached to the first byte.
+ */
+static ssize_t connection_send_fd( connection_t * connection, uint8_t * buffer, size_t length, int passed ) {
+    union {
+        struct cmsghdr align;
+        uint8_t space[CMSG_SPACE( sizeof(int) )];
+    } control;
+    memset( &control, 0, sizeof control );
+
+    struct iovec iov = { .iov_base = buffer, .iov_len = length };
+    struct msghdr message = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = &control, .msg_controllen = sizeof control };
+
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR( &message );
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN( sizeof(int) );
+    memcpy( CMSG_DATA( cmsg ), &passed, sizeof(int) );
+
+    return sendmsg( connection->fd, &message, MSG_DONTWAIT | MSG_NOSIGNAL );
+}
 
-                    // Attempt to get the source context, create if required...
-                    khint_t srcHint = kh_get( gnw_address_t, address_table, source );
-                    context_t * srcContext = NULL;
+/**
+ * A non-blocking gathered send of several queued frames, over whichever data path the connection is using.
+ *
+ * @return The number of bytes taken, or -1 with errno set (EAGAIN if the socket or ring is full)
+ */
+static ssize_t connection_sendv( connection_t * connection, struct iovec * iov, int count ) {
+    if( connection->link == NULL ) {
+        struct msghdr message = { .msg_iov = iov, .msg_iovlen = count };
+        return sendmsg( connection->fd, &message, MSG_DONTWAIT | MSG_NOSIGNAL );
+    }
 
-                    printf( "%p, %p\n", address_table, srcHint );
+    // The ring is a byte stream, so write each piece in turn until it fills
+    ssize_t total = 0;
+    for( int i = 0; i < count; i++ ) {
+        ssize_t written = connection_send( connection, iov[i].iov_base, iov[i].iov_len );
+        if( written == -1 )
+            return total > 0 ? total : -1;
 
-                    if( srcHint == kh_end(address_table) || kh_exist( address_table, srcHint ) == 0 ) {
-                        int status;
-                        srcHint = kh_put( gnw_address_t, address_table, source, &status );
-                        srcContext = &kh_value( address_table, srcHint );
-                        assert( srcContext != NULL, "Context pointer was NULL!" );
-                        setup_context( srcContext );
-                    }
-                    
-                    assert( srcHint != kh_end(address_table), "Failed to actually put a new key :/" );
-                    srcContext = &kh_value( address_table, srcHint );
+        total += written;
+        if( (size_t)written < iov[i].iov_len )
+            break;
+    }
+    return total;
+}
 
-                    kv_push( gnw_address_t, srcContext->forward, target );
+/**
+ * The clock hop latency is measured on. It has to be the realtime clock, as that is what the
+ * kernel stamps arriving data with.
+ *
+ * @return The time, in nanoseconds
+ */
+static uint64_t router_stamp() {
+    struct timespec now;
+    clock_gettime( CLOCK_REALTIME, &now );
+    return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
 
-                    log_info( "Connected %lu to %lu\n", source, target );
-                } break;
+/**
+ * Count a frame leaving, against when it arrived.
+ *
+ * @param stamp When it arrived, or 0 if it isn't being measured
+ * @param now When it went (see router_stamp())
+ */
+static void hop_record( uint64_t stamp, uint64_t now ) {
+    if( stamp != 0 )
+        histogram_record( &shard->hops, now > stamp ? now - stamp : 0 );
+}
 
-                case GNW_CMD_DISCONNECT: {
-                    log_error( "UNIMPLEMENTED FUNCTION: DISCONNECT" );
-                } break;
-                
-                case GNW_CMD_POLICY: {
-                    uint8_t policy;
-                    gnw_address_t target;
+static inline size_t load_slot( gnw_address_t address ) {
+    return (address * 2654435761u) >> (32 - LOAD_BOARD_BITS);
+}
 
-                    next = packet_read_u8( next, &policy );
-                    next = packet_read_u32( next, &target );
+/**
+ * Publish an address's load to the board, for least-loaded picks on every shard.
+ */
+static void load_publish( gnw_address_t address, uint32_t load ) {
+    uint64_t word = ((uint64_t)address << 32) | load;
 
-                    khint_t targetHint = kh_get( gnw_address_t, address_table, target );
-                    context_t * targetContext = NULL;
+    // Only written when it changes, so a steady queue doesn't keep taking the line from every reader
+    uint64_t * slot = &load_board[load_slot( address )];
+    if( __atomic_load_n( slot, __ATOMIC_RELAXED ) != word )
+        __atomic_store_n( slot, word, __ATOMIC_RELAXED );
+}
 
-                    if( targetHint == kh_end(address_table) ) {
-                        log_error( "Unable to set the policy on a connection that does not currently exist!" );
-                        break;
-                    }
-                    targetContext = &kh_value( address_table, targetHint );
+/**
+ * @return An address's load as last published, or 0 if it has none
+ */
+static uint32_t load_read( gnw_address_t address ) {
+    uint64_t word = __atomic_load_n( &load_board[load_slot( address )], __ATOMIC_RELAXED );
+    return (gnw_address_t)(word >> 32) == address ? (uint32_t)word : 0;
+}
 
-                    targetContext->forward_policy = policy;
+/**
+ * @return The bytes waiting to go out on a connection, in the router's queue, in io_uring sends or in the
+ *         socket itself
+ */
+static uint32_t connection_load( connection_t * connection ) {
+    size_t outstanding = connection->output.queued + connection->socket_queued;
+#ifdef HAVE_IO_URING
+    outstanding += connection->send_queued;
+#endif
+    return outstanding < LOAD_UNBOUND ? (uint32_t)outstanding : LOAD_UNBOUND - 1;
+}
 
-                    const char * policyStr[] = {
-                        [GNW_POLICY_ANYCAST] = "ANYCAST",
-                        [GNW_POLICY_BROADCAST] = "BROADCAST",
-                        [GNW_POLICY_ROUNDROBIN] = "ROUNDROBIN",
-                        "???"
-                    };
+/**
+ * Publish the load of whichever address a connection is bound to, after its queue has changed.
+ */
+static void connection_publish_load( connection_t * connection ) {
+    if( connection->address != GNW_ANY )
+        load_publish( connection->address, connection_load( connection ) );
+}
 
-                    log_info( "Forward policy set to %s for %08x\n", policyStr[targetContext->forward_policy], target );
-                } break;
+/**
+ * Queue 'buf' from 'offset' on, behind everything already waiting for this connection.
+ *
+ * @param connection The connection to queue on
+ * @param buf The frame, the caller's reference is taken over by the queue
+ * @param offset How much of the frame has already been sent
+ * @param passed_fd A descriptor to send with the frame's first byte (so 'offset' must be 0), or -1
+ * @param stamp When the frame arrived, or 0
+ */
+static void output_push( connection_t * connection, gnw_buf_t * buf, size_t offset, int passed_fd, uint64_t stamp ) {
+    output_queue_t * out = &connection->output;
+    if( out->entries == NULL )
+        out->entries = kdq_init( output_entry_t );
+
+    output_entry_t * entry = kdq_pushp( output_entry_t, out->entries );
+    entry->buf = buf;
+    entry->offset = offset;
+    entry->passed_fd = passed_fd;
+    entry->stamp = stamp;
+    out->queued += buf->length - offset;
+    connection_publish_load( connection );
+}
 
-                default:
-                    log_warn( "Missing handler for command directive %02x", payload[0] );
-            }
+/**
+ * Drop 'length' sent bytes off the front of the queue, releasing every frame that is finished with.
+ */
+static void output_consume( output_queue_t * out, size_t length ) {
+    out->queued -= length;
+    uint64_t now = 0;
+
+    while( length > 0 ) {
+        output_entry_t * entry = &kdq_first( out->entries );
+        size_t remaining = entry->buf->length - entry->offset;
+        if( length < remaining ) {
+            entry->offset += length;
+            return;
+        }
 
-            break;
+        if( entry->stamp != 0 && now == 0 )
+            now = router_stamp();
+        hop_record( entry->stamp, now );
 
-        case GNW_DATA: {
-            khint_t hint = kh_get( gnw_address_t, address_table, header.source );
+        length -= remaining;
+        gnw_buf_release( entry->buf );
+        kdq_shift( output_entry_t, out->entries );
+    }
+}
 
-            log_debug( "IN: %08x", header.source );
+/**
+ * Release everything still queued, closing any descriptors that never went. The queue itself is
+ * kept, so the next connection on this slot doesn't have to allocate one.
+ */
+static void output_clear( output_queue_t * out ) {
+    if( out->entries != NULL ) {
+        output_entry_t * entry;
+        while( (entry = kdq_shift( output_entry_t, out->entries )) != NULL ) {
+            if( entry->passed_fd != -1 )
+                close( entry->passed_fd );
+            gnw_buf_release( entry->buf );
+        }
+    }
 
-            // Just drop the message, if we don't have a known, bound address for this...
-            if( !kh_exist( address_table, hint ) ) {
-                log_debug( "Dropped %lu bytes.", length );
-                return;
-            }
+    out->queued = 0;
+}
 
-            // Grab this entry
-            context_t * entry = &(kh_value( address_table, hint ));
+/**
+ * Keep a reference to every buffer the zero-copy send just made took bytes from, until the kernel is done with it.
+ * Must be called before the sent bytes are consumed.
+ */
+static void output_pin( connection_t * connection, size_t sent ) {
+    output_queue_t * out = &connection->output;
+    if( out->pinned == NULL )
+        out->pinned = kdq_init( output_pin_t );
 
-            // Update the stats
-            entry->bytes_in += length;
-            entry->packets_in ++;
+    for( size_t i = 0; sent > 0; i++ ) {
+        output_entry_t * entry = &kdq_at( out->entries, i );
+        size_t remaining = entry->buf->length - entry->offset;
 
-            // TEST BROADCAST MODE ONLY
-            // ToDo: This should look up the routing mode, then forward according to the policy to anything
-            //       in the entry->forward vector.
-            //       Kludge for now...
+        output_pin_t * pin = kdq_pushp( output_pin_t, out->pinned );
+        pin->send = connection->zerocopy.sent - 1;
+        pin->buf = gnw_buf_ref( entry->buf );
 
-            switch( entry->forward_policy ) {
-                case GNW_POLICY_BROADCAST: {
-                    for( size_t i = 0; i < kv_size( entry->forward ); i++ ) {
-                        gnw_address_t target = kv_a( gnw_address_t, entry->forward, i );
-
-                        khint_t fwd = kh_get( gnw_address_t, address_table, target );
-                        if( !kh_exist( address_table, fwd ) ) {
-                            log_debug( "Missing or null forward entry, skipped." );
-                            // ToDo: Should delete any missing destinations, but packets will be
-                            // dropped anyway... so.. leave for now?
-                            continue;
-                        }
+        sent -= sent < remaining ? sent : remaining;
+    }
+}
 
-                        context_t * fwdEntry = &kh_value( address_table, fwd );
-                        if( fwdEntry == NULL || fwd == kh_end(address_table) ) {
-                            log_debug( "Missing or null forward entry, skipped." );
-                            continue;
-                        }
+/**
+ * Read the zero-copy completions waiting on this connection, releasing the buffers they cover.
+ */
+static void output_reap( connection_t * connection ) {
+    output_queue_t * out = &connection->output;
 
-                        log_debug( "BROADCAST: %08x -> %08x (%d)", header.source, target, fwdEntry->bound_fd );
+    if( zerocopy_reap( &connection->zerocopy, connection->fd ) == -1 )
+        log_debug( "Error queue on fd %d: %s", connection->fd, strerror(errno) );
 
-                        // FIXFIXFIX - Might have to be a data packet rather than a bare one!
-                        uint8_t * localRef = buffer;
-                        gnw_emitPacket( fwdEntry->bound_fd, localRef, length ); // Forward wholesale
+    while( out->pinned != NULL && kdq_size( out->pinned ) > 0 &&
+           zerocopy_complete( &connection->zerocopy, kdq_first( out->pinned ).send ) ) {
+        gnw_buf_release( kdq_first( out->pinned ).buf );
+        kdq_shift( output_pin_t, out->pinned );
+    }
+}
 
-                        fwdEntry->bytes_out += length;
-                        fwdEntry->packets_out ++;
-                    }
-                } break;
-            
-                case GNW_POLICY_ANYCAST: {
-                    gnw_address_t target = kv_a( gnw_address_t, entry->forward, rand() % kv_size( entry->forward ) );
-
-                    khint_t fwd = kh_get( gnw_address_t, address_table, target );
-                    if( !kh_exist( address_table, fwd ) ) {
-                        log_debug( "Missing or null forward entry, skipped." );
-                        // ToDo: Should delete any missing destinations, but packets will be
-                        // dropped anyway... so.. leave for now?
-                        break;
-                    }
+/**
+ * Drop every pinned buffer, once the connection is closed. The kernel keeps its own hold on the
+ * pages of anything still in flight, so the worst a reused buffer can do is change what a dead
+ * socket sends.
+ */
+static void output_unpin( output_queue_t * out ) {
+    if( out->pinned == NULL )
+        return;
 
-                    context_t * fwdEntry = &kh_value( address_table, fwd );
-                    if( fwdEntry == NULL || fwd == kh_end(address_table) ) {
-                        log_debug( "Missing or null forward entry, skipped." );
-                        break;
-                    }
+    output_pin_t * pin;
+    while( (pin = kdq_shift( output_pin_t, out->pinned )) != NULL )
+        gnw_buf_release( pin->buf );
+}
 
-                    log_debug( "ANYCAST: %08x -> %08x (%d)", header.source, target, fwdEntry->bound_fd );
+/**
+ * Push as much of the output queue onto the wire as the socket will take, without blocking.
+ *
+ * @param connection The connection to drain
+ */
+void connection_flush( connection_t * connection ) {
+    output_queue_t * out = &connection->output;
+    struct iovec iov[ROUTER_FLUSH_IOV];
+
+    // Anything being held goes now
+    connection->hold_deadline = 0;
+
+    // Completions normally get picked up from the error event, but don't let them pile up regardless
+    if( out->pinned != NULL && kdq_size( out->pinned ) >= ROUTER_ZEROCOPY_PINNED )
+        output_reap( connection );
+
+    while( out->queued > 0 ) {
+        output_entry_t * first = &kdq_first( out->entries );
+        ssize_t sent;
+
+        if( first->passed_fd != -1 ) {
+            // A descriptor rides on the first byte of its frame
+            sent = connection_send_fd( connection, gnw_buf_data( first->buf ), first->buf->length, first->passed_fd );
+            if( sent > 0 ) {
+                close( first->passed_fd );
+                first->passed_fd = -1;
+            }
+        }
+        else {
+            // Gather as many frames as we can into one send, stopping at the next descriptor. Message
+            // transports need one frame per send, or the receiver would see them glued together.
+            size_t limit = connection->transport == TRANSPORT_SEQPACKET ? 1 : ROUTER_FLUSH_IOV;
+            int count = 0;
+            size_t bytes = 0;
+            for( size_t i = 0; i < kdq_size( out->entries ) && (size_t)count < limit; i++ ) {
+                output_entry_t * entry = &kdq_at( out->entries, i );
+                if( i > 0 && entry->passed_fd != -1 )
+                    break;
 
-                    // FIXFIXFIX - Might have to be a data packet rather than a bare one!
-                    uint8_t * localRef = buffer;
-                    gnw_emitPacket( fwdEntry->bound_fd, localRef, length ); // Forward wholesale
+                iov[count].iov_base = gnw_buf_data( entry->buf ) + entry->offset;
+                iov[count].iov_len = entry->buf->length - entry->offset;
+                bytes += iov[count].iov_len;
+                count++;
+            }
 
-                    fwdEntry->bytes_out += length;
-                    fwdEntry->packets_out ++;
-                } break;
+            // Big sends go zero-copy, the queue's references keep the buffers alive until the kernel is done
+            bool zerocopy = connection->zerocopy.enabled && bytes >= config.zerocopy_threshold;
+            if( zerocopy ) {
+                struct msghdr message = { .msg_iov = iov, .msg_iovlen = count };
+                sent = zerocopy_sendmsg( &connection->zerocopy, connection->fd, &message, MSG_DONTWAIT | MSG_NOSIGNAL );
+                if( sent > 0 )
+                    output_pin( connection, sent );
+            }
 
-                case GNW_POLICY_ROUNDROBIN: {
-                    // Sneaky, using the packets_in count as the round-robin offset, saves a variable kicking around though
-                    gnw_address_t target = kv_a( gnw_address_t, entry->forward, entry->packets_in % kv_size( entry->forward ) );
-
-                    khint_t fwd = kh_get( gnw_address_t, address_table, target );
-                    if( !kh_exist( address_table, fwd ) ) {
-                        log_debug( "Missing or null forward entry, skipped." );
-                        // ToDo: Should delete any missing destinations, but packets will be
-                        // dropped anyway... so.. leave for now?
-                        break;
-                    }
+            // Out of room for completions, so copy it this time
+            if( !zerocopy || (sent == -1 && errno == ENOBUFS) )
+                sent = connection_sendv( connection, iov, count );
+        }
 
-                    context_t * fwdEntry = &kh_value( address_table, fwd );
-                    if( fwdEntry == NULL || fwd == kh_end(address_table) ) {
-                        log_debug( "Missing or null forward entry, skipped." );
-                        break;
-                    }
+        if( sent > 0 ) {
+            output_consume( out, sent );
+            load_track( connection, sent );
+            continue;
+        }
 
-                    log_debug( "ROUNDROBIN: %08x -> %08x (%d)", header.source, target, fwdEntry->bound_fd );
+        if( sent == -1 && errno == EINTR )
+            continue;
 
-                    // FIXFIXFIX - Might have to be a data packet rather than a bare one!
-                    uint8_t * localRef = buffer;
-                    gnw_emitPacket( fwdEntry->bound_fd, localRef, length ); // Forward wholesale
+        if( sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+            break;
 
-                    fwdEntry->bytes_out += length;
-                    fwdEntry->packets_out ++;
-                } break;
+        // The read side will see the failure and close the connection, just discard what we have
+        log_error( "Send failed on fd %d: %s", connection->fd, strerror(errno) );
+        output_clear( out );
+    }
 
-                default:
-                    log_error( "Bad forward policy! [%02x]", entry->forward_policy );
-            }
+    if( out->queued < QUEUE_LOW_WATER( config.queue_limit ) )
+        connection_release( connection );
 
-        }
-        break;
+    connection_publish_load( connection );
+    connection_update_interest( connection );
+}
 
-        default:
+/**
+ * @return The monotonic clock, in microseconds
+ */
+static uint64_t router_clock() {
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+/**
+ * Make sure the shard's coalescing timer fires by 'deadline'.
+ *
+ * @param deadline A router_clock() time
+ */
+static void coalesce_arm( uint64_t deadline ) {
+    if( shard->coalesce_armed != 0 && shard->coalesce_armed <= deadline )
+        return;
+
+    struct itimerspec when = { .it_value = { .tv_sec = deadline / 1000000, .tv_nsec = (deadline % 1000000) * 1000 } };
+    if( timerfd_settime( shard->coalesce_fd, TFD_TIMER_ABSTIME, &when, NULL ) == -1 ) {
+        log_error( "Unable to set the coalescing timer: %s", strerror(errno) );
+        return;
+    }
+    shard->coalesce_armed = deadline;
+}
+
+/**
+ * @return True if small frames for this connection should be held back and gathered into fewer sends
+ */
+static bool connection_coalesces( connection_t * connection ) {
+    // Ring writes make no syscalls to save, and message transports send one frame at a time anyway
+    return connection->latency_budget > 0 && connection->link == NULL && connection->transport != TRANSPORT_SEQPACKET;
+}
+
+/**
+ * Hold this connection's output until its latency budget runs out, unless it already is being held.
+ */
+static void coalesce_hold( connection_t * connection ) {
+    if( connection->hold_deadline != 0 )
+        return;
+
+    connection->hold_deadline = router_clock() + connection->latency_budget;
+    kv_push( int, shard->holding, connection->fd );
+    coalesce_arm( connection->hold_deadline );
+}
+
+/**
+ * The coalescing timer fired: flush every connection whose deadline has passed, and re-arm for the next.
+ */
+void coalesce_service() {
+    uint64_t expirations;
+    if( read( shard->coalesce_fd, &expirations, sizeof expirations ) == -1 && errno != EAGAIN )
+        log_error( "Unable to read the coalescing timer: %s", strerror(errno) );
+    shard->coalesce_armed = 0;
+
+    uint64_t now = router_clock();
+    uint64_t next = 0;
+    size_t kept = 0;
+
+    // Anything flushed or closed since it was listed has no deadline any more, and just drops out
+    for( size_t i = 0; i < kv_size( shard->holding ); i++ ) {
+        connection_t * connection = connection_get( kv_A( shard->holding, i ) );
+        if( !connection->active || connection->hold_deadline == 0 )
+            continue;
+
+        if( connection->hold_deadline <= now ) {
+            connection_flush( connection );
+            continue;
+        }
+
+        kv_A( shard->holding, kept++ ) = connection->fd;
+        if( next == 0 || connection->hold_deadline < next )
+            next = connection->hold_deadline;
+    }
+    shard->holding.n = kept;
+
+    if( next != 0 )
+        coalesce_arm( next );
+}
+
+/**
+ * Account for bytes handed to a connection's socket. A consumer that has fallen behind has most of its backlog
+ * in the socket buffer rather than our queue, so while anything picks targets by load, these are counted
+ * too until a sample of the socket shows them read.
+ *
+ * @param connection The connection sent on
+ * @param sent The bytes the kernel took
+ */
+void load_track( connection_t * connection, size_t sent ) {
+    // Ring writes are read straight out of the ring, there is no socket buffer to sample
+    if( !shard->sample_load || connection->address == GNW_ANY || connection->link != NULL )
+        return;
+
+    uint64_t queued = (uint64_t)connection->socket_queued + sent;
+    connection->socket_queued = queued < LOAD_UNBOUND ? (uint32_t)queued : LOAD_UNBOUND - 1;
+    connection_publish_load( connection );
+
+    if( !connection->load_listed ) {
+        connection->load_listed = true;
+        kv_push( int, shard->sampling, connection->fd );
+        coalesce_arm( router_clock() + LOAD_SAMPLE_INTERVAL );
+    }
+}
+
+/**
+ * Sample how much of each listed connection's socket buffer its peer has yet to read, republishing its load.
+ * Connections drop out of the list once their socket is empty, and the timer is re-armed while any remain.
+ */
+void load_service() {
+    size_t kept = 0;
+
+    for( size_t i = 0; i < kv_size( shard->sampling ); i++ ) {
+        connection_t * connection = connection_get( kv_A( shard->sampling, i ) );
+        if( !connection->active || !connection->load_listed )
+            continue;
+
+        int unread = 0;
+        if( ioctl( connection->fd, SIOCOUTQ, &unread ) == -1 || unread < 0 )
+            unread = 0;
+        connection->socket_queued = (uint32_t)unread;
+        connection_publish_load( connection );
+
+        if( unread == 0 ) {
+            connection->load_listed = false;
+            continue;
+        }
+        kv_A( shard->sampling, kept++ ) = connection->fd;
+    }
+    shard->sampling.n = kept;
+
+    if( kept > 0 )
+        coalesce_arm( router_clock() + LOAD_SAMPLE_INTERVAL );
+}
+
+/**
+ * Start routing a data frame. Every target it gets queued for shares one copy of it, made only
+ * if one is needed.
+ *
+ * @param buffer The frame
+ * @param length The frame length
+ * @param buf A buffer already holding the frame, whose reference is taken over, or NULL
+ */
+static void frame_begin( uint8_t * buffer, size_t length, gnw_buf_t * buf ) {
+    shard->frame.data = buffer;
+    shard->frame.length = length;
+    shard->frame.buf = buf;
+    shard->frame.stamp = shard->read_stamp;
+}
+
+/**
+ * Finish routing the current data frame, dropping our reference to its copy.
+ */
+static void frame_end() {
+    gnw_buf_release( shard->frame.buf );
+    shard->frame.data = NULL;
+    shard->frame.length = 0;
+    shard->frame.buf = NULL;
+    shard->frame.stamp = 0;
+}
+
+/**
+ * @return A new reference to a buffer holding this frame, which is only copied if it isn't the current data frame or
+ *         the current data frame hasn't been copied yet
+ */
+static gnw_buf_t * frame_hold( uint8_t * buffer, size_t length ) {
+    if( buffer != shard->frame.data || length != shard->frame.length ) {
+        gnw_buf_t * copy = gnw_buf_copy( buffer, length );
+        assert( copy != NULL, "Unable to allocate a packet buffer" );
+        return copy;
+    }
+
+    if( shard->frame.buf == NULL ) {
+        shard->frame.buf = gnw_buf_copy( buffer, length );
+        assert( shard->frame.buf != NULL, "Unable to allocate a packet buffer" );
+    }
+    return gnw_buf_ref( shard->frame.buf );
+}
+
+/**
+ * Forward a complete frame to 'fd' through whichever data path is active.
+ *
+ * Frames are written straight to the socket when nothing is queued ahead of them, and any
+ * remainder is queued and drained on writability, so a slow consumer never stalls the loop.
+ * A frame that would take the queue past its limit is dropped whole, keeping framing intact.
+ *
+ * If the connection has a latency budget, small frames are held instead, and go out in one
+ * gathered send once enough bytes are waiting or the oldest has waited out the budget.
+ *
+ * @param fd The destination connection
+ * @param buffer The frame, header included
+ * @param length The frame length
+ * @return True if the frame was sent or queued, false if it was dropped
+ */
+bool router_emit( int fd, uint8_t * buffer, size_t length ) {
+#ifdef HAVE_IO_URING
+    if( uring_active )
+        return uring_emit( fd, buffer, length, true );
+#endif
+    connection_t * connection = connection_get( fd );
+    if( !connection->active )
+        return false;
+
+    output_queue_t * out = &connection->output;
+    size_t sent = 0;
+
+    // Only data frames being routed are timed
+    uint64_t stamp = buffer == shard->frame.data ? shard->frame.stamp : 0;
+
+    // Only output that is being held (rather than backed up behind a full socket) can be added to
+    bool hold = connection_coalesces( connection ) && (out->queued == 0 || connection->hold_deadline != 0) &&
+                out->queued + length < config.coalesce_bytes;
+
+    // A zero-copy send needs a buffer that outlives it, so big frames always go by way of the queue
+    bool zerocopy = connection->zerocopy.enabled && length >= config.zerocopy_threshold;
+
+    if( out->queued == 0 && !hold && !zerocopy ) {
+        // A staged broadcast goes out by reference, message transports need it sent as one piece
+        bool fanout = fanout_staged( &shard->fanout, buffer, length ) && connection->link == NULL &&
+                      connection->transport != TRANSPORT_SEQPACKET;
+
+        ssize_t result = fanout ? fanout_send( &shard->fanout, fd ) : connection_send( connection, buffer, length );
+        if( result > 0 )
+            load_track( connection, result );
+        if( result == (ssize_t)length ) {
+            if( stamp != 0 )
+                hop_record( stamp, router_stamp() );
+            return true;
+        }
+
+        if( result == -1 ) {
+            if( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) {
+                log_debug( "Send failed on fd %d: %s", fd, strerror(errno) );
+                return false;
+            }
+            result = 0;
+        }
+
+        // Part of this frame is already on the wire, so the rest must follow whatever the limit
+        sent = result;
+    }
+    else if( out->queued > 0 && out->queued + length > config.queue_limit )
+        return false;
+
+    output_push( connection, frame_hold( buffer, length ), sent, -1, stamp );
+
+    if( hold )
+        coalesce_hold( connection );
+    else if( connection->hold_deadline != 0 || (zerocopy && out->queued == length) ) {
+        // Enough is waiting now (or this frame has nothing ahead of it), it all goes without waiting
+        connection_flush( connection );
+        return true;
+    }
+
+    connection_update_interest( connection );
+    return true;
+}
+
+/**
+ * Send a control frame to 'fd', optionally with a descriptor attached, queued in order behind
+ * anything already waiting. Control frames are never dropped, whatever the queue limit.
+ *
+ * @param fd The destination connection, which must be a unix socket to pass a descriptor
+ * @param buf The complete frame, the caller's reference is taken over
+ * @param passed A descriptor to send, or -1. Always closed (here, or once it has been sent)
+ * @return True if the frame was sent or queued
+ */
+bool router_emit_buf( int fd, gnw_buf_t * buf, int passed ) {
+    connection_t * connection = connection_get( fd );
+    bool usable = connection->active && (passed == -1 || connection->link == NULL);
+
+#ifdef HAVE_IO_URING
+    if( uring_active ) {
+        // Control frames aren't held to the queue limit
+        if( passed == -1 )
+            usable = uring_emit( fd, gnw_buf_data( buf ), buf->length, false ) && usable;
+        usable = usable && passed == -1;
+        if( usable ) {
+            gnw_buf_release( buf );
+            return true;
+        }
+    }
+#endif
+    if( !usable ) {
+        if( passed != -1 )
+            close( passed );
+        gnw_buf_release( buf );
+        return false;
+    }
+
+    size_t sent = 0;
+    if( connection->output.queued == 0 ) {
+        ssize_t result = passed != -1 ? connection_send_fd( connection, gnw_buf_data( buf ), buf->length, passed )
+                                      : connection_send( connection, gnw_buf_data( buf ), buf->length );
+
+        // The descriptor goes with the first byte
+        if( result > 0 && passed != -1 ) {
+            close( passed );
+            passed = -1;
+        }
+
+        if( result == (ssize_t)buf->length ) {
+            gnw_buf_release( buf );
+            return true;
+        }
+
+        if( result == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) {
+            log_debug( "Send failed on fd %d: %s", fd, strerror(errno) );
+            if( passed != -1 )
+                close( passed );
+            gnw_buf_release( buf );
+            return false;
+        }
+        sent = result > 0 ? result : 0;
+    }
+
+    output_push( connection, buf, sent, passed, 0 );
+
+    // Control frames never wait out a latency budget, so take anything held along with them
+    if( connection->hold_deadline != 0 )
+        connection_flush( connection );
+    else
+        connection_update_interest( connection );
+    return true;
+}
+
+/**
+ * Reply to a command on 'fd', in order behind anything already queued for it. Replies are never
+ * dropped, whatever the queue limit, and never block on a non-blocking socket.
+ *
+ * @param fd The connection the command came from
+ * @param payload The reply payload
+ * @param length The payload length
+ */
+void router_reply( int fd, uint8_t * payload, size_t length ) {
+    gnw_buf_t * buf = gnw_buf_alloc( length );
+    assert( buf != NULL, "Unable to allocate a packet buffer" );
+
+    memcpy( gnw_buf_put( buf, length ), payload, length );
+    gnw_buf_push_header( buf, GNW_REPLY, 0xFFFFFFFF );
+    router_emit_buf( fd, buf, -1 );
+}
+
+/**
+ * @param address A GraphIPC address
+ * @return The index of the shard that owns this address, and everything bound to it
+ */
+static inline int shard_owner( gnw_address_t address ) {
+    // Multiplicative hash, so sequentially allocated addresses still spread over every shard
+    return (int)(((uint64_t)(uint32_t)(address * 2654435761u) * (uint64_t)shard_count) >> 32);
+}
+
+/**
+ * Queue a message for another shard. Delivery happens when the receiving shard next
+ * drains its inbox, which we prompt once per batch from shard_flush().
+ *
+ * @param to The receiving shard
+ * @param message The message, ownership passes to the receiver
+ */
+void shard_send( int to, shard_msg_t * message ) {
+    // Anything already held back must go first, or frames could be reordered
+    if( kv_size( shard->overflow[to] ) > 0 || !mailbox_push( &shards[to].inbox[shard->index], message ) )
+        kv_push( shard_msg_t *, shard->overflow[to], message );
+
+    shard->wake[to] = true;
+}
+
+/**
+ * Queue a message for the control thread, which is woken at the end of the batch just as another shard would be.
+ *
+ * @param message The message, ownership passes to the control thread
+ */
+void control_send( shard_msg_t * message ) {
+    if( kv_size( shard->overflow[shard_count] ) > 0 || !mailbox_push( &control.inbox[shard->index], message ) )
+        kv_push( shard_msg_t *, shard->overflow[shard_count], message );
+
+    shard->wake[shard_count] = true;
+}
+
+shard_msg_t * shard_message( int kind, gnw_address_t target, int fd, uint8_t * buffer, size_t length ) {
+    shard_msg_t * message = (shard_msg_t *)bufpool_alloc( sizeof(shard_msg_t) + length );
+    assert( message != NULL, "Unable to allocate a shard message" );
+
+    message->kind = kind;
+    message->target = target;
+    message->fd = fd;
+    message->buf = NULL;
+    message->length = length;
+    memcpy( message->frame, buffer, length );
+
+    return message;
+}
+
+/**
+ * A SHARD_MSG_FRAME for 'target', sharing the frame with every other target it is queued for.
+ */
+shard_msg_t * shard_frame_message( gnw_address_t target, uint8_t * buffer, size_t length ) {
+    shard_msg_t * message = (shard_msg_t *)bufpool_alloc( sizeof(shard_msg_t) );
+    assert( message != NULL, "Unable to allocate a shard message" );
+
+    message->kind = SHARD_MSG_FRAME;
+    message->target = target;
+    message->fd = -1;
+    message->buf = frame_hold( buffer, length );
+    message->stamp = buffer == shard->frame.data ? shard->frame.stamp : 0;
+    message->length = length;
+
+    return message;
+}
+
+/**
+ * Emit a data frame to a bound target context owned by this shard.
+ */
+static void router_deliver_context( context_t * fwdEntry, int fd, uint8_t * buffer, size_t length ) {
+    if( !router_emit( fd, buffer, length ) ) {
+        fwdEntry->packets_dropped ++;
+        return;
+    }
+
+    fwdEntry->bytes_out += length;
+    fwdEntry->packets_out ++;
+
+    // Backpressure - if this target is congested, stop reading from the source feeding it until it drains.
+    // Only possible when the source is read by this shard, frames from other shards are bounded by the drop limit.
+    connection_t * congested = connection_get( fd );
+    if( congested->output.queued > QUEUE_HIGH_WATER( config.queue_limit ) && shard->current_fd > -1 && shard->current_fd != congested->fd ) {
+        connection_t * source = connection_get( shard->current_fd );
+        if( source->active && !source->paused ) {
+            log_debug( "fd %d is congested, pausing fd %d", congested->fd, source->fd );
+            source->paused = true;
+            connection_update_interest( source );
+            kv_push( int, congested->blocked, source->fd );
+        }
+    }
+}
+
+/**
+ * Emit a data frame to 'target', which must be owned by this shard.
+ */
+void router_deliver( gnw_address_t target, uint8_t * buffer, size_t length ) {
+    khint_t fwd = kh_get( gnw_address_t, shard->address_table, target );
+    if( fwd == kh_end( shard->address_table ) || !kh_exist( shard->address_table, fwd ) ) {
+        log_debug( "Missing or null forward entry, skipped." );
+        // ToDo: Should delete any missing destinations, but packets will be
+        // dropped anyway... so.. leave for now?
+        return;
+    }
+
+    context_t * fwdEntry = &kh_value( shard->address_table, fwd );
+    if( fwdEntry->bound_fd < 0 ) {
+        log_debug( "Forward entry %08x is not bound, skipped.", target );
+        return;
+    }
+
+    router_deliver_context( fwdEntry, fwdEntry->bound_fd, buffer, length );
+}
+
+/**
+ * Note that the address table has changed, so every cached route on this shard must be resolved again.
+ * Anything that adds an address (which may move every context), binds or unbinds one, or changes an
+ * edge has to call this.
+ */
+static void topology_changed() {
+    shard->topology_epoch++;
+}
+
+/**
+ * @return The forward targets of 'context', resolved against the current address table
+ */
+static route_t * routes_resolve( context_t * context ) {
+    if( context->routes_epoch == shard->topology_epoch )
+        return context->routes.a;
+
+    kv_resize( route_t, context->routes, kv_max( context->forward ) );
+    context->routes.n = kv_size( context->forward );
+
+    for( size_t i = 0; i < kv_size( context->forward ); i++ ) {
+        route_t * route = &kv_A( context->routes, i );
+        route->address = kv_A( context->forward, i );
+        route->owner = shard_owner( route->address );
+        route->context = NULL;
+        route->fd = -1;
+
+        if( route->owner != shard->index )
+            continue;
+
+        khint_t hint = kh_get( gnw_address_t, shard->address_table, route->address );
+        if( hint != kh_end( shard->address_table ) && kh_exist( shard->address_table, hint ) ) {
+            route->context = &kh_value( shard->address_table, hint );
+            route->fd = route->context->bound_fd;
+        }
+    }
+
+    context->routes_epoch = shard->topology_epoch;
+    return context->routes.a;
+}
+
+/**
+ * @return How much output a route's target has waiting: exactly, if this shard owns it, otherwise as its owner last
+ *         published. LOAD_UNBOUND if nothing is bound to take it.
+ */
+static uint32_t route_load( route_t * route ) {
+    if( route->owner != shard->index )
+        return load_read( route->address );
+    return route->fd >= 0 ? connection_load( connection_get( route->fd ) ) : LOAD_UNBOUND;
+}
+
+/**
+ * @return The index of the least loaded route, ties broken at random so idle targets share the traffic
+ */
+static size_t route_least_loaded( route_t * routes, size_t count ) {
+    size_t best = 0;
+    size_t ties = 0;
+    uint32_t least = LOAD_UNBOUND;
+
+    for( size_t i = 0; i < count; i++ ) {
+        uint32_t load = route_load( &routes[i] );
+        if( load < least ) {
+            least = load;
+            best = i;
+            ties = 1;
+        }
+        else if( load == least && rand() % ++ties == 0 )
+            best = i;
+    }
+    return best;
+}
+
+/**
+ * @return The index of the less loaded of two distinct routes picked at random
+ */
+static size_t route_two_choice( route_t * routes, size_t count ) {
+    if( count == 1 )
+        return 0;
+
+    size_t first = rand() % count;
+    size_t second = rand() % (count - 1);
+    if( second >= first )
+        second++;
+
+    return route_load( &routes[second] ) < route_load( &routes[first] ) ? second : first;
+}
+
+/**
+ * Smooth weighted round-robin: every edge earns its weight in credit, and the one with the most goes next,
+ * paying back the total. Each edge gets its share of every run of messages as evenly spread as it can be,
+ * rather than its whole share in one burst.
+ *
+ * @return The index of the next route
+ */
+static size_t route_weighted( context_t * context ) {
+    size_t best = 0;
+    int64_t total = 0;
+
+    for( size_t i = 0; i < kv_size( context->shares ); i++ ) {
+        edge_share_t * share = &kv_A( context->shares, i );
+        share->current += share->weight;
+        total += share->weight;
+        if( share->current > kv_A( context->shares, best ).current )
+            best = i;
+    }
+
+    kv_A( context->shares, best ).current -= total;
+    return best;
+}
+
+/**
+ * @return The index of the route a message's key maps to, or a random one if the message has no key
+ */
+static size_t route_affinity( context_t * context, route_t * routes, size_t count, uint8_t * buffer, size_t length ) {
+    gnw_header_t header;
+    uint8_t * payload = gnw_parse_header( buffer, &header );
+    size_t size = length - GNW_HEADER_SIZE;
+
+    // A merge's sequence number isn't part of the message
+    if( (header.type & GNW_SEQUENCED) && size >= sizeof(uint32_t) ) {
+        payload += sizeof(uint32_t);
+        size -= sizeof(uint32_t);
+    }
+
+    uint64_t hash;
+    if( !affinity_extract( &context->affinity, payload, size, &hash ) ) {
+        context->unkeyed++;
+        return rand() % count;
+    }
+
+    return affinity_pick( hash, &routes[0].address, count, sizeof(route_t) );
+}
+
+/**
+ * Emit a data frame along a resolved route, handing it to the owning shard if that isn't us.
+ */
+void router_forward( route_t * route, uint8_t * buffer, size_t length ) {
+    if( route->owner != shard->index ) {
+        shard_send( route->owner, shard_frame_message( route->address, buffer, length ) );
+        return;
+    }
+
+    if( route->fd < 0 ) {
+        log_debug( "Forward entry %08x is missing or not bound, skipped.", route->address );
+        return;
+    }
+
+    router_deliver_context( route->context, route->fd, buffer, length );
+}
+
+/**
+ * Move the connection on 'fd' to the shard that owns the address it is binding, so every
+ * frame it sends afterwards is read by the thread holding its forwarding state.
+ *
+ * @param fd The connection to move
+ * @param owner The receiving shard
+ * @param buffer The NEW_ADDRESS frame, which the owner replays once it has the connection
+ * @param length The frame length
+ */
+void shard_migrate( int fd, int owner, uint8_t * buffer, size_t length ) {
+    connection_t * connection = connection_get( fd );
+
+    reactor_remove( shard->reactor, fd );
+    if( connection->link != NULL )
+        link_unwatch( connection );
+
+    // Sources here can't be tracked from the new shard, so stop holding them back
+    connection_release( connection );
+
+    shard_msg_t * message = shard_message( SHARD_MSG_ADOPT, 0, fd, buffer, length );
+    message->connection = *connection; // The input and output buffers move with it
+    message->connection.paused = false;
+
+    memset( connection, 0, sizeof(connection_t) );
+    connection->fd = -1;
+
+    log_debug( "Moving fd %d to shard %d", fd, owner );
+    shard_send( owner, message );
+}
+
+/**
+ * Take up a shared-memory link offered on 'fd', using the descriptors that arrived with the offer.
+ *
+ * The reply goes out on the socket behind everything already sent there, and the client only
+ * switches over once it reads it, so nothing can overtake across the two paths. If anything is
+ * still queued for the socket we can't promise that, so the offer is declined. Likewise if the
+ * reply itself can't be sent straight away, as once the link is set, whatever is left queued
+ * would be flushed into the ring rather than the socket.
+ *
+ * @param fd The connection the offer came from
+ */
+void link_accept( int fd ) {
+    connection_t * connection = connection_get( fd );
+    shmlink_t * link = NULL;
+
+    bool busy = connection->output.queued > 0 || connection->link != NULL;
+#ifdef HAVE_IO_URING
+    busy = busy || uring_active;
+#endif
+
+    if( busy )
+        log_warn( "Shared-memory link offered on fd %d while it was busy, declined", fd );
+    else if( connection->passed_count != ROUTER_PASSED_FDS )
+        log_warn( "Shared-memory link offered on fd %d without its descriptors, declined", fd );
+    else {
+        link = (shmlink_t *)bufpool_alloc( sizeof(shmlink_t) );
+        assert( link != NULL, "Unable to allocate a shared-memory link" );
+
+        // Attaching takes ownership of the descriptors, whether or not it works
+        int result = shmlink_attach( link, connection->passed[0], connection->passed[1], connection->passed[2] );
+        connection->passed_count = 0;
+
+        if( result != 0 ) {
+            log_warn( "Unable to attach the shared-memory link on fd %d: %s", fd, strerror(-result) );
+            bufpool_free( link );
+            link = NULL;
+        }
+    }
+    connection_drop_passed( connection );
+
+    uint8_t reply[2] = { 0 };
+    uint8_t * out = packet_write_u8( reply, GNW_CMD_SHM_LINK );
+    out = packet_write_u8( out, link != NULL );
+    router_reply( fd, reply, out - reply );
+
+    if( link == NULL )
+        return;
+
+    if( connection->output.queued > 0 ) {
+        output_entry_t * held = &kdq_first( connection->output.entries );
+        if( held->offset == 0 ) {
+            // None of it went, so it can still become a decline
+            gnw_buf_data( held->buf )[GNW_HEADER_SIZE + 1] = 0;
+            log_warn( "Shared-memory link offered on fd %d while its socket was full, declined", fd );
+        }
+        else {
+            // The client will read an accept we can't stand behind, so there's no keeping the two in step
+            log_error( "Shared-memory link reply on fd %d was only partly sent, closing it", fd );
+            connection_close( connection );
+        }
+
+        shmlink_destroy( link );
+        bufpool_free( link );
+        return;
+    }
+
+    connection->link = link;
+    connection->link_settled = false;
+    link_watch( connection );
+    log_info( "fd %d switched to a shared-memory link (%lu byte rings)", fd, (unsigned long)(link->tx.mask + 1) );
+}
+
+/**
+ * @param address A GraphIPC address
+ * @return Its context, if this shard has one
+ */
+static context_t * context_find( gnw_address_t address ) {
+    khint_t hint = kh_get( gnw_address_t, shard->address_table, address );
+    if( hint == kh_end( shard->address_table ) )
+        return NULL;
+    return &kh_value( shard->address_table, hint );
+}
+
+/**
+ * @return True if this address is bound to a connection this shard can hand a descriptor to
+ */
+static bool cut_through_endpoint( context_t * context ) {
+    if( context == NULL || context->bound_fd == -1 )
+        return false;
+
+    connection_t * connection = connection_get( context->bound_fd );
+    return connection->active && connection->transport == TRANSPORT_UNIX && connection->link == NULL;
+}
+
+/**
+ * A source can be cut through when every frame it sends can only ever go to one place, and
+ * both ends are on unix sockets held by this shard.
+ */
+static bool cut_through_eligible( gnw_address_t address, context_t * context ) {
+    if( !config.arg_cut_through || kv_size( context->forward ) != 1 )
+        return false;
+
+#ifdef HAVE_IO_URING
+    if( uring_active )
+        return false;
+#endif
+
+    int policy = context->forward_policy;
+    if( policy != GNW_POLICY_BROADCAST && policy != GNW_POLICY_ANYCAST && policy != GNW_POLICY_ROUNDROBIN &&
+        policy != GNW_POLICY_LEASTLOADED && policy != GNW_POLICY_TWOCHOICE && policy != GNW_POLICY_AFFINITY )
+        return false;
+
+    gnw_address_t target = kv_A( context->forward, 0 );
+    if( target == address || shard_owner( target ) != shard->index )
+        return false;
+
+    return cut_through_endpoint( context ) && cut_through_endpoint( context_find( target ) );
+}
+
+/**
+ * Send a cut-through control frame to 'fd', optionally with a descriptor.
+ */
+static bool cut_through_emit( int fd, uint8_t op, gnw_address_t source, gnw_address_t target, int passed ) {
+    gnw_buf_t * buf = gnw_buf_alloc( 10 );
+    assert( buf != NULL, "Unable to allocate a packet buffer" );
+
+    uint8_t * ptr = gnw_buf_put( buf, op == GNW_CUT_SEND ? 10 : 6 );
+    ptr = packet_write_u8( ptr, GNW_CMD_CUT_THROUGH );
+    ptr = packet_write_u8( ptr, op );
+    ptr = packet_write_u32( ptr, source );
+    if( op == GNW_CUT_SEND )
+        ptr = packet_write_u32( ptr, target );
+
+    gnw_buf_push_header( buf, GNW_COMMAND, 0xFFFFFFFF );
+    return router_emit_buf( fd, buf, passed );
+}
+
+/**
+ * Hand the source its end of a fresh socketpair. The target gets the other end once the source's
+ * switch-over marker comes back through the router, behind everything it sent before it.
+ */
+static void cut_through_start( gnw_address_t address, context_t * context ) {
+    int pair[2];
+    if( socketpair( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair ) == -1 ) {
+        log_warn( "Unable to create a direct link for %08x: %s", address, strerror(errno) );
+        return;
+    }
+
+    gnw_address_t target = kv_A( context->forward, 0 );
+    if( !cut_through_emit( context->bound_fd, GNW_CUT_SEND, address, target, pair[0] ) ) {
+        close( pair[1] );
+        return;
+    }
+
+    context->cut_state = CUT_PENDING;
+    context->cut_fd = pair[1];
+    context->cut_target = target;
+    log_info( "Cutting %08x through to %08x", address, target );
+}
+
+/**
+ * Tell the source to close its direct link and go back through the router.
+ */
+static void cut_through_stop( gnw_address_t address, context_t * context ) {
+    bool bound = context->bound_fd != -1 && connection_get( context->bound_fd )->active;
+    if( bound )
+        cut_through_emit( context->bound_fd, GNW_CUT_CLOSE, address, 0, -1 );
+
+    // A pending link still gets its marker, which is when the target's end is passed on
+    if( bound && context->cut_state == CUT_PENDING ) {
+        context->cut_state = CUT_CANCELLED;
+        return;
+    }
+
+    if( context->cut_fd != -1 )
+        close( context->cut_fd );
+    context->cut_fd = -1;
+    context->cut_state = CUT_NONE;
+    log_info( "Edge %08x -> %08x routed through the router again", address, context->cut_target );
+}
+
+/**
+ * Bring the direct link for 'address' in line with the current topology: start one if its only
+ * edge has become eligible, and fall back to routing if the edge changed underneath one.
+ *
+ * @param address The source address to check
+ */
+void cut_through_update( gnw_address_t address ) {
+    context_t * context = context_find( address );
+    if( context == NULL || context->cut_state == CUT_CANCELLED )
+        return;
+
+    bool eligible = cut_through_eligible( address, context );
+
+    if( context->cut_state == CUT_NONE ) {
+        if( eligible )
+            cut_through_start( address, context );
+        return;
+    }
+
+    if( !eligible || kv_A( context->forward, 0 ) != context->cut_target )
+        cut_through_stop( address, context );
+}
+
+/**
+ * Handle a cut-through message from a source.
+ *
+ * @param payload The payload following the directive
+ * @param length The payload length
+ */
+void cut_through_handle( uint8_t * payload, size_t length ) {
+    uint8_t op = 0;
+    gnw_address_t address = 0;
+    payload = packet_read_u8( payload, &op );
+    payload = packet_read_u32( payload, &address );
+
+    context_t * context = context_find( address );
+    if( context == NULL ) {
+        log_warn( "Cut-through message for unknown address %08x, ignored", address );
+        return;
+    }
+
+    switch( op ) {
+        case GNW_CUT_SWITCHED: {
+            if( context->cut_state != CUT_PENDING && context->cut_state != CUT_CANCELLED ) {
+                log_warn( "Unexpected cut-through marker from %08x, ignored", address );
+                break;
+            }
+
+            // Everything routed before the marker is queued ahead of this, so the target reads it all first
+            context_t * target = context_find( context->cut_target );
+            int passed = context->cut_fd;
+            context->cut_fd = -1;
+
+            if( target == NULL || target->bound_fd == -1 ||
+                !cut_through_emit( target->bound_fd, GNW_CUT_RECEIVE, address, 0, passed ) ) {
+                log_warn( "Unable to pass the direct link from %08x to %08x", address, context->cut_target );
+                if( target == NULL || target->bound_fd == -1 )
+                    close( passed );
+            }
+
+            if( context->cut_state == CUT_CANCELLED ) {
+                context->cut_state = CUT_NONE;
+                cut_through_update( address );
+            }
+            else
+                context->cut_state = CUT_ACTIVE;
+        } break;
+
+        case GNW_CUT_STATS: {
+            if( length < 13 )
+                break;
+
+            uint32_t packets = 0;
+            uint32_t bytes = 0;
+            payload = packet_read_u32( payload, &packets );
+            payload = packet_read_u32( payload, &bytes );
+
+            context->packets_in += packets;
+            context->bytes_in += bytes;
+
+            context_t * target = context_find( context->cut_target );
+            if( target != NULL ) {
+                target->packets_out += packets;
+                target->bytes_out += bytes;
+            }
+        } break;
+
+        default:
+            log_warn( "Unknown cut-through operation %02x from %08x", op, address );
+    }
+}
+
+/**
+ * Drops a held frame, for a resequencer giving up on an unfinished message.
+ */
+static void merge_drop( void * part ) {
+    gnw_buf_release( (gnw_buf_t *)part );
+}
+
+/**
+ * Send everything a merge target's resequencer will let go of, in order, then note whether it is left
+ * waiting on a missing sequence number, so merge_service() can give up on it in time.
+ */
+static void merge_release( gnw_address_t target, context_t * context ) {
+    bool released = false;
+    gnw_buf_t * part;
+    while( (part = reseq_pop( context->merge )) != NULL ) {
+        // Each goes as the current frame on its own, so its queues share the buffer. How long it waited its turn
+        // isn't hop latency, so it isn't timed.
+        frame_begin( gnw_buf_data( part ), part->length, part );
+        shard->frame.stamp = 0;
+        if( context->bound_fd >= 0 )
+            router_deliver_context( context, context->bound_fd, gnw_buf_data( part ), part->length );
+        frame_end();
+        released = true;
+    }
+
+    // Every new gap gets the whole timeout to fill
+    if( released || !reseq_waiting( context->merge ) )
+        context->merge_since = 0;
+    if( !reseq_waiting( context->merge ) || context->merge_since != 0 )
+        return;
+
+    context->merge_since = router_clock();
+    coalesce_arm( context->merge_since + config.merge_timeout );
+    if( !context->merge_listed ) {
+        kv_push( gnw_address_t, shard->merging, target );
+        context->merge_listed = true;
+    }
+}
+
+/**
+ * Take a frame that came over a merge edge, for a target owned by this shard, and send on whatever that lets
+ * through in sequence order. Must not be called while a frame is being routed, as released frames become the
+ * current frame in turn.
+ *
+ * @param target The merge target
+ * @param buffer The frame, stamped with a sequence number if GNW_SEQUENCED
+ * @param length The frame length
+ * @param buf A buffer holding the frame, whose reference is taken over, or NULL
+ */
+void merge_receive( gnw_address_t target, uint8_t * buffer, size_t length, gnw_buf_t * buf ) {
+    gnw_header_t header;
+    uint8_t * payload = gnw_parse_header( buffer, &header );
+
+    // Without a number there is no place to keep, so it just goes straight through
+    if( !(header.type & GNW_SEQUENCED) ) {
+        frame_begin( buffer, length, buf );
+        router_deliver( target, buffer, length );
+        frame_end();
+        return;
+    }
+
+    context_t * context = context_find( target );
+    if( context == NULL || header.length < sizeof(uint32_t) ) {
+        log_debug( "Sequenced frame for %08x has nowhere to go, dropped", target );
+        gnw_buf_release( buf );
+        return;
+    }
+
+    if( context->merge == NULL ) {
+        context->merge = (reseq_t *)malloc( sizeof(reseq_t) );
+        bool created = context->merge != NULL && reseq_init( context->merge, config.merge_window, merge_drop );
+        assert( created, "Unable to allocate a resequencer" );
+    }
+
+    // The number is only for us, so the copy held for the target is made without it
+    uint32_t sequence = 0;
+    payload = packet_read_u32( payload, &sequence );
+    gnw_buf_t * part = gnw_buf_copy( payload, header.length - sizeof(uint32_t) );
+    assert( part != NULL, "Unable to allocate a packet buffer" );
+    gnw_buf_push_header( part, GNW_DATA | (header.type & GNW_MORE), header.source );
+    gnw_buf_release( buf );
+
+    bool last = (header.type & GNW_MORE) == 0;
+    int placed;
+    while( (placed = reseq_insert( context->merge, sequence, part, last )) == RESEQ_AHEAD ) {
+        // The window is full, so whatever gap is holding it up is given up on now rather than at its timeout
+        reseq_skip( context->merge );
+        merge_release( target, context );
+    }
+
+    if( placed == RESEQ_RESTART ) {
+        // The sources have started counting again, so everything held from before goes first
+        log_info( "Merge into %08x restarted at %u", target, sequence );
+        while( context->merge->held > 0 ) {
+            reseq_skip( context->merge );
+            merge_release( target, context );
+        }
+        reseq_restart( context->merge, sequence );
+        placed = reseq_insert( context->merge, sequence, part, last );
+    }
+
+    if( placed == RESEQ_LATE ) {
+        log_debug( "Frame %u for %08x arrived after its turn, dropped", sequence, target );
+        context->packets_dropped++;
+        gnw_buf_release( part );
+    }
+
+    merge_release( target, context );
+}
+
+/**
+ * Give up on the missing sequence number of every merge that has waited out its timeout, releasing whatever was
+ * held behind it, and make sure the timer fires for the next to come due.
+ */
+void merge_service() {
+    uint64_t now = router_clock();
+    uint64_t next = 0;
+    size_t kept = 0;
+
+    for( size_t i = 0; i < kv_size( shard->merging ); i++ ) {
+        gnw_address_t target = kv_A( shard->merging, i );
+        context_t * context = context_find( target );
+        if( context == NULL )
+            continue;
+
+        if( context->merge_since != 0 && context->merge_since + config.merge_timeout <= now ) {
+            log_debug( "Merge into %08x gave up waiting for %u", target, context->merge->next );
+            reseq_skip( context->merge );
+            context->merge_since = 0;
+            merge_release( target, context );
+        }
+
+        if( context->merge_since == 0 ) {
+            context->merge_listed = false;
+            continue;
+        }
+
+        kv_A( shard->merging, kept++ ) = target;
+        uint64_t deadline = context->merge_since + config.merge_timeout;
+        if( next == 0 || deadline < next )
+            next = deadline;
+    }
+    shard->merging.n = kept;
+
+    if( next != 0 )
+        coalesce_arm( next );
+}
+
+/**
+ * Take a combine target's inputs from the published topology, if it has changed since they were last taken: every
+ * address whose forward policy is combine, with an edge to the target.
+ */
+static void combine_refresh( context_t * context, gnw_address_t target ) {
+    topology_t * topology = shard->topology;
+    if( topology == NULL || context->combine_generation == topology->generation )
+        return;
+
+    kvec_t( gnw_address_t ) sources;
+    kv_init( sources );
+    for( khint_t iter = kh_begin( topology->nodes ); iter != kh_end( topology->nodes ); iter++ ) {
+        if( !kh_exist( topology->nodes, iter ) || kh_value( topology->nodes, iter ).forward_policy != GNW_POLICY_COMBINE )
+            continue;
+
+        topology_node_t * node = &kh_value( topology->nodes, iter );
+        for( size_t i = 0; i < kv_size( node->forward ); i++ ) {
+            if( kv_A( node->forward, i ) == target ) {
+                kv_push( gnw_address_t, sources, kh_key( topology->nodes, iter ) );
+                break;
+            }
+        }
+    }
+
+    // If this fails the old inputs stay, and it is tried again on the next frame
+    if( combiner_inputs( context->combine, sources.a, kv_size( sources ) ) )
+        context->combine_generation = topology->generation;
+    kv_destroy( sources );
+}
+
+/**
+ * Send the round at the head of a combine target's inputs, as one frame from the target's own address. A round too
+ * big for a single fragment goes as GNW_MORE fragments, like any other big message.
+ */
+static void combine_round( gnw_address_t target, context_t * context ) {
+    size_t length = combiner_length( context->combine, config.combine_format );
+
+    // Usually it fits, and is written straight into the buffer it is sent from
+    uint8_t * round = NULL;
+    gnw_buf_t * whole = NULL;
+    if( length <= GNW_FRAGMENT_SIZE ) {
+        whole = gnw_buf_alloc( length );
+        assert( whole != NULL, "Unable to allocate a packet buffer" );
+        round = gnw_buf_put( whole, length );
+    }
+    else {
+        round = (uint8_t *)malloc( length );
+        assert( round != NULL, "Unable to allocate a combined round" );
+    }
+    combiner_take( context->combine, config.combine_format, round );
+
+    size_t offset = 0;
+    do {
+        size_t chunk = length - offset < GNW_FRAGMENT_SIZE ? length - offset : GNW_FRAGMENT_SIZE;
+        bool more = offset + chunk < length;
+
+        gnw_buf_t * part = whole;
+        if( part == NULL ) {
+            part = gnw_buf_copy( round + offset, chunk );
+            assert( part != NULL, "Unable to allocate a packet buffer" );
+        }
+        gnw_buf_push_header( part, more ? GNW_DATA | GNW_MORE : GNW_DATA, target );
+
+        // How long its inputs waited for each other isn't hop latency, so it isn't timed
+        frame_begin( gnw_buf_data( part ), part->length, part );
+        shard->frame.stamp = 0;
+        if( context->bound_fd >= 0 )
+            router_deliver_context( context, context->bound_fd, gnw_buf_data( part ), part->length );
+        frame_end();
+
+        offset += chunk;
+    } while( offset < length );
+
+    if( whole == NULL )
+        free( round );
+}
+
+/**
+ * Send every round a combine target has complete, then note whether it is left waiting on a missing input, so
+ * combine_service() can send the round without it in time.
+ */
+static void combine_release( gnw_address_t target, context_t * context ) {
+    bool released = false;
+    while( combiner_ready( context->combine ) ) {
+        combine_round( target, context );
+        released = true;
+    }
+
+    // Every new round gets the whole timeout to fill
+    if( released || !combiner_waiting( context->combine ) )
+        context->combine_since = 0;
+    if( !combiner_waiting( context->combine ) || context->combine_since != 0 )
+        return;
+
+    context->combine_since = router_clock();
+    coalesce_arm( context->combine_since + config.combine_timeout );
+    if( !context->combine_listed ) {
+        kv_push( gnw_address_t, shard->combining, target );
+        context->combine_listed = true;
+    }
+}
+
+/**
+ * Take a frame that came over a combine edge, for a target owned by this shard, into the target's next round from
+ * that source, and send whatever rounds that completes. Must not be called while a frame is being routed, as rounds
+ * become the current frame in turn.
+ *
+ * @param target The combine target
+ * @param buffer The frame
+ * @param length The frame length
+ * @param buf A buffer holding the frame, whose reference is taken over, or NULL
+ */
+void combine_receive( gnw_address_t target, uint8_t * buffer, size_t length, gnw_buf_t * buf ) {
+    gnw_header_t header;
+    uint8_t * payload = gnw_parse_header( buffer, &header );
+
+    context_t * context = context_find( target );
+    if( context == NULL ) {
+        log_debug( "Combined frame for %08x has nowhere to go, dropped", target );
+        gnw_buf_release( buf );
+        return;
+    }
+
+    if( context->combine == NULL ) {
+        context->combine = (combiner_t *)malloc( sizeof(combiner_t) );
+        assert( context->combine != NULL, "Unable to allocate a combiner" );
+        combiner_init( context->combine, config.combine_depth );
+        context->combine_generation = 0;
+    }
+    combine_refresh( context, target );
+
+    // Our topology can trail the source's shard by a moment, so an input we don't know of yet just loses the frame
+    int input = combiner_find( context->combine, header.source );
+    if( input == -1 ) {
+        log_debug( "Frame from %08x is not an input of %08x yet, dropped", header.source, target );
+        context->packets_dropped++;
+        gnw_buf_release( buf );
+        return;
+    }
+
+    // A sequence number means nothing once the inputs are joined, so it goes
+    size_t stamp = (header.type & GNW_SEQUENCED) && header.length >= sizeof(uint32_t) ? sizeof(uint32_t) : 0;
+    bool last = (header.type & GNW_MORE) == 0;
+
+    // A full input has the round at the head sent without whatever it is missing, rather than lose the new one
+    if( last && combiner_full( context->combine, input ) )
+        combine_round( target, context );
+
+    if( !combiner_add( context->combine, input, payload + stamp, header.length - stamp, last ) )
+        context->packets_dropped++;
+    gnw_buf_release( buf );
+
+    combine_release( target, context );
+}
+
+/**
+ * Send the round of every combine target that has waited out its timeout, without the inputs it is missing, and
+ * make sure the timer fires for the next to come due.
+ */
+void combine_service() {
+    uint64_t now = router_clock();
+    uint64_t next = 0;
+    size_t kept = 0;
+
+    for( size_t i = 0; i < kv_size( shard->combining ); i++ ) {
+        gnw_address_t target = kv_A( shard->combining, i );
+        context_t * context = context_find( target );
+        if( context == NULL )
+            continue;
+
+        // An input may have gone, which can complete the round
+        combine_refresh( context, target );
+
+        if( context->combine_since != 0 && context->combine_since + config.combine_timeout <= now ) {
+            log_debug( "Combine into %08x gave up waiting on its missing inputs", target );
+            combine_round( target, context );
+            context->combine_since = 0;
+        }
+        combine_release( target, context );
+
+        if( context->combine_since == 0 ) {
+            context->combine_listed = false;
+            continue;
+        }
+
+        kv_A( shard->combining, kept++ ) = target;
+        uint64_t deadline = context->combine_since + config.combine_timeout;
+        if( next == 0 || deadline < next )
+            next = deadline;
+    }
+    shard->combining.n = kept;
+
+    if( next != 0 )
+        coalesce_arm( next );
+}
+
+void handle_packet( int fd, uint8_t * buffer, size_t length ) {
+    assert( buffer != NULL, "Attempted to parse a null buffer!" );
+    assert( length > 0, "Attempted to parse an empty (zero-length) buffer!" );
+
+    gnw_header_t header;
+    uint8_t * payload = gnw_parse_header( buffer, &header );
+    
+    switch( GNW_FRAME_TYPE( header.type ) ) {
+        case GNW_COMMAND:
+            if( header.length == 0 ) {
+                log_warn( "Client issued a command with no directive, nothing to do!" );
+                return;
+            }
+
+            uint8_t directive = 0;
+            uint8_t * next = packet_read_u8( payload, &directive );
+
+            // Changes to the graph (and requests to see it) are the control thread's business, never the data path's
+            if( directive == GNW_CMD_CONNECT || directive == GNW_CMD_DISCONNECT || directive == GNW_CMD_POLICY ||
+                directive == GNW_CMD_LATENCY || directive == GNW_CMD_READ_WEIGHT || directive == GNW_CMD_AFFINITY_KEY ||
+                directive == GNW_CMD_EDGE_WEIGHT || directive == GNW_CMD_STATUS ) {
+                control_send( shard_message( SHARD_MSG_COMMAND, 0, -1, buffer, length ) );
+                return;
+            }
+
+            // Cut-through is applied by the shard that owns the source, which holds both ends
+            if( directive == GNW_CMD_CUT_THROUGH ) {
+                if( header.length < 2 + sizeof(gnw_address_t) ) {
+                    log_warn( "Command directive %02x is too short, ignored", directive );
+                    return;
+                }
+
+                gnw_address_t subject = 0;
+                packet_read_u32( next + 1, &subject );
+
+                int owner = shard_owner( subject );
+                if( owner != shard->index ) {
+                    shard_send( owner, shard_message( SHARD_MSG_PACKET, subject, -1, buffer, length ) );
+                    return;
+                }
+            }
+
+            switch( directive ) {
+                // Handle new address requests - bit of a misnomer, as this actually really 'claims' an address
+                // rather than creating a new one. Essentially 'binds' the address to the fd the request came
+                // from
+                case GNW_CMD_NEW_ADDRESS:
+                    log_debug( "New address request" );
+
+                    // Generate a random address (one we own, so it never needs to move), else use the requested one.
+                    gnw_address_t address_req = 0;
+                    if( header.length == 5 )
+                        packet_read_u32( next, &address_req );
+                    else {
+                        do {
+                            address_req = 0xFFFFF000 & rand(); // Random address, default mask
+                        } while( shard_owner( address_req ) != shard->index );
+                    }
+
+                    // Bind on the owning shard, so this connection is read by the thread holding its state
+                    if( shard_owner( address_req ) != shard->index ) {
+                        shard_migrate( fd, shard_owner( address_req ), buffer, length );
+                        return;
+                    }
+
+                    khint_t hint = kh_get( gnw_address_t, shard->address_table, address_req );
+                    context_t * context = &kh_value( shard->address_table, hint );
+
+                    if( hint == kh_end(shard->address_table) || kh_exist( shard->address_table, hint ) == 0 ) {
+                        int status;
+                        hint = kh_put( gnw_address_t, shard->address_table, address_req, &status );
+                        context = &kh_value( shard->address_table, hint );
+                        setup_context( context );
+                    }
+                    context = &kh_value( shard->address_table, hint );
+
+                    context->bound_fd = fd; // Bind this fd to this address (or visa-versa)
+                    connection_get( fd )->address = address_req;
+                    connection_publish_load( connection_get( fd ) );
+                    connection_get( fd )->latency_budget = context->latency_budget;
+                    connection_get( fd )->read_weight = context->read_weight;
+                    topology_changed();
+
+                    // Reply to the client with their assigned address
+                    uint8_t reply[5] = { 0 };
+                    uint8_t * out = packet_write_u8( reply, GNW_CMD_NEW_ADDRESS );
+                    //next = packet_write_u32( next, 0x1000 );
+                    out = packet_write_u32( out, address_req ); // Just accept _any_ address from the clients for now...
+                    router_reply( fd, reply, out - reply );
+
+                    // Edges into or out of this address may be able to go direct now
+                    cut_through_update( address_req );
+                    for( khint_t iter = kh_begin( shard->address_table ); iter != kh_end( shard->address_table ); iter++ ) {
+                        if( !kh_exist( shard->address_table, iter ) )
+                            continue;
+                        context_t * other = &kh_value( shard->address_table, iter );
+                        if( kv_size( other->forward ) == 1 && kv_A( other->forward, 0 ) == address_req )
+                            cut_through_update( kh_key( shard->address_table, iter ) );
+                    }
+
+                    break;
+                
+                case GNW_CMD_SHM_LINK:
+                    link_accept( fd );
+                    break;
+
+                case GNW_CMD_CUT_THROUGH:
+                    cut_through_handle( next, header.length - 1 );
+                    break;
+
+                default:
+                    log_warn( "Missing handler for command directive %02x", payload[0] );
+            }
+
+            break;
+
+        case GNW_DATA: {
+            // Frames are routed by the shard that owns their source
+            int owner = shard_owner( header.source );
+            if( owner != shard->index ) {
+                shard_send( owner, shard_message( SHARD_MSG_PACKET, header.source, -1, buffer, length ) );
+                return;
+            }
+
+            khint_t hint = kh_get( gnw_address_t, shard->address_table, header.source );
+
+            log_debug( "IN: %08x", header.source );
+
+            // Just drop the message, if we don't have a known, bound address for this...
+            if( !kh_exist( shard->address_table, hint ) ) {
+                log_debug( "Dropped %lu bytes.", length );
+                return;
+            }
+
+            // Grab this entry
+            context_t * entry = &(kh_value( shard->address_table, hint ));
+
+            // Update the stats
+            entry->bytes_in += length;
+            entry->packets_in ++;
+
+            // Nowhere to go
+            size_t count = kv_size( entry->forward );
+            if( count == 0 )
+                return;
+
+            route_t * routes = routes_resolve( entry );
+
+            // Merged and combined frames leave when their target is ready for them rather than now, each routed on its own
+            if( entry->forward_policy == GNW_POLICY_MERGE || entry->forward_policy == GNW_POLICY_COMBINE ) {
+                bool merge = entry->forward_policy == GNW_POLICY_MERGE;
+                for( size_t i = 0; i < count; i++ ) {
+                    if( routes[i].owner == shard->index ) {
+                        if( merge )
+                            merge_receive( routes[i].address, buffer, length, NULL );
+                        else
+                            combine_receive( routes[i].address, buffer, length, NULL );
+                        continue;
+                    }
+
+                    shard_msg_t * message = shard_frame_message( routes[i].address, buffer, length );
+                    message->kind = merge ? SHARD_MSG_MERGE : SHARD_MSG_COMBINE;
+                    shard_send( routes[i].owner, message );
+                }
+                return;
+            }
+
+            // Every fragment of a message has to follow the first one, wherever the policy sent it
+            int fragment_route = entry->fragment_route < (int)count ? entry->fragment_route : -1;
+
+            // Every queue this frame lands in shares one copy of it
+            frame_begin( buffer, length, NULL );
+
+            switch( entry->forward_policy ) {
+                case GNW_POLICY_BROADCAST: {
+                    // Large frames going to several places are copied into the kernel once, rather than once per target
+                    bool staged = shard->fanout_ready && length >= config.splice_threshold && count > 1 &&
+                                  fanout_stage( &shard->fanout, buffer, length );
+
+                    for( size_t i = 0; i < count; i++ ) {
+                        log_debug( "BROADCAST: %08x -> %08x", header.source, routes[i].address );
+                        router_forward( &routes[i], buffer, length ); // Forward wholesale
+                    }
+
+                    if( staged )
+                        fanout_unstage( &shard->fanout );
+                } break;
+            
+                case GNW_POLICY_ANYCAST: {
+                    route_t * route = &routes[fragment_route >= 0 ? (size_t)fragment_route : rand() % count];
+
+                    entry->fragment_route = (header.type & GNW_MORE) ? (int)(route - routes) : -1;
+
+                    log_debug( "ANYCAST: %08x -> %08x", header.source, route->address );
+                    router_forward( route, buffer, length ); // Forward wholesale
+                } break;
+
+                case GNW_POLICY_ROUNDROBIN: {
+                    // A fragmented message only takes one turn
+                    size_t pick;
+                    if( fragment_route >= 0 )
+                        pick = (size_t)fragment_route;
+                    else if( entry->weighted && kv_size( entry->shares ) == count )
+                        pick = route_weighted( entry );
+                    else
+                        pick = ++entry->rotation % count;
+                    route_t * route = &routes[pick];
+
+                    if( fragment_route < 0 && kv_size( entry->shares ) == count )
+                        kv_A( entry->shares, pick ).messages++;
+
+                    entry->fragment_route = (header.type & GNW_MORE) ? (int)pick : -1;
+
+                    log_debug( "ROUNDROBIN: %08x -> %08x", header.source, route->address );
+                    router_forward( route, buffer, length ); // Forward wholesale
+                } break;
+
+                case GNW_POLICY_LEASTLOADED:
+                case GNW_POLICY_TWOCHOICE: {
+                    size_t pick;
+                    if( fragment_route >= 0 )
+                        pick = (size_t)fragment_route;
+                    else if( entry->forward_policy == GNW_POLICY_LEASTLOADED )
+                        pick = route_least_loaded( routes, count );
+                    else
+                        pick = route_two_choice( routes, count );
+                    route_t * route = &routes[pick];
+
+                    entry->fragment_route = (header.type & GNW_MORE) ? (int)pick : -1;
+
+                    log_debug( "LEASTLOADED: %08x -> %08x", header.source, route->address );
+                    router_forward( route, buffer, length ); // Forward wholesale
+                } break;
+
+                case GNW_POLICY_AFFINITY: {
+                    // Only the first fragment carries the key
+                    size_t pick = fragment_route >= 0 ? (size_t)fragment_route : route_affinity( entry, routes, count, buffer, length );
+                    route_t * route = &routes[pick];
+
+                    entry->fragment_route = (header.type & GNW_MORE) ? (int)pick : -1;
+
+                    log_debug( "AFFINITY: %08x -> %08x", header.source, route->address );
+                    router_forward( route, buffer, length ); // Forward wholesale
+                } break;
+
+                default:
+                    log_error( "Bad forward policy! [%02x]", entry->forward_policy );
+            }
+
+            frame_end();
+        }
+        break;
+
+        default:
             log_warn( "Unknown header type %02x, ignored, may be build mismatch?", header.type );
             gnw_dumpPacket( stdout, buffer, length );
     }
 
 }
 
-void handle_event( int index, struct pollfd * pollStruct, uint8_t * buffer, ssize_t length ) {
-    // Is this an error?
-    if( (pollStruct->revents & POLLIN) != POLLIN || length < 1 ) {
+/**
+ * Fetch the connection slot for 'fd', growing the table if the fd is beyond the current end.
+ *
+ * Note: growing the table may move it, so pointers from earlier calls are invalidated.
+ *
+ * @param fd The file descriptor to look up
+ * @return The (possibly inactive) connection slot for this fd
+ */
+connection_t * connection_get( int fd ) {
+    assert( fd > -1, "Attempted to look up a connection for an invalid fd!" );
+
+    if( (size_t)fd >= kv_max( shard->connections ) ) {
+        size_t old_size = kv_max( shard->connections );
+        size_t new_size = (size_t)fd + 1;
+        kv_roundup32( new_size );
+        kv_resize( connection_t, shard->connections, new_size );
+        shard->connections.n = new_size;
+
+        for( size_t i = old_size; i < new_size; i++ ) {
+            connection_t * blank = &kv_A( shard->connections, i );
+            memset( blank, 0, sizeof(connection_t) );
+            blank->fd = -1;
+        }
+    }
+
+    return &kv_A( shard->connections, fd );
+}
+
+connection_t * connection_open( int fd ) {
+    connection_t * connection = connection_get( fd );
+    assert( !connection->active, "Opened a connection over an fd that was still active!" );
+
+    connection->fd = fd;
+    connection->active = true;
+    connection->read_weight = 1;
+    connection->address = GNW_ANY;
+    bool allocated = framebuffer_init( &connection->input, INPUT_BUFFER_SIZE );
+    assert( allocated, "NULL buffer reference after malloc" );
+
+#ifdef HAVE_IO_URING
+    if( uring_active ) {
+        uring_attach( connection );
+        return connection;
+    }
+#endif
+
+    connection->interest = REACTOR_READ;
+    if( reactor_add( shard->reactor, fd, connection->interest ) == -1 )
+        log_error( "Unable to monitor fd %d: %s", fd, strerror(errno) );
+
+    return connection;
+}
+
+void connection_close( connection_t * connection ) {
+    if( !connection->active )
+        return;
+
+    log_debug( "Closing connection on fd %d", connection->fd );
+
+#ifdef HAVE_IO_URING
+    if( uring_active )
+        uring_detach( connection );
+    else
+#endif
+    reactor_remove( shard->reactor, connection->fd );
+    close( connection->fd );
+
+    framebuffer_destroy( &connection->input );
+
+    // Nothing will drain this queue now, so let anyone waiting on it go
+    connection_release( connection );
+    kv_destroy( connection->blocked );
+    kv_init( connection->blocked );
+
+    output_clear( &connection->output );
+    output_unpin( &connection->output );
+    memset( &connection->zerocopy, 0, sizeof(zerocopy_t) );
+
+    // Nothing will take the address's frames until it is bound again
+    if( connection->address != GNW_ANY )
+        load_publish( connection->address, LOAD_UNBOUND );
+    connection->address = GNW_ANY;
+    connection->socket_queued = 0;
+    connection->load_listed = false;
+    connection->paused = false;
+    connection->interest = 0;
+    connection->latency_budget = 0;
+    connection->hold_deadline = 0;
+
+    // A stale place in the run queue is skipped once nothing is pending
+    connection->pending = 0;
+    connection->deficit = 0;
+    connection->read_bytes = 0;
+    connection->read_deferred = 0;
+
+    if( connection->link != NULL ) {
+        link_unwatch( connection );
+        shmlink_destroy( connection->link );
+        bufpool_free( connection->link );
+        connection->link = NULL;
+    }
+    connection_drop_passed( connection );
+    connection->transport = TRANSPORT_TCP;
+    connection->stream.remaining = 0;
+
+    // Unbind any addresses on this fd, so a later connection reusing the number doesn't receive their traffic
+    topology_changed();
+    for( khint_t iter = kh_begin( shard->address_table ); iter != kh_end( shard->address_table ); iter++ ) {
+        if( kh_exist( shard->address_table, iter ) && kh_value( shard->address_table, iter ).bound_fd == connection->fd )
+            kh_value( shard->address_table, iter ).bound_fd = -1;
+    }
+
+    // Any direct link with an end on this connection is finished with
+    for( khint_t iter = kh_begin( shard->address_table ); iter != kh_end( shard->address_table ); iter++ ) {
+        if( kh_exist( shard->address_table, iter ) && kh_value( shard->address_table, iter ).cut_state != CUT_NONE )
+            cut_through_update( kh_key( shard->address_table, iter ) );
+    }
+
+    connection->fd = -1;
+    connection->active = false;
+}
+
+/**
+ * Start passing the frame at the head of the input through in fragments, if it is too big to ever fit the buffer.
+ *
+ * @return True if it was, and the header has been consumed
+ */
+static bool connection_stream_start( connection_t * connection ) {
+    framebuffer_t * input = &connection->input;
+    if( framebuffer_length( input ) < GNW_HEADER_SIZE )
+        return false;
+
+    gnw_header_t header;
+    gnw_parse_header( framebuffer_data( input ), &header );
+    if( GNW_HEADER_SIZE + (size_t)header.length <= input->capacity )
+        return false;
+
+    if( GNW_FRAME_TYPE( header.type ) != GNW_DATA )
+        log_warn( "Frame of %u bytes on fd %d is too big to handle, discarding it", header.length, connection->fd );
+
+    size_t taken = gnw_stream_start( &connection->stream, framebuffer_data( input ), framebuffer_length( input ) );
+    if( taken == 0 )
+        return false;
+
+    framebuffer_consume( input, taken );
+    return true;
+}
+
+/**
+ * Pass the next fragment of an oversized frame through, once a whole one (or the end of the frame) has arrived.
+ *
+ * @return False if there isn't enough buffered yet
+ */
+static bool connection_stream( connection_t * connection ) {
+    framebuffer_t * input = &connection->input;
+    size_t fragment = gnw_stream_next( &connection->stream );
+    if( framebuffer_length( input ) < fragment )
+        return false;
+
+    // Anything but data is just skipped
+    if( GNW_FRAME_TYPE( connection->stream.type ) == GNW_DATA ) {
+        gnw_buf_t * buf = gnw_stream_fragment( &connection->stream, framebuffer_data( input ) );
+        assert( buf != NULL, "Unable to allocate a packet buffer" );
+        framebuffer_consume( input, fragment );
+
+        handle_packet( connection->fd, gnw_buf_data( buf ), buf->length );
+        gnw_buf_release( buf );
+    }
+    else {
+        connection->stream.remaining -= fragment;
+        framebuffer_consume( input, fragment );
+    }
+
+    return true;
+}
+
+/**
+ * Pass on every complete frame held in this connection's input buffer.
+ *
+ * Frames are handled in place, straight out of the buffer, and the partial frame left at the
+ * end stays where it is until the buffer actually needs the room.
+ *
+ * @param connection The connection to service
+ */
+void connection_dispatch( connection_t * connection ) {
+    framebuffer_t * input = &connection->input;
+    uint64_t discarded = input->discarded;
+
+    // Each frame is consumed before it is handled, so if handling it moves this connection
+    // to another shard, the new owner picks up from the right place
+    uint8_t * packet = NULL;
+    size_t ready_bytes = 0;
+    while( connection->active ) {
+        if( connection->stream.remaining > 0 ) {
+            if( !connection_stream( connection ) )
+                break;
+        }
+        else if( (ready_bytes = framebuffer_next( input, &packet )) > 0 )
+            handle_packet( connection->fd, packet, ready_bytes );
+        else if( !connection_stream_start( connection ) )
+            break;
+    }
+
+    // Gone (or moved to another shard), the buffer is no longer ours to touch
+    if( !connection->active )
+        return;
+
+    if( input->discarded != discarded )
+        log_warn( "Network desync on fd %d, skipped %lu bytes to resync", connection->fd, input->discarded - discarded );
+}
+
+/**
+ * Append received data to this connection's input buffer, and dispatch every complete frame.
+ *
+ * @param connection The connection the data arrived on
+ * @param buffer The received data
+ * @param length The number of bytes received
+ */
+void handle_event( connection_t * connection, uint8_t * buffer, ssize_t length ) {
+    framebuffer_t * input = &connection->input;
+
+    assert( input->buffer != NULL, "Buffer reference was null!" );
+
+    // Only a partial frame is ever held between calls, so this only trips on oversized frames
+    if( !framebuffer_append( input, buffer, length ) ) {
+        log_error( "Input buffer overflow on fd %d, discarded %lu bytes", connection->fd, framebuffer_length( input ) );
+        framebuffer_clear( input );
+        framebuffer_append( input, buffer, length );
+    }
+
+    connection_dispatch( connection );
+}
+
+/**
+ * recv() for socket connections, keeping any descriptors passed alongside the data, and
+ * noting when the kernel says the data arrived in shard->read_stamp.
+ */
+static ssize_t connection_recvmsg( connection_t * connection, uint8_t * buffer, size_t length ) {
+    union {
+        struct cmsghdr align;
+        uint8_t space[CMSG_SPACE( sizeof(int) * ROUTER_PASSED_FDS ) + CMSG_SPACE( sizeof(struct timespec) )];
+    } control;
+
+    struct iovec iov = { .iov_base = buffer, .iov_len = length };
+    struct msghdr message = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = &control, .msg_controllen = sizeof control };
+
+    ssize_t received = recvmsg( connection->fd, &message, MSG_DONTWAIT | MSG_CMSG_CLOEXEC );
+    if( received < 0 )
+        return received;
+
+    if( message.msg_flags & MSG_CTRUNC )
+        log_warn( "Too many descriptors passed on fd %d, some were lost", connection->fd );
+
+    // Sockets that can't say when the data arrived are timed from now
+    shard->read_stamp = 0;
+
+    for( struct cmsghdr * cmsg = CMSG_FIRSTHDR( &message ); cmsg != NULL; cmsg = CMSG_NXTHDR( &message, cmsg ) ) {
+        if( cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS ) {
+            struct timespec arrived;
+            memcpy( &arrived, CMSG_DATA( cmsg ), sizeof arrived );
+            shard->read_stamp = (uint64_t)arrived.tv_sec * 1000000000 + (uint64_t)arrived.tv_nsec;
+            continue;
+        }
+
+        if( cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS )
+            continue;
+
+        // Only the most recent set is kept, an unclaimed earlier set is stale
+        connection_drop_passed( connection );
+
+        int * fds = (int *)CMSG_DATA( cmsg );
+        size_t count = (cmsg->cmsg_len - CMSG_LEN( 0 )) / sizeof(int);
+        for( size_t i = 0; i < count; i++ ) {
+            if( connection->passed_count < ROUTER_PASSED_FDS )
+                connection->passed[connection->passed_count++] = fds[i];
+            else
+                close( fds[i] );
+        }
+    }
+
+    if( shard->read_stamp == 0 )
+        shard->read_stamp = router_stamp();
+    return received;
+}
+
+/**
+ * Pull the next chunk of input, from the socket or from the link's ring.
+ *
+ * @return The number of bytes received, 0 at the end of the stream, or -1 with errno set (EAGAIN once drained)
+ */
+static ssize_t connection_receive( connection_t * connection, uint8_t * buffer, size_t length, bool from_link ) {
+    if( from_link ) {
+        ssize_t received = shmlink_read( connection->link, buffer, length );
+        if( received == 0 )
+            errno = EAGAIN;
+        else if( received == -1 )
+            errno = EPROTO;
+        shard->read_stamp = router_stamp();
+        return received == 0 ? -1 : received;
+    }
+
+    // Descriptors and arrival times both come as ancillary data
+    return connection_recvmsg( connection, buffer, length );
+}
+
+/**
+ * End a connection's turn with input still waiting, putting it at the back of the run queue.
+ *
+ * @param connection The connection whose turn is over
+ * @param which READ_PENDING_SOCKET or READ_PENDING_LINK
+ * @param budget What is left of its share, carried to the next turn
+ */
+static void connection_defer( connection_t * connection, uint8_t which, int64_t budget ) {
+    connection->deficit = budget;
+    connection->read_deferred++;
+
+    // Both of its reads share the one place in the queue
+    if( connection->pending == 0 )
+        kdq_push( int, shard->runnable, connection->fd );
+    connection->pending |= which;
+}
+
+/**
+ * Before a link's ring is first read, take in everything the client sent over the socket before it
+ * switched. Both feed the one input buffer, so otherwise the ring's bytes would overtake the socket's,
+ * or land behind half a frame of them.
+ *
+ * @param connection A connection with a link
+ * @return True once the socket has been read dry, false if the ring has to wait for it
+ */
+static bool link_settle( connection_t * connection ) {
+    if( !(connection->pending & READ_PENDING_SOCKET) )
+        connection_read( connection, false );
+
+    // The socket's turn ran out, so the ring waits behind it in the run queue
+    if( connection->active && (connection->pending & READ_PENDING_SOCKET) ) {
+        connection_defer( connection, READ_PENDING_LINK, connection->deficit );
+        return false;
+    }
+
+    // Paused (the resume rings the link again), closed or moved to another shard
+    if( !connection->active || connection->paused )
+        return false;
+
+    // The client only writes whole frames to the socket, and all of them before any to the ring
+    if( framebuffer_length( &connection->input ) > 0 || connection->stream.remaining > 0 ) {
+        log_warn( "fd %d switched to its shared-memory link part way through a frame, discarded %lu bytes",
+                  connection->fd, framebuffer_length( &connection->input ) );
+        framebuffer_clear( &connection->input );
+        connection->stream.remaining = 0;
+    }
+
+    connection->link_settled = true;
+    return true;
+}
+
+/**
+ * Give a connection its turn: read and dispatch up to its share of the input waiting, stopping early
+ * if it would block. Whatever is left is picked up from the run queue, after everyone else has had a turn.
+ *
+ * @param connection The connection to read
+ * @param from_link Read the connection's shared-memory link rather than its socket
+ */
+void connection_read( connection_t * connection, bool from_link ) {
+    uint8_t which = from_link ? READ_PENDING_LINK : READ_PENDING_SOCKET;
+    connection->pending &= ~which;
+
+    if( from_link && !connection->link_settled && !link_settle( connection ) )
+        return;
+
+    int64_t budget = connection->deficit + (int64_t)config.read_quantum * connection->read_weight;
+    connection->deficit = 0;
+
+    // Stop early if backpressure pauses us, resuming re-arms the fd so the rest is picked up then
+    while( connection->active && !connection->paused ) {
+        if( budget <= 0 ) {
+            connection_defer( connection, which, budget );
+            return;
+        }
+
+        size_t space = 0;
+        uint8_t * target = framebuffer_reserve( &connection->input, &space );
+
+        // A partial frame filling the whole buffer can never complete, so throw it away rather than wedge
+        if( space == 0 ) {
+            log_error( "Frame on fd %d is larger than the input buffer, discarded %lu bytes", connection->fd, framebuffer_length( &connection->input ) );
+            framebuffer_clear( &connection->input );
+            continue;
+        }
+
+        // A datagram has to be taken whole, so it may overrun the share, which is paid back next turn
+        if( (from_link || connection->transport != TRANSPORT_SEQPACKET) && space > (uint64_t)budget )
+            space = (size_t)budget;
+
+        ssize_t length = connection_receive( connection, target, space, from_link );
+
+        if( length > 0 ) {
+            framebuffer_commit( &connection->input, length );
+            connection->read_bytes += length;
+            budget -= length;
+
+            shard->current_fd = connection->fd;
+            connection_dispatch( connection );
+            shard->current_fd = -1;
+            continue;
+        }
+
+        // Drained, and as in any deficit round robin an idle connection doesn't keep what it didn't use
+        if( length == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+            return;
+
+        if( length == -1 && errno == EINTR )
+            continue;
+
+        if( length == -1 )
+            log_error( "SOCKET ERROR, dropped client: %s", strerror(errno) );
+
+        connection_close( connection );
+    }
+}
+
+/**
+ * One round of the read scheduler: every connection waiting in the run queue as the round starts
+ * gets one more turn, in the order their last turns ended.
+ */
+void shard_read_round() {
+    for( size_t turns = kdq_size( shard->runnable ); turns > 0; turns-- ) {
+        int fd = *kdq_shift( int, shard->runnable );
+        connection_t * connection = connection_get( fd );
+
+        // Cleared up front, so either read that defers again puts it back in the queue
+        uint8_t pending = connection->pending;
+        connection->pending = 0;
+        if( !connection->active )
+            continue;
+
+        if( pending & READ_PENDING_SOCKET )
+            connection_read( connection, false );
+
+        connection = connection_get( fd );
+        if( (pending & READ_PENDING_LINK) && connection->active && connection->link != NULL )
+            connection_read( connection, true );
+    }
+}
+
+void admit_connection( int remote_fd, int transport ) {
+    if( transport == TRANSPORT_TCP ) {
+        // Disable Nagle, otherwise small packets will be held back.
+        int flag = 1;
+        int result = setsockopt( remote_fd, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(int) );
+        if (result < 0)
+            log_warn( "Unable to disable Nagle algorithm on the router socket, expect packet delays!" );
+
+        // Poll the device queue from recv() rather than waiting on the interrupt
+        int budget = ROUTER_BUSY_POLL_USEC;
+        if( config.busy_poll && setsockopt( remote_fd, SOL_SOCKET, SO_BUSY_POLL, &budget, sizeof budget ) == -1 )
+            log_debug( "SO_BUSY_POLL refused on fd %d: %s", remote_fd, strerror(errno) );
+    }
+
+    // Have the kernel stamp arriving data, so hop latency includes the time spent waiting to be read
+    if( transport == TRANSPORT_TCP || transport == TRANSPORT_SEQPACKET ) {
+        int flag = 1;
+        setsockopt( remote_fd, SOL_SOCKET, SO_TIMESTAMPNS, &flag, sizeof flag );
+    }
+
+    // splice() follows the socket's own blocking mode, and every other send and receive is MSG_DONTWAIT anyway
+    if( config.splice_threshold > 0 )
+        fcntl( remote_fd, F_SETFL, fcntl( remote_fd, F_GETFL ) | O_NONBLOCK );
+
+    connection_t * connection = connection_open( remote_fd );
+
+    connection->transport = transport;
+
+    // Only TCP takes MSG_ZEROCOPY, the local transports copy whatever the flag says
+    bool zerocopy = transport == TRANSPORT_TCP && config.zerocopy_threshold > 0;
+#ifdef HAVE_IO_URING
+    zerocopy = zerocopy && !uring_active;
+#endif
+    if( zerocopy && !zerocopy_enable( &connection->zerocopy, remote_fd ) )
+        log_warn( "Zero-copy sends are unavailable on fd %d: %s", remote_fd, strerror(errno) );
+
+    // Every read is a whole number of frames, so there is never anything to resync
+    if( transport == TRANSPORT_SEQPACKET )
+        connection->input.messages = true;
+}
+
+/**
+ * Take a token for one new connection, topping the bucket up for the time since the last one first.
+ *
+ * @return False if none are left, and the connection should wait in the backlog
+ */
+static bool admission_take() {
+    if( config.admit_rate == 0 )
+        return true;
+
+    uint64_t now = router_clock();
+    admission.tokens += (double)(now - admission.refilled) * config.admit_rate / 1000000.0;
+    if( admission.tokens > ROUTER_ACCEPT_BATCH )
+        admission.tokens = ROUTER_ACCEPT_BATCH;
+    admission.refilled = now;
+
+    if( admission.tokens < 1.0 )
+        return false;
+
+    admission.tokens -= 1.0;
+    return true;
+}
+
+/**
+ * Stop watching the listen sockets until the next token is due. They are level-triggered, so would
+ * otherwise wake us continually while connections wait in the backlog.
+ */
+static void admission_pause() {
+    if( admission.paused )
+        return;
+
+    uint64_t wait = (uint64_t)((1.0 - admission.tokens) * 1000000.0 / config.admit_rate) + 1;
+    struct itimerspec when = { .it_value = { .tv_sec = wait / 1000000, .tv_nsec = (wait % 1000000) * 1000 } };
+    if( timerfd_settime( admission.timer_fd, 0, &when, NULL ) == -1 ) {
+        log_error( "Unable to set the admission timer: %s", strerror(errno) );
+        return;
+    }
+
+    for( int i = 0; i < listener_count; i++ )
+        reactor_remove( shard->reactor, listeners[i].fd );
+    admission.paused = true;
+}
+
+/**
+ * The admission timer fired, start accepting again.
+ */
+void admission_resume() {
+    uint64_t expirations;
+    if( read( admission.timer_fd, &expirations, sizeof expirations ) == -1 && errno != EAGAIN )
+        log_warn( "Unable to read the admission timer: %s", strerror(errno) );
+
+    if( !admission.paused )
+        return;
+
+    for( int i = 0; i < listener_count; i++ ) {
+        if( reactor_add( shard->reactor, listeners[i].fd, REACTOR_READ | REACTOR_LEVEL ) == -1 )
+            log_error( "Unable to monitor listen socket %d: %s", listeners[i].fd, strerror(errno) );
+    }
+    admission.paused = false;
+}
+
+/**
+ * Accept everything waiting on a listen socket, up to a batch, so a setup storm is admitted a few
+ * dozen at a time between rounds of established traffic rather than one connection per wakeup.
+ */
+void accept_connection( listener_t * listener ) {
+    for( int accepted = 0; accepted < ROUTER_ACCEPT_BATCH; accepted++ ) {
+        if( !admission_take() ) {
+            admission_pause();
+            return;
+        }
+
+        int remote_fd = accept4( listener->fd, NULL, NULL, SOCK_CLOEXEC );
+        if( remote_fd == -1 ) {
+            if( config.admit_rate > 0 )
+                admission.tokens += 1.0; // Unused
+
+            if( errno == EINTR || errno == ECONNABORTED )
+                continue;
+            if( errno != EAGAIN && errno != EWOULDBLOCK )
+                perror( "accept" );
+            return;
+        }
+
+        log_info( "New connection." );
+        admit_connection( remote_fd, listener->transport );
+    }
+}
+
+void printAddressTable( FILE * stream ) {
+    if( shard_count > 1 )
+        fprintf( stream, "Address Table (shard %d):\n", shard->index );
+    else
+        fprintf( stream, "Address Table:\n" );
+
+    khint_t iter = kh_begin( shard->address_table );
+    while( iter != kh_end( shard->address_table ) ) {
+        if( kh_exist( shard->address_table, iter ) ) {
+            fprintf( stream, "\t|->\t%08x ", kh_key( shard->address_table, iter ) );
+
+            context_t * entry = &kh_value( shard->address_table, iter );
+
+            assert( entry != NULL, "NULL ENTRY, STOP." );
+
+            // Has this been marked as dead?
+            if( entry->state == GNW_STATE_CLOSE ) {
+                fprintf( stream, "{CLOSED}\n" );
+                continue;
+            }
+
+            if ( kv_size(entry->forward) == 0 ) {
+                fprintf( stream, "{drop} to {∅}" );
+            }
+            else {
+                switch( entry->forward_policy ) {
+                    case GNW_POLICY_BROADCAST: fprintf( stream, "{broadcast}" ); break;
+                    case GNW_POLICY_ANYCAST: fprintf( stream, "{anycast}" ); break;
+                    case GNW_POLICY_ROUNDROBIN: fprintf( stream, "{round-robin}" ); break;
+                    case GNW_POLICY_MERGE: fprintf( stream, "{merge}" ); break;
+                    case GNW_POLICY_COMBINE: fprintf( stream, "{combine}" ); break;
+                    case GNW_POLICY_LEASTLOADED: fprintf( stream, "{least-loaded}" ); break;
+                    case GNW_POLICY_TWOCHOICE: fprintf( stream, "{two-choice}" ); break;
+                    case GNW_POLICY_AFFINITY: fprintf( stream, "{affinity}" ); break;
+                    default: fprintf( stream, "{BAD POLICY}" );
+                }
+                fprintf( stream, " to { " );
+                for( size_t i = 0; i < kv_size( entry->forward ); i++ ) {
+                    gnw_address_t target = kv_a( gnw_address_t, entry->forward, i );
+                    fprintf( stream, "%08x ", target );
+                }
+                fprintf( stream, "}" );
+            }
+
+            char * fmtBytesInUnit;
+            double fmtBytesIn = fmt_iec_size( entry->bytes_in, &fmtBytesInUnit );
+
+            char * fmtBytesOutUnit;
+            double fmtBytesOut = fmt_iec_size( entry->bytes_out, &fmtBytesOutUnit );
+
+            fprintf( stream,
+                "\t%.2f %s\t%.2f %s\tPackets (%lu/%lu)\t%s",
+                fmtBytesIn,
+                fmtBytesInUnit,
+                fmtBytesOut,
+                fmtBytesOutUnit,
+                entry->packets_in,
+                entry->packets_out,
+                entry->bound_fd > -1 ? "BOUND" : "---" );
+
+            if( entry->cut_state == CUT_ACTIVE )
+                fprintf( stream, "\tDIRECT" );
+
+            // Output queue depth for the bound connection, and anything dropped because it was full
+            if( entry->bound_fd > -1 ) {
+                connection_t * connection = connection_get( entry->bound_fd );
+                char * fmtQueueUnit;
+                double fmtQueue = fmt_iec_size( connection->output.queued, &fmtQueueUnit );
+
+                fprintf( stream, "\tQueue %.2f %s%s\tDropped %lu", fmtQueue, fmtQueueUnit, connection->paused ? " (paused)" : "", entry->packets_dropped );
+
+                // What the read scheduler gave it, and how often its turn ended with more waiting
+                char * fmtReadUnit;
+                double fmtRead = fmt_iec_size( connection->read_bytes, &fmtReadUnit );
+                fprintf( stream, "\tRead %.2f %s (%lu deferred)", fmtRead, fmtReadUnit, connection->read_deferred );
+                if( connection->read_weight != 1 )
+                    fprintf( stream, "\tWeight %u", connection->read_weight );
+            }
+
+            if( entry->latency_budget > 0 )
+                fprintf( stream, "\tBudget %u us", entry->latency_budget );
+
+            // Where its resequencer is up to, and what it has had to give up on
+            if( entry->merge != NULL )
+                fprintf( stream, "\tMerge at %u, %u held, %lu skipped, %lu late", entry->merge->next, entry->merge->held,
+                         entry->merge->skipped, entry->merge->late );
+
+            // Likewise for a combine, and how often a round had to go without all of its inputs
+            if( entry->combine != NULL )
+                fprintf( stream, "\tCombine %lu inputs, %lu rounds, %lu partial, %lu dropped", entry->combine->input_count,
+                         entry->combine->rounds, entry->combine->partial, entry->combine->dropped );
+
+            // How a round-robin source's messages have actually been shared out, against the weights asked for
+            if( entry->forward_policy == GNW_POLICY_ROUNDROBIN && kv_size( entry->shares ) > 0 ) {
+                uint64_t messages = 0;
+                for( size_t i = 0; i < kv_size( entry->shares ); i++ )
+                    messages += kv_A( entry->shares, i ).messages;
+
+                fprintf( stream, "\tShare {" );
+                for( size_t i = 0; i < kv_size( entry->shares ) && i < kv_size( entry->forward ); i++ ) {
+                    edge_share_t * share = &kv_A( entry->shares, i );
+                    fprintf( stream, " %08x %.1f%% (w%u)", kv_A( entry->forward, i ),
+                             messages > 0 ? 100.0 * share->messages / messages : 0.0, share->weight );
+                }
+                fprintf( stream, " }" );
+            }
+
+            // What an affinity source keys on, and how many of its messages had no such key
+            if( entry->forward_policy == GNW_POLICY_AFFINITY ) {
+                char spec[AFFINITY_PATH_MAX + 16];
+                affinity_format( &entry->affinity, spec, sizeof spec );
+                fprintf( stream, "\tKey %s, %lu unkeyed", spec, entry->unkeyed );
+            }
+
+            fprintf( stream, "\n" );
+
+            //gnw_emitPacket( entry->bound_fd, "EHLO\n", 5 ); // Forward wholesale
+        }
+
+        iter++;
+    }
+
+    // Arrival to send for every data frame this shard forwarded since the last table
+    if( shard->hops.count > 0 ) {
+        fprintf( stream, "Hop latency (%s): p50 %.1f us, p99 %.1f us over %lu frames\n",
+                 config.busy_poll ? "busy-poll" : "sleeping",
+                 histogram_percentile( &shard->hops, 50 ) / 1000.0,
+                 histogram_percentile( &shard->hops, 99 ) / 1000.0,
+                 shard->hops.count );
+        histogram_reset( &shard->hops );
+    }
+
+    // Jain's index over the producers that always had more to send, by bytes read per unit of weight: 1.0 is a fair split
+    double sum = 0, squares = 0;
+    size_t backlogged = 0;
+    uint64_t deferred = 0;
+    for( size_t i = 0; i < kv_size( shard->connections ); i++ ) {
+        connection_t * connection = &kv_A( shard->connections, i );
+        if( connection->active && connection->read_deferred > 0 ) {
+            double share = (double)connection->read_bytes / connection->read_weight;
+            sum += share;
+            squares += share * share;
+            backlogged++;
+            deferred += connection->read_deferred;
+        }
+        connection->read_bytes = 0;
+        connection->read_deferred = 0;
+    }
+    if( backlogged > 0 )
+        fprintf( stream, "Read fairness: Jain index %.3f over %lu backlogged producers, %lu deferred turns\n",
+                 squares > 0 ? (sum * sum) / (backlogged * squares) : 1.0, backlogged, deferred );
+
+    // Uncomment for buffer debug //
+    /*
+    printf( "Local Buffers:\n" );
+    for( size_t i = 0; i < kv_size( shard->connections ); i++ ) {
+        connection_t * connection = &kv_A( shard->connections, i );
+        if( connection->active ) {
+            ssize_t length = framebuffer_length( &connection->input );
+
+            printf( "\t|->\tfd=%d, length=%ld\n", connection->fd, length );
+        }
+    }
+    printf( "\n" );
+    */
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * io_uring data path
+ *
+ * Receives use multishot recv against a provided buffer ring, so one submission keeps a socket
+ * reading indefinitely. Forwarded frames are copied into slots of a single registered arena and
+ * sent with WRITE_FIXED; everything queued while handling a batch of completions goes to the
+ * kernel in the one io_uring_enter() at the top of the loop, so a whole broadcast is one syscall.
+ */
+
+#define URING_DEPTH         256
+#define URING_RECV_BUFFERS  128
+#define URING_SEND_SLOTS    128
+#define URING_RECV_GROUP    0
+
+#define URING_OP_ACCEPT 1
+#define URING_OP_RECV   2
+#define URING_OP_SEND   3
+#define URING_OP_CANCEL 4
+#define URING_OP_WAKE   5
+#define URING_OP_MASK   0x7
+
+typedef struct uring_send {
+    int fd;
+    uint32_t generation;
+    uint8_t * data;
+    size_t length;
+    size_t offset;
+    int slot;                 // Registered arena slot, or -1 for an unregistered heap buffer
+    struct uring_send * next;
+} uring_send_t;
+
+uring_t uring;
+uring_buf_ring_t uring_recv_buffers;
+
+uint8_t * uring_send_arena = NULL;
+size_t uring_slot_size = 0;
+kvec_t( int ) uring_free_slots;
+
+static uint64_t uring_tag( connection_t * connection, int op ) {
+    return ((uint64_t)connection->generation << 32) | ((uint64_t)connection->fd << 3) | (uint64_t)op;
+}
+
+static connection_t * uring_untag( uint64_t user_data ) {
+    int fd = (int)((user_data & 0xFFFFFFFFu) >> 3);
+    uint32_t generation = (uint32_t)(user_data >> 32);
+
+    if( (size_t)fd >= kv_size( shard->connections ) )
+        return NULL;
+
+    connection_t * connection = &kv_A( shard->connections, fd );
+    if( !connection->active || connection->generation != generation )
+        return NULL; // Stale completion for a connection that has since gone
+
+    return connection;
+}
+
+int uring_router_init() {
+    int result = uring_init( &uring, URING_DEPTH );
+    if( result < 0 ) {
+        log_error( "Unable to create an io_uring instance: %s", strerror(-result) );
+        return -1;
+    }
+
+    result = uring_buf_ring_init( &uring, &uring_recv_buffers, URING_RECV_GROUP, URING_RECV_BUFFERS, config.network_mtu );
+    if( result < 0 ) {
+        log_error( "Unable to register the receive buffer ring (kernel too old?): %s", strerror(-result) );
+        uring_exit( &uring );
+        return -1;
+    }
+
+    // One registration for the whole send arena, slots are handed out from a free list
+    uring_slot_size = config.network_mtu;
+    uring_send_arena = (uint8_t *)malloc( URING_SEND_SLOTS * uring_slot_size );
+    assert( uring_send_arena != NULL, "Unable to allocate the io_uring send arena" );
+
+    struct iovec arena = { .iov_base = uring_send_arena, .iov_len = URING_SEND_SLOTS * uring_slot_size };
+    result = uring_register_buffers( &uring, &arena, 1 );
+    if( result < 0 ) {
+        log_error( "Unable to register the send arena: %s", strerror(-result) );
+        free( uring_send_arena );
+        uring_buf_ring_exit( &uring, &uring_recv_buffers );
+        uring_exit( &uring );
+        return -1;
+    }
+
+    kv_init( uring_free_slots );
+    for( int i = URING_SEND_SLOTS - 1; i >= 0; i-- )
+        kv_push( int, uring_free_slots, i );
+
+    // The listener index rides in the tag, so a completion knows which transport it is for
+    for( int i = 0; i < listener_count; i++ ) {
+        struct io_uring_sqe * sqe = uring_get_sqe( &uring );
+        assert( sqe != NULL, "io_uring submission queue overflow" );
+        uring_prep_accept_multishot( sqe, listeners[i].fd, ((uint64_t)i << 3) | URING_OP_ACCEPT );
+    }
+
+    // The control thread rings the shard's eventfd when it publishes, so watch that alongside the sockets
+    struct io_uring_sqe * sqe = uring_get_sqe( &uring );
+    assert( sqe != NULL, "io_uring submission queue overflow" );
+    uring_prep_poll_multishot( sqe, shard->wake_fd, POLLIN, URING_OP_WAKE );
+
+    uring_active = true;
+    return 0;
+}
+
+void uring_router_exit() {
+    uring_active = false;
+    uring_buf_ring_exit( &uring, &uring_recv_buffers );
+    uring_exit( &uring );
+    free( uring_send_arena );
+    kv_destroy( uring_free_slots );
+}
+
+void uring_attach( connection_t * connection ) {
+    connection->generation++;
+    connection->send_head = NULL;
+    connection->send_tail = NULL;
+
+    struct io_uring_sqe * sqe = uring_get_sqe( &uring );
+    assert( sqe != NULL, "io_uring submission queue overflow" );
+    uring_prep_recv_multishot( sqe, connection->fd, URING_RECV_GROUP, uring_tag( connection, URING_OP_RECV ) );
+}
+
+static void uring_send_free( uring_send_t * send ) {
+    if( send->slot != -1 )
+        kv_push( int, uring_free_slots, send->slot );
+    else
+        bufpool_free( send->data );
+    bufpool_free( send );
+}
+
+static void uring_send_next( connection_t * connection ) {
+    uring_send_t * send = connection->send_head;
+    if( send == NULL )
+        return;
+
+    struct io_uring_sqe * sqe = uring_get_sqe( &uring );
+    assert( sqe != NULL, "io_uring submission queue overflow" );
+
+    if( send->slot != -1 )
+        uring_prep_write_fixed( sqe, send->fd, send->data + send->offset, send->length - send->offset, 0, (uint64_t)(uintptr_t)send | URING_OP_SEND );
+    else
+        uring_prep_send( sqe, send->fd, send->data + send->offset, send->length - send->offset, (uint64_t)(uintptr_t)send | URING_OP_SEND );
+}
+
+void uring_detach( connection_t * connection ) {
+    // Stop the multishot receive; the cancel is submitted with the next batch
+    struct io_uring_sqe * sqe = uring_get_sqe( &uring );
+    if( sqe != NULL )
+        uring_prep_cancel( sqe, uring_tag( connection, URING_OP_RECV ), URING_OP_CANCEL );
+    shutdown( connection->fd, SHUT_RDWR );
+
+    // The in-flight head is released by its own completion, anything behind it can go now
+    if( connection->send_head != NULL ) {
+        uring_send_t * iter = connection->send_head->next;
+        while( iter != NULL ) {
+            uring_send_t * next = iter->next;
+            uring_send_free( iter );
+            iter = next;
+        }
+        connection->send_head->next = NULL;
+    }
+    connection->send_head = NULL;
+    connection->send_tail = NULL;
+    connection->send_queued = 0;
+}
+
+/**
+ * Queue a copy of a frame to go out on 'fd', behind any sends already waiting for it.
+ *
+ * @param fd The destination connection
+ * @param buffer The frame, header included
+ * @param length The frame length
+ * @param limited Drop the frame if it would take the send queue past the queue limit, as for data frames
+ * @return True if the frame was queued, false if it was dropped
+ */
+bool uring_emit( int fd, uint8_t * buffer, size_t length, bool limited ) {
+    if( fd < 0 || (size_t)fd >= kv_size( shard->connections ) || !kv_A( shard->connections, fd ).active )
+        return false;
+
+    connection_t * connection = &kv_A( shard->connections, fd );
+
+    // The same limit as the epoll path's output queue, so a slow consumer can't grow the send queue without bound
+    if( limited && connection->send_queued > 0 && connection->send_queued + length > config.queue_limit )
+        return false;
+
+    uring_send_t * send = (uring_send_t *)bufpool_alloc( sizeof(uring_send_t) );
+    if( send == NULL ) {
+        log_error( "Unable to allocate a send for fd %d, frame dropped", fd );
+        return false;
+    }
+    send->fd = fd;
+    send->generation = connection->generation;
+    send->length = length;
+    send->offset = 0;
+    send->next = NULL;
+
+    // Registered slot if one fits, otherwise fall back to a plain heap buffer and SEND
+    if( length <= uring_slot_size && kv_size( uring_free_slots ) > 0 ) {
+        send->slot = kv_pop( uring_free_slots );
+        send->data = uring_send_arena + (send->slot * uring_slot_size);
+    } else {
+        send->slot = -1;
+        send->data = (uint8_t *)bufpool_alloc( length );
+        if( send->data == NULL ) {
+            log_error( "Unable to allocate %lu bytes to send on fd %d, frame dropped", length, fd );
+            bufpool_free( send );
+            return false;
+        }
+    }
+    memcpy( send->data, buffer, length );
+    connection->send_queued += length;
+    connection_publish_load( connection );
+
+    // Only one send per socket is in flight at a time, so frames can never be reordered
+    if( connection->send_tail != NULL ) {
+        connection->send_tail->next = send;
+        connection->send_tail = send;
+        return true;
+    }
+
+    connection->send_head = send;
+    connection->send_tail = send;
+    uring_send_next( connection );
+    return true;
+}
+
+static void uring_complete_send( uring_send_t * send, int result ) {
+    connection_t * connection = NULL;
+    if( (size_t)send->fd < kv_size( shard->connections ) ) {
+        connection = &kv_A( shard->connections, send->fd );
+        if( !connection->active || connection->generation != send->generation || connection->send_head != send )
+            connection = NULL;
+    }
+
+    if( connection == NULL ) {
+        uring_send_free( send );
+        return;
+    }
+
+    if( result < 0 ) {
+        log_error( "Send failed on fd %d: %s, dropped client", send->fd, strerror(-result) );
+        connection_close( connection );
+        uring_send_free( send );
+        return;
+    }
+
+    // Short write, push the remainder before anything else on this socket
+    send->offset += result;
+    connection->send_queued -= result;
+    connection_publish_load( connection );
+    if( send->offset < send->length ) {
+        uring_send_next( connection );
+        return;
+    }
+
+    connection->send_head = send->next;
+    if( connection->send_head == NULL )
+        connection->send_tail = NULL;
+    uring_send_free( send );
+
+    uring_send_next( connection );
+}
+
+static void uring_complete( struct io_uring_cqe * cqe ) {
+    int op = (int)(cqe->user_data & URING_OP_MASK);
+
+    switch( op ) {
+        case URING_OP_ACCEPT: {
+            listener_t * listener = &listeners[cqe->user_data >> 3];
+
+            if( cqe->res >= 0 ) {
+                log_info( "New connection." );
+                admit_connection( cqe->res, listener->transport );
+            }
+            else
+                log_error( "accept: %s", strerror(-cqe->res) );
+
+            // Multishot accept ends on error, so re-arm it
+            if( !(cqe->flags & IORING_CQE_F_MORE) ) {
+                struct io_uring_sqe * sqe = uring_get_sqe( &uring );
+                assert( sqe != NULL, "io_uring submission queue overflow" );
+                uring_prep_accept_multishot( sqe, listener->fd, cqe->user_data );
+            }
+        } break;
+
+        case URING_OP_RECV: {
+            connection_t * connection = uring_untag( cqe->user_data );
+
+            if( cqe->flags & IORING_CQE_F_BUFFER ) {
+                uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                if( connection != NULL && cqe->res > 0 )
+                    handle_event( connection, uring_buf_ring_get( &uring_recv_buffers, bid ), cqe->res );
+                uring_buf_ring_recycle( &uring_recv_buffers, bid );
+            }
+
+            // handle_event may have dropped the connection
+            connection = uring_untag( cqe->user_data );
+            if( connection == NULL )
+                break;
+
+            if( cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS) ) {
+                if( cqe->res < 0 )
+                    log_error( "SOCKET ERROR, dropped client" );
+                connection_close( connection );
+                break;
+            }
+
+            // Out of buffers (or the kernel ended the multishot) - buffers are recycled inline, so just re-arm
+            if( !(cqe->flags & IORING_CQE_F_MORE) ) {
+                struct io_uring_sqe * sqe = uring_get_sqe( &uring );
+                assert( sqe != NULL, "io_uring submission queue overflow" );
+                uring_prep_recv_multishot( sqe, connection->fd, URING_RECV_GROUP, cqe->user_data );
+            }
+        } break;
+
+        case URING_OP_SEND:
+            uring_complete_send( (uring_send_t *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK), cqe->res );
+            break;
+
+        case URING_OP_WAKE: {
+            // Whatever woke us is picked up at the top of the loop, just reset it
+            eventfd_t count;
+            eventfd_read( shard->wake_fd, &count );
+
+            if( !(cqe->flags & IORING_CQE_F_MORE) ) {
+                struct io_uring_sqe * sqe = uring_get_sqe( &uring );
+                assert( sqe != NULL, "io_uring submission queue overflow" );
+                uring_prep_poll_multishot( sqe, shard->wake_fd, POLLIN, URING_OP_WAKE );
+            }
+        } break;
+
+        case URING_OP_CANCEL:
+        default:
+            break;
+    }
+}
+
+void uring_process() {
+    while( config.system_state ) {
+
+        uint32_t jumpout = 0;
+        while( jumpout++ < 4000 ) {
+            shard_control();
+            shard_flush(); // Only ever to the control thread, there is just the one shard
+
+            // The coalescing timer isn't watched here, so merges waiting on a gap and combines waiting on an input are
+            // checked every millisecond
+            bool waiting = kv_size( shard->merging ) > 0 || kv_size( shard->combining ) > 0;
+            if( kv_size( shard->merging ) > 0 )
+                merge_service();
+            if( kv_size( shard->combining ) > 0 )
+                combine_service();
+
+            // Submit everything queued by the last batch, and wait for more work
+            int result = uring_submit( &uring, 1, waiting ? 1 : 10000 );
+            if( result == -ETIME )
+                break;
+            if( result < 0 ) {
+                log_error( "io_uring_enter: %s", strerror(-result) );
+                break;
+            }
+
+            struct io_uring_cqe * cqe;
+            while( (cqe = uring_peek_cqe( &uring )) != NULL ) {
+                struct io_uring_cqe local = *cqe;
+                uring_cqe_seen( &uring );
+                uring_complete( &local );
+            }
+        }
+    }
+}
+#endif
+
+/**
+ * Our end of a link was rung: the peer wrote into the ring while we were idle, or freed space
+ * while our output was blocked on it.
+ */
+void link_service( connection_t * connection ) {
+    shmlink_clear( connection->link );
+
+    if( connection->output.queued > 0 )
+        connection_flush( connection );
+
+    // Already waiting its turn otherwise
+    if( connection->active && !(connection->pending & READ_PENDING_LINK) )
+        connection_read( connection, true );
+}
+
+/**
+ * Sets up an empty shard. Must be called for every shard before any of them start running,
+ * as each one holds a mailbox for every other.
+ *
+ * @param target The shard to initialise
+ * @param index The shard's position in 'shards'
+ */
+void shard_init( shard_t * target, int index ) {
+    memset( target, 0, sizeof(shard_t) );
+    target->index = index;
+    target->current_fd = -1;
+    target->topology_epoch = 1; // Contexts start at 0, so they are resolved on first use
+
+    target->reactor = reactor_create();
+    if( target->reactor == NULL ) {
+        perror( "reactor" );
+        exit( EXIT_FAILURE );
+    }
+
+    target->wake_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    if( target->wake_fd == -1 ) {
+        perror( "eventfd" );
+        exit( EXIT_FAILURE );
+    }
+    reactor_add( target->reactor, target->wake_fd, REACTOR_READ );
+
+    target->coalesce_fd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+    if( target->coalesce_fd == -1 ) {
+        perror( "timerfd" );
+        exit( EXIT_FAILURE );
+    }
+    reactor_add( target->reactor, target->coalesce_fd, REACTOR_READ );
+    kv_init( target->holding );
+    target->runnable = kdq_init( int );
+    kv_init( target->merging );
+    kv_init( target->combining );
+    kv_init( target->sampling );
+
+    // Set up the (empty) address hashtable
+    // Tracks on GNW addresses (uint32s)
+    target->address_table = kh_init( gnw_address_t );
+    target->bells = kh_init( bell );
+
+    if( config.splice_threshold > 0 ) {
+        int result = fanout_init( &target->fanout, ROUTER_SPLICE_CAPACITY );
+        if( result != 0 )
+            log_warn( "Unable to set up zero-copy broadcast, copying instead: %s", strerror(-result) );
+        target->fanout_ready = (result == 0);
+    }
+
+    // Set up the connection table, to track each connection
+    // Indexed directly on file descriptors (ints)
+    kv_init( target->connections );
+
+    // Mailboxes are cache-line aligned, so the two ends of each never share a line
+    void * inbox = NULL;
+    int result = posix_memalign( &inbox, MAILBOX_CACHE_LINE, sizeof(mailbox_t) * shard_count );
+    assert( result == 0, "Unable to allocate shard mailboxes" );
+    target->inbox = (mailbox_t *)inbox;
+    for( int i = 0; i < shard_count; i++ )
+        assert( mailbox_init( &target->inbox[i], SHARD_MAILBOX_SIZE ), "Unable to allocate shard mailboxes" );
+
+    // One more of each, for the control thread
+    target->overflow = calloc( shard_count + 1, sizeof(*target->overflow) );
+    target->wake = calloc( shard_count + 1, sizeof(bool) );
+    assert( target->overflow != NULL && target->wake != NULL, "Unable to allocate shard state" );
+}
+
+void shard_destroy( shard_t * target ) {
+    shard = target;
+
+    // Closing a connection unbinds its addresses, so the table has to outlive them
+    for( size_t i = 0; i < kv_size( target->connections ); i++ ) {
+        connection_close( &kv_A( target->connections, i ) );
+        kdq_destroy( output_entry_t, kv_A( target->connections, i ).output.entries );
+        kdq_destroy( output_pin_t, kv_A( target->connections, i ).output.pinned );
+    }
+    kv_destroy( target->connections );
+    kh_destroy( bell, target->bells );
+
+    for( khint_t iter = kh_begin( target->address_table ); iter != kh_end( target->address_table ); iter++ ) {
+        if( !kh_exist( target->address_table, iter ) )
+            continue;
+
+        context_t * context = &kh_value( target->address_table, iter );
+        if( context->merge != NULL ) {
+            reseq_destroy( context->merge );
+            free( context->merge );
+        }
+        if( context->combine != NULL ) {
+            combiner_destroy( context->combine );
+            free( context->combine );
+        }
+    }
+    kh_destroy( gnw_address_t, target->address_table );
+
+    if( target->fanout_ready )
+        fanout_destroy( &target->fanout );
+
+    for( int i = 0; i < shard_count; i++ ) {
+        shard_msg_t * message;
+        while( (message = mailbox_pop( &target->inbox[i] )) != NULL ) {
+            gnw_buf_release( message->buf );
+            bufpool_free( message );
+        }
+        mailbox_destroy( &target->inbox[i] );
+    }
+
+    for( int i = 0; i <= shard_count; i++ ) {
+        for( size_t j = 0; j < kv_size( target->overflow[i] ); j++ ) {
+            gnw_buf_release( kv_A( target->overflow[i], j )->buf );
+            bufpool_free( kv_A( target->overflow[i], j ) );
+        }
+        kv_destroy( target->overflow[i] );
+    }
+    free( target->inbox );
+    free( target->overflow );
+    free( target->wake );
+
+    kv_destroy( target->holding );
+    kdq_destroy( int, target->runnable );
+    kv_destroy( target->merging );
+    kv_destroy( target->combining );
+    kv_destroy( target->sampling );
+
+    reactor_destroy( target->reactor );
+    close( target->wake_fd );
+    close( target->coalesce_fd );
+}
+
+/**
+ * Take over a connection handed to us by shard_migrate().
+ */
+void shard_adopt( shard_msg_t * message ) {
+    connection_t * connection = connection_get( message->fd );
+    assert( !connection->active, "Adopted a connection over an fd that was still active!" );
+
+    // Keep whichever output queues are already allocated, so the slot never holds two
+    kdq_t( output_entry_t ) * spare = connection->output.entries;
+    kdq_t( output_pin_t ) * spare_pinned = connection->output.pinned;
+    *connection = message->connection;
+    if( connection->output.entries == NULL )
+        connection->output.entries = spare;
+    else
+        kdq_destroy( output_entry_t, spare );
+    if( connection->output.pinned == NULL )
+        connection->output.pinned = spare_pinned;
+    else
+        kdq_destroy( output_pin_t, spare_pinned );
+
+    // Held output was on the old shard's timer, so it just goes as soon as the socket allows
+    connection->hold_deadline = 0;
+
+    // Its place in the old shard's run queue is gone, and anything still waiting is reported again below
+    connection->pending = 0;
+    connection->deficit = 0;
+
+    // Replay the bind request, then anything that arrived behind it
+    handle_packet( connection->fd, message->frame, message->length );
+    if( !connection->active )
+        return;
+    connection_dispatch( connection );
+
+    // Any data already waiting is reported straight away, so nothing is lost in the move
+    if( !connection->active )
+        return;
+    connection->interest = connection_interest( connection );
+    if( reactor_add( shard->reactor, connection->fd, connection->interest ) == -1 )
+        log_error( "Unable to monitor fd %d: %s", connection->fd, strerror(errno) );
+
+    if( connection->link != NULL )
+        link_watch( connection );
+}
+
+/**
+ * Process everything other shards have sent us.
+ */
+void shard_receive() {
+    // Reset the wakeup first, so anything pushed after this point wakes us again
+    eventfd_t count;
+    eventfd_read( shard->wake_fd, &count );
+
+    for( int from = 0; from < shard_count; from++ ) {
+        shard_msg_t * message;
+        while( (message = mailbox_pop( &shard->inbox[from] )) != NULL ) {
+            switch( message->kind ) {
+                case SHARD_MSG_FRAME:
+                    // The message's reference becomes the current frame's, so every queue shares it
+                    frame_begin( gnw_buf_data( message->buf ), message->length, message->buf );
+                    shard->frame.stamp = message->stamp;
+                    router_deliver( message->target, gnw_buf_data( message->buf ), message->length );
+                    frame_end();
+                    break;
+                case SHARD_MSG_MERGE:
+                    merge_receive( message->target, gnw_buf_data( message->buf ), message->length, message->buf );
+                    break;
+                case SHARD_MSG_COMBINE:
+                    combine_receive( message->target, gnw_buf_data( message->buf ), message->length, message->buf );
+                    break;
+                case SHARD_MSG_PACKET: handle_packet( message->fd, message->frame, message->length ); break;
+                case SHARD_MSG_ADOPT:  shard_adopt( message ); break;
+                default:
+                    log_error( "Bad shard message kind! [%d]", message->kind );
+            }
+            bufpool_free( message );
+        }
+    }
+}
+
+/**
+ * Retry held back messages, then wake every shard (and the control thread) we sent to during
+ * the last batch - one eventfd write per destination per batch, rather than one per frame.
+ *
+ * @return True if any messages are still held back behind a full mailbox
+ */
+bool shard_flush() {
+    bool held = false;
+
+    for( int to = 0; to <= shard_count; to++ ) {
+        mailbox_t * mailbox = to < shard_count ? &shards[to].inbox[shard->index] : &control.inbox[shard->index];
+
+        size_t sent = 0;
+        while( sent < kv_size( shard->overflow[to] ) && mailbox_push( mailbox, kv_A( shard->overflow[to], sent ) ) )
+            sent++;
+
+        if( sent > 0 ) {
+            memmove( shard->overflow[to].a, shard->overflow[to].a + sent, (kv_size( shard->overflow[to] ) - sent) * sizeof(shard_msg_t *) );
+            shard->overflow[to].n -= sent;
+            shard->wake[to] = true;
+        }
+
+        if( kv_size( shard->overflow[to] ) > 0 )
+            held = true;
+
+        if( shard->wake[to] ) {
+            eventfd_write( to < shard_count ? shards[to].wake_fd : control.wake_fd, 1 );
+            shard->wake[to] = false;
+        }
+    }
+
+    return held;
+}
+
+/**
+ * Take up an address's edge weights, starting every edge's share over if the edges or their weights have changed.
+ */
+static void shares_update( context_t * context, topology_node_t * node ) {
+    size_t count = kv_size( node->forward );
+    bool same = kv_size( context->shares ) == count && kv_size( context->forward ) == count &&
+                (count == 0 || memcmp( context->forward.a, node->forward.a, count * sizeof(gnw_address_t) ) == 0);
+    for( size_t i = 0; same && i < count; i++ )
+        same = kv_A( context->shares, i ).weight == kv_A( node->weights, i );
+    if( same )
+        return;
+
+    kv_resize( edge_share_t, context->shares, count > 0 ? count : 1 );
+    context->shares.n = count;
+    context->weighted = false;
+    for( size_t i = 0; i < count; i++ ) {
+        edge_share_t * share = &kv_A( context->shares, i );
+        share->weight = kv_A( node->weights, i );
+        share->current = 0;
+        share->messages = 0;
+        context->weighted = context->weighted || share->weight != 1;
+    }
+}
+
+/**
+ * Copy the edges, policy, budget, read weight and affinity key of one address from the published topology into its context, if this shard owns it.
+ */
+static void topology_apply( gnw_address_t address, topology_node_t * node ) {
+    khint_t hint = kh_get( gnw_address_t, shard->address_table, address );
+    if( hint == kh_end( shard->address_table ) ) {
+        int status;
+        hint = kh_put( gnw_address_t, shard->address_table, address, &status );
+        setup_context( &kh_value( shard->address_table, hint ) );
+    }
+    context_t * context = &kh_value( shard->address_table, hint );
+
+    shares_update( context, node );
+    kv_copy( gnw_address_t, context->forward, node->forward );
+    context->forward_policy = node->forward_policy;
 
-        // If we have an active buffer, kill it now.
-        khint_t iter = kh_get( int, local_buffer, pollStruct->fd );
-        if( iter != kh_end( local_buffer ) ) {
-            printf( "Killing local buffer for %d\n", pollStruct->fd );
-            kh_value( local_buffer, iter ).buffer_tail = NULL;
-            if( kh_value( local_buffer, iter ).buffer != NULL )
-                free( kh_value( local_buffer, iter ).buffer );
-            kh_value( local_buffer, iter ).buffer = NULL;
-            khint_t delHint = kh_get( int, local_buffer, pollStruct->fd );
-            kh_del( int, local_buffer, delHint );
+    if( context->latency_budget != node->latency_budget ) {
+        context->latency_budget = node->latency_budget;
+
+        if( context->bound_fd != -1 ) {
+            connection_t * connection = connection_get( context->bound_fd );
+            connection->latency_budget = node->latency_budget;
+            if( node->latency_budget == 0 && connection->hold_deadline != 0 )
+                connection_flush( connection );
         }
+    }
 
-        // Kill the poll structure data
-        close( pollStruct->fd );
-        pollStruct->fd = -1;
-        pollStruct->events = 0;
-        pollStruct->revents = 0;
+    // Takes effect from the connection's next turn
+    context->read_weight = node->read_weight;
+    if( context->bound_fd != -1 )
+        connection_get( context->bound_fd )->read_weight = node->read_weight;
 
-        log_error( "SOCKET ERROR, dropped client" );
-        return;
-    }
+    context->affinity = node->affinity;
+
+    topology_changed();
+    cut_through_update( address );
+}
 
-    // Try and get the local buffer reference
-    khint_t iter = kh_get( int, local_buffer, pollStruct->fd );
+/**
+ * Bring this shard's contexts up to date with the latest topology the control thread has published.
+ * Only the addresses that changed since the last sync are touched, and if nothing has, this is a single load.
+ */
+static void topology_sync() {
+    uint64_t since = shard->topology != NULL ? shard->topology->generation : 0;
+    if( snapshot_generation( &control.topology ) == since )
+        return;
 
-    // If it's not there, make one!
-    if( iter == kh_end( local_buffer ) ) {
-        printf( "Creating new buffer space...\n" );
+    // Gives up the previous snapshot, which must not be touched again
+    topology_t * topology = (topology_t *)snapshot_acquire( &control.topology, shard->index );
+    shard->topology = topology;
+    if( topology == NULL )
+        return;
 
-        int state = 0;
-        iter = kh_put( int, local_buffer, pollStruct->fd, &state );
-        local_buffer_t * newBuffer = &kh_value( local_buffer, iter );
+    for( khint_t iter = kh_begin( topology->nodes ); iter != kh_end( topology->nodes ); iter++ ) {
+        if( !kh_exist( topology->nodes, iter ) )
+            continue;
 
-        printf( "State = %d\n", state );
-        assert( newBuffer != NULL, "Failed to add a new buffer!" );
+        gnw_address_t address = kh_key( topology->nodes, iter );
+        topology_node_t * node = &kh_value( topology->nodes, iter );
+        if( node->changed > since && shard_owner( address ) == shard->index )
+            topology_apply( address, node );
+    }
 
-        newBuffer->buffer = malloc( config.network_mtu * 20 );
-        newBuffer->buffer_tail = kh_value( local_buffer, iter ).buffer;
+    // Socket backlogs are only worth sampling if something picks its targets by load
+    shard->sample_load = false;
+    for( khint_t iter = kh_begin( topology->nodes ); iter != kh_end( topology->nodes ); iter++ ) {
+        if( !kh_exist( topology->nodes, iter ) )
+            continue;
 
-        assert( newBuffer->buffer != NULL, "NULL buffer reference after malloc" );
-        assert( newBuffer->buffer_tail != NULL, "Null tail reference after malloc" );
-        assert( newBuffer->buffer == newBuffer->buffer_tail, "Tail/Buffer mismatch after malloc" );
+        int policy = kh_value( topology->nodes, iter ).forward_policy;
+        if( policy == GNW_POLICY_LEASTLOADED || policy == GNW_POLICY_TWOCHOICE ) {
+            shard->sample_load = true;
+            break;
+        }
     }
+}
 
-    // Update iter and pull the buffer reference
-    iter = kh_get( int, local_buffer, pollStruct->fd );
-    local_buffer_t * local = &kh_value( local_buffer, iter );
+/**
+ * Hand our address table to the control thread to print, as text.
+ */
+static void shard_status() {
+    char * text = NULL;
+    size_t length = 0;
 
-    assert( local->buffer != NULL, "Buffer reference was null!" );
-    assert( local->buffer_tail != NULL, "Buffer tail reference was null!" );
+    FILE * stream = open_memstream( &text, &length );
+    if( stream == NULL ) {
+        log_warn( "Unable to build the status for shard %d: %s", shard->index, strerror(errno) );
+        return;
+    }
+    printAddressTable( stream );
+    fclose( stream );
 
-    size_t buffer_size = (local->buffer_tail - local->buffer);
-    size_t remaining_buffer = (config.network_mtu * 20) - buffer_size;
+    control_send( shard_message( SHARD_MSG_STATUS, 0, -1, (uint8_t *)text, length + 1 ) );
+    free( text );
+}
 
-    printf( "%ld < %ld\n", length, remaining_buffer );
-    assert( length < remaining_buffer, "BUFFER OVERFLOW" );
+/**
+ * Pick up anything the control thread has published, once per pass of the event loop.
+ */
+void shard_control() {
+    topology_sync();
 
-    memmove( local->buffer_tail, buffer, length );
-    local->buffer_tail += length;
-    buffer_size += length;
+    uint64_t status = __atomic_load_n( &control.status_generation, __ATOMIC_ACQUIRE );
+    if( status != shard->status_seen ) {
+        shard->status_seen = status;
+        shard_status();
+    }
+}
 
-    //printf( "Cached: %lu B\n", buffer_size );
+static void topology_free( void * value ) {
+    topology_t * topology = (topology_t *)value;
 
-    // Attempt to find a packet frame, then pass it on...
-    ssize_t ready_bytes = 0;
-    while( (ready_bytes = gnw_nextPacket( local->buffer, buffer_size )) < 0 ) {
-        packet_shift( local->buffer, buffer_size, NULL, 1 );
-        remaining_buffer++;
-        buffer_size--;
+    for( khint_t iter = kh_begin( topology->nodes ); iter != kh_end( topology->nodes ); iter++ ) {
+        if( kh_exist( topology->nodes, iter ) ) {
+            kv_destroy( kh_value( topology->nodes, iter ).forward );
+            kv_destroy( kh_value( topology->nodes, iter ).weights );
+        }
     }
+    kh_destroy( topology, topology->nodes );
+    free( topology );
+}
 
-    //printf( "Bytes: %ld\n", ready_bytes );
+/**
+ * @param address A GraphIPC address
+ * @param create Add it, with no edges, if it isn't in the graph yet
+ * @return The control thread's working copy of its node, or NULL
+ */
+static topology_node_t * control_node( gnw_address_t address, bool create ) {
+    khint_t hint = kh_get( topology, control.nodes, address );
+    if( hint != kh_end( control.nodes ) )
+        return &kh_value( control.nodes, hint );
+
+    if( !create )
+        return NULL;
+
+    int status;
+    hint = kh_put( topology, control.nodes, address, &status );
+    topology_node_t * node = &kh_value( control.nodes, hint );
+    memset( node, 0, sizeof(topology_node_t) );
+    kv_init( node->forward );
+    kv_init( node->weights );
+    node->forward_policy = GNW_POLICY_BROADCAST;
+    node->read_weight = 1;
+    node->affinity.kind = AFFINITY_RANGE;
+    return node;
+}
 
-    // After that, is there any buffer left?
-    if( ready_bytes > 0 ) {
-        // Isolate, copy and forward
-        uint8_t packet[ready_bytes];
-        packet_shift( local->buffer, buffer_size, packet, ready_bytes );
-        local->buffer_tail -= ready_bytes;
+/**
+ * Mark a node as changed, so it goes out with the next snapshot and the shards apply it.
+ */
+static void control_touch( topology_node_t * node ) {
+    node->changed = control.topology.generation + 1;
+    control.dirty = true;
+}
 
-        assert( local->buffer_tail >= local->buffer, "Buffer under-run!" );
+/**
+ * Ask every shard for its status, and print everything that isn't any one shard's.
+ */
+static void control_status() {
+    bufpool_stat_t pool;
+    bufpool_stat( &pool );
+
+    char * fmtCachedUnit;
+    double fmtCached = fmt_iec_size( pool.cached, &fmtCachedUnit );
+    fprintf( stderr, "Buffer pool: %lu hits, %lu refills, %lu misses, %lu released\t%.2f %s spare\n",
+             pool.hits, pool.refills, pool.misses, pool.releases, fmtCached, fmtCachedUnit );
+
+    __atomic_add_fetch( &control.status_generation, 1, __ATOMIC_RELEASE );
+    for( int i = 0; i < shard_count; i++ )
+        eventfd_write( shards[i].wake_fd, 1 );
+}
 
-        handle_packet( pollStruct->fd, packet, ready_bytes );
+/**
+ * Apply one topology command to the working copy.
+ */
+static void control_command( uint8_t * buffer, size_t length ) {
+    gnw_header_t header;
+    uint8_t * next = gnw_parse_header( buffer, &header );
+
+    uint8_t directive = 0;
+    next = packet_read_u8( next, &directive );
+
+    // The size of everything after the directive
+    size_t needed = 0;
+    switch( directive ) {
+        case GNW_CMD_CONNECT:
+        case GNW_CMD_DISCONNECT:
+        case GNW_CMD_LATENCY:
+        case GNW_CMD_READ_WEIGHT: needed = sizeof(gnw_address_t) + sizeof(uint32_t); break;
+        case GNW_CMD_EDGE_WEIGHT: needed = 2 * sizeof(gnw_address_t) + sizeof(uint32_t); break;
+        case GNW_CMD_POLICY:      needed = 1 + sizeof(gnw_address_t); break;
+        case GNW_CMD_AFFINITY_KEY: needed = sizeof(gnw_address_t) + 2 + 2 * sizeof(uint32_t); break;
+    }
+    if( header.length < 1 + needed ) {
+        log_warn( "Command directive %02x is too short, ignored", directive );
+        return;
     }
-}
 
-int router_process() {
+    switch( directive ) {
+        case GNW_CMD_CONNECT: {
+            gnw_address_t source = 0;
+            gnw_address_t target = 0;
 
-    // Set up the socket server
-    struct addrinfo listen_hints;
+            next = packet_read_u32( next, &source );
+            next = packet_read_u32( next, &target );
 
-    // Set up the (empty) address hashtable
-    // Tracks on GNW addresses (uint32s)
-    address_table = kh_init( gnw_address_t );
+            topology_node_t * node = control_node( source, true );
+            kv_push( gnw_address_t, node->forward, target );
+            kv_push( uint32_t, node->weights, 1 );
+            control_touch( node );
 
-    // Set up a local buffer table, to track each connection
-    // Tracks on file descriptors (ints)
-    local_buffer = kh_init( int );
+            log_info( "Connected %08x to %08x\n", source, target );
+        } break;
 
-    memset( &listen_hints, 0, sizeof listen_hints );
-    listen_hints.ai_family   = AF_INET;
-    listen_hints.ai_socktype = SOCK_STREAM;
+        case GNW_CMD_DISCONNECT: {
+            gnw_address_t source = 0;
+            gnw_address_t target = 0;
 
-    int listen_fd = getListenSocket( &listen_hints );
+            next = packet_read_u32( next, &source );
+            next = packet_read_u32( next, &target );
 
-    if( listen( listen_fd, ROUTER_BACKLOG ) == -1 ) {
-        perror( "listen" );
-        exit( EXIT_FAILURE );
-    }
+            topology_node_t * node = control_node( source, false );
+            if( node == NULL ) {
+                log_warn( "Unable to disconnect %08x, it has no edges", source );
+                break;
+            }
+
+            // Drop the first matching edge, keeping the rest in order
+            size_t i = 0;
+            while( i < kv_size( node->forward ) && kv_A( node->forward, i ) != target )
+                i++;
+            if( i == kv_size( node->forward ) ) {
+                log_warn( "No edge from %08x to %08x to disconnect", source, target );
+                break;
+            }
 
-    struct pollfd poll_list[MAX_MONITOR_FDS] = { 0 };
-    for( int i=0; i<MAX_MONITOR_FDS; i++ )
-        poll_list[i].fd = -1; // Mark as non-monitored
+            memmove( node->forward.a + i, node->forward.a + i + 1, (kv_size( node->forward ) - i - 1) * sizeof(gnw_address_t) );
+            memmove( node->weights.a + i, node->weights.a + i + 1, (kv_size( node->weights ) - i - 1) * sizeof(uint32_t) );
+            node->forward.n--;
+            node->weights.n--;
+            control_touch( node );
+
+            log_info( "Disconnected %08x from %08x\n", source, target );
+        } break;
+
+        case GNW_CMD_POLICY: {
+            uint8_t policy;
+            gnw_address_t target;
+
+            next = packet_read_u8( next, &policy );
+            next = packet_read_u32( next, &target );
+
+            // Policies may be set ahead of the edges, like budgets
+            topology_node_t * node = control_node( target, true );
+            node->forward_policy = policy;
+            control_touch( node );
+
+            const char * policyStr[] = {
+                [GNW_POLICY_ANYCAST] = "ANYCAST",
+                [GNW_POLICY_BROADCAST] = "BROADCAST",
+                [GNW_POLICY_ROUNDROBIN] = "ROUNDROBIN",
+                [GNW_POLICY_MERGE] = "MERGE",
+                [GNW_POLICY_COMBINE] = "COMBINE",
+                [GNW_POLICY_LEASTLOADED] = "LEASTLOADED",
+                [GNW_POLICY_TWOCHOICE] = "TWOCHOICE",
+                [GNW_POLICY_AFFINITY] = "AFFINITY",
+                "???"
+            };
+
+            log_info( "Forward policy set to %s for %08x\n", policy <= GNW_POLICY_AFFINITY ? policyStr[policy] : "???", target );
+        } break;
+
+        case GNW_CMD_LATENCY: {
+            gnw_address_t target = 0;
+            uint32_t budget = 0;
+
+            next = packet_read_u32( next, &target );
+            next = packet_read_u32( next, &budget );
+
+            // Budgets may be set ahead of the node arriving, it picks this up when it binds
+            topology_node_t * node = control_node( target, true );
+            node->latency_budget = budget;
+            control_touch( node );
+
+            log_info( "Latency budget for %08x set to %u us\n", target, budget );
+        } break;
+
+        case GNW_CMD_READ_WEIGHT: {
+            gnw_address_t target = 0;
+            uint32_t weight = 0;
+
+            next = packet_read_u32( next, &target );
+            next = packet_read_u32( next, &weight );
+
+            // Like budgets, weights may be set before the node binds
+            topology_node_t * node = control_node( target, true );
+            node->read_weight = weight > 0 ? weight : 1;
+            control_touch( node );
+
+            log_info( "Read weight for %08x set to %u\n", target, node->read_weight );
+        } break;
+
+        case GNW_CMD_EDGE_WEIGHT: {
+            gnw_address_t source = 0;
+            gnw_address_t target = 0;
+            uint32_t weight = 0;
+
+            next = packet_read_u32( next, &source );
+            next = packet_read_u32( next, &target );
+            next = packet_read_u32( next, &weight );
+
+            // Weights belong to edges, so unlike budgets there has to be one already (the first, if there are several)
+            topology_node_t * node = control_node( source, false );
+            size_t i = 0;
+            while( node != NULL && i < kv_size( node->forward ) && kv_A( node->forward, i ) != target )
+                i++;
+            if( node == NULL || i == kv_size( node->forward ) ) {
+                log_warn( "No edge from %08x to %08x to weight", source, target );
+                break;
+            }
 
-    poll_list[0].fd = listen_fd;
-    poll_list[0].events = POLLIN;
-    poll_list[0].revents = 0;
+            kv_A( node->weights, i ) = weight > 0 ? weight : 1;
+            control_touch( node );
 
-    uint8_t buffer[config.network_mtu];
+            log_info( "Edge %08x -> %08x weight set to %u\n", source, target, kv_A( node->weights, i ) );
+        } break;
 
-    while( config.system_state ) {
+        case GNW_CMD_AFFINITY_KEY: {
+            gnw_address_t target = 0;
+            affinity_key_t key;
+            memset( &key, 0, sizeof(affinity_key_t) );
 
-        printf( "Address Table:\n" );
-        khint_t iter = kh_begin( address_table );
-        while( iter != kh_end( address_table ) ) {
-            if( kh_exist( address_table, iter ) ) {
-                fprintf( stderr, "\t|->\t%08x ", kh_key( address_table, iter ) );
+            next = packet_read_u32( next, &target );
+            next = packet_read_u8( next, &key.kind );
+            next = packet_read_u8( next, &key.delimiter );
+            next = packet_read_u32( next, &key.first );
+            next = packet_read_u32( next, &key.length );
 
-                context_t * entry = &kh_value( address_table, iter );
+            // The path is whatever is left of the command
+            size_t path = header.length - 1 - needed;
+            if( key.kind > AFFINITY_JSON || (key.kind == AFFINITY_JSON && (path == 0 || path >= AFFINITY_PATH_MAX)) ) {
+                log_warn( "Bad affinity key for %08x, ignored", target );
+                break;
+            }
+            memcpy( key.path, next, key.kind == AFFINITY_JSON ? path : 0 );
 
-                assert( entry != NULL, "NULL ENTRY, STOP." );
+            // Keys may be set ahead of the policy or the edges
+            topology_node_t * node = control_node( target, true );
+            node->affinity = key;
+            control_touch( node );
 
-                // Has this been marked as dead?
-                if( entry->state == GNW_STATE_CLOSE ) {
-                    fprintf( stderr, "{CLOSED}\n" );
-                    continue;
-                }
+            char spec[AFFINITY_PATH_MAX + 16];
+            affinity_format( &key, spec, sizeof spec );
+            log_info( "Affinity key for %08x set to %s\n", target, spec );
+        } break;
 
-                if ( kv_size(entry->forward) == 0 ) {
-                    fprintf( stderr, "{drop} to {∅}" );
-                }
-                else {
-                    switch( entry->forward_policy ) {
-                        case GNW_POLICY_BROADCAST: fprintf( stderr, "{broadcast}" ); break;
-                        case GNW_POLICY_ANYCAST: fprintf( stderr, "{anycast}" ); break;
-                        case GNW_POLICY_ROUNDROBIN: fprintf( stderr, "{round-robin}" ); break;
-                        default: fprintf( stderr, "{BAD POLICY}" );
-                    }
-                    fprintf( stderr, " to { " );
-                    for( size_t i = 0; i < kv_size( entry->forward ); i++ ) {
-                        gnw_address_t target = kv_a( gnw_address_t, entry->forward, i );
-                        fprintf( stderr, "%08x ", target );
-                    }
-                    fprintf( stderr, "}" );
-                }
+        case GNW_CMD_STATUS:
+            control_status();
+            break;
+
+        default:
+            log_warn( "Missing control handler for command directive %02x", directive );
+    }
+}
+
+/**
+ * Publish a copy of the working topology, and wake every shard to pick it up.
+ */
+static void control_publish() {
+    topology_t * topology = (topology_t *)malloc( sizeof(topology_t) );
+    assert( topology != NULL, "Unable to allocate a topology snapshot" );
+    topology->generation = control.topology.generation + 1;
+    topology->nodes = kh_init( topology );
+
+    for( khint_t iter = kh_begin( control.nodes ); iter != kh_end( control.nodes ); iter++ ) {
+        if( !kh_exist( control.nodes, iter ) )
+            continue;
 
-                char * fmtBytesInUnit;
-                double fmtBytesIn = fmt_iec_size( entry->bytes_in, &fmtBytesInUnit );
+        int status;
+        khint_t hint = kh_put( topology, topology->nodes, kh_key( control.nodes, iter ), &status );
+        topology_node_t * from = &kh_value( control.nodes, iter );
+        topology_node_t * node = &kh_value( topology->nodes, hint );
 
-                char * fmtBytesOutUnit;
-                double fmtBytesOut = fmt_iec_size( entry->bytes_out, &fmtBytesOutUnit );
+        *node = *from;
+        kv_init( node->forward );
+        kv_copy( gnw_address_t, node->forward, from->forward );
+        kv_init( node->weights );
+        kv_copy( uint32_t, node->weights, from->weights );
+    }
 
-                fprintf( stderr,
-                    "\t%.2f %s\t%.2f %s\tPackets (%lu/%lu)\t%s",
-                    fmtBytesIn,
-                    fmtBytesInUnit,
-                    fmtBytesOut,
-                    fmtBytesOutUnit,
-                    entry->packets_in,
-                    entry->packets_out,
-                    entry->bound_fd > -1 ? "BOUND" : "---" );
+    snapshot_publish( &control.topology, topology );
+    control.dirty = false;
 
-                fprintf( stderr, "\n" );
+    for( int i = 0; i < shard_count; i++ )
+        eventfd_write( shards[i].wake_fd, 1 );
+}
 
-                //gnw_emitPacket( entry->bound_fd, "EHLO\n", 5 ); // Forward wholesale
+/**
+ * Process everything the shards have sent us.
+ */
+static void control_receive() {
+    eventfd_t count;
+    eventfd_read( control.wake_fd, &count );
+
+    for( int from = 0; from < shard_count; from++ ) {
+        shard_msg_t * message;
+        while( (message = mailbox_pop( &control.inbox[from] )) != NULL ) {
+            switch( message->kind ) {
+                case SHARD_MSG_COMMAND: control_command( message->frame, message->length ); break;
+                case SHARD_MSG_STATUS:  fputs( (char *)message->frame, stderr ); break;
+                default:
+                    log_error( "Bad control message kind! [%d]", message->kind );
             }
+            bufpool_free( message );
+        }
+    }
+}
+
+/**
+ * The control thread. Sleeps until a shard hands it something, publishing whatever that changes, and
+ * asks for everyone's status every ROUTER_STATUS_INTERVAL.
+ */
+void * control_thread( void * arg ) {
+    (void)arg;
+
+    struct pollfd wake = { .fd = control.wake_fd, .events = POLLIN };
+    uint64_t status_due = router_clock() + ROUTER_STATUS_INTERVAL;
+
+    while( config.system_state ) {
+        uint64_t now = router_clock();
+        if( now >= status_due ) {
+            control_status();
+            status_due = now + ROUTER_STATUS_INTERVAL;
+        }
 
-            iter++;
+        if( poll( &wake, 1, (int)((status_due - now) / 1000) + 1 ) == -1 && errno != EINTR ) {
+            perror( "poll" );
+            break;
         }
 
-        // Uncomment for buffer debug //
-        /*
-        printf( "Local Buffers (%d):\n", kh_size( local_buffer ) );
-        iter = kh_begin( local_buffer );
-        while( iter != kh_end( local_buffer ) ) {
-            if( kh_exist( local_buffer, iter ) ) {
-                int fd = kh_key( local_buffer, iter );
-                local_buffer_t * buffer = &kh_value( local_buffer, iter );
-                ssize_t length = (buffer->buffer_tail - buffer->buffer);
+        control_receive();
+        if( control.dirty )
+            control_publish();
 
-                printf( "\t|->\tfd=%d, length=%ld\n", fd, length );
-            }
+        // Retired snapshots go once every shard has moved on, which may be a pass or two behind
+        snapshot_reclaim( &control.topology );
+    }
+
+    return NULL;
+}
+
+/**
+ * Sets up the control thread's state. Must be called after shard_count is settled, and before any shard runs.
+ */
+void control_init() {
+    memset( &control, 0, sizeof(control_t) );
 
-            iter++;
+    control.wake_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    if( control.wake_fd == -1 ) {
+        perror( "eventfd" );
+        exit( EXIT_FAILURE );
+    }
+
+    void * inbox = NULL;
+    int result = posix_memalign( &inbox, MAILBOX_CACHE_LINE, sizeof(mailbox_t) * shard_count );
+    assert( result == 0, "Unable to allocate control mailboxes" );
+    control.inbox = (mailbox_t *)inbox;
+    for( int i = 0; i < shard_count; i++ )
+        assert( mailbox_init( &control.inbox[i], SHARD_MAILBOX_SIZE ), "Unable to allocate control mailboxes" );
+
+    control.nodes = kh_init( topology );
+    assert( snapshot_init( &control.topology, shard_count, topology_free ), "Unable to allocate the topology snapshot" );
+}
+
+void control_destroy() {
+    for( int i = 0; i < shard_count; i++ ) {
+        shard_msg_t * message;
+        while( (message = mailbox_pop( &control.inbox[i] )) != NULL )
+            bufpool_free( message );
+        mailbox_destroy( &control.inbox[i] );
+    }
+    free( control.inbox );
+
+    snapshot_destroy( &control.topology );
+    for( khint_t iter = kh_begin( control.nodes ); iter != kh_end( control.nodes ); iter++ ) {
+        if( kh_exist( control.nodes, iter ) ) {
+            kv_destroy( kh_value( control.nodes, iter ).forward );
+            kv_destroy( kh_value( control.nodes, iter ).weights );
         }
-        printf( "\n" );
-        */
+    }
+    kh_destroy( topology, control.nodes );
+
+    close( control.wake_fd );
+}
+
+/**
+ * Pin the calling thread to the CPU configured for this shard, if any were.
+ */
+static void shard_pin() {
+    if( config.cpu_count == 0 )
+        return;
+
+    int cpu = config.cpus[shard->index % config.cpu_count];
+    cpu_set_t mask;
+    CPU_ZERO( &mask );
+    CPU_SET( cpu, &mask );
+
+    int error = pthread_setaffinity_np( pthread_self(), sizeof mask, &mask );
+    if( error != 0 )
+        log_warn( "Unable to pin shard %d to CPU %d: %s", shard->index, cpu, strerror(error) );
+    else
+        log_info( "Shard %d pinned to CPU %d", shard->index, cpu );
+}
+
+/**
+ * The event loop for the calling thread's shard. Only shard 0 has the listen sockets in its reactor.
+ */
+void shard_loop() {
+    reactor_event_t ready[ROUTER_MAX_EVENTS];
+
+    shard_pin();
+
+    while( config.system_state ) {
 
         uint32_t jumpout = 0;
-        int events = -1;
-        while( (events = poll( poll_list, MAX_MONITOR_FDS, 10000 )) > 0 && jumpout++ < 4000 ) {
+        while( jumpout++ < 4000 ) {
+            // New topology, or a request for our status, is picked up between batches
+            shard_control();
 
-            // Is this an event on the listen socket?
-            if( poll_list[0].revents != 0 ) {
-                log_info( "New connection." );
+            // If a full mailbox is holding frames back, poll rather than sleep so they are retried promptly
+            bool held = shard_flush();
+
+            // Connections still waiting for a read turn are served without sleeping
+            bool runnable = kdq_size( shard->runnable ) > 0;
+
+            int events = reactor_wait( shard->reactor, ready, ROUTER_MAX_EVENTS, config.busy_poll || runnable ? 0 : (held ? 1 : 10000) );
+            if( events < 0 || (events == 0 && !held && !runnable) )
+                break;
+
+            // Only descriptors with activity are reported, so just walk the ready list
+            for( int i=0; i<events; i++ ) {
 
-                struct sockaddr_storage remote_socket;
-                socklen_t newSock_len = sizeof( socklen_t );
-                int remote_fd = accept( listen_fd, (struct sockaddr *)&remote_socket, &newSock_len );
-                if( remote_fd == -1 ) {
-                    perror( "accept" );
+                // Is this an event on a listen socket?
+                listener_t * listener = listener_find( ready[i].fd );
+                if( listener != NULL ) {
+                    accept_connection( listener );
                     continue;
                 }
 
-                // Disable Nagle, otherwise small packets will be held back.
-                int flag = 1;
-                int result = setsockopt( remote_fd, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(int) );
-                if (result < 0)
-                    log_warn( "Unable to disable Nagle algorithm on the router socket, expect packet delays!" );
-
-                // Push this new socket onto a blank on the poll list
-                int entry = 1;
-                for( entry=1; entry<MAX_MONITOR_FDS; entry++ ) {
-                    if( poll_list[entry].fd == -1 ) {
-                        poll_list[entry].fd = remote_fd;
-                        poll_list[entry].events = POLLIN;
-                        break;
-                    }
+                // Or time to start accepting again?
+                if( ready[i].fd == admission.timer_fd ) {
+                    admission_resume();
+                    continue;
                 }
-              
-                if( poll_list[entry].fd != remote_fd ) {
-                    log_warn( "No more free sockets, dropping the new one." );
-                    close( remote_fd );
-                    poll_list[0].revents = 0;
+
+                // Or work from another shard?
+                if( ready[i].fd == shard->wake_fd ) {
+                    shard_receive();
                     continue;
                 }
 
-                // Manual reset. Not sure if we actually need this...
-                poll_list[0].revents = 0;
-                continue;
-            }
+                // Or held output coming due?
+                if( ready[i].fd == shard->coalesce_fd ) {
+                    coalesce_service();
+                    merge_service();
+                    combine_service();
+                    load_service();
+                    continue;
+                }
 
-            // If we're here, it must be one of the other monitored fd's
-            for( int i=1; i<MAX_MONITOR_FDS; i++ ) {
+                // Or the bell of a shared-memory link?
+                khint_t ringing = kh_get( bell, shard->bells, ready[i].fd );
+                if( ringing != kh_end( shard->bells ) ) {
+                    link_service( connection_get( kh_value( shard->bells, ringing ) ) );
+                    continue;
+                }
 
-                // Skip any empty FDs
-                if( poll_list[i].fd == -1 )
+                connection_t * connection = connection_get( ready[i].fd );
+                if( !connection->active )
                     continue;
 
-                // Handle any events on this fd
-                if( poll_list[i].revents != 0 ) {
+                if( ready[i].events & REACTOR_WRITE )
+                    connection_flush( connection );
 
-                    // If the socket is gone, just drop the fd and continue the scan.
-                    if( (poll_list[i].revents & POLLHUP) == POLLHUP ) {
+                // Zero-copy completions are reported as errors, without being one
+                if( (ready[i].events & REACTOR_ERROR) && connection->output.pinned != NULL && kdq_size( connection->output.pinned ) > 0 )
+                    output_reap( connection );
 
-                        // If we have an active buffer, kill it now.
-                        khint_t iter = kh_get( int, local_buffer, poll_list[i].fd );
-                        if( iter != kh_end( local_buffer ) ) {
-                            printf( "Killing local buffer for %d\n", poll_list[i].fd );
-                            kh_value( local_buffer, iter ).buffer_tail = NULL;
-                            if( kh_value( local_buffer, iter ).buffer != NULL )
-                                free( kh_value( local_buffer, iter ).buffer );
+                // Hangups and errors are picked up by the read itself, after any remaining data is drained
+                if( connection->active && !(connection->pending & READ_PENDING_SOCKET) &&
+                    ready[i].events & (REACTOR_READ | REACTOR_HANGUP | REACTOR_ERROR) )
+                    connection_read( connection, false );
+            }
 
-                            kh_value( local_buffer, iter ).buffer = NULL;
-                            khint_t delHint = kh_get( int, local_buffer, poll_list[i].fd );
-                            kh_del( int, local_buffer, delHint );
-                        }
+            // Then everyone whose last turn was cut short gets another
+            shard_read_round();
+        }
+    }
+}
 
-                        // Kill the poll structure data
-                        close( poll_list[i].fd );
-                        poll_list[i].fd = -1;
-                        poll_list[i].events = 0;
-                        poll_list[i].revents = 0;
+void * shard_thread( void * arg ) {
+    shard = (shard_t *)arg;
+    shard_loop();
+    return NULL;
+}
 
-                        continue;
-                    }
+int router_process() {
 
-                    // Reset the buffer, just in case (drop this for speed, but danger!)
-                    memset( buffer, 0, config.network_mtu );
+    // Set up the socket server
+    struct addrinfo listen_hints;
 
-                    // Pull any bytes on the wire
-                    ssize_t length = read( poll_list[i].fd, buffer, config.network_mtu );
+#ifdef HAVE_IO_URING
+    if( config.arg_io_uring && shard_count > 1 ) {
+        log_warn( "The io_uring data path is single threaded, ignoring --threads" );
+        shard_count = 1;
+    }
+#endif
 
-                    // Push the event to the event handler.
-                    handle_event( i, &(poll_list[i]), buffer, length );
+    shards = (shard_t *)calloc( shard_count, sizeof(shard_t) );
+    assert( shards != NULL, "Unable to allocate the router shards" );
+    for( int i = 0; i < shard_count; i++ )
+        shard_init( &shards[i], i );
+    control_init();
 
-                    // Reset the event flags, and continue.
-                    poll_list[i].revents = 0;
-                }
-            }
+    // The main thread runs shard 0, which also accepts new connections
+    shard = &shards[0];
+    log_info( "Using the %s event backend, with %d shard(s)", reactor_backend(), shard_count );
+
+    memset( &listen_hints, 0, sizeof listen_hints );
+    listen_hints.ai_family   = AF_INET;
+    listen_hints.ai_socktype = SOCK_STREAM;
+
+    int listen_fd = getListenSocket( &listen_hints );
+
+    if( listen( listen_fd, config.backlog ) == -1 ) {
+        perror( "listen" );
+        exit( EXIT_FAILURE );
+    }
+    listeners[listener_count++] = (listener_t){ .fd = listen_fd, .transport = TRANSPORT_TCP, .path = NULL };
+
+    // Local transports alongside TCP, these are optional - TCP alone still works if they fail
+    int local_fd = getLocalListenSocket( ROUTER_UNIX_PATH, SOCK_STREAM );
+    if( local_fd != -1 )
+        listeners[listener_count++] = (listener_t){ .fd = local_fd, .transport = TRANSPORT_UNIX, .path = ROUTER_UNIX_PATH };
+
+    local_fd = getLocalListenSocket( ROUTER_SEQPACKET_PATH, SOCK_SEQPACKET );
+    if( local_fd != -1 )
+        listeners[listener_count++] = (listener_t){ .fd = local_fd, .transport = TRANSPORT_SEQPACKET, .path = ROUTER_SEQPACKET_PATH };
+
+#ifdef HAVE_IO_URING
+    if( config.arg_io_uring ) {
+        if( uring_router_init() == 0 )
+            log_info( "Using the io_uring data path" );
+        else
+            log_warn( "io_uring is unavailable, falling back to %s", reactor_backend() );
+    }
+#else
+    if( config.arg_io_uring )
+        log_warn( "Built without io_uring support, falling back to %s", reactor_backend() );
+#endif
+
+    // The listen sockets stay level-triggered, so pending connections are never lost between wakeups.
+    // They are drained a batch at a time, which needs them non-blocking.
+    for( int i = 0; i < listener_count; i++ ) {
+#ifdef HAVE_IO_URING
+        if( uring_active )
+            break;
+#endif
+        fcntl( listeners[i].fd, F_SETFL, fcntl( listeners[i].fd, F_GETFL ) | O_NONBLOCK );
+        if( reactor_add( shard->reactor, listeners[i].fd, REACTOR_READ | REACTOR_LEVEL ) == -1 ) {
+            perror( "reactor_add" );
+            exit( EXIT_FAILURE );
+        }
+    }
+
+#ifdef HAVE_IO_URING
+    if( uring_active && config.admit_rate > 0 )
+        log_warn( "The io_uring data path accepts without limit, ignoring --admit" );
+    else
+#endif
+    if( config.admit_rate > 0 ) {
+        admission.timer_fd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+        if( admission.timer_fd == -1 ) {
+            perror( "timerfd" );
+            exit( EXIT_FAILURE );
+        }
+        reactor_add( shard->reactor, admission.timer_fd, REACTOR_READ );
+        admission.refilled = router_clock();
+    }
+
+    if( pthread_create( &control.thread, NULL, control_thread, NULL ) != 0 ) {
+        perror( "pthread_create" );
+        exit( EXIT_FAILURE );
+    }
+
+    for( int i = 1; i < shard_count; i++ ) {
+        if( pthread_create( &shards[i].thread, NULL, shard_thread, &shards[i] ) != 0 ) {
+            perror( "pthread_create" );
+            exit( EXIT_FAILURE );
         }
     }
 
-    kh_destroy( gnw_address_t, address_table );
+#ifdef HAVE_IO_URING
+    if( uring_active )
+        uring_process();
+    else
+#endif
+    shard_loop();
+
+    for( int i = 1; i < shard_count; i++ )
+        pthread_join( shards[i].thread, NULL );
+    pthread_join( control.thread, NULL );
+
+    for( int i = 0; i < shard_count; i++ )
+        shard_destroy( &shards[i] );
+    control_destroy();
+
+#ifdef HAVE_IO_URING
+    if( uring_active )
+        uring_router_exit();
+#endif
+
+    free( shards );
 
-    if( listen_fd != -1 )
-        close( listen_fd );
+    for( int i = 0; i < listener_count; i++ ) {
+        close( listeners[i].fd );
+        if( listeners[i].path != NULL )
+            unlink( listeners[i].path );
+    }
+    if( admission.timer_fd != -1 )
+        close( admission.timer_fd );
 
     return EXIT_SUCCESS;
 }
@@ -824,6 +4763,27 @@ int router_process() {
 #define ARG_MTU        7
 #define ARG_DOT        8
 #define ARG_VERSION    9
+#define ARG_IO_URING   10
+#define ARG_THREADS    11
+#define ARG_QUEUE      12
+#define ARG_CUT_THROUGH 13
+#define ARG_SPLICE     14
+#define ARG_LATENCY    15
+#define ARG_COALESCE   16
+#define ARG_ZEROCOPY   17
+#define ARG_BUSY_POLL  18
+#define ARG_CPU        19
+#define ARG_BACKLOG    20
+#define ARG_ADMIT      21
+#define ARG_READ_WEIGHT 22
+#define ARG_QUANTUM    23
+#define ARG_MERGE_WINDOW  24
+#define ARG_MERGE_TIMEOUT 25
+#define ARG_COMBINE_DEPTH   26
+#define ARG_COMBINE_TIMEOUT 27
+#define ARG_COMBINE_FORMAT  28
+#define ARG_KEY             29
+#define ARG_EDGE_WEIGHT     30
 
 int main(int argc, char ** argv ) {
 
@@ -832,6 +4792,15 @@ int main(int argc, char ** argv ) {
     log_setLevel( ERROR );
 
     config.network_mtu = getIFaceMTU( "lo" );
+    config.queue_limit = ROUTER_QUEUE_LIMIT;
+    config.coalesce_bytes = ROUTER_COALESCE_BYTES;
+    config.backlog = ROUTER_BACKLOG;
+    config.read_quantum = ROUTER_READ_QUANTUM;
+    config.merge_window = ROUTER_MERGE_WINDOW;
+    config.merge_timeout = ROUTER_MERGE_TIMEOUT;
+    config.combine_depth = ROUTER_COMBINE_DEPTH;
+    config.combine_timeout = ROUTER_COMBINE_TIMEOUT;
+    config.combine_format = COMBINE_CONCAT;
     config.system_state = SYSTEM_ACTIVE;
     config.verbosity = 0;
 
@@ -841,12 +4810,17 @@ int main(int argc, char ** argv ) {
     }
     log_debug( "Network MTU detected as %d B\n", config.network_mtu );
 
+    // One shard per core by default
+    shard_count = (int)sysconf( _SC_NPROCESSORS_ONLN );
+    if( shard_count < 1 )
+        shard_count = 1;
+
     // If we have any arguments, assume that this is a remote command.
     if( argc > 1 ) {
         int rfd = socket_connect( "127.0.0.1", ROUTER_PORT ); // Assume local, for now.
 
 #pragma GCC diagnostic ignored "-Wmissing-braces" // This is a GCC bug for initializing structures in an array
-        struct option longOptions[11] = {
+        struct option longOptions[32] = {
                 [ARG_HELP] =       { .name="help",       .has_arg=no_argument,       .flag=NULL },
                 [ARG_STATUS] =     { .name="status",     .has_arg=no_argument,       .flag=NULL },
                 [ARG_POLICY] =     { .name="policy",     .has_arg=required_argument, .flag=NULL },
@@ -857,6 +4831,27 @@ int main(int argc, char ** argv ) {
                 [ARG_MTU] =        { .name="mtu",        .has_arg=required_argument, .flag=NULL },
                 [ARG_DOT] =        { .name="dot",        .has_arg=no_argument,       .flag=NULL },
                 [ARG_VERSION] =    { .name="version",    .has_arg=no_argument,       .flag=NULL },
+                [ARG_IO_URING] =   { .name="io-uring",   .has_arg=no_argument,       .flag=NULL },
+                [ARG_THREADS] =    { .name="threads",    .has_arg=required_argument, .flag=NULL },
+                [ARG_QUEUE] =      { .name="queue",      .has_arg=required_argument, .flag=NULL },
+                [ARG_CUT_THROUGH] = { .name="cut-through", .has_arg=no_argument,      .flag=NULL },
+                [ARG_SPLICE] =     { .name="splice",     .has_arg=required_argument, .flag=NULL },
+                [ARG_LATENCY] =    { .name="latency",    .has_arg=required_argument, .flag=NULL },
+                [ARG_COALESCE] =   { .name="coalesce",   .has_arg=required_argument, .flag=NULL },
+                [ARG_ZEROCOPY] =   { .name="zerocopy",   .has_arg=required_argument, .flag=NULL },
+                [ARG_BUSY_POLL] =  { .name="busy-poll",  .has_arg=no_argument,       .flag=NULL },
+                [ARG_CPU] =        { .name="cpu",        .has_arg=required_argument, .flag=NULL },
+                [ARG_BACKLOG] =    { .name="backlog",    .has_arg=required_argument, .flag=NULL },
+                [ARG_ADMIT] =      { .name="admit",      .has_arg=required_argument, .flag=NULL },
+                [ARG_READ_WEIGHT] = { .name="read-weight", .has_arg=required_argument, .flag=NULL },
+                [ARG_QUANTUM] =    { .name="quantum",    .has_arg=required_argument, .flag=NULL },
+                [ARG_MERGE_WINDOW] = { .name="merge-window", .has_arg=required_argument, .flag=NULL },
+                [ARG_MERGE_TIMEOUT] = { .name="merge-timeout", .has_arg=required_argument, .flag=NULL },
+                [ARG_COMBINE_DEPTH] = { .name="combine-depth", .has_arg=required_argument, .flag=NULL },
+                [ARG_COMBINE_TIMEOUT] = { .name="combine-timeout", .has_arg=required_argument, .flag=NULL },
+                [ARG_COMBINE_FORMAT] = { .name="combine-format", .has_arg=required_argument, .flag=NULL },
+                [ARG_KEY] =        { .name="key",        .has_arg=required_argument, .flag=NULL },
+                [ARG_EDGE_WEIGHT] = { .name="edge-weight", .has_arg=required_argument, .flag=NULL },
                 0
         };
 #pragma GCC diagnostic pop
@@ -882,13 +4877,34 @@ int main(int argc, char ** argv ) {
                     printf("The userspace router for GraphIPC messaging\n\n");
                     printf(ANSI_COLOR_CYAN "--help -h\n" ANSI_COLOR_RESET "\tShow this help message\n\n");
                     printf(ANSI_COLOR_CYAN "--status\n" ANSI_COLOR_RESET "\tRequest a status message from a running router instance\n\n");
-                    printf(ANSI_COLOR_CYAN "--policy\n" ANSI_COLOR_RESET "\tChange the link policy between --source and --target\n\n");
+                    printf(ANSI_COLOR_CYAN "--policy\n" ANSI_COLOR_RESET "\tChange the link policy of --target: broadcast, anycast, roundrobin, merge (as broadcast, but GNW_SEQUENCED frames reach each target in sequence order), combine (each target waits for a message from every source combining into it, and gets them as one), least-loaded (each message to the target with the least output waiting), two-choice (the less loaded of two random targets, for wide fan-outs), or affinity (each message to the target its --key hashes to, so equal keys always reach the same target, and adding or removing a target only moves its share of the keys)\n\n");
+                    printf(ANSI_COLOR_CYAN "--key\n" ANSI_COLOR_RESET "\tWhere the affinity policy of --target finds each message's key: field:N[:D] for the Nth field delimited by D (Default ',', or tab), bytes:OFFSET:LENGTH for a byte range (LENGTH 0 for the rest), or json:PATH for a JSON field such as user.id. Messages without one go to a target at random (Default: the whole message)\n\n");
                     printf(ANSI_COLOR_CYAN "--connect -c\n" ANSI_COLOR_RESET "\tConnect --source to --target, with default (broadcast) policy\n\n");
                     printf(ANSI_COLOR_CYAN "--disconnect -d\n" ANSI_COLOR_RESET "\tDisconnect --source from --target\n\n");
+                    printf(ANSI_COLOR_CYAN "--edge-weight\n" ANSI_COLOR_RESET "\tSet the weight of the edge from --source to --target: a roundrobin source sends an edge with weight N N times the messages of one with weight 1, spread evenly between them (Default: 1)\n\n");
                     printf(ANSI_COLOR_CYAN "--source -s\n" ANSI_COLOR_RESET "\tThe source address of the arc to modify\n\n");
                     printf(ANSI_COLOR_CYAN "--target -t\n" ANSI_COLOR_RESET "\tThe target address of the arc or node to modify\n\n");
                     printf(ANSI_COLOR_CYAN "--mtu\n" ANSI_COLOR_RESET "\tForce a particular MTU - settings this too high may cause excessive packet loss!\n\n");
                     printf(ANSI_COLOR_CYAN "--dot\n" ANSI_COLOR_RESET "\tOutput the connectome in DOT format periodically, rather than status messages or the address table\n\n");
+                    printf(ANSI_COLOR_CYAN "--io-uring\n" ANSI_COLOR_RESET "\tUse io_uring for the data path (batched submission, registered buffers), falling back to epoll if unavailable\n\n");
+                    printf(ANSI_COLOR_CYAN "--threads\n" ANSI_COLOR_RESET "\tThe number of router threads, each owning a shard of the connections and addresses (Default: one per core)\n\n");
+                    printf(ANSI_COLOR_CYAN "--queue\n" ANSI_COLOR_RESET "\tThe output queue limit per connection in bytes, frames beyond this are dropped (Default: 1MiB)\n\n");
+                    printf(ANSI_COLOR_CYAN "--cut-through\n" ANSI_COLOR_RESET "\tHand the two ends of a 1:1 edge a direct unix socket between them, the router only keeps the statistics. Falls back to routing when the edge changes\n\n");
+                    printf(ANSI_COLOR_CYAN "--splice\n" ANSI_COLOR_RESET "\tBroadcast frames of at least this many bytes with tee/splice, so the kernel copies each one once rather than once per target (Default: 0, off)\n\n");
+                    printf(ANSI_COLOR_CYAN "--latency\n" ANSI_COLOR_RESET "\tSet the latency budget of --target in microseconds: small frames for it wait up to this long to be sent together (Default: 0, sent immediately)\n\n");
+                    printf(ANSI_COLOR_CYAN "--coalesce\n" ANSI_COLOR_RESET "\tFrames held back by a latency budget are sent as soon as this many bytes are waiting (Default: 16KiB)\n\n");
+                    printf(ANSI_COLOR_CYAN "--zerocopy\n" ANSI_COLOR_RESET "\tSend TCP writes of at least this many bytes with MSG_ZEROCOPY, holding the buffers until the kernel reports them done (Default: 0, off)\n\n");
+                    printf(ANSI_COLOR_CYAN "--busy-poll\n" ANSI_COLOR_RESET "\tSpin on the sockets rather than sleeping until they are ready, trading whole cores for lower hop latency (best with --cpu)\n\n");
+                    printf(ANSI_COLOR_CYAN "--cpu\n" ANSI_COLOR_RESET "\tA comma separated list of CPUs to pin the router threads to, one each in turn (Default: unpinned)\n\n");
+                    printf(ANSI_COLOR_CYAN "--backlog\n" ANSI_COLOR_RESET "\tThe listen backlog for each listen socket, capped by the kernel at net.core.somaxconn (Default: 128)\n\n");
+                    printf(ANSI_COLOR_CYAN "--admit\n" ANSI_COLOR_RESET "\tAccept at most this many new connections per second, the rest wait in the backlog (Default: 0, no limit)\n\n");
+                    printf(ANSI_COLOR_CYAN "--read-weight\n" ANSI_COLOR_RESET "\tSet the read weight of --target: a busy producer with weight N is read N times as much per round as one with weight 1 (Default: 1)\n\n");
+                    printf(ANSI_COLOR_CYAN "--quantum\n" ANSI_COLOR_RESET "\tThe bytes read from each busy connection per round before the next gets a turn, times its weight (Default: 64KiB)\n\n");
+                    printf(ANSI_COLOR_CYAN "--merge-window\n" ANSI_COLOR_RESET "\tHow many sequence numbers a merge target holds ahead of the one it is waiting for, before giving up on it to make room (Default: 1024)\n\n");
+                    printf(ANSI_COLOR_CYAN "--merge-timeout\n" ANSI_COLOR_RESET "\tHow long in microseconds a merge target waits for a missing sequence number before giving up on it (Default: 20000)\n\n");
+                    printf(ANSI_COLOR_CYAN "--combine-depth\n" ANSI_COLOR_RESET "\tHow many whole messages each input of a combine target holds while waiting for the others, before a round goes without them to make room (Default: 64)\n\n");
+                    printf(ANSI_COLOR_CYAN "--combine-timeout\n" ANSI_COLOR_RESET "\tHow long in microseconds a combine round waits for its missing inputs before going without them (Default: 20000)\n\n");
+                    printf(ANSI_COLOR_CYAN "--combine-format\n" ANSI_COLOR_RESET "\tHow each combine round is written: concat, the inputs' messages back to back in address order, or tuple, a u32 count then each message as a u32 length and its bytes (Default: concat)\n\n");
                     printf(ANSI_COLOR_CYAN "-v\n" ANSI_COLOR_RESET "\tIncrease log verbosity, each instance increases the log level (Default: ERROR only). Must be called first to have effect\n\n");
                     //printf(ANSI_COLOR_CYAN "--FLAG\n" ANSI_COLOR_RESET "\tDESCRIPTION\n\n");
                     return EXIT_SUCCESS;
@@ -913,6 +4929,16 @@ int main(int argc, char ** argv ) {
                         next = packet_write_u8( next, GNW_POLICY_ROUNDROBIN );
                     else if( strncmp(optarg, "anycast", 7 ) == 0 )
                         next = packet_write_u8( next, GNW_POLICY_ANYCAST );
+                    else if( strncmp(optarg, "merge", 5 ) == 0 )
+                        next = packet_write_u8( next, GNW_POLICY_MERGE );
+                    else if( strncmp(optarg, "combine", 7 ) == 0 )
+                        next = packet_write_u8( next, GNW_POLICY_COMBINE );
+                    else if( strncmp(optarg, "least", 5 ) == 0 )
+                        next = packet_write_u8( next, GNW_POLICY_LEASTLOADED );
+                    else if( strncmp(optarg, "two", 3 ) == 0 )
+                        next = packet_write_u8( next, GNW_POLICY_TWOCHOICE );
+                    else if( strncmp(optarg, "affinity", 8 ) == 0 )
+                        next = packet_write_u8( next, GNW_POLICY_AFFINITY );
 
                     next = packet_write_u32( next, arg_target_address );
 
@@ -922,6 +4948,63 @@ int main(int argc, char ** argv ) {
                     return EXIT_SUCCESS;
                 }
 
+                case ARG_LATENCY: {
+                    unsigned char buffer[1 + sizeof(gnw_address_t) + sizeof(uint32_t)] = { 0 };
+                    uint8_t * next = packet_write_u8( buffer, GNW_CMD_LATENCY );
+                    next = packet_write_u32( next, arg_target_address );
+                    next = packet_write_u32( next, (uint32_t)strtoul( optarg, NULL, 10 ) );
+                    gnw_emitCommandPacket( rfd, GNW_COMMAND, buffer, next - buffer );
+
+                    close(rfd);
+                    return EXIT_SUCCESS;
+                }
+
+                case ARG_READ_WEIGHT: {
+                    unsigned char buffer[1 + sizeof(gnw_address_t) + sizeof(uint32_t)] = { 0 };
+                    uint8_t * next = packet_write_u8( buffer, GNW_CMD_READ_WEIGHT );
+                    next = packet_write_u32( next, arg_target_address );
+                    next = packet_write_u32( next, (uint32_t)strtoul( optarg, NULL, 10 ) );
+                    gnw_emitCommandPacket( rfd, GNW_COMMAND, buffer, next - buffer );
+
+                    close(rfd);
+                    return EXIT_SUCCESS;
+                }
+
+                case ARG_EDGE_WEIGHT: {
+                    unsigned char buffer[1 + sizeof(gnw_address_t) * 2 + sizeof(uint32_t)] = { 0 };
+                    uint8_t * next = packet_write_u8( buffer, GNW_CMD_EDGE_WEIGHT );
+                    next = packet_write_u32( next, arg_source_address );
+                    next = packet_write_u32( next, arg_target_address );
+                    next = packet_write_u32( next, (uint32_t)strtoul( optarg, NULL, 10 ) );
+                    gnw_emitCommandPacket( rfd, GNW_COMMAND, buffer, next - buffer );
+
+                    close(rfd);
+                    return EXIT_SUCCESS;
+                }
+
+                case ARG_KEY: {
+                    affinity_key_t key;
+                    if( !affinity_parse( &key, optarg ) ) {
+                        log_error( "Bad affinity key '%s', expected field:N[:D], bytes:OFFSET:LENGTH or json:PATH", optarg );
+                        close(rfd);
+                        return EXIT_FAILURE;
+                    }
+
+                    unsigned char buffer[1 + sizeof(gnw_address_t) + 2 + 2 * sizeof(uint32_t) + AFFINITY_PATH_MAX] = { 0 };
+                    uint8_t * next = packet_write_u8( buffer, GNW_CMD_AFFINITY_KEY );
+                    next = packet_write_u32( next, arg_target_address );
+                    next = packet_write_u8( next, key.kind );
+                    next = packet_write_u8( next, key.delimiter );
+                    next = packet_write_u32( next, key.first );
+                    next = packet_write_u32( next, key.length );
+                    if( key.kind == AFFINITY_JSON )
+                        next = packet_write_u8_buffer( next, (uint8_t *)key.path, strlen( key.path ) );
+                    gnw_emitCommandPacket( rfd, GNW_COMMAND, buffer, next - buffer );
+
+                    close(rfd);
+                    return EXIT_SUCCESS;
+                }
+
                 case 'c':
                 case ARG_CONNECT: {
                     printf( "Connect!\n" );
@@ -969,6 +5052,94 @@ int main(int argc, char ** argv ) {
 
                 case ARG_DOT: config.arg_dot = true; break;
 
+                case ARG_IO_URING: config.arg_io_uring = true; break;
+
+                case ARG_CUT_THROUGH: config.arg_cut_through = true; break;
+
+                case ARG_SPLICE: config.splice_threshold = (size_t)strtoul( optarg, NULL, 10 ); break;
+
+                case ARG_COALESCE: config.coalesce_bytes = (size_t)strtoul( optarg, NULL, 10 ); break;
+
+                case ARG_ZEROCOPY: config.zerocopy_threshold = (size_t)strtoul( optarg, NULL, 10 ); break;
+                case ARG_BUSY_POLL: config.busy_poll = true; break;
+                case ARG_ADMIT: config.admit_rate = (uint32_t)strtoul( optarg, NULL, 10 ); break;
+
+                case ARG_MERGE_TIMEOUT: config.merge_timeout = (uint32_t)strtoul( optarg, NULL, 10 ); break;
+                case ARG_COMBINE_TIMEOUT: config.combine_timeout = (uint32_t)strtoul( optarg, NULL, 10 ); break;
+
+                case ARG_COMBINE_DEPTH:
+                    config.combine_depth = (uint32_t)strtoul( optarg, NULL, 10 );
+                    if( config.combine_depth < 1 || config.combine_depth > 65536 ) {
+                        log_warn( "The combine depth must be between 1 and 65536, using %u", ROUTER_COMBINE_DEPTH );
+                        config.combine_depth = ROUTER_COMBINE_DEPTH;
+                    }
+                    break;
+
+                case ARG_COMBINE_FORMAT:
+                    if( strcmp( optarg, "tuple" ) == 0 )
+                        config.combine_format = COMBINE_TUPLE;
+                    else if( strcmp( optarg, "concat" ) == 0 )
+                        config.combine_format = COMBINE_CONCAT;
+                    else
+                        log_warn( "Unknown combine format '%s', using concat", optarg );
+                    break;
+
+                case ARG_MERGE_WINDOW:
+                    config.merge_window = (uint32_t)strtoul( optarg, NULL, 10 );
+                    if( config.merge_window < 1 || config.merge_window > (1u << 20) ) {
+                        log_warn( "The merge window must be between 1 and %u, using %u", 1u << 20, ROUTER_MERGE_WINDOW );
+                        config.merge_window = ROUTER_MERGE_WINDOW;
+                    }
+                    break;
+
+                case ARG_QUANTUM:
+                    config.read_quantum = (size_t)strtoul( optarg, NULL, 10 );
+                    if( config.read_quantum < (size_t)config.network_mtu ) {
+                        log_warn( "The read quantum is below the MTU, using %d bytes", config.network_mtu );
+                        config.read_quantum = (size_t)config.network_mtu;
+                    }
+                    break;
+
+                case ARG_BACKLOG:
+                    config.backlog = (int)strtol( optarg, NULL, 10 );
+                    if( config.backlog < 1 ) {
+                        log_warn( "The listen backlog must be at least 1, using %d", ROUTER_BACKLOG );
+                        config.backlog = ROUTER_BACKLOG;
+                    }
+                    break;
+
+                case ARG_CPU: {
+                    config.cpu_count = 0;
+                    char * next = optarg;
+                    while( *next != '\0' && config.cpu_count < ROUTER_MAX_CPUS ) {
+                        char * end;
+                        long cpu = strtol( next, &end, 10 );
+                        if( end == next || cpu < 0 || cpu >= ROUTER_MAX_CPUS ) {
+                            log_error( "Bad CPU list '%s', expected numbers below %d separated by commas", optarg, ROUTER_MAX_CPUS );
+                            return EXIT_FAILURE;
+                        }
+                        config.cpus[config.cpu_count++] = (int)cpu;
+                        next = *end == ',' ? end + 1 : end;
+                    }
+                    break;
+                }
+
+                case ARG_QUEUE:
+                    config.queue_limit = (size_t)strtoul( optarg, NULL, 10 );
+                    if( config.queue_limit < config.network_mtu ) {
+                        log_warn( "Output queue limit is below the MTU, using %lu bytes", config.network_mtu );
+                        config.queue_limit = config.network_mtu;
+                    }
+                    break;
+
+                case ARG_THREADS:
+                    shard_count = (int)strtol( optarg, NULL, 10 );
+                    if( shard_count < 1 ) {
+                        log_warn( "Need at least one router thread, using 1" );
+                        shard_count = 1;
+                    }
+                    break;
+
                 case ARG_VERSION:
                     printf( "Version: %s (%s)\n", GIT_TAG, GIT_HASH );
                     return EXIT_SUCCESS;
@@ -18,6 +18,8 @@
 #include "BuildInfo.h"
 #include "common.h"
 #include "lib/GraphNetwork.h"
+#include "lib/FrameBuffer.h"
+#include "lib/ShmLink.h"
 #include "lib/LinkedList.h"
 #include "lib/packet.h"
 #include "Log.h"
@@ -34,7 +36,11 @@
 #include <unistd.h>
 #include <wait.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
 #include "lib/klib/khash.h"
+#include "lib/klib/kvec.h"
+#include "lib/klib/kdq.h"
 #include <signal.h>
 #include <termios.h>
 #include <netinet/tcp.h>
@@ -71,6 +77,8 @@ struct _configuration {
     unsigned int   arg_verbosity;
     bool           arg_echo;
     char           arg_delimiter;
+    size_t         arg_zerocopy;    // TCP data messages of at least this many bytes are sent with MSG_ZEROCOPY, 0 to never
+    bool           arg_sequence;    // Stamp every data message with a sequence number, for a merge to put back in order
 };
 
 struct _mux_config {
@@ -118,12 +126,7 @@ KHASH_MAP_INIT_INT( gnw_address_t, sink_context_t );
 khash_t(gnw_address_t) * sinkTable;
 
 // The 'big buffer in the sky' for the node as a whole
-typedef struct {
-    uint8_t * head;
-    uint8_t * tail;
-} local_buffer_t;
-
-KHASH_MAP_INIT_INT( int, local_buffer_t );
+KHASH_MAP_INIT_INT( int, framebuffer_t );
 khash_t(int) * input_buffer;
 
 struct termios saved_attributes;
@@ -155,7 +158,7 @@ void set_input_mode (void) {
 }
 
 
-local_buffer_t * getLocalBuffer( int fd ) {
+framebuffer_t * getLocalBuffer( int fd ) {
     khint_t hint = kh_get( int, input_buffer, fd );
 
     // Does this key exist?
@@ -169,9 +172,8 @@ local_buffer_t * getLocalBuffer( int fd ) {
 
         //fprintf( stderr, "STATUS = %d\n", status );
 
-        local_buffer_t * local = &kh_value( input_buffer, hint );
-        local->head = (uint8_t *)malloc( config.network_mtu * 20 );
-        local->tail = local->head;
+        framebuffer_t * local = &kh_value( input_buffer, hint );
+        framebuffer_init( local, config.network_mtu * 20 );
     }
 
     return &kh_value( input_buffer, hint );
@@ -185,26 +187,349 @@ void destroyLocalBuffer( int fd ) {
         return;
     
     log_debug( "Freeing local buffers for fd = %d\n", fd );
-    local_buffer_t * buffer = &kh_value( input_buffer, hint );
-    free( buffer->head );
-    buffer->head = NULL;
-    buffer->tail = NULL;
+    framebuffer_destroy( &kh_value( input_buffer, hint ) );
+    kh_del( int, input_buffer, hint );
 }
 
 int router_fd = -1;
+zerocopy_t router_zerocopy; // MSG_ZEROCOPY state for the router socket, with --zerocopy over TCP
+
+// Shared-memory link to the router, only used once the router has accepted it
+shmlink_t router_link = { .memfd = -1, .bell = -1, .peer_bell = -1 };
+bool router_link_active = false;
+
+// Direct (cut-through) links for 1:1 edges, keyed on the source address
+typedef struct {
+    int fd;
+    uint32_t packets; // Sent since the last report to the router
+    uint32_t bytes;
+} direct_link_t;
+
+#define DIRECT_STATS_INTERVAL 1000
+
+KHASH_MAP_INIT_INT( direct, direct_link_t );
+khash_t(direct) * directOut; // Our sources that write straight to their target
+khash_t(direct) * directIn;  // Sources that write straight to us
+
+// The last descriptor the router passed us, waiting for the command that claims it
+int passedFd = -1;
+
+// Messages still arriving as GNW_MORE fragments, by source, held until their last fragment
+typedef kvec_t( uint8_t ) partial_message_t;
+KHASH_MAP_INIT_INT( partial, partial_message_t );
+khash_t(partial) * partialMessages;
+
+// Sequence numbers for a resequencing (GNW_POLICY_MERGE) edge, see emitRouterSequenced()
+KDQ_INIT( uint32_t );
+kdq_t( uint32_t ) * sequenceCarried; // From stamped messages we were sent, each taken by the next record we produce
+uint32_t sequenceNext = 0;           // Our own count, for records with no stamp to carry on
+uint32_t sequenceCurrent = 0;
+bool sequenceOpen = false;           // A record is part way out, the rest keeps sequenceCurrent
+
+bool emitDirectPacket( uint8_t type, gnw_address_t source, unsigned char * payload, size_t length );
+void drainDirectIn( gnw_address_t source );
+
+/**
+ * Offer the router a shared-memory link, passing the memfd and both bells over the socket.
+ *
+ * Everything keeps going over the socket until the router's reply arrives (see handleCommandPacket).
+ *
+ * @param fd The (unix stream) router socket
+ */
+void offerRouterLink( int fd ) {
+    int result = shmlink_create( &router_link, SHMLINK_DEFAULT_CAPACITY );
+    if( result != 0 ) {
+        log_warn( "Unable to create a shared-memory link, staying on the socket: %s", strerror(-result) );
+        return;
+    }
+
+    uint8_t frame[12] = { 0 };
+    uint8_t * ptr = packet_write_u8( frame, GNW_MAGIC );
+    ptr = packet_write_u8( ptr, GNW_VERSION );
+    ptr = packet_write_u8( ptr, GNW_COMMAND );
+    ptr = packet_write_u32( ptr, 0xFFFFFFFF );
+    ptr = packet_write_u32( ptr, 1 );
+    ptr = packet_write_u8( ptr, GNW_CMD_SHM_LINK );
+
+    // The router waits on our peer_bell, and rings our bell
+    int fds[3] = { router_link.memfd, router_link.peer_bell, router_link.bell };
+    union {
+        struct cmsghdr align;
+        uint8_t space[CMSG_SPACE( sizeof fds )];
+    } control;
+    memset( &control, 0, sizeof control );
+
+    struct iovec iov = { .iov_base = frame, .iov_len = sizeof frame };
+    struct msghdr message = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = &control, .msg_controllen = sizeof control };
+
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR( &message );
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN( sizeof fds );
+    memcpy( CMSG_DATA( cmsg ), fds, sizeof fds );
+
+    if( sendmsg( fd, &message, MSG_NOSIGNAL ) != sizeof frame ) {
+        log_warn( "Unable to offer a shared-memory link, staying on the socket: %s", strerror(errno) );
+        shmlink_destroy( &router_link );
+    }
+}
+
+/**
+ * Write all of 'buffer' into the link, waiting for the router to drain it if the ring is full.
+ *
+ * @return False if the router went away before everything was written
+ */
+bool writeRouterLink( const uint8_t * buffer, size_t length ) {
+    bool waited = false;
+    bool sent = true;
+
+    while( length > 0 ) {
+        ssize_t written = shmlink_write( &router_link, buffer, length );
+        assert( written != -1, "Shared-memory link to the router is corrupt, STOP." );
+
+        buffer += written;
+        length -= written;
+        if( written > 0 )
+            continue;
+
+        // Full - the router rings us once it makes room. Watch the socket too, in case it has gone.
+        struct pollfd wait[2] = {
+            { .fd = router_link.bell, .events = POLLIN },
+            { .fd = router_fd, .events = 0 }
+        };
+        poll( wait, 2, 100 );
+        if( wait[1].revents & (POLLHUP | POLLERR | POLLNVAL) ) {
+            log_error( "Router went away while we were blocked on the shared-memory link" );
+            sent = false;
+            break;
+        }
+
+        shmlink_clear( &router_link );
+        waited = true;
+    }
+
+    // Clearing the bell may have swallowed a ring for incoming data, so leave it set for the main loop
+    if( waited )
+        eventfd_write( router_link.bell, 1 );
+
+    return sent;
+}
 int getRouterFD() {
     if( router_fd == -1 ) {
+        int transport = socket_transport( config.arg_host, NULL );
         log_info( "Connecting to router at %s:%s...", config.arg_host, config.arg_port );
         router_fd = socket_connect( config.arg_host, config.arg_port );
 
-        int flag = 1;
-        int result = setsockopt( router_fd, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(int) );
-        if (result < 0)
-            log_warn( "Unable to disable Nagle algorithm on the router socket, expect packet delays!" );
+        if( transport == TRANSPORT_TCP ) {
+            int flag = 1;
+            int result = setsockopt( router_fd, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(int) );
+            if (result < 0)
+                log_warn( "Unable to disable Nagle algorithm on the router socket, expect packet delays!" );
+
+            if( config.arg_zerocopy > 0 && !zerocopy_enable( &router_zerocopy, router_fd ) )
+                log_warn( "Zero-copy sends are unavailable on the router socket: %s", strerror(errno) );
+        }
+
+        // The router sends exactly one frame per message, so reads never need resyncing
+        if( transport == TRANSPORT_SEQPACKET )
+            getLocalBuffer( router_fd )->messages = true;
+
+        if( transport == TRANSPORT_SHM && router_fd != -1 )
+            offerRouterLink( router_fd );
     }
     return router_fd;
 }
 
+/**
+ * Send a single frame to the router, over the shared-memory link if there is one, otherwise the socket.
+ * Data frames go straight to their target instead, if the source has a direct link.
+ *
+ * @param type GNW_DATA (optionally with GNW_MORE and GNW_SEQUENCED), or GNW_COMMAND
+ * @param source The source address for data packets (ignored for commands)
+ * @param payload The packet payload, at most GNW_FRAGMENT_SIZE bytes for data
+ * @param length The payload length
+ */
+void emitRouterFrame( uint8_t type, gnw_address_t source, unsigned char * payload, size_t length ) {
+    bool data = GNW_FRAME_TYPE( type ) == GNW_DATA;
+    if( data && kh_size( directOut ) > 0 && emitDirectPacket( type, source, payload, length ) )
+        return;
+
+    if( !router_link_active ) {
+        if( data )
+            gnw_emitDataFrame( getRouterFD(), type, source, payload, length );
+        else
+            gnw_emitCommandPacket( getRouterFD(), type, payload, length );
+        return;
+    }
+
+    if( data && length == 0 )
+        return;
+
+    // The ring is a byte stream, so the header and payload can go in separately - no copy needed
+    uint8_t header[11];
+    uint8_t * ptr = packet_write_u8( header, GNW_MAGIC );
+    ptr = packet_write_u8( ptr, GNW_VERSION );
+    ptr = packet_write_u8( ptr, type );
+    ptr = packet_write_u32( ptr, data ? source : 0xFFFFFFFF );
+    ptr = packet_write_u32( ptr, length );
+
+    if( writeRouterLink( header, sizeof header ) )
+        writeRouterLink( payload, length );
+}
+
+/**
+ * Send a data message stamped with a sequence number, for a merge to put back in order.
+ *
+ * A record carries on the number of the stamped message it was produced from, so a worker keeps its
+ * input's place, and otherwise takes the next of our own count. Every fragment carries the number.
+ *
+ * @param source The source address
+ * @param payload The message
+ * @param length The message length
+ * @param more True if the message continues in a later call
+ */
+void emitRouterSequenced( gnw_address_t source, unsigned char * payload, size_t length, bool more ) {
+    if( !sequenceOpen )
+        sequenceCurrent = kdq_size( sequenceCarried ) > 0 ? *kdq_shift( uint32_t, sequenceCarried ) : sequenceNext++;
+    sequenceOpen = more;
+
+    // Each fragment is copied in behind the number, as every path to the router sends one payload per frame
+    uint8_t frame[GNW_FRAGMENT_SIZE];
+    packet_write_u32( frame, sequenceCurrent );
+    do {
+        size_t fragment = length < GNW_FRAGMENT_SIZE - sizeof(uint32_t) ? length : GNW_FRAGMENT_SIZE - sizeof(uint32_t);
+        memcpy( frame + sizeof(uint32_t), payload, fragment );
+        payload += fragment;
+        length -= fragment;
+
+        uint8_t type = (length > 0 || more) ? GNW_DATA | GNW_SEQUENCED | GNW_MORE : GNW_DATA | GNW_SEQUENCED;
+        emitRouterFrame( type, source, frame, fragment + sizeof(uint32_t) );
+    } while( length > 0 );
+}
+
+/**
+ * Send a data message, split into GNW_MORE fragments if it is bigger than GNW_FRAGMENT_SIZE.
+ *
+ * @param source The source address
+ * @param payload The message
+ * @param length The message length
+ * @param more True if the message continues in a later call
+ */
+void emitRouterData( gnw_address_t source, unsigned char * payload, size_t length, bool more ) {
+    if( config.arg_sequence ) {
+        emitRouterSequenced( source, payload, length, more );
+        return;
+    }
+
+    // Big messages for the router's socket go zero-copy, the payload is ours again once that returns
+    if( router_zerocopy.enabled && length >= config.arg_zerocopy && !router_link_active &&
+        kh_get( direct, directOut, source ) == kh_end( directOut ) ) {
+        if( !gnw_emitDataZerocopy( getRouterFD(), &router_zerocopy, source, payload, length, more ) )
+            log_error( "Zero-copy send to the router failed: %s", strerror(errno) );
+        return;
+    }
+
+    while( length > GNW_FRAGMENT_SIZE ) {
+        emitRouterFrame( GNW_DATA | GNW_MORE, source, payload, GNW_FRAGMENT_SIZE );
+        payload += GNW_FRAGMENT_SIZE;
+        length -= GNW_FRAGMENT_SIZE;
+    }
+
+    emitRouterFrame( more ? GNW_DATA | GNW_MORE : GNW_DATA, source, payload, length );
+}
+
+/**
+ * Send a packet to the router, see emitRouterFrame().
+ *
+ * @param type GNW_DATA, or GNW_COMMAND
+ * @param source The source address for data packets (ignored for commands)
+ * @param payload The packet payload, data payloads of any size are fragmented as needed
+ * @param length The payload length
+ */
+void emitRouterPacket( uint8_t type, gnw_address_t source, unsigned char * payload, size_t length ) {
+    if( type == GNW_DATA )
+        emitRouterData( source, payload, length, false );
+    else
+        emitRouterFrame( type, source, payload, length );
+}
+
+/**
+ * Report what went over a direct link since the last report, so the router's statistics stay whole.
+ */
+void reportDirectStats( gnw_address_t source, direct_link_t * link ) {
+    if( link->packets == 0 )
+        return;
+
+    unsigned char report[14] = { 0 };
+    uint8_t * ptr = packet_write_u8( report, GNW_CMD_CUT_THROUGH );
+    ptr = packet_write_u8( ptr, GNW_CUT_STATS );
+    ptr = packet_write_u32( ptr, source );
+    ptr = packet_write_u32( ptr, link->packets );
+    ptr = packet_write_u32( ptr, link->bytes );
+    emitRouterPacket( GNW_COMMAND, 0, report, ptr - report );
+
+    link->packets = 0;
+    link->bytes = 0;
+}
+
+/**
+ * Close the direct link for 'source', so its packets go back through the router.
+ */
+void closeDirectOut( gnw_address_t source ) {
+    khint_t hint = kh_get( direct, directOut, source );
+    if( hint == kh_end( directOut ) )
+        return;
+
+    direct_link_t link = kh_value( directOut, hint );
+    kh_del( direct, directOut, hint );
+
+    close( link.fd );
+    reportDirectStats( source, &link );
+}
+
+/**
+ * Send a data packet straight to its target, if this source has a direct link.
+ *
+ * @return False if there is no link (or it just failed), and the packet should go to the router
+ */
+bool emitDirectPacket( uint8_t type, gnw_address_t source, unsigned char * payload, size_t length ) {
+    khint_t hint = kh_get( direct, directOut, source );
+    if( hint == kh_end( directOut ) )
+        return false;
+
+    if( length == 0 )
+        return true;
+
+    direct_link_t * link = &kh_value( directOut, hint );
+
+    uint8_t header[11];
+    uint8_t * ptr = packet_write_u8( header, GNW_MAGIC );
+    ptr = packet_write_u8( ptr, GNW_VERSION );
+    ptr = packet_write_u8( ptr, type );
+    ptr = packet_write_u32( ptr, source );
+    ptr = packet_write_u32( ptr, length );
+
+    struct iovec iov[2] = {
+        { .iov_base = header, .iov_len = sizeof header },
+        { .iov_base = payload, .iov_len = length }
+    };
+    struct msghdr message = { .msg_iov = iov, .msg_iovlen = 2 };
+    size_t total = sizeof header + length;
+
+    size_t sent = gnw_sendAll( link->fd, NULL, &message );
+    if( sent < total ) {
+        log_warn( "Direct link for %08x failed, routing through the router again: %s", source, strerror(errno) );
+        closeDirectOut( source );
+        return sent == 0 ? false : true;
+    }
+
+    link->packets++;
+    link->bytes += total;
+    if( link->packets >= DIRECT_STATS_INTERVAL )
+        reportDirectStats( source, link );
+    return true;
+}
+
 gnw_address_t getNextLocalAddress() {
     nextLocalAddress = (nextLocalAddress+1) & config.gnw_local_mask;
 
@@ -215,7 +540,7 @@ gnw_address_t getNextLocalAddress() {
     unsigned char reqBuffer[5] = { 0 };
     uint8_t * ptr = packet_write_u8( reqBuffer, GNW_CMD_NEW_ADDRESS );
     ptr = packet_write_u32( ptr, realAddress );
-    gnw_emitCommandPacket( getRouterFD(), GNW_COMMAND, reqBuffer, 5 );
+    emitRouterPacket( GNW_COMMAND, 0, reqBuffer, 5 );
     
     return realAddress;
 }
@@ -364,12 +689,12 @@ int fd_is_valid(int fd)
     return fcntl(fd, F_GETFD) != -1 || errno != EBADF;
 }
 
-void handleDataPacket( gnw_header_t * header, uint8_t * payload ) {
+void deliverData( gnw_address_t source, uint8_t * payload, size_t length ) {
     // Node: IN -> DEMUX -> PROCESS -> MUX -> OUT
 
     // Are we in 'output mode' (or otherwise echo'ing)?
     if( config.arg_echo ) {
-        for (int i = 0; i < header->length; i++) {
+        for (size_t i = 0; i < length; i++) {
             // Note: using putc here to avoid issues with null terminators and non-printable streams
             putc(*(payload + i), stdout);
         }
@@ -378,23 +703,73 @@ void handleDataPacket( gnw_header_t * header, uint8_t * payload ) {
     }
 
     // Mangle the source address if we're configured to do so.
-    header->source = applyDeMuxPolicy( header->source );
+    source = applyDeMuxPolicy( source );
 
     // Look up whoever this is.
-    khint_t hint = kh_get( gnw_address_t, sinkTable, header->source );
+    khint_t hint = kh_get( gnw_address_t, sinkTable, source );
     if( hint == kh_end( sinkTable ) ) {
         // Note: Should actually spawn stuff here
-        log_error( "No such address %08x, but the router seems to think we are it? Dropped packet.", header->source );
+        log_error( "No such address %08x, but the router seems to think we are it? Dropped packet.", source );
         return;
     }
 
     // At this point, we'd expect that the hint points to actual data.
     sink_context_t * context = &kh_value( sinkTable, hint );
-    write( PIPE_WRITE(context->wrap_stdin), payload, header->length );
+    write( PIPE_WRITE(context->wrap_stdin), payload, length );
 
     // Update the stats!
     context->packets_in++;
-    context->bytes_in += header->length;
+    context->bytes_in += length;
+}
+
+void handleDataPacket( gnw_header_t * header, uint8_t * payload ) {
+    // The number is only there to keep the message's place, it never reaches the wrapped process
+    if( header->type & GNW_SEQUENCED ) {
+        if( header->length < sizeof(uint32_t) ) {
+            log_warn( "Sequenced frame from %08x is too short, dropped", header->source );
+            return;
+        }
+
+        uint32_t sequence = 0;
+        payload = packet_read_u32( payload, &sequence );
+        header->length -= sizeof(uint32_t);
+
+        if( config.arg_sequence && (header->type & GNW_MORE) == 0 )
+            kdq_push( uint32_t, sequenceCarried, sequence );
+    }
+
+    khint_t hint = kh_get( partial, partialMessages, header->source );
+
+    // Whole messages go straight through
+    if( (header->type & GNW_MORE) == 0 && hint == kh_end( partialMessages ) ) {
+        deliverData( header->source, payload, header->length );
+        return;
+    }
+
+    // Fragments are held until the message is complete, so messages from different sources never interleave
+    if( hint == kh_end( partialMessages ) ) {
+        int status;
+        hint = kh_put( partial, partialMessages, header->source, &status );
+        kv_init( kh_value( partialMessages, hint ) );
+    }
+
+    partial_message_t * message = &kh_value( partialMessages, hint );
+    size_t needed = kv_size( *message ) + header->length;
+    if( needed > kv_max( *message ) ) {
+        size_t grown = kv_max( *message ) * 2;
+        kv_resize( uint8_t, *message, grown > needed ? grown : needed );
+    }
+    memcpy( message->a + kv_size( *message ), payload, header->length );
+    message->n += header->length;
+
+    if( header->type & GNW_MORE )
+        return;
+
+    partial_message_t complete = *message;
+    kh_del( partial, partialMessages, hint );
+
+    deliverData( header->source, complete.a, kv_size( complete ) );
+    kv_destroy( complete );
 }
 
 void handleCommandPacket( gnw_header_t * header, uint8_t * payload ) {
@@ -419,6 +794,80 @@ void handleCommandPacket( gnw_header_t * header, uint8_t * payload ) {
             }
             break;
 
+        case GNW_CMD_SHM_LINK: {
+            uint8_t accepted = 0;
+            if( header->length > 1 )
+                next = packet_read_u8( next, &accepted );
+
+            if( !accepted ) {
+                log_warn( "Router declined the shared-memory link, staying on the socket" );
+                shmlink_destroy( &router_link );
+                break;
+            }
+
+            // Everything the router sent over the socket before this is already handled, so switch over
+            log_info( "Router accepted the shared-memory link" );
+            router_link_active = true;
+            addNewWatch( router_link.bell );
+        } break;
+
+        case GNW_CMD_CUT_THROUGH: {
+            uint8_t op = 0;
+            gnw_address_t source = 0;
+            if( header->length < 6 )
+                break;
+            next = packet_read_u8( next, &op );
+            next = packet_read_u32( next, &source );
+
+            int status;
+            khint_t hint;
+            switch( op ) {
+                case GNW_CUT_SEND:
+                    // Always answer with the marker, even without a link, so the router isn't left waiting
+                    if( passedFd != -1 ) {
+                        closeDirectOut( source );
+                        hint = kh_put( direct, directOut, source, &status );
+                        kh_value( directOut, hint ) = (direct_link_t){ .fd = passedFd };
+                        passedFd = -1;
+                        log_info( "Sending %08x directly to its target", source );
+                    }
+                    else
+                        log_warn( "Router offered a direct link for %08x without a descriptor", source );
+
+                    unsigned char marker[6] = { 0 };
+                    uint8_t * ptr = packet_write_u8( marker, GNW_CMD_CUT_THROUGH );
+                    ptr = packet_write_u8( ptr, GNW_CUT_SWITCHED );
+                    ptr = packet_write_u32( ptr, source );
+                    emitRouterPacket( GNW_COMMAND, 0, marker, ptr - marker );
+                    break;
+
+                case GNW_CUT_RECEIVE:
+                    if( passedFd == -1 ) {
+                        log_warn( "Router passed a direct link from %08x without a descriptor", source );
+                        break;
+                    }
+
+                    // A replacement link only starts once the old one has been read dry
+                    if( kh_get( direct, directIn, source ) != kh_end( directIn ) )
+                        drainDirectIn( source );
+
+                    hint = kh_put( direct, directIn, source, &status );
+                    kh_value( directIn, hint ) = (direct_link_t){ .fd = passedFd };
+                    addNewWatch( passedFd );
+                    passedFd = -1;
+                    log_info( "Receiving %08x directly", source );
+                    break;
+
+                case GNW_CUT_CLOSE:
+                    log_info( "Sending %08x through the router again", source );
+                    closeDirectOut( source );
+                    break;
+
+                default:
+                    log_warn( "Unknown cut-through operation %02x", op );
+            }
+        } break;
+
         default:
             log_warn( "Unknown command response? (%u)", (unsigned char)(*payload) );
             break;
@@ -428,7 +877,7 @@ void handleCommandPacket( gnw_header_t * header, uint8_t * payload ) {
 void handlePacket( gnw_header_t * header, uint8_t * payload ) {
     uint8_t * ptr = payload;
 
-    switch( header->type ) {
+    switch( GNW_FRAME_TYPE( header->type ) ) {
 
         // Data stuff
         case GNW_DATA: handleDataPacket( header, payload ); break;
@@ -444,11 +893,142 @@ void handlePacket( gnw_header_t * header, uint8_t * payload ) {
     }
 }
 
+void handleRemoteFrames( framebuffer_t * buffer, bool routed );
+
+/**
+ * Stop watching 'fd' in the main poll loop.
+ */
+void dropWatch( int fd ) {
+    for( int index = 0; index < MAX_INPUT_STREAMS; index++ ) {
+        if( stream_fd[index].fd == fd ) {
+            stream_fd[index].fd = IGNORE_FD;
+            stream_fd[index].revents = 0;
+        }
+    }
+}
+
+/**
+ * The router is sending us frames from 'source' again, so its direct link has been closed at the
+ * far end. Read out whatever is left on it first, so nothing is overtaken.
+ */
+void drainDirectIn( gnw_address_t source ) {
+    khint_t hint = kh_get( direct, directIn, source );
+    int fd = kh_value( directIn, hint ).fd;
+    kh_del( direct, directIn, hint );
+    dropWatch( fd );
+
+    // Take the link's buffer out of the table, as the caller is still reading from another one in there
+    framebuffer_t buffer;
+    khint_t bufferHint = kh_get( int, input_buffer, fd );
+    if( bufferHint != kh_end( input_buffer ) ) {
+        buffer = kh_value( input_buffer, bufferHint );
+        kh_del( int, input_buffer, bufferHint );
+    }
+    else
+        framebuffer_init( &buffer, config.network_mtu * 20 );
+
+    while( true ) {
+        size_t capacity = 0;
+        uint8_t * target = framebuffer_reserve( &buffer, &capacity );
+        ssize_t actualRead = read( fd, target, capacity );
+        if( actualRead < 0 && errno == EINTR )
+            continue;
+        if( actualRead < 1 )
+            break;
+
+        framebuffer_commit( &buffer, actualRead );
+        handleRemoteFrames( &buffer, false );
+    }
+
+    log_info( "Direct link from %08x closed", source );
+    framebuffer_destroy( &buffer );
+    close( fd );
+}
+
+/**
+ * Parse and handle every complete frame in a buffer of data from the router, or from a direct link.
+ *
+ * @param buffer The received data
+ * @param routed True if this came from the router
+ */
+void handleRemoteFrames( framebuffer_t * buffer, bool routed ) {
+    // While we have data on the buffer, try and parse it!
+    uint64_t discarded = buffer->discarded;
+    uint8_t * frame = NULL;
+    while( framebuffer_next( buffer, &frame ) > 0 ) {
+        gnw_header_t header = { 0 };
+        uint8_t * payload = gnw_parse_header( frame, &header );
+
+        if( routed && GNW_FRAME_TYPE( header.type ) == GNW_DATA && kh_size( directIn ) > 0 &&
+            kh_get( direct, directIn, header.source ) != kh_end( directIn ) )
+            drainDirectIn( header.source );
+
+        /*fprintf( stderr, "PKT>>>" );
+        gnw_dumpPacket( stderr, frame, 11 + header.length ); // DEBUG*/
+
+        // Pass on to the packet handler, straight out of the buffer - nothing here writes to it
+        handlePacket( &header, payload );
+    }
+
+    if( buffer->discarded != discarded )
+        log_warn( "Network desync, skipped %lu bytes to resync", buffer->discarded - discarded );
+
+    // A partial frame filling the whole buffer can never complete, so drop it rather than wedge
+    if( framebuffer_length( buffer ) == buffer->capacity ) {
+        log_error( "Frame larger than the input buffer, discarded %lu bytes", framebuffer_length( buffer ) );
+        framebuffer_clear( buffer );
+    }
+}
+
+/**
+ * @return The source address writing to us over the direct link 'fd', or 0 if it isn't one
+ */
+gnw_address_t directSource( int fd ) {
+    for( khint_t iter = kh_begin( directIn ); iter != kh_end( directIn ); iter++ ) {
+        if( kh_exist( directIn, iter ) && kh_value( directIn, iter ).fd == fd )
+            return kh_key( directIn, iter );
+    }
+    return 0;
+}
+
 void handleRemoteData( int * fd, int * shutdown, unsigned int events ) {
-    local_buffer_t * buffer = getLocalBuffer( *fd );
+    framebuffer_t * buffer = getLocalBuffer( *fd );
+
+    size_t capacity = 0;
+    uint8_t * target = framebuffer_reserve( buffer, &capacity );
+
+    // The router may pass a descriptor along with a command, keep it for the command to claim
+    union {
+        struct cmsghdr align;
+        uint8_t space[CMSG_SPACE( sizeof(int) )];
+    } control;
+    struct iovec iov = { .iov_base = target, .iov_len = capacity };
+    struct msghdr message = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = &control, .msg_controllen = sizeof control };
+
+    ssize_t actualRead = recvmsg( *fd, &message, MSG_CMSG_CLOEXEC );
+    if( actualRead == -1 && errno == ENOTSOCK )
+        actualRead = read( *fd, target, capacity );
+    else if( actualRead > 0 ) {
+        for( struct cmsghdr * cmsg = CMSG_FIRSTHDR( &message ); cmsg != NULL; cmsg = CMSG_NXTHDR( &message, cmsg ) ) {
+            if( cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS )
+                continue;
+
+            if( passedFd != -1 )
+                close( passedFd );
+            memcpy( &passedFd, CMSG_DATA( cmsg ), sizeof(int) );
+        }
+    }
 
-    size_t capacity = (config.network_mtu * 20) - (buffer->tail - buffer->head);
-    ssize_t actualRead = read( *fd, buffer->tail, capacity );
+    // A direct link closing is normal, its source has gone back to the router
+    gnw_address_t source = 0;
+    if( actualRead < 1 && *fd != getRouterFD() && (source = directSource( *fd )) != 0 ) {
+        log_info( "Direct link from %08x closed", source );
+        kh_del( direct, directIn, kh_get( direct, directIn, source ) );
+        destroyLocalBuffer( *fd );
+        close( *fd );
+        *fd = -1;
+        return;
+    }
 
     // Did the read fail?
     if( actualRead < 1 ) {
@@ -466,44 +1046,39 @@ void handleRemoteData( int * fd, int * shutdown, unsigned int events ) {
 
     // Otherwise, the read should have worked, update the tail pointer
     assert( actualRead > 0, "Read worked but total bytes was negaive! This should never happen!" );
-    buffer->tail += actualRead;
-    
-    // While we have data on the buffer, try and parse it!
-    ssize_t readyBytes = 0;
-    while( (readyBytes = gnw_nextPacket( buffer->head, buffer->tail - buffer->head )) != 0 ) {
-        // Are we in some invalid buffer state?
-        if( readyBytes < 0 ) {
-            log_warn( "Network desync, attempting to resync... (Err = %d)", readyBytes );
-            // Dump a byte, try to clear the buffer and re-try.
-            packet_shift( buffer->head, config.network_mtu * 20, NULL, 1 );
-            buffer->tail--;
-            continue;
-        }
+    framebuffer_commit( buffer, actualRead );
+    handleRemoteFrames( buffer, *fd == getRouterFD() );
+}
 
-        gnw_header_t header = { 0 };
-        uint8_t * ptr = gnw_parse_header( buffer->head, &header );
+/**
+ * The router rang our link bell, so pull everything waiting in the ring.
+ */
+void handleLinkData() {
+    shmlink_clear( &router_link );
 
-        /*fprintf( stderr, "PKT>>>" );
-        gnw_dumpPacket( stderr, buffer->head, readyBytes ); // DEBUG*/
+    // Separate from the socket's buffer, as replies can still arrive there mid-frame on the link
+    framebuffer_t * buffer = getLocalBuffer( router_link.bell );
 
-        // Safety buffer, so we can't accidentally trash the main one
-        uint8_t payload[11 + header.length];
-        memcpy( payload, ptr, header.length );
+    while( true ) {
+        size_t capacity = 0;
+        uint8_t * target = framebuffer_reserve( buffer, &capacity );
+        ssize_t actualRead = shmlink_read( &router_link, target, capacity );
+        assert( actualRead != -1, "Shared-memory link from the router is corrupt, STOP." );
 
-        // Shift (read) out, and update the pointers.
-        packet_shift( buffer->head, config.network_mtu * 20, NULL, 11 + header.length );
-        buffer->tail -= 11 + header.length;
+        if( actualRead == 0 )
+            return;
 
-        // Pass on to the packet handler
-        handlePacket( &header, payload );
+        framebuffer_commit( buffer, actualRead );
+        handleRemoteFrames( buffer, true );
     }
 }
 
 void handleLocalData( int * fd, int * shutdown, unsigned int events ) {
-    local_buffer_t * buffer = getLocalBuffer( *fd );
+    framebuffer_t * buffer = getLocalBuffer( *fd );
 
-    size_t capacity = (config.network_mtu * 20) - (buffer->tail - buffer->head);
-    ssize_t actualRead = read( *fd, buffer->tail, capacity );
+    size_t capacity = 0;
+    uint8_t * target = framebuffer_reserve( buffer, &capacity );
+    ssize_t actualRead = read( *fd, target, capacity );
 
     // Did the read fail?
     if( actualRead < 1 ) {
@@ -535,28 +1110,25 @@ void handleLocalData( int * fd, int * shutdown, unsigned int events ) {
         return;
     }
 
-    buffer->tail += actualRead;
-    size_t remainingCapacity = (config.network_mtu * 20) - (buffer->tail - buffer->head);
+    framebuffer_commit( buffer, actualRead );
+    size_t remainingCapacity = buffer->capacity - framebuffer_length( buffer );
 
     // Are we essentially full?
     if( remainingCapacity < config.network_mtu ) {
-        // Emergency send! About to blow off the end of the buffer!
-        gnw_emitDataPacket( router_fd, applyMuxPolicy(config.arg_address), buffer->head, buffer->tail );
-        buffer->tail = buffer->head;
+        // Emergency send! About to blow off the end of the buffer! The record isn't finished, so it is sent as a
+        // fragment, and the rest follows as more fragments of the same message
+        emitRouterData( applyMuxPolicy(config.arg_address), framebuffer_data( buffer ), framebuffer_length( buffer ), true );
+        framebuffer_clear( buffer );
         return;
     }
 
-    uint8_t * cursor = buffer->head;
-    while( cursor < buffer->tail ) {
-        if( *cursor == config.arg_delimiter ) {
-            gnw_emitDataPacket( router_fd, applyMuxPolicy(config.arg_address), buffer->head, cursor - buffer->head );
-            assert( cursor - buffer->head <= config.network_mtu * 20, "Cursor blew off the end of the local buffer!" );
-            packet_shift( buffer->head, config.network_mtu * 20, NULL, cursor - buffer->head );
-            buffer->tail -= cursor - buffer->head;
-            cursor = buffer->head;
-
-        }
-        cursor++;
+    // Each record runs up to (not including) the next delimiter, which then leads the following record
+    uint8_t * delimiter = NULL;
+    while( framebuffer_length( buffer ) > 1 &&
+           (delimiter = memchr( framebuffer_data( buffer ) + 1, config.arg_delimiter, framebuffer_length( buffer ) - 1 )) != NULL ) {
+        size_t length = delimiter - framebuffer_data( buffer );
+        emitRouterPacket( GNW_DATA, applyMuxPolicy(config.arg_address), framebuffer_data( buffer ), length );
+        framebuffer_consume( buffer, length );
     }
 }
 
@@ -577,8 +1149,10 @@ typedef struct {
 #define ARG_IMMEDIATE  9
 #define ARG_VERSION    10
 #define ARG_DELIMITER  11
-#define ARG_LOCALMASK  12
-#define ARG_QUIET      13
+#define ARG_ZEROCOPY   12
+#define ARG_SEQUENCE   13
+#define ARG_LOCALMASK  14
+#define ARG_QUIET      15
 
 int main(int argc, char ** argv ) {
     // Prevent the kernel from hanging on to our child processes later on
@@ -613,6 +1187,10 @@ int main(int argc, char ** argv ) {
     // Configure local structures...
     sinkTable = kh_init( gnw_address_t );
     input_buffer = kh_init( int );
+    directOut = kh_init( direct );
+    directIn = kh_init( direct );
+    partialMessages = kh_init( partial );
+    sequenceCarried = kdq_init( uint32_t );
 
 
     // Following pragma block is just to prevent gcc complaining about mismatched braces in this structure
@@ -632,6 +1210,8 @@ int main(int argc, char ** argv ) {
             [ARG_IMMEDIATE]  = { .name="immediate", .has_arg=no_argument,       .flag=NULL },
             [ARG_VERSION]    = { .name="version",   .has_arg=no_argument,       .flag=NULL },
             [ARG_DELIMITER]  = { .name="delim",     .has_arg=required_argument, .flag=NULL },
+            [ARG_ZEROCOPY]   = { .name="zerocopy",  .has_arg=required_argument, .flag=NULL },
+            [ARG_SEQUENCE]   = { .name="sequence",  .has_arg=no_argument,       .flag=NULL },
             0
     };
     // Purely so descriptions and arguments are managed together in the same block - this could be done purely in the --help/--usage
@@ -639,7 +1219,7 @@ int main(int argc, char ** argv ) {
     short_args_description_t shortOptions[] = {
         [ARG_HELP]      = { .arg=NULL, .description="Show this help message." },
         [ARG_USAGE]     = { .arg=NULL, .description="Show this help message." },
-        [ARG_HOST]      = { .arg="h",  .description="Specify a GraphRouter host address (defaults to localhost)." },
+        [ARG_HOST]      = { .arg="h",  .description="Specify a GraphRouter host address (defaults to localhost), or 'unix[:path]' / 'seqpacket[:path]' for a local socket, or 'shm[:path]' to move onto a shared-memory link once connected." },
         [ARG_PORT]      = { .arg="p",  .description="Specify a GraphRouter port." },
         [ARG_ADDRESS]   = { .arg="a",  .description="The (requested) hexadecimal node address, may not be respected by the router. Cannot be 0." },
         [ARG_INPUT]     = { .arg="i",  .description="Run in input bridge mode; take and input on stdin and forward to the GraphRouter." },
@@ -649,6 +1229,8 @@ int main(int argc, char ** argv ) {
         [ARG_IMMEDIATE] = { .arg=NULL, .description="Start running the inner binary immediately. By default wrapped processes are only started on demand when data arrives." },
         [ARG_VERSION]   = { .arg=NULL, .description="Report which version this program is, then exit." },
         [ARG_DELIMITER] = { .arg="d",  .description="Configure the packet delimiter, if unspecified, will default to the unix string newline '\\n'." },
+        [ARG_ZEROCOPY]  = { .arg=NULL, .description="Send data messages of at least this many bytes to a TCP router with MSG_ZEROCOPY, rather than copying them into the kernel. Off by default." },
+        [ARG_SEQUENCE]  = { .arg=NULL, .description="Stamp every message sent with a sequence number, for a router merge policy to put back in order. Records produced from stamped messages keep their number, others are counted from 0. Disables --zerocopy." },
         0
     };
 #pragma GCC diagnostic pop
@@ -797,6 +1379,14 @@ int main(int argc, char ** argv ) {
                 printf( "Delimiter = '%c'\n", config.arg_delimiter );
                 break;
 
+            case ARG_ZEROCOPY:
+                config.arg_zerocopy = (size_t)strtoul( optarg, NULL, 10 );
+                break;
+
+            case ARG_SEQUENCE:
+                config.arg_sequence = true;
+                break;
+
             case 'v':
                 config.arg_verbosity++;
 
@@ -910,8 +1500,13 @@ int main(int argc, char ** argv ) {
             for( int index = 0; index < MAX_INPUT_STREAMS; index++ ) {
                 if( stream_fd[index].revents != 0 ) {
 
-                    // Is this from the router?
-                    if( stream_fd[index].fd == getRouterFD() ) {
+                    // Is this the router, over the shared-memory link?
+                    if( router_link_active && stream_fd[index].fd == router_link.bell ) {
+                        handleLinkData();
+                        stream_fd[index].revents = 0;
+                    }
+                    // Is this from the router, or straight from another node?
+                    else if( stream_fd[index].fd == getRouterFD() || (kh_size( directIn ) > 0 && directSource( stream_fd[index].fd ) != 0) ) {
                         handleRemoteData( &(stream_fd[index].fd), &status, stream_fd[index].revents );
                         stream_fd[index].revents = 0;
                     }
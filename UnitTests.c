@@ -20,6 +20,17 @@
 #include "lib/GraphNetwork.h"
 #include "lib/packet.h"
 #include "lib/RingBuffer.h"
+#include "lib/Mailbox.h"
+#include "lib/Snapshot.h"
+#include "lib/Resequencer.h"
+#include "lib/Combiner.h"
+#include "lib/Affinity.h"
+#include "lib/FrameBuffer.h"
+#include "lib/ShmLink.h"
+#include "lib/Fanout.h"
+#include "lib/PacketBuffer.h"
+#include "lib/BufferPool.h"
+#include "lib/Histogram.h"
 #include "lib/utility.h"
 #include "Log.h"
 #include <arpa/inet.h>
@@ -28,6 +39,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
 #include "lib/klib/khash.h"
 #include "lib/klib/kvec.h"
 
@@ -105,6 +124,798 @@ void test_ring_buffer() {
     return;
 }
 
+#define MAILBOX_TEST_ITEMS 100000
+
+void * mailbox_producer( void * arg ) {
+    mailbox_t * mailbox = (mailbox_t *)arg;
+    for( uintptr_t i=1; i<=MAILBOX_TEST_ITEMS; i++ ) {
+        while( !mailbox_push( mailbox, (void *)i ) )
+            ; // Spin until the consumer makes room
+    }
+    return NULL;
+}
+
+void test_mailbox() {
+    mailbox_t mailbox;
+    assert( mailbox_init( &mailbox, 100 ), "Unable to create a mailbox" );
+    assertEqual( mailbox.mask + 1, 128 );
+    assert( mailbox_pop( &mailbox ) == NULL, "New mailbox was not empty" );
+
+    for( uintptr_t i=1; i<=128; i++ )
+        assert( mailbox_push( &mailbox, (void *)i ), "Mailbox refused an item before it was full" );
+    assert( !mailbox_push( &mailbox, (void *)1 ), "Mailbox accepted an item while full" );
+    assertEqual( mailbox_length( &mailbox ), 128 );
+
+    for( uintptr_t i=1; i<=128; i++ )
+        assertEqual( (uintptr_t)mailbox_pop( &mailbox ), i );
+    assert( mailbox_pop( &mailbox ) == NULL, "Drained mailbox was not empty" );
+
+    // Ordering across threads, with the ring wrapping many times over
+    pthread_t producer;
+    pthread_create( &producer, NULL, mailbox_producer, &mailbox );
+
+    uintptr_t expect = 1;
+    while( expect <= MAILBOX_TEST_ITEMS ) {
+        void * item = mailbox_pop( &mailbox );
+        if( item == NULL )
+            continue;
+        assertEqual( (uintptr_t)item, expect );
+        expect++;
+    }
+    pthread_join( producer, NULL );
+
+    assert( mailbox_pop( &mailbox ) == NULL, "Mailbox held extra items after the transfer" );
+    mailbox_destroy( &mailbox );
+}
+
+#define SHMLINK_TEST_BYTES (16 * 1024 * 1024)
+
+bool shmlink_rung( int bell ) {
+    struct pollfd check = { .fd = bell, .events = POLLIN };
+    return poll( &check, 1, 0 ) == 1;
+}
+
+void * shmlink_producer( void * arg ) {
+    shmlink_t * link = (shmlink_t *)arg;
+    uint8_t chunk[1000];
+    uint32_t next = 0;
+
+    size_t sent = 0;
+    while( sent < SHMLINK_TEST_BYTES ) {
+        size_t length = SHMLINK_TEST_BYTES - sent < sizeof chunk ? SHMLINK_TEST_BYTES - sent : sizeof chunk;
+        for( size_t i = 0; i < length; i++ )
+            chunk[i] = (uint8_t)(next + i);
+
+        size_t offset = 0;
+        while( offset < length ) {
+            ssize_t written = shmlink_write( link, chunk + offset, length - offset );
+            assert( written >= 0, "Shared-memory ring reported corruption" );
+            offset += written;
+        }
+        next += length;
+        sent += length;
+    }
+    return NULL;
+}
+
+#define SNAPSHOT_TEST_COPIES 20000
+#define SNAPSHOT_TEST_READERS 2
+
+typedef struct {
+    uint64_t value;
+    bool released;
+} snapshot_copy_t;
+
+// Copies are never really freed, just marked, so a reader can tell if it was handed one too early
+snapshot_copy_t snapshot_copies[SNAPSHOT_TEST_COPIES + 1];
+
+typedef struct {
+    snapshot_t * snapshot;
+    size_t index;
+} snapshot_reader_arg_t;
+
+void snapshot_test_release( void * value ) {
+    __atomic_store_n( &((snapshot_copy_t *)value)->released, true, __ATOMIC_RELAXED );
+}
+
+void * snapshot_reader( void * arg ) {
+    snapshot_reader_arg_t * reader = (snapshot_reader_arg_t *)arg;
+
+    uint64_t last = 0;
+    while( last < SNAPSHOT_TEST_COPIES ) {
+        snapshot_copy_t * copy = (snapshot_copy_t *)snapshot_acquire( reader->snapshot, reader->index );
+        if( copy == NULL )
+            continue;
+
+        // Use it for a while, it must stay put until we fetch again
+        for( int i = 0; i < 16; i++ )
+            assert( !__atomic_load_n( &copy->released, __ATOMIC_RELAXED ), "Snapshot released while a reader held it" );
+        assert( copy->value >= last, "Snapshot went backwards" );
+        last = copy->value;
+
+        // Copy i is generation i, and the reader has to report exactly the one it holds
+        assertEqual( __atomic_load_n( &reader->snapshot->readers[reader->index].generation, __ATOMIC_RELAXED ), copy->value );
+    }
+    return NULL;
+}
+
+void test_snapshot() {
+    snapshot_t snapshot;
+    memset( snapshot_copies, 0, sizeof snapshot_copies );
+    assert( snapshot_init( &snapshot, SNAPSHOT_TEST_READERS, snapshot_test_release ), "Unable to create a snapshot" );
+    assert( snapshot_acquire( &snapshot, 0 ) == NULL, "New snapshot was not empty" );
+    assertEqual( snapshot_generation( &snapshot ), 0 );
+
+    snapshot_publish( &snapshot, &snapshot_copies[1] );
+    assertEqual( snapshot_generation( &snapshot ), 1 );
+    assert( snapshot_acquire( &snapshot, 0 ) == &snapshot_copies[1], "Reader did not see the published copy" );
+
+    // The first copy has to wait for both readers to move on
+    snapshot_publish( &snapshot, &snapshot_copies[2] );
+    assertEqual( snapshot_reclaim( &snapshot ), 1 );
+    assert( snapshot_acquire( &snapshot, 1 ) == &snapshot_copies[2], "Reader did not see the replacement" );
+    assertEqual( snapshot_reclaim( &snapshot ), 1 );
+    assert( !snapshot_copies[1].released, "Copy released while a reader could still hold it" );
+
+    assert( snapshot_acquire( &snapshot, 0 ) == &snapshot_copies[2], "Reader did not see the replacement" );
+    assertEqual( snapshot_reclaim( &snapshot ), 0 );
+    assert( snapshot_copies[1].released, "Copy was not released once every reader moved on" );
+
+    snapshot_destroy( &snapshot );
+    assert( snapshot_copies[2].released, "Destroying the snapshot did not release the current copy" );
+
+    // Readers racing a writer that replaces the copy as fast as it can
+    memset( snapshot_copies, 0, sizeof snapshot_copies );
+    assert( snapshot_init( &snapshot, SNAPSHOT_TEST_READERS, snapshot_test_release ), "Unable to create a snapshot" );
+
+    pthread_t threads[SNAPSHOT_TEST_READERS];
+    snapshot_reader_arg_t readers[SNAPSHOT_TEST_READERS];
+    for( size_t i = 0; i < SNAPSHOT_TEST_READERS; i++ ) {
+        readers[i] = (snapshot_reader_arg_t){ .snapshot = &snapshot, .index = i };
+        pthread_create( &threads[i], NULL, snapshot_reader, &readers[i] );
+    }
+
+    for( uint64_t i = 1; i <= SNAPSHOT_TEST_COPIES; i++ ) {
+        snapshot_copies[i].value = i;
+        snapshot_publish( &snapshot, &snapshot_copies[i] );
+    }
+
+    for( size_t i = 0; i < SNAPSHOT_TEST_READERS; i++ )
+        pthread_join( threads[i], NULL );
+
+    // Both readers finished on the last copy, so everything before it can go
+    assertEqual( snapshot_reclaim( &snapshot ), 0 );
+    for( uint64_t i = 1; i < SNAPSHOT_TEST_COPIES; i++ )
+        assert( snapshot_copies[i].released, "Retired copy was never released" );
+    assert( !snapshot_copies[SNAPSHOT_TEST_COPIES].released, "Current copy was released" );
+
+    snapshot_destroy( &snapshot );
+}
+
+int reseq_test_released = 0;
+
+void reseq_test_release( void * part ) {
+    reseq_test_released++;
+}
+
+void test_resequencer() {
+    reseq_t reseq;
+    int parts[16];
+    reseq_test_released = 0;
+    assert( reseq_init( &reseq, 4, reseq_test_release ), "Unable to create a resequencer" );
+
+    // Out of order in, in order out
+    assertEqual( reseq_insert( &reseq, 1, &parts[1], true ), RESEQ_HELD );
+    assertEqual( reseq_insert( &reseq, 2, &parts[2], true ), RESEQ_HELD );
+    assert( reseq_pop( &reseq ) == NULL, "Released a message ahead of a missing one" );
+    assert( reseq_waiting( &reseq ), "Not waiting on the missing message" );
+    assertEqual( reseq_insert( &reseq, 0, &parts[0], true ), RESEQ_HELD );
+    for( int i = 0; i < 3; i++ )
+        assert( reseq_pop( &reseq ) == &parts[i], "Message released out of order" );
+    assert( reseq_pop( &reseq ) == NULL, "Released a message that never arrived" );
+    assert( !reseq_waiting( &reseq ), "Still waiting once everything was released" );
+
+    // Fragments come out together once the last is in, and a number already released is late
+    assertEqual( reseq_insert( &reseq, 3, &parts[3], false ), RESEQ_HELD );
+    assert( reseq_pop( &reseq ) == NULL, "Released an unfinished message" );
+    assertEqual( reseq_insert( &reseq, 3, &parts[4], true ), RESEQ_HELD );
+    assert( reseq_pop( &reseq ) == &parts[3], "First fragment not released first" );
+    assert( reseq_pop( &reseq ) == &parts[4], "Last fragment not released last" );
+    assertEqual( reseq_insert( &reseq, 2, &parts[2], true ), RESEQ_LATE );
+    assertEqual( reseq.late, 1 );
+
+    // Beyond the window has to wait for room, which giving up on the gap makes
+    assertEqual( reseq_insert( &reseq, 5, &parts[5], true ), RESEQ_HELD );
+    assertEqual( reseq_insert( &reseq, 8, &parts[8], true ), RESEQ_AHEAD );
+    assertEqual( reseq_skip( &reseq ), 1 );
+    assert( reseq_pop( &reseq ) == &parts[5], "Message behind a skipped gap not released" );
+    assertEqual( reseq_insert( &reseq, 8, &parts[8], true ), RESEQ_HELD );
+
+    // An unfinished message that is given up on is dropped
+    assertEqual( reseq_insert( &reseq, 6, &parts[6], false ), RESEQ_HELD );
+    assertEqual( reseq_skip( &reseq ), 2 );
+    assertEqual( reseq_test_released, 1 );
+    assert( reseq_pop( &reseq ) == &parts[8], "Message behind an unfinished one not released" );
+    assertEqual( reseq.skipped, 3 );
+
+    // With nothing held, the window just jumps ahead, and numbering can start again
+    assertEqual( reseq_insert( &reseq, 100, &parts[9], true ), RESEQ_HELD );
+    assert( reseq_pop( &reseq ) == &parts[9], "Message after a jump not released" );
+    assertEqual( reseq_insert( &reseq, 0, &parts[10], true ), RESEQ_RESTART );
+    reseq_restart( &reseq, 0 );
+    assertEqual( reseq_insert( &reseq, 0, &parts[10], true ), RESEQ_HELD );
+    assert( reseq_pop( &reseq ) == &parts[10], "Message after a restart not released" );
+    assertEqual( reseq.released, 8 );
+
+    // Anything still held is released on destroy
+    assertEqual( reseq_insert( &reseq, 2, &parts[11], true ), RESEQ_HELD );
+    assertEqual( reseq_insert( &reseq, 3, &parts[12], false ), RESEQ_HELD );
+    reseq_destroy( &reseq );
+    assertEqual( reseq_test_released, 3 );
+}
+
+void test_combiner() {
+    combiner_t combiner;
+    uint8_t round[64];
+    uint32_t sources[] = { 0x30, 0x10, 0x20 };
+    combiner_init( &combiner, 2 );
+    assert( combiner_inputs( &combiner, sources, 3 ), "Unable to set the combiner's inputs" );
+    assert( !combiner_ready( &combiner ) && !combiner_waiting( &combiner ), "An empty combiner has something waiting" );
+
+    // Inputs are taken in source order, whatever order their messages arrive in
+    int first = combiner_find( &combiner, 0x10 ), second = combiner_find( &combiner, 0x20 ), third = combiner_find( &combiner, 0x30 );
+    assertEqual( first, 0 );
+    assertEqual( third, 2 );
+    assertEqual( combiner_find( &combiner, 0x40 ), -1 );
+
+    assert( combiner_add( &combiner, third, (uint8_t *)"c", 1, true ), "Message not queued" );
+    assert( combiner_add( &combiner, first, (uint8_t *)"a", 1, false ), "Fragment not kept" );
+    assert( combiner_add( &combiner, first, (uint8_t *)"A", 1, true ), "Message not queued" );
+    assert( combiner_waiting( &combiner ), "Not waiting on the missing input" );
+    assert( combiner_add( &combiner, second, (uint8_t *)"bb", 2, true ), "Message not queued" );
+    assert( combiner_ready( &combiner ), "Not ready with every input present" );
+
+    assertEqual( combiner_length( &combiner, COMBINE_CONCAT ), 5 );
+    combiner_take( &combiner, COMBINE_CONCAT, round );
+    assert( memcmp( round, "aAbbc", 5 ) == 0, "Round not concatenated in source order" );
+    assert( !combiner_ready( &combiner ) && !combiner_waiting( &combiner ), "Round not taken off the queues" );
+
+    // A partial round leaves the missing input empty, and a tuple still has a slot for it
+    assert( combiner_add( &combiner, first, (uint8_t *)"xy", 2, true ), "Message not queued" );
+    assert( combiner_add( &combiner, third, (uint8_t *)"z", 1, true ), "Message not queued" );
+    assertEqual( combiner_length( &combiner, COMBINE_TUPLE ), 4 + 3 * 4 + 3 );
+    combiner_take( &combiner, COMBINE_TUPLE, round );
+    uint32_t value = 0;
+    uint8_t * ptr = packet_read_u32( round, &value );
+    assertEqual( value, 3 );
+    ptr = packet_read_u32( ptr, &value );
+    assertEqual( value, 2 );
+    assert( memcmp( ptr, "xy", 2 ) == 0, "First tuple element wrong" );
+    ptr = packet_read_u32( ptr + 2, &value );
+    assertEqual( value, 0 );
+    ptr = packet_read_u32( ptr, &value );
+    assertEqual( value, 1 );
+    assert( *ptr == 'z', "Last tuple element wrong" );
+    assertEqual( combiner.rounds, 1 );
+    assertEqual( combiner.partial, 1 );
+
+    // Each input holds at most 'depth' messages
+    assert( combiner_add( &combiner, first, (uint8_t *)"1", 1, true ), "Message not queued" );
+    assert( combiner_add( &combiner, first, (uint8_t *)"2", 1, true ), "Message not queued" );
+    assert( combiner_full( &combiner, first ), "Input not full at its depth" );
+    assert( !combiner_add( &combiner, first, (uint8_t *)"3", 1, true ), "Message queued past the depth" );
+    assertEqual( combiner.dropped, 1 );
+
+    // Changing the inputs keeps what the remaining ones hold
+    uint32_t replaced[] = { 0x50, 0x10 };
+    assert( combiner_inputs( &combiner, replaced, 2 ), "Unable to change the combiner's inputs" );
+    first = combiner_find( &combiner, 0x10 );
+    assertEqual( first, 0 );
+    assertEqual( combiner_find( &combiner, 0x30 ), -1 );
+    assert( combiner_waiting( &combiner ), "Held messages lost when the inputs changed" );
+    assert( combiner_add( &combiner, combiner_find( &combiner, 0x50 ), (uint8_t *)"5", 1, true ), "Message not queued" );
+    combiner_take( &combiner, COMBINE_CONCAT, round );
+    assert( memcmp( round, "15", 2 ) == 0, "Round after changing the inputs wrong" );
+
+    combiner_destroy( &combiner );
+}
+
+void test_affinity() {
+    affinity_key_t key;
+    uint64_t hash = 0, other = 0;
+
+    // Fields count from 1, and a line's terminator isn't part of the last one
+    assert( affinity_parse( &key, "field:3" ), "Field key not parsed" );
+    assertEqual( key.first, 2 );
+    assert( affinity_extract( &key, (uint8_t *)"a,b,user7\n", 10, &hash ), "Field not found" );
+    assertEqual( hash == affinity_hash( (uint8_t *)"user7", 5 ), 1 );
+    assert( !affinity_extract( &key, (uint8_t *)"a,b", 3, &hash ), "Missing field found" );
+
+    assert( affinity_parse( &key, "field:2:tab" ), "Tab delimited key not parsed" );
+    assert( affinity_extract( &key, (uint8_t *)"x\tuser7\ty", 9, &other ), "Tab delimited field not found" );
+    assertEqual( hash == other, 1 );
+
+    // A byte range has to fit, a zero length runs to the end
+    assert( affinity_parse( &key, "bytes:2:5" ), "Range key not parsed" );
+    assert( affinity_extract( &key, (uint8_t *)"--user7--", 9, &other ), "Range not found" );
+    assertEqual( hash == other, 1 );
+    assert( !affinity_extract( &key, (uint8_t *)"--use", 5, &other ), "Short range found" );
+    assert( affinity_parse( &key, "bytes:4:0" ), "Open range not parsed" );
+    assert( affinity_extract( &key, (uint8_t *)"id: user7", 9, &other ), "Open range not found" );
+    assertEqual( hash == other, 1 );
+
+    // JSON fields may be nested, but only a plain value is a key
+    assert( affinity_parse( &key, "json:user.id" ), "JSON key not parsed" );
+    const char * json = "{\"seq\": 1, \"user\": {\"id\": \"user7\", \"tags\": [1, 2]}}\n";
+    assert( affinity_extract( &key, (uint8_t *)json, strlen( json ), &other ), "JSON field not found" );
+    assertEqual( hash == other, 1 );
+    assert( affinity_parse( &key, "json:user.tags" ), "JSON key not parsed" );
+    assert( !affinity_extract( &key, (uint8_t *)json, strlen( json ), &other ), "JSON array taken as a key" );
+    assert( !affinity_extract( &key, (uint8_t *)"user7", 5, &other ), "Key found in something that isn't JSON" );
+
+    char spec[AFFINITY_PATH_MAX + 16];
+    affinity_format( &key, spec, sizeof spec );
+    assert( strcmp( spec, "json:user.tags" ) == 0, "Key not formatted as it was parsed" );
+    assert( !affinity_parse( &key, "field:0" ), "Field 0 accepted" );
+    assert( !affinity_parse( &key, "bytes:4" ), "Range without a length accepted" );
+    assert( !affinity_parse( &key, "user.id" ), "Key without a kind accepted" );
+
+    // Adding a target only takes the keys it wins, removing one only moves the keys it held
+    uint32_t targets[] = { 0x2001, 0x2002, 0x2003, 0x2004, 0x2005 };
+    uint32_t without[] = { 0x2001, 0x2002, 0x2004, 0x2005 };
+    size_t counts[5] = { 0 };
+    for( uint32_t i = 0; i < 5000; i++ ) {
+        uint64_t keyed = affinity_hash( (uint8_t *)&i, sizeof i );
+        size_t all = affinity_pick( keyed, targets, 5, sizeof(uint32_t) );
+        counts[all]++;
+
+        size_t fewer = affinity_pick( keyed, targets, 4, sizeof(uint32_t) );
+        if( fewer != all )
+            assertEqual( all, 4 );
+
+        uint32_t remaining = without[affinity_pick( keyed, without, 4, sizeof(uint32_t) )];
+        if( targets[all] != 0x2003 )
+            assertEqual( remaining, targets[all] );
+    }
+
+    // Each target gets about its share
+    for( int i = 0; i < 5; i++ )
+        assertEqual( counts[i] > 800 && counts[i] < 1200, 1 );
+
+    // The order the targets are listed in makes no difference
+    uint32_t reversed[] = { 0x2005, 0x2004, 0x2003, 0x2002, 0x2001 };
+    for( uint32_t i = 0; i < 1000; i++ ) {
+        uint64_t keyed = affinity_hash( (uint8_t *)&i, sizeof i );
+        assertEqual( targets[affinity_pick( keyed, targets, 5, sizeof(uint32_t) )], reversed[affinity_pick( keyed, reversed, 5, sizeof(uint32_t) )] );
+    }
+
+    // Nor does it matter if the addresses are inside bigger records, as the router's routes are
+    struct { uint64_t padding; uint32_t address; } records[5];
+    for( int i = 0; i < 5; i++ )
+        records[i].address = targets[i];
+    for( uint32_t i = 0; i < 1000; i++ ) {
+        uint64_t keyed = affinity_hash( (uint8_t *)&i, sizeof i );
+        assertEqual( affinity_pick( keyed, &records[0].address, 5, sizeof records[0] ), affinity_pick( keyed, targets, 5, sizeof(uint32_t) ) );
+    }
+}
+
+void test_shm_link() {
+    shmlink_t creator;
+    assertEqual( shmlink_create( &creator, 5000 ), 0 );
+    assertEqual( creator.tx.mask + 1, 8192 );
+
+    // Attach over duplicates, as if the descriptors had been passed to another process
+    shmlink_t peer;
+    assertEqual( shmlink_attach( &peer, dup( creator.memfd ), dup( creator.peer_bell ), dup( creator.bell ) ), 0 );
+    assertEqual( peer.rx.mask + 1, 8192 );
+
+    // The mapping is sealed, so neither side can resize it under the other
+    assertEqual( ftruncate( creator.memfd, 0 ), -1 );
+
+    // ...and an unsealed memfd is refused before it is ever mapped
+    shmlink_t unsealed;
+    int loose = memfd_create( "graphipc-test", MFD_CLOEXEC );
+    assertEqual( ftruncate( loose, creator.mapping_size ), 0 );
+    assertEqual( shmlink_attach( &unsealed, loose, eventfd( 0, EFD_CLOEXEC ), eventfd( 0, EFD_CLOEXEC ) ), -EPERM );
+
+    // The reader starts idle, so the first write rings it, and later ones don't until it idles again
+    uint8_t out[8192] = { 0 };
+    uint8_t in[8192] = { 0 };
+    for( size_t i = 0; i < sizeof out; i++ )
+        out[i] = (uint8_t)(i * 7);
+
+    assertEqual( shmlink_write( &creator, out, 100 ), 100 );
+    assert( shmlink_rung( peer.bell ), "First write did not ring an idle reader" );
+    shmlink_clear( &peer );
+    assertEqual( shmlink_write( &creator, out + 100, 100 ), 100 );
+    assert( !shmlink_rung( peer.bell ), "Write rang a reader that was not idle" );
+
+    assertEqual( shmlink_read( &peer, in, sizeof in ), 200 );
+    assert( memcmp( in, out, 200 ) == 0, "Shared-memory ring returned the wrong bytes" );
+    assertEqual( shmlink_read( &peer, in, sizeof in ), 0 );
+
+    // Fill it, wrapping around the end, then check the full writer gets rung once there is room
+    assertEqual( shmlink_write( &creator, out, sizeof out ), 8192 );
+    assertEqual( shmlink_write( &creator, out, 1 ), 0 );
+    assert( !shmlink_rung( creator.bell ), "Writer rung before the reader made any room" );
+
+    assertEqual( shmlink_read( &peer, in, 1000 ), 1000 );
+    assert( shmlink_rung( creator.bell ), "Reader did not ring a blocked writer" );
+    shmlink_clear( &creator );
+    assertEqual( shmlink_read( &peer, in + 1000, sizeof in ), 7192 );
+    assert( memcmp( in, out, sizeof out ) == 0, "Shared-memory ring returned the wrong bytes after wrapping" );
+
+    // Both directions are independent
+    assertEqual( shmlink_write( &peer, out, 10 ), 10 );
+    assertEqual( shmlink_read( &creator, in, sizeof in ), 10 );
+    assertEqual( shmlink_read( &peer, in, sizeof in ), 0 );
+
+    // Ordering across threads, with the ring wrapping many times over
+    pthread_t producer;
+    pthread_create( &producer, NULL, shmlink_producer, &creator );
+
+    uint32_t expect = 0;
+    size_t received = 0;
+    while( received < SHMLINK_TEST_BYTES ) {
+        ssize_t length = shmlink_read( &peer, in, sizeof in );
+        assert( length >= 0, "Shared-memory ring reported corruption" );
+        for( ssize_t i = 0; i < length; i++ )
+            assertEqual( in[i], (uint8_t)(expect + i) );
+        expect += length;
+        received += length;
+    }
+    pthread_join( producer, NULL );
+    assertEqual( shmlink_read( &peer, in, sizeof in ), 0 );
+
+    shmlink_destroy( &peer );
+    shmlink_destroy( &creator );
+}
+
+/**
+ * Read everything waiting on a non-blocking socket into 'buffer'.
+ */
+size_t fanout_collect( int fd, uint8_t * buffer, size_t length ) {
+    size_t total = 0;
+    ssize_t got;
+    while( total < length && (got = recv( fd, buffer + total, length - total, MSG_DONTWAIT )) > 0 )
+        total += got;
+    return total;
+}
+
+void test_fanout() {
+    fanout_t fanout;
+    assertEqual( fanout_init( &fanout, 256 * 1024 ), 0 );
+    assert( fanout.capacity >= 64 * 1024, "Fan-out pipes are smaller than the default pipe size" );
+
+    int pairs[3][2];
+    for( int i = 0; i < 3; i++ ) {
+        assertEqual( socketpair( AF_UNIX, SOCK_STREAM, 0, pairs[i] ), 0 );
+        fcntl( pairs[i][0], F_SETFL, O_NONBLOCK );
+    }
+
+    static uint8_t frame[48 * 1024];
+    static uint8_t in[64 * 1024];
+    for( size_t i = 0; i < sizeof frame; i++ )
+        frame[i] = (uint8_t)(i * 13);
+
+    // One staging, every socket gets an identical copy
+    assert( fanout_stage( &fanout, frame, sizeof frame ), "Unable to stage a frame" );
+    assert( fanout_staged( &fanout, frame, sizeof frame ), "Staged frame not recognised" );
+    assert( !fanout_staged( &fanout, frame, 10 ), "A different frame was mistaken for the staged one" );
+
+    for( int i = 0; i < 3; i++ ) {
+        assertEqual( fanout_send( &fanout, pairs[i][0] ), sizeof frame );
+        assertEqual( fanout_collect( pairs[i][1], in, sizeof in ), sizeof frame );
+        assert( memcmp( in, frame, sizeof frame ) == 0, "Fan-out delivered the wrong bytes" );
+    }
+
+    // Fill one socket up - it takes what it can, and the next socket still gets the whole frame
+    size_t taken = 0;
+    ssize_t sent;
+    while( (sent = fanout_send( &fanout, pairs[0][0] )) == (ssize_t)sizeof frame )
+        taken += sent;
+    if( sent > 0 )
+        taken += sent;
+    else
+        assertEqual( errno, EAGAIN );
+
+    assertEqual( fanout_send( &fanout, pairs[1][0] ), sizeof frame );
+    assertEqual( fanout_collect( pairs[1][1], in, sizeof in ), sizeof frame );
+    assert( memcmp( in, frame, sizeof frame ) == 0, "A short send corrupted the next fan-out" );
+
+    size_t drained = 0;
+    size_t got;
+    while( (got = fanout_collect( pairs[0][1], in, sizeof in )) > 0 ) {
+        for( size_t i = 0; i < got; i++ )
+            assertEqual( in[i], frame[(drained + i) % sizeof frame] );
+        drained += got;
+    }
+    assertEqual( drained, taken );
+
+    // Restaging replaces the old frame, and frames too big for the pipe are refused
+    assert( fanout_stage( &fanout, frame + 1, 100 ), "Unable to restage a frame" );
+    assertEqual( fanout_send( &fanout, pairs[2][0] ), 100 );
+    assertEqual( fanout_collect( pairs[2][1], in, sizeof in ), 100 );
+    assert( memcmp( in, frame + 1, 100 ) == 0, "Restaged frame delivered the wrong bytes" );
+
+    fanout_unstage( &fanout );
+    assert( !fanout_staged( &fanout, frame + 1, 100 ), "Frame still staged after unstaging" );
+    assertEqual( fanout_send( &fanout, pairs[2][0] ), -1 );
+    assert( !fanout_stage( &fanout, frame, fanout.capacity + 1 ), "Staged a frame bigger than the pipe" );
+
+    for( int i = 0; i < 3; i++ ) {
+        close( pairs[i][0] );
+        close( pairs[i][1] );
+    }
+    fanout_destroy( &fanout );
+}
+
+void * buffer_pool_free_all( void * data ) {
+    void ** buffers = (void **)data;
+    for( size_t i = 0; i < BUFPOOL_CACHE_DEPTH; i++ )
+        bufpool_free( buffers[i] );
+    return NULL;
+}
+
+void test_buffer_pool() {
+    bufpool_trim();
+
+    bufpool_stat_t before, after;
+    bufpool_stat( &before );
+
+    // Sizes round up to their class, the whole of which is usable
+    void * small = bufpool_alloc( 1 );
+    assert( small != NULL, "Unable to allocate from the pool" );
+    assertEqual( bufpool_capacity( small ), BUFPOOL_MIN_SIZE );
+
+    void * odd = bufpool_alloc( 3000 );
+    assertEqual( bufpool_capacity( odd ), 4096 );
+    memset( odd, 0xAA, bufpool_capacity( odd ) );
+
+    // A freed buffer is the next one handed out for its class, without touching the heap
+    bufpool_free( odd );
+    bufpool_stat( &after );
+    uint64_t misses = after.misses;
+
+    void * again = bufpool_alloc( 2049 );
+    assert( again == odd, "Freed buffer was not reused" );
+    bufpool_stat( &after );
+    assertEqual( after.misses, misses );
+    assertEqual( after.hits, before.hits + 1 );
+
+    // Bigger than the largest class goes straight to the heap
+    void * huge = bufpool_alloc( BUFPOOL_MAX_SIZE + 1 );
+    assert( huge != NULL, "Unable to allocate an oversized buffer" );
+    assertEqual( bufpool_capacity( huge ), BUFPOOL_MAX_SIZE + 1 );
+    bufpool_free( huge );
+
+    bufpool_free( again );
+    bufpool_free( small );
+    bufpool_free( NULL );
+
+    // Buffers freed on another thread come back through the depot, rather than from the heap
+    bufpool_trim();
+    static void * buffers[BUFPOOL_CACHE_DEPTH];
+    for( size_t i = 0; i < BUFPOOL_CACHE_DEPTH; i++ )
+        buffers[i] = bufpool_alloc( 512 );
+
+    pthread_t thread;
+    assertEqual( pthread_create( &thread, NULL, buffer_pool_free_all, buffers ), 0 );
+    assertEqual( pthread_join( thread, NULL ), 0 );
+
+    bufpool_stat( &before );
+    assert( before.cached > 0, "Nothing reached the depot from the exiting thread" );
+
+    void * refilled = bufpool_alloc( 512 );
+    bufpool_stat( &after );
+    assertEqual( after.refills, before.refills + 1 );
+    assertEqual( after.misses, before.misses );
+
+    bool found = false;
+    for( size_t i = 0; i < BUFPOOL_CACHE_DEPTH; i++ )
+        found = found || buffers[i] == refilled;
+    assert( found, "Refilled buffer was not one freed by the other thread" );
+
+    bufpool_free( refilled );
+    bufpool_trim();
+    bufpool_stat( &after );
+    assertEqual( after.cached, 0 );
+}
+
+void test_packet_buffer() {
+    bufpool_trim();
+
+    // A payload gets its header written in front of it, without moving
+    gnw_buf_t * buf = gnw_buf_alloc( 5 );
+    assert( buf != NULL, "Unable to allocate a packet buffer" );
+    assertEqual( buf->length, 0 );
+
+    uint8_t * payload = gnw_buf_put( buf, 5 );
+    memcpy( payload, "hello", 5 );
+    gnw_buf_push_header( buf, GNW_DATA, 0x1234 );
+    assertEqual( buf->length, GNW_HEADER_SIZE + 5 );
+    assert( gnw_buf_data( buf ) + GNW_HEADER_SIZE == payload, "Payload moved when the header was pushed" );
+
+    gnw_header_t header;
+    uint8_t * ptr = gnw_buf_data( buf );
+    ptr = packet_read_u8( ptr, &header.magic );
+    ptr = packet_read_u8( ptr, &header.version );
+    ptr = packet_read_u8( ptr, &header.type );
+    ptr = packet_read_u32( ptr, &header.source );
+    ptr = packet_read_u32( ptr, &header.length );
+    assertEqual( header.magic, GNW_MAGIC );
+    assertEqual( header.type, GNW_DATA );
+    assertEqual( header.source, 0x1234 );
+    assertEqual( header.length, 5 );
+    assert( memcmp( ptr, "hello", 5 ) == 0, "Payload corrupted by the header" );
+
+    // There is only so much headroom
+    assert( gnw_buf_push( buf, GNW_BUF_HEADROOM ) == NULL, "Pushed past the start of the buffer" );
+    assert( gnw_buf_put( buf, buf->capacity ) == NULL, "Put past the end of the buffer" );
+
+    // Every reference has to go before the storage is reused
+    assert( gnw_buf_ref( buf ) == buf, "Taking a reference returned a different buffer" );
+    gnw_buf_release( buf );
+    assertEqual( buf->refs, 1 );
+    gnw_buf_release( buf );
+
+    gnw_buf_t * reused = gnw_buf_alloc( 100 );
+    assert( reused == buf, "Released buffer was not reused from the pool" );
+    assertEqual( reused->length, 0 );
+    assertEqual( reused->refs, 1 );
+
+    // Large frames hold all of their data
+    static uint8_t large[300 * 1024];
+    for( size_t i = 0; i < sizeof large; i++ )
+        large[i] = (uint8_t)(i * 7);
+
+    gnw_buf_t * big = gnw_buf_copy( large, sizeof large );
+    assert( big != NULL, "Unable to allocate a large packet buffer" );
+    assert( big != reused, "Large buffer shared storage with a buffer still in use" );
+    assertEqual( big->length, sizeof large );
+    assert( memcmp( gnw_buf_data( big ), large, sizeof large ) == 0, "Large copy delivered the wrong bytes" );
+
+    gnw_buf_release( big );
+    gnw_buf_release( reused );
+    gnw_buf_release( NULL );
+    bufpool_trim();
+}
+
+void test_frame_stream() {
+    bufpool_trim();
+
+    // A sequenced frame far bigger than any input buffer, numbered 77
+    static uint8_t frame[GNW_HEADER_SIZE + sizeof(uint32_t) + 40000];
+    uint8_t * ptr = packet_write_u8( frame, GNW_MAGIC );
+    ptr = packet_write_u8( ptr, GNW_VERSION );
+    ptr = packet_write_u8( ptr, GNW_DATA | GNW_SEQUENCED );
+    ptr = packet_write_u32( ptr, 0x1234 );
+    ptr = packet_write_u32( ptr, sizeof(uint32_t) + 40000 );
+    ptr = packet_write_u32( ptr, 77 );
+    for( size_t i = 0; i < 40000; i++ )
+        ptr[i] = (uint8_t)(i * 7);
+
+    // Nothing can start until its number has arrived too
+    gnw_stream_t stream;
+    assertEqual( gnw_stream_start( &stream, frame, GNW_HEADER_SIZE + 2 ), 0 );
+    assertEqual( gnw_stream_start( &stream, frame, sizeof frame ), GNW_HEADER_SIZE + sizeof(uint32_t) );
+    assertEqual( stream.remaining, 40000 );
+
+    // Every fragment carries the number, and only the last goes without GNW_MORE
+    size_t offset = 0;
+    int fragments = 0;
+    while( stream.remaining > 0 ) {
+        size_t fragment = gnw_stream_next( &stream );
+        gnw_buf_t * buf = gnw_stream_fragment( &stream, ptr + offset );
+        assert( buf != NULL, "Unable to allocate a packet buffer" );
+        assert( buf->length <= GNW_HEADER_SIZE + GNW_FRAGMENT_SIZE, "Fragment bigger than a whole frame could be" );
+
+        gnw_header_t header;
+        uint32_t sequence = 0;
+        uint8_t * payload = packet_read_u32( gnw_parse_header( gnw_buf_data( buf ), &header ), &sequence );
+        assertEqual( header.source, 0x1234 );
+        assertEqual( header.length, sizeof(uint32_t) + fragment );
+        assertEqual( header.type, stream.remaining > 0 ? GNW_DATA | GNW_SEQUENCED | GNW_MORE : GNW_DATA | GNW_SEQUENCED );
+        assertEqual( sequence, 77 );
+        assert( memcmp( payload, ptr + offset, fragment ) == 0, "Fragment delivered the wrong bytes" );
+
+        offset += fragment;
+        fragments++;
+        gnw_buf_release( buf );
+    }
+    assertEqual( offset, 40000 );
+    assertEqual( fragments, 3 );
+
+    // Without a number, the payload is passed on as it is
+    packet_write_u8( frame + 2, GNW_DATA );
+    assertEqual( gnw_stream_start( &stream, frame, sizeof frame ), GNW_HEADER_SIZE );
+    assertEqual( gnw_stream_next( &stream ), GNW_FRAGMENT_SIZE );
+    gnw_buf_t * plain = gnw_stream_fragment( &stream, frame + GNW_HEADER_SIZE );
+    assert( plain != NULL, "Unable to allocate a packet buffer" );
+    assertEqual( plain->length, GNW_HEADER_SIZE + GNW_FRAGMENT_SIZE );
+    assertEqual( gnw_buf_data( plain )[2], GNW_DATA | GNW_MORE );
+    assert( memcmp( gnw_buf_data( plain ) + GNW_HEADER_SIZE, frame + GNW_HEADER_SIZE, GNW_FRAGMENT_SIZE ) == 0, "Fragment delivered the wrong bytes" );
+
+    gnw_buf_release( plain );
+    bufpool_trim();
+}
+
+uint8_t * write_test_frame( uint8_t * ptr, gnw_address_t source, uint8_t fill, uint32_t length ) {
+    ptr = packet_write_u8( ptr, GNW_MAGIC );
+    ptr = packet_write_u8( ptr, GNW_VERSION );
+    ptr = packet_write_u8( ptr, GNW_DATA );
+    ptr = packet_write_u32( ptr, source );
+    ptr = packet_write_u32( ptr, length );
+    memset( ptr, fill, length );
+    return ptr + length;
+}
+
+void test_frame_buffer() {
+    framebuffer_t frames;
+    assert( framebuffer_init( &frames, 128 ), "Unable to create a frame buffer" );
+
+    // Two whole frames and half of a third
+    uint8_t stream[128] = { 0 };
+    uint8_t * end = write_test_frame( stream, 0x1000, 'a', 5 );
+    end = write_test_frame( end, 0x2000, 'b', 7 );
+    uint8_t * third = end;
+    end = write_test_frame( end, 0x3000, 'c', 9 );
+
+    assert( framebuffer_append( &frames, stream, (third - stream) + 6 ), "Frame buffer refused data it had room for" );
+
+    uint8_t * frame = NULL;
+    gnw_header_t header;
+    assertEqual( framebuffer_next( &frames, &frame ), 16 );
+    gnw_parse_header( frame, &header );
+    assertEqual( header.source, 0x1000 );
+
+    assertEqual( framebuffer_next( &frames, &frame ), 18 );
+    gnw_parse_header( frame, &header );
+    assertEqual( header.source, 0x2000 );
+
+    assertEqual( framebuffer_next( &frames, &frame ), 0 );
+    assertEqual( framebuffer_length( &frames ), 6 );
+
+    // The rest of the third frame completes it
+    assert( framebuffer_append( &frames, third + 6, (end - third) - 6 ), "Frame buffer refused data it had room for" );
+    assertEqual( framebuffer_next( &frames, &frame ), 20 );
+    uint8_t * payload = gnw_parse_header( frame, &header );
+    assertEqual( header.source, 0x3000 );
+    assertEqual( payload[8], 'c' );
+
+    // Fully drained, so the buffer should have snapped back to the front without moving anything
+    assertEqual( framebuffer_length( &frames ), 0 );
+    assertEqual( frames.head, 0 );
+
+    // Garbage in front of a frame is skipped in one step, and counted
+    uint8_t noise[4] = { 0x01, GNW_MAGIC, 0x00, 0x02 };
+    assert( framebuffer_append( &frames, noise, 4 ), "Frame buffer refused data it had room for" );
+    end = write_test_frame( stream, 0x4000, 'd', 3 );
+    assert( framebuffer_append( &frames, stream, end - stream ), "Frame buffer refused data it had room for" );
+
+    assertEqual( framebuffer_next( &frames, &frame ), 14 );
+    gnw_parse_header( frame, &header );
+    assertEqual( header.source, 0x4000 );
+    assertEqual( frames.discarded, 4 );
+
+    // Reserve only compacts once the room left at the end is smaller than the room consumed up front
+    framebuffer_clear( &frames );
+    uint8_t filler[120];
+    memset( filler, GNW_MAGIC, sizeof(filler) );
+    assert( framebuffer_append( &frames, filler, 100 ), "Frame buffer refused data it had room for" );
+    framebuffer_consume( &frames, 90 );
+
+    size_t space = 0;
+    uint8_t * target = framebuffer_reserve( &frames, &space );
+    assertEqual( space, 118 );
+    assert( target == frames.buffer + 10, "Reserve did not compact the remaining data to the front" );
+    assertEqual( frames.head, 0 );
+
+    assert( !framebuffer_append( &frames, filler, 120 ), "Frame buffer accepted more data than it could hold" );
+
+    framebuffer_destroy( &frames );
+}
+
 void dump_buffer( uint8_t * buffer, size_t length ) {
     for( size_t i=0; i<length; i++ )
         printf( "%02x", buffer[i] );
@@ -171,6 +982,149 @@ void test_network_sync() {
     }
 }
 
+void test_fragmentation() {
+    int pair[2];
+    assertEqual( socketpair( AF_UNIX, SOCK_STREAM, 0, pair ), 0 );
+
+    static uint8_t message[GNW_FRAGMENT_SIZE * 2 + 1000];
+    static uint8_t in[sizeof message + 8 * GNW_HEADER_SIZE];
+    for( size_t i = 0; i < sizeof message; i++ )
+        message[i] = (uint8_t)(i * 31);
+
+    // Big payloads are split, every fragment but the last is marked, and the pieces join back up
+    gnw_emitDataPacket( pair[0], 0x1234, message, sizeof message );
+    gnw_emitDataFragment( pair[0], 0x1234, message, 10, true );
+
+    size_t got = 0;
+    size_t expected = sizeof message + 10 + 4 * GNW_HEADER_SIZE;
+    while( got < expected ) {
+        ssize_t result = read( pair[1], in + got, sizeof in - got );
+        assert( result > 0, "Fragments went missing" );
+        got += result;
+    }
+
+    const uint8_t types[] = { GNW_DATA | GNW_MORE, GNW_DATA | GNW_MORE, GNW_DATA, GNW_DATA | GNW_MORE };
+    const uint32_t lengths[] = { GNW_FRAGMENT_SIZE, GNW_FRAGMENT_SIZE, 1000, 10 };
+
+    uint8_t * ptr = in;
+    size_t offset = 0;
+    for( int i = 0; i < 4; i++ ) {
+        ssize_t length = gnw_nextPacket( ptr, in + got - ptr );
+        assertEqual( length, GNW_HEADER_SIZE + lengths[i] );
+
+        gnw_header_t header;
+        uint8_t * payload = gnw_parse_header( ptr, &header );
+        assertEqual( header.type, types[i] );
+        assertEqual( GNW_FRAME_TYPE( header.type ), GNW_DATA );
+        assertEqual( header.source, 0x1234 );
+        assertEqual( header.length, lengths[i] );
+
+        if( i < 3 ) {
+            assert( memcmp( payload, message + offset, header.length ) == 0, "Fragment delivered the wrong bytes" );
+            offset += header.length;
+        }
+        ptr += length;
+    }
+    assertEqual( offset, sizeof message );
+
+    close( pair[0] );
+    close( pair[1] );
+}
+
+void test_zerocopy() {
+    // Zero-copy is TCP only, so use a loopback connection
+    int listener = socket( AF_INET, SOCK_STREAM, 0 );
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_addr.s_addr = htonl( INADDR_LOOPBACK ) };
+    socklen_t size = sizeof address;
+    assertEqual( bind( listener, (struct sockaddr *)&address, sizeof address ), 0 );
+    assertEqual( listen( listener, 1 ), 0 );
+    assertEqual( getsockname( listener, (struct sockaddr *)&address, &size ), 0 );
+
+    int out = socket( AF_INET, SOCK_STREAM, 0 );
+    assertEqual( connect( out, (struct sockaddr *)&address, sizeof address ), 0 );
+    int in = accept( listener, NULL, NULL );
+    assert( in != -1, "Unable to accept the loopback connection" );
+
+    zerocopy_t zerocopy;
+    if( !zerocopy_enable( &zerocopy, out ) ) {
+        log_warn( "    SO_ZEROCOPY is unsupported here, skipped" );
+        close( in );
+        close( out );
+        close( listener );
+        return;
+    }
+
+    static uint8_t message[GNW_FRAGMENT_SIZE * 3 + 100];
+    static uint8_t received[sizeof message + 4 * GNW_HEADER_SIZE];
+    for( size_t i = 0; i < sizeof message; i++ )
+        message[i] = (uint8_t)(i * 17);
+
+    // Every send has completed by the time the call returns, so the payload is ours again
+    assert( gnw_emitDataZerocopy( out, &zerocopy, 0x4321, message, sizeof message, false ), "Zero-copy send failed" );
+    assertEqual( zerocopy_pending( &zerocopy ), 0 );
+    assert( zerocopy.sent > 0 && zerocopy_complete( &zerocopy, zerocopy.sent - 1 ), "Zero-copy completion was missed" );
+    memset( message, 0, 64 );
+
+    size_t got = 0;
+    while( got < sizeof received ) {
+        ssize_t result = read( in, received + got, sizeof received - got );
+        assert( result > 0, "Zero-copy frames went missing" );
+        got += result;
+    }
+
+    // The same fragments as a copying send
+    uint8_t * ptr = received;
+    size_t offset = 0;
+    for( int i = 0; i < 4; i++ ) {
+        gnw_header_t header;
+        uint8_t * payload = gnw_parse_header( ptr, &header );
+        assertEqual( header.type, i < 3 ? GNW_DATA | GNW_MORE : GNW_DATA );
+        assertEqual( header.source, 0x4321 );
+        assertEqual( header.length, i < 3 ? GNW_FRAGMENT_SIZE : 100 );
+
+        for( size_t j = 0; j < header.length; j++ )
+            assertEqual( payload[j], (uint8_t)((offset + j) * 17) );
+        offset += header.length;
+        ptr = payload + header.length;
+    }
+    assertEqual( offset, sizeof message );
+
+    close( in );
+    close( out );
+    close( listener );
+}
+
+void test_histogram() {
+    histogram_t histogram;
+    histogram_reset( &histogram );
+    assert( histogram_percentile( &histogram, 50 ) == 0, "An empty histogram should have no percentiles" );
+
+    // Small values have a bucket each, so come back exactly
+    for( uint64_t i = 1; i <= 4; i++ )
+        histogram_record( &histogram, i );
+    assert( histogram.count == 4, "Every value should be counted" );
+    assert( histogram_percentile( &histogram, 0 ) == 1, "The smallest value should be exact" );
+    assert( histogram_percentile( &histogram, 50 ) == 2, "The median of 1..4 should be 2" );
+    assert( histogram_percentile( &histogram, 100 ) == 4, "The largest value should be exact" );
+
+    // Larger values land within a step of themselves
+    histogram_reset( &histogram );
+    for( uint64_t i = 1; i <= 100000; i++ )
+        histogram_record( &histogram, i * 10 );
+
+    uint64_t percentiles[] = { 50, 90, 99 };
+    for( size_t i = 0; i < sizeof percentiles / sizeof percentiles[0]; i++ ) {
+        uint64_t expected = percentiles[i] * 10000;
+        uint64_t reported = histogram_percentile( &histogram, (double)percentiles[i] );
+        uint64_t error = reported > expected ? reported - expected : expected - reported;
+        assert( error <= expected / HISTOGRAM_STEPS, "Percentile should be within a step of the true value" );
+    }
+
+    // The very top of the range still has a bucket
+    histogram_record( &histogram, UINT64_MAX );
+    assert( histogram_percentile( &histogram, 100 ) > ((uint64_t)1 << 63), "The largest value should land in the top bucket" );
+}
+
 void test_utility_functions() {
 
     uint64_t test_size = 1;
@@ -359,12 +1313,48 @@ int main(int argc, char ** argv ) {
     log_info( "  Ring Buffer..." );
     test_ring_buffer();
 
+    log_info( "  Frame Buffer..." );
+    test_frame_buffer();
+
+    log_info( "  Mailbox..." );
+    test_mailbox();
+
+    log_info( "  Snapshot..." );
+    test_snapshot();
+
+    log_info( "  Resequencer..." );
+    test_resequencer();
+
+    log_info( "  Combiner..." );
+    test_combiner();
+
+    log_info( "  Affinity..." );
+    test_affinity();
+
+    log_info( "  Shared-Memory Link..." );
+    test_shm_link();
+
+    log_info( "  Fan-out..." );
+    test_fanout();
+
+    log_info( "  Buffer Pool..." );
+    test_buffer_pool();
+
+    log_info( "  Packet Buffer..." );
+    test_packet_buffer();
+
+    log_info( "  Frame Streaming..." );
+    test_frame_stream();
+
     // Internals Tests
     log_info( "Testing Network Functions..." );
     test_network_sync();
+    test_fragmentation();
+    test_zerocopy();
 
     log_info( "Testing Utility Functions..." );
     test_utility_functions();
+    test_histogram();
 
     // KLIB Tests
     log_info( "Running klib tests..." );
@@ -23,11 +23,71 @@
 #include <memory.h>
 #include <sys/ioctl.h>
 #include <net/if.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "common.h"
+#include "lib/GraphNetwork.h"
+
+int socket_transport( const char * host, const char ** path ) {
+    int transport = TRANSPORT_TCP;
+    const char * local = NULL;
+
+    if( strncmp( host, "unix", 4 ) == 0 && (host[4] == '\0' || host[4] == ':') ) {
+        transport = TRANSPORT_UNIX;
+        local = host[4] == ':' ? host + 5 : ROUTER_UNIX_PATH;
+    }
+    else if( strncmp( host, "seqpacket", 9 ) == 0 && (host[9] == '\0' || host[9] == ':') ) {
+        transport = TRANSPORT_SEQPACKET;
+        local = host[9] == ':' ? host + 10 : ROUTER_SEQPACKET_PATH;
+    }
+    else if( strncmp( host, "shm", 3 ) == 0 && (host[3] == '\0' || host[3] == ':') ) {
+        transport = TRANSPORT_SHM;
+        local = host[3] == ':' ? host + 4 : ROUTER_UNIX_PATH;
+    }
+
+    if( path != NULL )
+        *path = local;
+
+    return transport;
+}
+
+int socket_connect_local( const char * path, int type ) {
+    struct sockaddr_un address;
+    memset( &address, 0, sizeof address );
+    address.sun_family = AF_UNIX;
+
+    if( strlen( path ) >= sizeof( address.sun_path ) ) {
+        fprintf( stderr, "client: socket path too long: %s\n", path );
+        return -1;
+    }
+    strcpy( address.sun_path, path );
+
+    int sockfd = socket( AF_UNIX, type, 0 );
+    if( sockfd == -1 ) {
+        perror( "client: socket" );
+        return -1;
+    }
+
+    if( connect( sockfd, (struct sockaddr *)&address, sizeof address ) == -1 ) {
+        perror( "client: connect" );
+        close( sockfd );
+        return -1;
+    }
+
+    return sockfd;
+}
 
 int socket_connect(const char *host, const char *port) {
     struct addrinfo hints;
     struct addrinfo *client_info;
 
+    const char * path = NULL;
+    switch( socket_transport( host, &path ) ) {
+        case TRANSPORT_UNIX:
+        case TRANSPORT_SHM:       return socket_connect_local( path, SOCK_STREAM );
+        case TRANSPORT_SEQPACKET: return socket_connect_local( path, SOCK_SEQPACKET );
+    }
+
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
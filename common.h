@@ -18,6 +18,28 @@
 
 #pragma once
 
+// Router transports, chosen by the host string given to socket_connect()
+#define TRANSPORT_TCP       0 // Any other host name or address
+#define TRANSPORT_UNIX      1 // "unix" or "unix:/path/to/socket"
+#define TRANSPORT_SEQPACKET 2 // "seqpacket" or "seqpacket:/path/to/socket", keeps message boundaries
+#define TRANSPORT_SHM       3 // "shm" or "shm:/path/to/socket", a unix stream socket that negotiates a shared-memory link
+
+/**
+ * Works out which transport a host string selects.
+ *
+ * @param host The host string, as passed to socket_connect()
+ * @param path Set to the socket path for the local transports (the default if none was given), may be NULL
+ * @return One of the TRANSPORT_* constants
+ */
+int socket_transport( const char * host, const char ** path );
+
+/**
+ * Connects to a router, over TCP or a local socket depending on 'host' (see socket_transport()).
+ *
+ * @param host The host name or address, or a local transport string
+ * @param port The TCP port, ignored by the local transports
+ * @return The connected socket, or -1 on failure
+ */
 int socket_connect(const char *host, const char *port);
 
 int getIFaceMTU( const char * interface );
@@ -0,0 +1,184 @@
+/*
+ * GraphIPC
+ * Copyright (C) 2017  John Vidler (john@johnvidler.co.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Affinity.h"
+#include "klib/kson.h"
+
+bool affinity_parse( affinity_key_t * key, const char * spec ) {
+    memset( key, 0, sizeof(affinity_key_t) );
+    char * end;
+
+    if( strncmp( spec, "field:", 6 ) == 0 ) {
+        unsigned long field = strtoul( spec + 6, &end, 10 );
+        if( end == spec + 6 || field < 1 || field > UINT32_MAX )
+            return false;
+
+        key->kind = AFFINITY_FIELD;
+        key->first = (uint32_t)(field - 1);
+        key->delimiter = ',';
+        if( *end == '\0' )
+            return true;
+        if( *end != ':' )
+            return false;
+
+        if( strcmp( end + 1, "tab" ) == 0 )
+            key->delimiter = '\t';
+        else if( strlen( end + 1 ) == 1 )
+            key->delimiter = (uint8_t)end[1];
+        else
+            return false;
+        return true;
+    }
+
+    if( strncmp( spec, "bytes:", 6 ) == 0 ) {
+        unsigned long offset = strtoul( spec + 6, &end, 10 );
+        if( end == spec + 6 || *end != ':' || offset > UINT32_MAX )
+            return false;
+
+        const char * from = end + 1;
+        unsigned long length = strtoul( from, &end, 10 );
+        if( end == from || *end != '\0' || length > UINT32_MAX )
+            return false;
+
+        key->kind = AFFINITY_RANGE;
+        key->first = (uint32_t)offset;
+        key->length = (uint32_t)length;
+        return true;
+    }
+
+    if( strncmp( spec, "json:", 5 ) == 0 ) {
+        size_t length = strlen( spec + 5 );
+        if( length == 0 || length >= AFFINITY_PATH_MAX )
+            return false;
+
+        key->kind = AFFINITY_JSON;
+        memcpy( key->path, spec + 5, length );
+        return true;
+    }
+
+    return false;
+}
+
+void affinity_format( const affinity_key_t * key, char * buffer, size_t size ) {
+    switch( key->kind ) {
+        case AFFINITY_FIELD:
+            if( key->delimiter == '\t' )
+                snprintf( buffer, size, "field:%u:tab", key->first + 1 );
+            else
+                snprintf( buffer, size, "field:%u:%c", key->first + 1, key->delimiter );
+            break;
+        case AFFINITY_RANGE: snprintf( buffer, size, "bytes:%u:%u", key->first, key->length ); break;
+        case AFFINITY_JSON:  snprintf( buffer, size, "json:%s", key->path ); break;
+        default:             snprintf( buffer, size, "???" );
+    }
+}
+
+uint64_t affinity_hash( const uint8_t * data, size_t length ) {
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for( size_t i = 0; i < length; i++ ) {
+        hash ^= data[i];
+        hash *= 0x100000001B3ull;
+    }
+    return hash;
+}
+
+/**
+ * Hash the value of a JSON field, walking one object down for each name in the dotted path.
+ */
+static bool affinity_json( const affinity_key_t * key, const uint8_t * data, size_t length, uint64_t * hash ) {
+    // The parser wants a terminated string
+    char * text = (char *)malloc( length + 1 );
+    if( text == NULL )
+        return false;
+    memcpy( text, data, length );
+    text[length] = '\0';
+
+    kson_t * json = kson_parse( text );
+    free( text );
+    if( json == NULL )
+        return false;
+
+    const kson_node_t * node = json->root;
+    char path[AFFINITY_PATH_MAX];
+    memcpy( path, key->path, AFFINITY_PATH_MAX );
+    path[AFFINITY_PATH_MAX - 1] = '\0';
+
+    char * save = NULL;
+    for( char * name = strtok_r( path, ".", &save ); name != NULL && node != NULL; name = strtok_r( NULL, ".", &save ) )
+        node = kson_by_key( node, name );
+
+    // Only a plain value makes a key, not an object or array
+    bool found = node != NULL && !kson_is_internal( node ) && node->v.str != NULL;
+    if( found )
+        *hash = affinity_hash( (const uint8_t *)node->v.str, strlen( node->v.str ) );
+
+    kson_destroy( json );
+    return found;
+}
+
+bool affinity_extract( const affinity_key_t * key, const uint8_t * data, size_t length, uint64_t * hash ) {
+    switch( key->kind ) {
+        case AFFINITY_FIELD: {
+            // A line's terminator isn't part of its last field
+            while( length > 0 && (data[length - 1] == '\n' || data[length - 1] == '\r') )
+                length--;
+
+            const uint8_t * start = data;
+            const uint8_t * end = data + length;
+            for( uint32_t field = 0; field < key->first; field++ ) {
+                start = memchr( start, key->delimiter, end - start );
+                if( start == NULL )
+                    return false;
+                start++;
+            }
+
+            const uint8_t * stop = memchr( start, key->delimiter, end - start );
+            *hash = affinity_hash( start, (stop != NULL ? stop : end) - start );
+            return true;
+        }
+
+        case AFFINITY_RANGE: {
+            if( length < key->first || (key->length > 0 && length - key->first < key->length) )
+                return false;
+
+            *hash = affinity_hash( data + key->first, key->length > 0 ? key->length : length - key->first );
+            return true;
+        }
+
+        case AFFINITY_JSON:
+            return affinity_json( key, data, length, hash );
+    }
+    return false;
+}
+
+size_t affinity_pick( uint64_t hash, const uint32_t * targets, size_t count, size_t stride ) {
+    size_t best = 0;
+    uint64_t highest = 0;
+
+    for( size_t i = 0; i < count; i++ ) {
+        const uint32_t * target = (const uint32_t *)((const uint8_t *)targets + i * stride);
+        uint64_t score = affinity_score( hash, *target );
+        if( i == 0 || score > highest ) {
+            highest = score;
+            best = i;
+        }
+    }
+    return best;
+}
@@ -0,0 +1,107 @@
+/*
+ * GraphIPC
+ * Copyright (C) 2017  John Vidler (john@johnvidler.co.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/*
+ * Key affinity: pulling a key out of a message, and mapping it onto one of a set of targets so
+ * every message with the same key meets the same target.
+ *
+ * Targets are picked by rendezvous hashing. Each target scores the key by hashing the two together,
+ * and the highest score wins, so adding a target only takes the keys it now wins, and removing one
+ * only moves the keys it held: about 1/N of them either way, whatever order the targets are in.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Where the key comes from
+#define AFFINITY_FIELD 0 // A field of delimited text
+#define AFFINITY_RANGE 1 // A fixed byte range
+#define AFFINITY_JSON  2 // The value of a (dotted) field of a JSON object
+
+// Longest JSON field path, including its terminator
+#define AFFINITY_PATH_MAX 64
+
+typedef struct {
+    uint8_t kind;
+    uint8_t delimiter;            // AFFINITY_FIELD: what separates the fields
+    uint32_t first;               // AFFINITY_FIELD: the field, from 0. AFFINITY_RANGE: the offset of the first byte
+    uint32_t length;              // AFFINITY_RANGE: the number of bytes, 0 for everything from 'first' on
+    char path[AFFINITY_PATH_MAX]; // AFFINITY_JSON: the field, with '.' between nested names
+} affinity_key_t;
+
+/**
+ * Parse a key specification: "field:N" or "field:N:D" for the Nth field (from 1) delimited by D (',' unless given,
+ * "tab" for a tab), "bytes:OFFSET:LENGTH" for a byte range, or "json:PATH" for a JSON field such as "user.id".
+ *
+ * @param key Where to put the parsed key
+ * @param spec The specification
+ * @return False if the specification isn't valid, 'key' is left undefined
+ */
+bool affinity_parse( affinity_key_t * key, const char * spec );
+
+/**
+ * Write a key back out as a specification, as affinity_parse() takes it.
+ *
+ * @param key The key
+ * @param buffer Where to write it
+ * @param size The space in 'buffer'
+ */
+void affinity_format( const affinity_key_t * key, char * buffer, size_t size );
+
+/**
+ * @return A 64-bit hash of 'length' bytes (FNV-1a)
+ */
+uint64_t affinity_hash( const uint8_t * data, size_t length );
+
+/**
+ * Pull a message's key out and hash it.
+ *
+ * @param key Where the key comes from
+ * @param data The message payload
+ * @param length The payload length
+ * @param hash Where to put the key's hash
+ * @return False if the message has no such key (too few fields, too short, not JSON or no such field)
+ */
+bool affinity_extract( const affinity_key_t * key, const uint8_t * data, size_t length, uint64_t * hash );
+
+/**
+ * A target's rendezvous score for a key, the target with the highest score takes the key.
+ *
+ * @param hash The key's hash, see affinity_extract()
+ * @param target The target's address
+ */
+static inline uint64_t affinity_score( uint64_t hash, uint32_t target ) {
+    // splitmix64's finaliser, so targets with neighbouring addresses still score independently
+    uint64_t mixed = hash ^ ((uint64_t)target * 0x9E3779B97F4A7C15ull);
+    mixed = (mixed ^ (mixed >> 30)) * 0xBF58476D1CE4E5B9ull;
+    mixed = (mixed ^ (mixed >> 27)) * 0x94D049BB133111EBull;
+    return mixed ^ (mixed >> 31);
+}
+
+/**
+ * Pick the target that takes a key. The addresses may sit inside larger records, 'stride' bytes apart.
+ *
+ * @param hash The key's hash, see affinity_extract()
+ * @param targets The first target's address
+ * @param count The number of targets
+ * @param stride The bytes from one address to the next, sizeof(uint32_t) for a plain array
+ * @return The index of the target that takes the key
+ */
+size_t affinity_pick( uint64_t hash, const uint32_t * targets, size_t count, size_t stride );
@@ -0,0 +1,254 @@
+/*
+ * GraphIPC
+ * Copyright (C) 2017  John Vidler (john@johnvidler.co.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "BufferPool.h"
+
+/** Sits in front of every buffer */
+typedef struct bufpool_block {
+    struct bufpool_block * next; // Free list link, while cached
+    size_t size;                 // Usable size, a power of two for pooled blocks
+} bufpool_block_t;
+
+typedef struct {
+    bufpool_block_t * head;
+    size_t count;
+} bufpool_list_t;
+
+/** One thread's caches and counters. Never freed, so the counters outlive the thread */
+typedef struct bufpool_cache {
+    bufpool_list_t classes[BUFPOOL_CLASSES];
+    bufpool_stat_t stat;
+    struct bufpool_cache * next_cache;
+} bufpool_cache_t;
+
+static struct {
+    pthread_mutex_t lock;
+    bufpool_list_t classes[BUFPOOL_CLASSES];
+    size_t cached;
+    bufpool_cache_t * caches; // Every thread's cache, for bufpool_stat()
+} depot = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static __thread bufpool_cache_t * local = NULL;
+static pthread_key_t local_key;
+static pthread_once_t local_once = PTHREAD_ONCE_INIT;
+
+// Counters are only written by their own thread, but read by any, so they never tear
+#define BUFPOOL_COUNT( field ) __atomic_store_n( &(field), (field) + 1, __ATOMIC_RELAXED )
+
+static size_t bufpool_cache_limit( int index ) {
+    size_t limit = BUFPOOL_CACHE_BYTES >> (index + BUFPOOL_MIN_SHIFT);
+    if( limit > BUFPOOL_CACHE_DEPTH )
+        limit = BUFPOOL_CACHE_DEPTH;
+    return limit < 2 ? 2 : limit;
+}
+
+/**
+ * @return The class that holds 'size' bytes, or -1 if it is too big to pool
+ */
+static int bufpool_class( size_t size ) {
+    if( size > BUFPOOL_MAX_SIZE )
+        return -1;
+
+    int index = 0;
+    while( (BUFPOOL_MIN_SIZE << index) < size )
+        index++;
+    return index;
+}
+
+/**
+ * Move up to 'count' blocks from the front of 'from' onto 'to'.
+ */
+static size_t bufpool_move( bufpool_list_t * from, bufpool_list_t * to, size_t count ) {
+    size_t moved = 0;
+    while( moved < count && from->head != NULL ) {
+        bufpool_block_t * block = from->head;
+        from->head = block->next;
+        block->next = to->head;
+        to->head = block;
+        moved++;
+    }
+    from->count -= moved;
+    to->count += moved;
+    return moved;
+}
+
+static void bufpool_empty( bufpool_list_t * list ) {
+    while( list->head != NULL ) {
+        bufpool_block_t * block = list->head;
+        list->head = block->next;
+        free( block );
+    }
+    list->count = 0;
+}
+
+/**
+ * Hand half of a full thread cache to the depot, freeing whatever the depot has no room for.
+ */
+static void bufpool_spill( bufpool_cache_t * cache, int index ) {
+    bufpool_list_t * list = &cache->classes[index];
+    size_t limit = bufpool_cache_limit( index );
+    size_t size = BUFPOOL_MIN_SIZE << index;
+
+    pthread_mutex_lock( &depot.lock );
+    size_t room = limit * BUFPOOL_DEPOT_FACTOR - depot.classes[index].count;
+    size_t moved = bufpool_move( list, &depot.classes[index], limit / 2 < room ? limit / 2 : room );
+    depot.cached += moved * size;
+    pthread_mutex_unlock( &depot.lock );
+
+    while( list->count > limit / 2 ) {
+        bufpool_block_t * block = list->head;
+        list->head = block->next;
+        list->count--;
+        free( block );
+        BUFPOOL_COUNT( cache->stat.releases );
+    }
+}
+
+/**
+ * Hand everything in a thread's cache to the depot, as the thread exits.
+ */
+static void bufpool_retire( void * data ) {
+    bufpool_cache_t * cache = (bufpool_cache_t *)data;
+
+    pthread_mutex_lock( &depot.lock );
+    for( int index = 0; index < BUFPOOL_CLASSES; index++ ) {
+        bufpool_list_t * list = &cache->classes[index];
+        size_t room = bufpool_cache_limit( index ) * BUFPOOL_DEPOT_FACTOR - depot.classes[index].count;
+        depot.cached += bufpool_move( list, &depot.classes[index], room ) * (BUFPOOL_MIN_SIZE << index);
+        bufpool_empty( list );
+    }
+    pthread_mutex_unlock( &depot.lock );
+}
+
+static void bufpool_key_init() {
+    pthread_key_create( &local_key, bufpool_retire );
+}
+
+static bufpool_cache_t * bufpool_local() {
+    if( local != NULL )
+        return local;
+
+    bufpool_cache_t * cache = (bufpool_cache_t *)calloc( 1, sizeof(bufpool_cache_t) );
+    if( cache == NULL )
+        return NULL;
+
+    pthread_once( &local_once, bufpool_key_init );
+    pthread_setspecific( local_key, cache );
+
+    pthread_mutex_lock( &depot.lock );
+    cache->next_cache = depot.caches;
+    depot.caches = cache;
+    pthread_mutex_unlock( &depot.lock );
+
+    local = cache;
+    return cache;
+}
+
+void * bufpool_alloc( size_t size ) {
+    int index = bufpool_class( size );
+    bufpool_cache_t * cache = bufpool_local();
+
+    if( index >= 0 && cache != NULL ) {
+        bufpool_list_t * list = &cache->classes[index];
+
+        if( list->head != NULL )
+            BUFPOOL_COUNT( cache->stat.hits );
+        else {
+            pthread_mutex_lock( &depot.lock );
+            size_t moved = bufpool_move( &depot.classes[index], list, bufpool_cache_limit( index ) / 2 );
+            depot.cached -= moved * (BUFPOOL_MIN_SIZE << index);
+            pthread_mutex_unlock( &depot.lock );
+
+            if( moved > 0 )
+                BUFPOOL_COUNT( cache->stat.refills );
+        }
+
+        if( list->head != NULL ) {
+            bufpool_block_t * block = list->head;
+            list->head = block->next;
+            list->count--;
+            return block + 1;
+        }
+    }
+
+    if( cache != NULL )
+        BUFPOOL_COUNT( cache->stat.misses );
+
+    size_t capacity = index >= 0 ? BUFPOOL_MIN_SIZE << index : size;
+    bufpool_block_t * block = (bufpool_block_t *)malloc( sizeof(bufpool_block_t) + capacity );
+    if( block == NULL )
+        return NULL;
+
+    block->next = NULL;
+    block->size = capacity;
+    return block + 1;
+}
+
+void bufpool_free( void * ptr ) {
+    if( ptr == NULL )
+        return;
+
+    bufpool_block_t * block = (bufpool_block_t *)ptr - 1;
+    bufpool_cache_t * cache = bufpool_local();
+    if( block->size > BUFPOOL_MAX_SIZE || cache == NULL ) {
+        free( block );
+        return;
+    }
+
+    int index = bufpool_class( block->size );
+    bufpool_list_t * list = &cache->classes[index];
+    block->next = list->head;
+    list->head = block;
+    list->count++;
+
+    if( list->count > bufpool_cache_limit( index ) )
+        bufpool_spill( cache, index );
+}
+
+size_t bufpool_capacity( const void * ptr ) {
+    return ((const bufpool_block_t *)ptr - 1)->size;
+}
+
+void bufpool_stat( bufpool_stat_t * stat ) {
+    *stat = (bufpool_stat_t){ 0 };
+
+    pthread_mutex_lock( &depot.lock );
+    for( bufpool_cache_t * cache = depot.caches; cache != NULL; cache = cache->next_cache ) {
+        stat->hits += __atomic_load_n( &cache->stat.hits, __ATOMIC_RELAXED );
+        stat->refills += __atomic_load_n( &cache->stat.refills, __ATOMIC_RELAXED );
+        stat->misses += __atomic_load_n( &cache->stat.misses, __ATOMIC_RELAXED );
+        stat->releases += __atomic_load_n( &cache->stat.releases, __ATOMIC_RELAXED );
+    }
+    stat->cached = depot.cached;
+    pthread_mutex_unlock( &depot.lock );
+}
+
+void bufpool_trim() {
+    if( local != NULL ) {
+        for( int index = 0; index < BUFPOOL_CLASSES; index++ )
+            bufpool_empty( &local->classes[index] );
+    }
+
+    pthread_mutex_lock( &depot.lock );
+    for( int index = 0; index < BUFPOOL_CLASSES; index++ )
+        bufpool_empty( &depot.classes[index] );
+    depot.cached = 0;
+    pthread_mutex_unlock( &depot.lock );
+}
@@ -0,0 +1,88 @@
+/*
+ * GraphIPC
+ * Copyright (C) 2017  John Vidler (john@johnvidler.co.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/*
+ * A size-class buffer pool, for the buffers every connection and frame needs.
+ *
+ * Requests are rounded up to a power of two, from BUFPOOL_MIN_SIZE to BUFPOOL_MAX_SIZE, and
+ * freed buffers are kept for reuse rather than handed back to the heap. Each thread keeps a
+ * small cache per size class, which it uses without locking. A thread whose cache fills moves
+ * half of it to a shared depot, and a thread whose cache runs dry takes a batch back, so
+ * buffers freed on a different thread from the one that allocated them still get reused.
+ *
+ * Anything bigger than BUFPOOL_MAX_SIZE goes straight to the heap.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BUFPOOL_MIN_SHIFT 8  // 256 bytes
+#define BUFPOOL_MAX_SHIFT 24 // 16 MiB
+#define BUFPOOL_MIN_SIZE ((size_t)1 << BUFPOOL_MIN_SHIFT)
+#define BUFPOOL_MAX_SIZE ((size_t)1 << BUFPOOL_MAX_SHIFT)
+#define BUFPOOL_CLASSES (BUFPOOL_MAX_SHIFT - BUFPOOL_MIN_SHIFT + 1)
+
+// Each thread caches up to this many buffers per class, or this many bytes, whichever is less (but at least 2)
+#define BUFPOOL_CACHE_DEPTH 64
+#define BUFPOOL_CACHE_BYTES (8 * 1024 * 1024)
+
+// The shared depot holds up to this many times a thread cache, per class
+#define BUFPOOL_DEPOT_FACTOR 8
+
+/** Counters over every thread, in the style of kalloc's km_stat_t */
+typedef struct {
+    uint64_t hits;     // Served from the calling thread's cache
+    uint64_t refills;  // Served from a batch taken from the shared depot
+    uint64_t misses;   // Had to go to the heap
+    uint64_t releases; // Freed back to the heap, as every cache for that class was full
+    size_t cached;     // Bytes currently held in the depot (thread caches are not counted)
+} bufpool_stat_t;
+
+/**
+ * Fetch a buffer of at least 'size' bytes.
+ *
+ * @param size The space needed
+ * @return The buffer, or NULL if the heap is exhausted
+ */
+void * bufpool_alloc( size_t size );
+
+/**
+ * Return a buffer to the pool.
+ *
+ * @param ptr A buffer from bufpool_alloc() (NULL is ignored), which may be freed on any thread
+ */
+void bufpool_free( void * ptr );
+
+/**
+ * @param ptr A buffer from bufpool_alloc()
+ * @return The usable size of the buffer, which may be more than was asked for
+ */
+size_t bufpool_capacity( const void * ptr );
+
+/**
+ * Gather the counters from every thread that has used the pool.
+ *
+ * @param stat Where to write them
+ */
+void bufpool_stat( bufpool_stat_t * stat );
+
+/**
+ * Hand every buffer held by the calling thread's cache, and the depot, back to the heap.
+ */
+void bufpool_trim();
@@ -0,0 +1,209 @@
+/*
+ * GraphIPC
+ * Copyright (C) 2017  John Vidler (john@johnvidler.co.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "Combiner.h"
+#include "packet.h"
+
+void combiner_init( combiner_t * combiner, uint32_t depth ) {
+    memset( combiner, 0, sizeof(combiner_t) );
+    combiner->depth = depth > 0 ? depth : 1;
+}
+
+/**
+ * Free everything one input holds.
+ */
+static void combiner_input_free( combiner_t * combiner, combiner_input_t * input ) {
+    for( uint32_t i = 0; i < input->count; i++ )
+        free( input->queue[(input->head + i) % combiner->depth].data );
+    free( input->queue );
+    free( input->partial );
+}
+
+void combiner_destroy( combiner_t * combiner ) {
+    for( size_t i = 0; i < combiner->input_count; i++ )
+        combiner_input_free( combiner, &combiner->inputs[i] );
+    free( combiner->inputs );
+    combiner->inputs = NULL;
+    combiner->input_count = 0;
+    combiner->waiting = 0;
+}
+
+static int combiner_compare( const void * a, const void * b ) {
+    uint32_t left = *(const uint32_t *)a;
+    uint32_t right = *(const uint32_t *)b;
+    return left < right ? -1 : left > right;
+}
+
+bool combiner_inputs( combiner_t * combiner, const uint32_t * sources, size_t count ) {
+    uint32_t * sorted = (uint32_t *)malloc( (count > 0 ? count : 1) * sizeof(uint32_t) );
+    combiner_input_t * inputs = (combiner_input_t *)calloc( count > 0 ? count : 1, sizeof(combiner_input_t) );
+    if( sorted == NULL || inputs == NULL ) {
+        free( sorted );
+        free( inputs );
+        return false;
+    }
+
+    memcpy( sorted, sources, count * sizeof(uint32_t) );
+    qsort( sorted, count, sizeof(uint32_t), combiner_compare );
+
+    // Every new input's queue first, so a failure leaves the combiner untouched
+    for( size_t i = 0; i < count; i++ ) {
+        inputs[i].source = sorted[i];
+        if( combiner_find( combiner, sorted[i] ) != -1 )
+            continue;
+
+        inputs[i].queue = (combiner_msg_t *)calloc( combiner->depth, sizeof(combiner_msg_t) );
+        if( inputs[i].queue == NULL ) {
+            for( size_t j = 0; j < i; j++ )
+                free( inputs[j].queue );
+            free( sorted );
+            free( inputs );
+            return false;
+        }
+    }
+
+    // Inputs that remain move across as they are, leaving nothing behind to be freed below
+    for( size_t i = 0; i < count; i++ ) {
+        int existing = combiner_find( combiner, sorted[i] );
+        if( existing == -1 )
+            continue;
+
+        // Its source stays, so the old inputs are still sorted for the finds that follow
+        combiner_input_t * old = &combiner->inputs[existing];
+        inputs[i] = *old;
+        old->queue = NULL;
+        old->partial = NULL;
+        old->count = 0;
+    }
+
+    // Whatever wasn't moved across has gone
+    for( size_t i = 0; i < combiner->input_count; i++ )
+        combiner_input_free( combiner, &combiner->inputs[i] );
+    free( combiner->inputs );
+    free( sorted );
+
+    combiner->inputs = inputs;
+    combiner->input_count = count;
+    combiner->waiting = 0;
+    for( size_t i = 0; i < count; i++ )
+        if( inputs[i].count > 0 )
+            combiner->waiting++;
+    return true;
+}
+
+int combiner_find( combiner_t * combiner, uint32_t source ) {
+    // Inputs are kept sorted, and there are only ever a handful
+    size_t low = 0, high = combiner->input_count;
+    while( low < high ) {
+        size_t middle = (low + high) / 2;
+        if( combiner->inputs[middle].source == source )
+            return (int)middle;
+        if( combiner->inputs[middle].source < source )
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return -1;
+}
+
+bool combiner_add( combiner_t * combiner, int index, const uint8_t * data, size_t length, bool last ) {
+    combiner_input_t * input = &combiner->inputs[index];
+
+    if( input->partial_length + length > input->partial_capacity ) {
+        size_t capacity = input->partial_capacity == 0 ? 256 : input->partial_capacity;
+        while( capacity < input->partial_length + length )
+            capacity *= 2;
+
+        uint8_t * partial = (uint8_t *)realloc( input->partial, capacity );
+        if( partial == NULL ) {
+            // The rest of this message is no use without the part that couldn't be kept
+            free( input->partial );
+            input->partial = NULL;
+            input->partial_length = input->partial_capacity = 0;
+            combiner->dropped++;
+            return false;
+        }
+        input->partial = partial;
+        input->partial_capacity = capacity;
+    }
+
+    memcpy( input->partial + input->partial_length, data, length );
+    input->partial_length += length;
+    if( !last )
+        return true;
+
+    if( input->count == combiner->depth ) {
+        input->partial_length = 0;
+        combiner->dropped++;
+        return false;
+    }
+
+    // The message's storage moves into the queue as it is, the next starts afresh
+    combiner_msg_t * message = &input->queue[(input->head + input->count) % combiner->depth];
+    message->data = input->partial;
+    message->length = input->partial_length;
+    input->partial = NULL;
+    input->partial_length = input->partial_capacity = 0;
+
+    if( input->count++ == 0 )
+        combiner->waiting++;
+    return true;
+}
+
+size_t combiner_length( combiner_t * combiner, int format ) {
+    size_t length = format == COMBINE_TUPLE ? sizeof(uint32_t) : 0;
+    for( size_t i = 0; i < combiner->input_count; i++ ) {
+        combiner_input_t * input = &combiner->inputs[i];
+        if( format == COMBINE_TUPLE )
+            length += sizeof(uint32_t);
+        if( input->count > 0 )
+            length += input->queue[input->head].length;
+    }
+    return length;
+}
+
+void combiner_take( combiner_t * combiner, int format, uint8_t * buffer ) {
+    if( combiner_ready( combiner ) )
+        combiner->rounds++;
+    else
+        combiner->partial++;
+
+    if( format == COMBINE_TUPLE )
+        buffer = packet_write_u32( buffer, (uint32_t)combiner->input_count );
+
+    for( size_t i = 0; i < combiner->input_count; i++ ) {
+        combiner_input_t * input = &combiner->inputs[i];
+        combiner_msg_t * message = input->count > 0 ? &input->queue[input->head] : NULL;
+        size_t length = message != NULL ? message->length : 0;
+
+        if( format == COMBINE_TUPLE )
+            buffer = packet_write_u32( buffer, (uint32_t)length );
+        if( message == NULL )
+            continue;
+
+        memcpy( buffer, message->data, length );
+        buffer += length;
+
+        free( message->data );
+        message->data = NULL;
+        input->head = (input->head + 1) % combiner->depth;
+        if( --input->count == 0 )
+            combiner->waiting--;
+    }
+}
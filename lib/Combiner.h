@@ -0,0 +1,144 @@
+/*
+ * GraphIPC
+ * Copyright (C) 2017  John Vidler (john@johnvidler.co.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/*
+ * A barrier join over a fixed set of inputs.
+ *
+ * Messages are queued per input as they arrive, possibly in several parts, and once every input
+ * has one waiting they are taken together as a single round: the head of each input, in input
+ * order, either back to back or as a length-prefixed tuple. Each input holds at most 'depth'
+ * whole messages; the owner decides what to do when one fills, or a round has waited too long,
+ * and can take a partial round at any time, with the missing inputs left empty.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Round formats
+#define COMBINE_CONCAT 0 // Each input's message, back to back
+#define COMBINE_TUPLE  1 // u32 input count, then each input's message as a u32 length and its bytes
+
+/** One whole message, owned by its input's queue */
+typedef struct {
+    uint8_t * data;
+    size_t length;
+} combiner_msg_t;
+
+typedef struct {
+    uint32_t source;
+    combiner_msg_t * queue; // 'depth' slots, a ring
+    uint32_t head;
+    uint32_t count;
+
+    uint8_t * partial;      // The message still arriving, if any
+    size_t partial_length;
+    size_t partial_capacity;
+} combiner_input_t;
+
+typedef struct {
+    combiner_input_t * inputs; // In ascending source order
+    size_t input_count;
+    uint32_t depth;
+    size_t waiting;            // Inputs with at least one whole message queued
+
+    uint64_t rounds;           // Rounds taken with every input present
+    uint64_t partial;          // Rounds taken with some missing
+    uint64_t dropped;          // Messages that found their input's queue full (or couldn't be stored)
+} combiner_t;
+
+/**
+ * Sets up a combiner with no inputs.
+ *
+ * @param combiner The combiner to initialise
+ * @param depth The most whole messages each input may hold
+ */
+void combiner_init( combiner_t * combiner, uint32_t depth );
+
+/**
+ * Frees every input and message held.
+ *
+ * @param combiner The combiner to destroy
+ */
+void combiner_destroy( combiner_t * combiner );
+
+/**
+ * Change the set of inputs. Inputs that remain keep whatever they hold, inputs that go lose it.
+ *
+ * @param combiner The combiner
+ * @param sources The new inputs, in any order, without duplicates
+ * @param count The number of inputs
+ * @return False if the inputs could not be allocated, the combiner is left as it was
+ */
+bool combiner_inputs( combiner_t * combiner, const uint32_t * sources, size_t count );
+
+/**
+ * @return The index of the input for 'source', or -1 if it isn't one
+ */
+int combiner_find( combiner_t * combiner, uint32_t source );
+
+/**
+ * @return True if the input can't queue another whole message until a round is taken
+ */
+static inline bool combiner_full( combiner_t * combiner, int input ) {
+    return combiner->inputs[input].count == combiner->depth;
+}
+
+/**
+ * Add one part of a message to an input.
+ *
+ * @param combiner The combiner
+ * @param input The input's index, see combiner_find()
+ * @param data The part, copied
+ * @param length The part length
+ * @param last True if this is the message's last part, which queues the message
+ * @return False if the message was dropped, as its input was full or it couldn't be stored
+ */
+bool combiner_add( combiner_t * combiner, int input, const uint8_t * data, size_t length, bool last );
+
+/**
+ * @return True if every input has a whole message queued
+ */
+static inline bool combiner_ready( combiner_t * combiner ) {
+    return combiner->input_count > 0 && combiner->waiting == combiner->input_count;
+}
+
+/**
+ * @return True if some, but not every, input has a whole message queued
+ */
+static inline bool combiner_waiting( combiner_t * combiner ) {
+    return combiner->waiting > 0 && combiner->waiting < combiner->input_count;
+}
+
+/**
+ * @param combiner The combiner
+ * @param format COMBINE_CONCAT or COMBINE_TUPLE
+ * @return The length of the round combiner_take() would write now
+ */
+size_t combiner_length( combiner_t * combiner, int format );
+
+/**
+ * Write the round at the head of every input, and take it off their queues. Inputs with nothing
+ * queued are left empty, which makes this a partial round.
+ *
+ * @param combiner The combiner
+ * @param format COMBINE_CONCAT or COMBINE_TUPLE
+ * @param buffer Where to write the round, at least combiner_length() bytes
+ */
+void combiner_take( combiner_t * combiner, int format, uint8_t * buffer );
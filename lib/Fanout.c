@@ -0,0 +1,158 @@
+/*
+ * GraphIPC
+ * Copyright (C) 2017  John Vidler (john@johnvidler.co.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "Fanout.h"
+
+static ssize_t fanout_tee( int in, int out, size_t length ) {
+    return tee( in, out, length, SPLICE_F_NONBLOCK );
+}
+
+static ssize_t fanout_splice( int in, int out, size_t length ) {
+    return splice( in, NULL, out, NULL, length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+}
+
+static int fanout_pipe( int fds[2], size_t capacity ) {
+    if( pipe( fds ) == -1 )
+        return -1;
+
+    for( int i = 0; i < 2; i++ ) {
+        fcntl( fds[i], F_SETFD, FD_CLOEXEC );
+        fcntl( fds[i], F_SETFL, fcntl( fds[i], F_GETFL ) | O_NONBLOCK );
+    }
+
+    // Not fatal if this is refused, frames bigger than the default size just aren't staged
+    return fcntl( fds[1], F_SETPIPE_SZ, (int)capacity );
+}
+
+int fanout_init( fanout_t * fanout, size_t capacity ) {
+    memset( fanout, 0, sizeof(fanout_t) );
+    fanout->stage[0] = fanout->stage[1] = -1;
+    fanout->scratch[0] = fanout->scratch[1] = -1;
+
+    fanout->sink = open( "/dev/null", O_WRONLY | O_CLOEXEC );
+    if( fanout->sink == -1 ) {
+        int error = errno;
+        fanout_destroy( fanout );
+        return -error;
+    }
+
+    int stage = fanout_pipe( fanout->stage, capacity );
+    if( fanout->stage[0] == -1 ) {
+        int error = errno;
+        fanout_destroy( fanout );
+        return -error;
+    }
+
+    int scratch = fanout_pipe( fanout->scratch, capacity );
+    if( fanout->scratch[0] == -1 ) {
+        int error = errno;
+        fanout_destroy( fanout );
+        return -error;
+    }
+
+    // The scratch pipe has to take the whole stage at once
+    if( stage == -1 )
+        stage = fcntl( fanout->stage[1], F_GETPIPE_SZ );
+    if( scratch == -1 )
+        scratch = fcntl( fanout->scratch[1], F_GETPIPE_SZ );
+    fanout->capacity = (size_t)(stage < scratch ? stage : scratch);
+
+    return 0;
+}
+
+void fanout_destroy( fanout_t * fanout ) {
+    int * fds[] = { &fanout->stage[0], &fanout->stage[1], &fanout->scratch[0], &fanout->scratch[1], &fanout->sink };
+    for( size_t i = 0; i < sizeof fds / sizeof fds[0]; i++ ) {
+        if( *fds[i] != -1 )
+            close( *fds[i] );
+        *fds[i] = -1;
+    }
+    fanout->buffer = NULL;
+    fanout->length = 0;
+}
+
+/**
+ * Throw away whatever is left in a pipe, without reading it into userspace.
+ */
+static void fanout_drain( fanout_t * fanout, int fd ) {
+    while( fanout_splice( fd, fanout->sink, fanout->capacity ) > 0 )
+        ;
+}
+
+bool fanout_stage( fanout_t * fanout, const uint8_t * buffer, size_t length ) {
+    if( fanout->buffer != NULL )
+        fanout_unstage( fanout );
+
+    if( length == 0 || length > fanout->capacity )
+        return false;
+
+    // The one and only copy
+    if( write( fanout->stage[1], buffer, length ) != (ssize_t)length ) {
+        fanout_drain( fanout, fanout->stage[0] );
+        return false;
+    }
+
+    fanout->buffer = buffer;
+    fanout->length = length;
+    return true;
+}
+
+ssize_t fanout_send( fanout_t * fanout, int fd ) {
+    if( fanout->buffer == NULL ) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Take a reference to the staged pages, the stage itself is left as it was
+    ssize_t referenced = fanout_tee( fanout->stage[0], fanout->scratch[1], fanout->length );
+    if( referenced <= 0 ) {
+        if( referenced == 0 )
+            errno = EAGAIN;
+        return -1;
+    }
+
+    ssize_t sent = 0;
+    while( sent < referenced ) {
+        ssize_t result = fanout_splice( fanout->scratch[0], fd, referenced - sent );
+        if( result <= 0 )
+            break;
+        sent += result;
+    }
+
+    if( sent < referenced ) {
+        int error = errno;
+        fanout_drain( fanout, fanout->scratch[0] );
+        errno = error;
+    }
+
+    if( sent == 0 )
+        return -1;
+    return sent;
+}
+
+void fanout_unstage( fanout_t * fanout ) {
+    if( fanout->buffer == NULL )
+        return;
+
+    fanout_drain( fanout, fanout->stage[0] );
+    fanout->buffer = NULL;
+    fanout->length = 0;
+}
@@ -0,0 +1,93 @@
+/*
+ * GraphIPC
+ * Copyright (C) 2017  John Vidler (john@johnvidler.co.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/*
+ * Zero-copy fan-out of one frame to many sockets.
+ *
+ * The frame is copied into a staging pipe once, and each send then tee()s the staged pages into
+ * a scratch pipe (by reference, no copy) and splice()s them out to the socket. However many
+ * sockets the frame goes to, the kernel only ever copies it once.
+ *
+ * The destination sockets must be non-blocking, as splice() honours the socket's own mode.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+typedef struct {
+    int stage[2];   // Holds the staged frame, only ever tee'd from
+    int scratch[2]; // Takes a reference to the stage for each send, and is spliced out to the socket
+    int sink;       // /dev/null, for dropping whatever a short send leaves in the scratch pipe
+    size_t capacity;
+
+    const uint8_t * buffer; // The frame currently staged, if any
+    size_t length;
+} fanout_t;
+
+/**
+ * Sets up the staging and scratch pipes.
+ *
+ * @param fanout The fan-out to initialise
+ * @param capacity The largest frame to stage, the pipes are grown to fit if the system allows it
+ * @return 0 on success, or -errno on failure
+ */
+int fanout_init( fanout_t * fanout, size_t capacity );
+
+/**
+ * Closes the pipes.
+ *
+ * @param fanout The fan-out to destroy
+ */
+void fanout_destroy( fanout_t * fanout );
+
+/**
+ * Copy a frame into the staging pipe, ready to be sent to any number of sockets.
+ *
+ * @param fanout The fan-out to stage on
+ * @param buffer The frame, which the caller keeps unchanged until fanout_unstage()
+ * @param length The frame length
+ * @return False if the frame doesn't fit (or staging failed), it should be sent normally
+ */
+bool fanout_stage( fanout_t * fanout, const uint8_t * buffer, size_t length );
+
+/**
+ * @return True if exactly this frame is currently staged
+ */
+static inline bool fanout_staged( fanout_t * fanout, const uint8_t * buffer, size_t length ) {
+    return fanout->buffer != NULL && fanout->buffer == buffer && fanout->length == length;
+}
+
+/**
+ * Send the staged frame to a (non-blocking) socket, without copying it.
+ *
+ * @param fanout The fan-out holding the frame
+ * @param fd The socket to send to
+ * @return The number of bytes taken, or -1 with errno set (EAGAIN if the socket is full). If that is short
+ *         of the frame, the rest has to be sent from the caller's copy.
+ */
+ssize_t fanout_send( fanout_t * fanout, int fd );
+
+/**
+ * Drop the staged frame, once every socket has had it.
+ *
+ * @param fanout The fan-out to clear
+ */
+void fanout_unstage( fanout_t * fanout );
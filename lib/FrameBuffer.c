@@ -0,0 +1,130 @@
+/*
+ * GraphIPC
+ * Copyright (C) 2017  John Vidler (john@johnvidler.co.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "FrameBuffer.h"
+#include "BufferPool.h"
+#include "GraphNetwork.h"
+
+bool framebuffer_init( framebuffer_t * frames, size_t capacity ) {
+    frames->buffer = (uint8_t *)bufpool_alloc( capacity );
+    frames->capacity = frames->buffer != NULL ? capacity : 0;
+    frames->head = 0;
+    frames->tail = 0;
+    frames->discarded = 0;
+    frames->messages = false;
+    return frames->buffer != NULL;
+}
+
+void framebuffer_destroy( framebuffer_t * frames ) {
+    bufpool_free( frames->buffer );
+    frames->buffer = NULL;
+    frames->capacity = 0;
+    frames->head = 0;
+    frames->tail = 0;
+}
+
+void framebuffer_clear( framebuffer_t * frames ) {
+    frames->head = 0;
+    frames->tail = 0;
+}
+
+uint8_t * framebuffer_reserve( framebuffer_t * frames, size_t * space ) {
+    // Only pay for the move when it at least doubles the room we can offer
+    if( frames->head > 0 && frames->capacity - frames->tail < frames->head ) {
+        size_t pending = frames->tail - frames->head;
+        memmove( frames->buffer, frames->buffer + frames->head, pending );
+        frames->head = 0;
+        frames->tail = pending;
+    }
+
+    *space = frames->capacity - frames->tail;
+    return frames->buffer + frames->tail;
+}
+
+void framebuffer_commit( framebuffer_t * frames, size_t length ) {
+    frames->tail += length;
+    if( frames->tail > frames->capacity )
+        frames->tail = frames->capacity;
+}
+
+bool framebuffer_append( framebuffer_t * frames, const uint8_t * data, size_t length ) {
+    size_t space = 0;
+    uint8_t * target = framebuffer_reserve( frames, &space );
+
+    // Not enough at the end, but there might be if everything is moved up front
+    if( space < length && frames->head > 0 ) {
+        size_t pending = frames->tail - frames->head;
+        memmove( frames->buffer, frames->buffer + frames->head, pending );
+        frames->head = 0;
+        frames->tail = pending;
+        target = frames->buffer + frames->tail;
+        space = frames->capacity - frames->tail;
+    }
+
+    if( space < length )
+        return false;
+
+    memcpy( target, data, length );
+    frames->tail += length;
+    return true;
+}
+
+void framebuffer_consume( framebuffer_t * frames, size_t length ) {
+    frames->head += length;
+
+    // Once everything is consumed, start again from the front - nothing needs moving
+    if( frames->head >= frames->tail ) {
+        frames->head = 0;
+        frames->tail = 0;
+    }
+}
+
+size_t framebuffer_next( framebuffer_t * frames, uint8_t ** frame ) {
+    while( frames->head < frames->tail ) {
+        uint8_t * start = frames->buffer + frames->head;
+        size_t available = frames->tail - frames->head;
+
+        ssize_t ready = gnw_nextPacket( start, available );
+
+        if( ready > 0 ) {
+            *frame = start;
+            framebuffer_consume( frames, ready );
+            return (size_t)ready;
+        }
+
+        // A message can't be continued by the next read, so whatever is left is junk
+        if( frames->messages ) {
+            frames->discarded += available;
+            framebuffer_clear( frames );
+            return 0;
+        }
+
+        if( ready == 0 )
+            return 0;
+
+        // Bad header - jump straight to the next candidate magic byte, or drop the lot if there isn't one
+        uint8_t * magic = (uint8_t *)memchr( start + 1, GNW_MAGIC, available - 1 );
+        size_t skip = (magic != NULL) ? (size_t)(magic - start) : available;
+
+        frames->discarded += skip;
+        framebuffer_consume( frames, skip );
+    }
+
+    return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * GraphIPC
+ * Copyright (C) 2017  John Vidler (john@johnvidler.co.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/*
+ * A receive buffer for framed GraphIPC streams.
+ *
+ * Data is consumed by moving a head offset rather than shifting the buffer, so taking a frame
+ * costs nothing beyond parsing its header. The unread remainder is only moved back to the front
+ * when a write would otherwise run off the end, and the buffer snaps back to empty whenever the
+ * head catches up with the tail, so for most traffic it never moves at all.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+typedef struct {
+    uint8_t * buffer;
+    size_t capacity;
+    size_t head;        // First unconsumed byte
+    size_t tail;        // End of the valid data
+    uint64_t discarded; // Bytes skipped while resynchronising on a bad stream
+
+    // Set for message-oriented transports (SOCK_SEQPACKET), where each read holds whole frames.
+    // Anything left over once the complete frames are taken is malformed, so it is dropped
+    // outright rather than scanned for a resync point.
+    bool messages;
+} framebuffer_t;
+
+/**
+ * Allocates an empty frame buffer, from the buffer pool.
+ *
+ * @param frames The buffer to initialise
+ * @param capacity The size of the storage, in bytes
+ * @return True on success, false if the storage could not be allocated
+ */
+bool framebuffer_init( framebuffer_t * frames, size_t capacity );
+
+/**
+ * Releases the storage. The structure may be re-initialised afterwards.
+ *
+ * @param frames The buffer to destroy
+ */
+void framebuffer_destroy( framebuffer_t * frames );
+
+/**
+ * Empties the buffer, discarding anything not yet consumed.
+ *
+ * @param frames The buffer to clear
+ */
+void framebuffer_clear( framebuffer_t * frames );
+
+/**
+ * @param frames The buffer to inspect
+ * @return A pointer to the first unconsumed byte
+ */
+static inline uint8_t * framebuffer_data( framebuffer_t * frames ) {
+    return frames->buffer + frames->head;
+}
+
+/**
+ * @param frames The buffer to inspect
+ * @return The number of unconsumed bytes
+ */
+static inline size_t framebuffer_length( framebuffer_t * frames ) {
+    return frames->tail - frames->head;
+}
+
+/**
+ * Finds space to read into, compacting the unread data to the front only if the space left
+ * at the end is smaller than the space already consumed at the front.
+ *
+ * Any pointers previously returned by framebuffer_next() are invalidated.
+ *
+ * @param frames The buffer to write to
+ * @param space Set to the number of bytes that may be written at the returned pointer
+ * @return Where to write new data, then call framebuffer_commit() with the amount written
+ */
+uint8_t * framebuffer_reserve( framebuffer_t * frames, size_t * space );
+
+/**
+ * Marks 'length' bytes written at the pointer from framebuffer_reserve() as valid.
+ */
+void framebuffer_commit( framebuffer_t * frames, size_t length );
+
+/**
+ * Copies 'length' bytes onto the end of the buffer.
+ *
+ * @return True if the data fitted, false (and nothing is written) if it would not
+ */
+bool framebuffer_append( framebuffer_t * frames, const uint8_t * data, size_t length );
+
+/**
+ * Marks 'length' bytes at the head as consumed.
+ */
+void framebuffer_consume( framebuffer_t * frames, size_t length );
+
+/**
+ * Takes the next complete GraphIPC frame from the head of the buffer.
+ *
+ * If the head is not a valid header, bytes are skipped up to the next GNW_MAGIC (found with
+ * memchr, rather than one byte per attempt) and counted in 'discarded'. In message mode the
+ * remainder is discarded instead, as is any incomplete frame.
+ *
+ * @param frames The buffer to read from
+ * @param frame Set to the start of the frame, which stays valid until the next reserve/append
+ * @return The length of the frame including its header, or 0 if no complete frame is buffered
+ */
+size_t framebuffer_next( framebuffer_t * frames, uint8_t ** frame );
@@ -28,6 +28,8 @@
 #include "../Log.h"
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
@@ -86,9 +88,9 @@ void gnw_dumpPacket( FILE * fd, unsigned char * buffer, ssize_t length ) {
     fprintf( fd, "source=%s, ", addressBuf );
 
     fprintf( fd, "type=" );
-    switch( header.type ) {
+    switch( GNW_FRAME_TYPE( header.type ) ) {
         case GNW_COMMAND: fprintf( fd, "COMMAND, " ); break;
-        case GNW_DATA:    fprintf( fd, "DATA, " );    break;
+        case GNW_DATA:    fprintf( fd, (header.type & GNW_MORE) ? "DATA+MORE, " : "DATA, " ); break;
         case GNW_INVALID: fprintf( fd, "INVALID, " ); break;
         default:
             fprintf( fd, "%2x, ", header.type );
@@ -126,6 +128,19 @@ void gnw_emitPacket( int fd, unsigned char * buffer, size_t length ) {
 }
 
 void gnw_emitDataPacket( int fd, gnw_address_t source, unsigned char * buffer, ssize_t length ) {
+    gnw_emitDataFragment( fd, source, buffer, length, false );
+}
+
+/**
+ * Send a data payload, split into fragments of at most GNW_FRAGMENT_SIZE bytes.
+ *
+ * @param fd The socket to write to
+ * @param source The source address
+ * @param buffer The payload (NULL sends zeroes)
+ * @param length The payload length
+ * @param more True if the message continues in a later call, so even the last fragment is marked GNW_MORE
+ */
+void gnw_emitDataFragment( int fd, gnw_address_t source, unsigned char * buffer, ssize_t length, bool more ) {
 
     // Refuse to send zero-length payloads
     if( length == 0 ) {
@@ -133,26 +148,138 @@ void gnw_emitDataPacket( int fd, gnw_address_t source, unsigned char * buffer, s
         return;
     }
 
-    link_stats.dataPackets++;
+    uint8_t * zeroes = buffer == NULL ? (uint8_t *)calloc( 1, length < GNW_FRAGMENT_SIZE ? length : GNW_FRAGMENT_SIZE ) : NULL;
 
-    uint8_t * packet = (uint8_t *)malloc( length + 11 );
-    memset( packet, 0, length+11 ); // Remove for fast/dangerous mode!
-    uint8_t * ptr = packet;
+    while( length > 0 ) {
+        size_t fragment = length < GNW_FRAGMENT_SIZE ? (size_t)length : GNW_FRAGMENT_SIZE;
+        bool last = (size_t)length == fragment;
+
+        link_stats.dataPackets++;
+
+        uint8_t header[GNW_HEADER_SIZE];
+        uint8_t * ptr = header;
+
+        ptr = packet_write_u8( ptr, GNW_MAGIC );
+        ptr = packet_write_u8( ptr, GNW_VERSION );
+        ptr = packet_write_u8( ptr, (last && !more) ? GNW_DATA : GNW_DATA | GNW_MORE );
+        ptr = packet_write_u32( ptr, source );
+        ptr = packet_write_u32( ptr, fragment );
+
+        // The header is gathered in front of the caller's payload, so the payload is never copied here
+        struct iovec iov[2] = {
+            { .iov_base = header, .iov_len = GNW_HEADER_SIZE },
+            { .iov_base = buffer != NULL ? buffer : zeroes, .iov_len = fragment }
+        };
+
+        ssize_t written = writev( fd, iov, 2 );
+        link_stats.bytesWritten += written;
+
+        if( buffer != NULL )
+            buffer += fragment;
+        length -= fragment;
+    }
+
+    free( zeroes );
+}
 
+void gnw_emitDataFrame( int fd, uint8_t type, gnw_address_t source, unsigned char * buffer, size_t length ) {
+    if( length == 0 )
+        return;
+
+    link_stats.dataPackets++;
+
+    uint8_t header[GNW_HEADER_SIZE];
+    uint8_t * ptr = header;
     ptr = packet_write_u8( ptr, GNW_MAGIC );
     ptr = packet_write_u8( ptr, GNW_VERSION );
-    ptr = packet_write_u8( ptr, GNW_DATA );
+    ptr = packet_write_u8( ptr, type );
     ptr = packet_write_u32( ptr, source );
     ptr = packet_write_u32( ptr, length );
 
-    if( buffer != NULL ) {
-        memcpy( ptr, buffer, length );
-        ptr += length;
+    struct iovec iov[2] = {
+        { .iov_base = header, .iov_len = GNW_HEADER_SIZE },
+        { .iov_base = buffer, .iov_len = length }
+    };
+
+    ssize_t written = writev( fd, iov, 2 );
+    link_stats.bytesWritten += written;
+}
+
+size_t gnw_sendAll( int fd, zerocopy_t * zerocopy, struct msghdr * message ) {
+    size_t sent = 0;
+
+    // The socket is blocking, so a short send only happens on a signal - finish it off
+    while( message->msg_iovlen > 0 ) {
+        ssize_t result = zerocopy != NULL && zerocopy->enabled ? zerocopy_sendmsg( zerocopy, fd, message, MSG_NOSIGNAL ) : -1;
+
+        // Too many completions outstanding (or zero-copy was given up on), copy this one
+        if( result == -1 && (zerocopy == NULL || !zerocopy->enabled || errno == ENOBUFS) )
+            result = sendmsg( fd, message, MSG_NOSIGNAL );
+
+        if( result == -1 && errno == EINTR )
+            continue;
+        if( result == -1 )
+            return sent;
+
+        sent += result;
+        while( message->msg_iovlen > 0 && (size_t)result >= message->msg_iov->iov_len ) {
+            result -= message->msg_iov->iov_len;
+            message->msg_iov++;
+            message->msg_iovlen--;
+        }
+        if( message->msg_iovlen > 0 ) {
+            message->msg_iov->iov_base = (uint8_t *)message->msg_iov->iov_base + result;
+            message->msg_iov->iov_len -= result;
+        }
     }
 
-    gnw_emitPacket( fd, packet, length + 11 );
+    return sent;
+}
+
+// Fragments gathered into each zero-copy send
+#define GNW_ZEROCOPY_BATCH 64
+
+bool gnw_emitDataZerocopy( int fd, zerocopy_t * zerocopy, gnw_address_t source, unsigned char * buffer, size_t length, bool more ) {
+    uint8_t headers[GNW_ZEROCOPY_BATCH][GNW_HEADER_SIZE];
+    struct iovec iov[GNW_ZEROCOPY_BATCH * 2];
+
+    while( length > 0 ) {
+        int count = 0;
+        size_t total = 0;
+
+        // Every fragment's header is gathered in front of its slice of the payload
+        for( ; length > 0 && count < GNW_ZEROCOPY_BATCH; count++ ) {
+            size_t fragment = length < GNW_FRAGMENT_SIZE ? length : GNW_FRAGMENT_SIZE;
+            length -= fragment;
+
+            uint8_t * ptr = headers[count];
+            ptr = packet_write_u8( ptr, GNW_MAGIC );
+            ptr = packet_write_u8( ptr, GNW_VERSION );
+            ptr = packet_write_u8( ptr, (length > 0 || more) ? GNW_DATA | GNW_MORE : GNW_DATA );
+            ptr = packet_write_u32( ptr, source );
+            ptr = packet_write_u32( ptr, fragment );
+
+            iov[count * 2] = (struct iovec){ .iov_base = headers[count], .iov_len = GNW_HEADER_SIZE };
+            iov[count * 2 + 1] = (struct iovec){ .iov_base = buffer, .iov_len = fragment };
+            buffer += fragment;
+            total += GNW_HEADER_SIZE + fragment;
+            link_stats.dataPackets++;
+        }
+
+        struct msghdr message = { .msg_iov = iov, .msg_iovlen = count * 2 };
+        size_t sent = gnw_sendAll( fd, zerocopy, &message );
+        link_stats.bytesWritten += sent;
+        if( sent < total ) {
+            zerocopy_wait( zerocopy, fd );
+            return false;
+        }
+
+        // The kernel sends the headers from here too, so they can't be rewritten (or the payload handed back) until it is done
+        if( !zerocopy_wait( zerocopy, fd ) )
+            return false;
+    }
 
-    free( packet );
+    return true;
 }
 
 /* Note: This is messy, why do I have two packet types, there should only be one, with a shared type-space!
@@ -21,9 +21,10 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include "RingBuffer.h"
+#include "ZeroCopy.h"
 //#include "RingBuffer.h"
 
-#define GNW_VERSION  2
+#define GNW_VERSION  3
 
 #define GNW_MAGIC 0x55
 
@@ -35,6 +36,19 @@
 // OR'd for reply versions of the above
 #define GNW_REPLY    0x01
 
+// OR'd into GNW_DATA on every fragment of a message but the last, the rest follows in later frames from the same source
+#define GNW_MORE     0x08
+
+// OR'd into GNW_DATA when the payload starts with a u32 sequence number, for a GNW_POLICY_MERGE edge to put back
+// in order. Every fragment of a message carries the same number, and the router strips it before a merge delivers.
+#define GNW_SEQUENCED 0x04
+
+// The frame type with any flags stripped
+#define GNW_FRAME_TYPE( type ) ((type) & ~(GNW_MORE | GNW_SEQUENCED))
+
+// Data payloads bigger than this are sent as GNW_MORE fragments, so every frame fits any receive buffer
+#define GNW_FRAGMENT_SIZE (16 * 1024)
+
 // Used for wait commands that can accept any packet type
 #define GNW_ANY      0
 
@@ -50,21 +64,41 @@
 #define GNW_CMD_POLICY       0x3
 #define GNW_CMD_CONNECT      0x4
 #define GNW_CMD_DISCONNECT   0x5
+#define GNW_CMD_SHM_LINK     0x6 // Offer a shared-memory link (fds ride along as SCM_RIGHTS), the reply carries a u8 accepted flag
+#define GNW_CMD_CUT_THROUGH  0x7 // Direct node-to-node link for a 1:1 edge, followed by a GNW_CUT_* operation and the u32 source
+#define GNW_CMD_LATENCY      0x8 // Write coalescing budget for an address: u32 address, u32 microseconds (0 sends immediately)
+#define GNW_CMD_READ_WEIGHT  0x9 // Share of the router's reads for whichever connection binds an address: u32 address, u32 weight (0 is taken as 1)
+#define GNW_CMD_AFFINITY_KEY 0xA // Where an affinity source's keys come from: u32 address, u8 kind, u8 delimiter, u32 first, u32 length, then the JSON path
+#define GNW_CMD_EDGE_WEIGHT  0xB // Weight of an existing edge, for round-robin: u32 source, u32 target, u32 weight (0 is taken as 1)
 #define GNW_CMD_QUIT         0xff // Not implemented
 
+// Cut-through operations
+#define GNW_CUT_SEND      0x1 // Router -> source, with a descriptor: write this source's frames to it (then the u32 target)
+#define GNW_CUT_SWITCHED  0x2 // Source -> router, in-band: everything after this marker goes over the direct link
+#define GNW_CUT_RECEIVE   0x3 // Router -> target, with a descriptor: this source's frames now arrive on it
+#define GNW_CUT_CLOSE     0x4 // Router -> source: the edge changed, close the direct link and route through the router again
+#define GNW_CUT_STATS     0x5 // Source -> router: u32 packets, u32 bytes sent directly since the last report
+
 // Link Constants
 #define GNW_POLICY_BROADCAST  0
 #define GNW_POLICY_ANYCAST    1
 #define GNW_POLICY_ROUNDROBIN 2
-#define GNW_POLICY_MERGE      3
-#define GNW_POLICY_COMBINE    4
+#define GNW_POLICY_MERGE      3 // As broadcast, but each target gets GNW_SEQUENCED frames back in order, whichever source they came from
+#define GNW_POLICY_COMBINE    4 // Each target waits for one message from every source combining into it, and gets them as one frame
+#define GNW_POLICY_LEASTLOADED 5 // Each message to the target with the least output waiting in the router
+#define GNW_POLICY_TWOCHOICE   6 // Each message to the less loaded of two targets picked at random, so wide fan-outs stay O(1)
+#define GNW_POLICY_AFFINITY    7 // Each message to the target its key hashes to, so messages with the same key always meet
 
 #define GNW_MAX_LINKS  10
 
 // Router configuration
-#define ROUTER_BACKLOG 10
+#define ROUTER_BACKLOG 128 // Default listen() backlog, the router takes --backlog
 #define ROUTER_PORT    (const char *)("19000")
 
+// Local transports, the router listens on these alongside the TCP port
+#define ROUTER_UNIX_PATH      "/tmp/graphipc.sock"
+#define ROUTER_SEQPACKET_PATH "/tmp/graphipc.seqpacket"
+
 // The router itself is uid == 0, so no process can ever be this UID.
 #define UID_INVALID 0
 
@@ -88,12 +122,52 @@ typedef struct {
     uint32_t      length;
 } gnw_header_t;
 
+// The header as it appears on the wire (gnw_header_t is padded)
+#define GNW_HEADER_SIZE 11
+
 void gnw_format_address( char * buffer, gnw_address_t address );
 
 void gnw_dumpPacket( FILE * fd, unsigned char * buffer, ssize_t length );
 
 void gnw_emitPacket( int fd, unsigned char * buffer, size_t length );
 void gnw_emitDataPacket( int fd, gnw_address_t source,  unsigned char * buffer, ssize_t length );
+void gnw_emitDataFragment( int fd, gnw_address_t source, unsigned char * buffer, ssize_t length, bool more );
+
+/**
+ * Send one data frame exactly as given, flags and all. Nothing is split, so the payload must already fit in a frame.
+ *
+ * @param fd The socket to write to
+ * @param type GNW_DATA with any of GNW_MORE and GNW_SEQUENCED
+ * @param source The source address
+ * @param buffer The payload, including the sequence number if GNW_SEQUENCED
+ * @param length The payload length, at most GNW_FRAGMENT_SIZE
+ */
+void gnw_emitDataFrame( int fd, uint8_t type, gnw_address_t source, unsigned char * buffer, size_t length );
+
+/**
+ * Sends all of a message over a blocking socket, picking up after any short send. The message's iovecs are
+ * consumed as they go.
+ *
+ * @param fd A blocking socket
+ * @param zerocopy The socket's zero-copy state, or NULL to always copy
+ * @param message The message to send
+ * @return The bytes sent, which is short of the message only if the socket failed (errno says why)
+ */
+size_t gnw_sendAll( int fd, zerocopy_t * zerocopy, struct msghdr * message );
+
+/**
+ * As gnw_emitDataFragment(), but the payload is sent with MSG_ZEROCOPY rather than copied, in as few sends as
+ * possible. Returns once the kernel has finished with the payload, so the caller is free to reuse it.
+ *
+ * @param fd A blocking TCP socket
+ * @param zerocopy The socket's zero-copy state, from zerocopy_enable()
+ * @param source The source address
+ * @param buffer The payload
+ * @param length The payload length
+ * @param more True if the message continues in a later call
+ * @return False if the send failed
+ */
+bool gnw_emitDataZerocopy( int fd, zerocopy_t * zerocopy, gnw_address_t source, unsigned char * buffer, size_t length, bool more );
 void gnw_emitCommandPacket( int fd, uint8_t type, unsigned char * buffer, ssize_t length );
 
 void gnw_sendCommand( int fd, uint8_t command );
@@ -0,0 +1,72 @@
+/*
+ * GraphIPC
+ * Copyright (C) 2017  John Vidler (john@johnvidler.co.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include "Histogram.h"
+
+void histogram_reset( histogram_t * histogram ) {
+    memset( histogram, 0, sizeof(histogram_t) );
+}
+
+/**
+ * @return The bucket holding 'value'
+ */
+static int histogram_bucket( uint64_t value ) {
+    if( value < HISTOGRAM_STEPS )
+        return (int)value;
+
+    // The top bit picks the power of two, the bits under it pick the step
+    int shift = 63 - __builtin_clzll( value ) - HISTOGRAM_STEP_BITS;
+    return ((shift + 1) << HISTOGRAM_STEP_BITS) + (int)((value >> shift) & (HISTOGRAM_STEPS - 1));
+}
+
+/**
+ * @return The middle of the range of values 'bucket' holds
+ */
+static uint64_t histogram_value( int bucket ) {
+    if( bucket < HISTOGRAM_STEPS )
+        return (uint64_t)bucket;
+
+    int shift = (bucket >> HISTOGRAM_STEP_BITS) - 1;
+    uint64_t low = (uint64_t)(HISTOGRAM_STEPS + (bucket & (HISTOGRAM_STEPS - 1))) << shift;
+    return low + (((uint64_t)1 << shift) >> 1);
+}
+
+void histogram_record( histogram_t * histogram, uint64_t value ) {
+    histogram->buckets[histogram_bucket( value )]++;
+    histogram->count++;
+}
+
+uint64_t histogram_percentile( histogram_t * histogram, double percentile ) {
+    if( histogram->count == 0 )
+        return 0;
+
+    // The rank of the value we want, counting from 1
+    uint64_t rank = (uint64_t)(percentile / 100.0 * (double)histogram->count + 0.5);
+    if( rank < 1 )
+        rank = 1;
+    if( rank > histogram->count )
+        rank = histogram->count;
+
+    uint64_t seen = 0;
+    for( int i = 0; i < HISTOGRAM_BUCKETS; i++ ) {
+        seen += histogram->buckets[i];
+        if( seen >= rank )
+            return histogram_value( i );
+    }
+    return histogram_value( HISTOGRAM_BUCKETS - 1 );
+}
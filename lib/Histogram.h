@@ -0,0 +1,60 @@
+/*
+ * GraphIPC
+ * Copyright (C) 2017  John Vidler (john@johnvidler.co.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/*
+ * A fixed-size log-linear histogram, for latency percentiles.
+ *
+ * Each power of two is split into HISTOGRAM_STEPS equal buckets, so any value is recorded to
+ * within 1/HISTOGRAM_STEPS of itself, from 0 up to the full range of a uint64_t, in a few KB
+ * and without ever allocating. Recording is a handful of instructions, with no locking, so
+ * each thread keeps its own.
+ */
+
+#include <stdint.h>
+
+#define HISTOGRAM_STEP_BITS 3
+#define HISTOGRAM_STEPS (1 << HISTOGRAM_STEP_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_STEP_BITS + 1) * HISTOGRAM_STEPS)
+
+typedef struct {
+    uint64_t count;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+/**
+ * Empty a histogram.
+ *
+ * @param histogram The histogram to clear
+ */
+void histogram_reset( histogram_t * histogram );
+
+/**
+ * Count one value.
+ *
+ * @param histogram The histogram to add to
+ * @param value The value
+ */
+void histogram_record( histogram_t * histogram, uint64_t value );
+
+/**
+ * @param histogram The histogram to query
+ * @param percentile 0 to 100
+ * @return The value at the given percentile (the middle of its bucket), or 0 if the histogram is empty
+ */
+uint64_t histogram_percentile( histogram_t * histogram, double percentile );
@@ -0,0 +1,74 @@
+/*
+ * GraphIPC
+ * Copyright (C) 2017  John Vidler (john@johnvidler.co.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include "Mailbox.h"
+
+bool mailbox_init( mailbox_t * mailbox, size_t capacity ) {
+    size_t size = 2;
+    while( size < capacity )
+        size <<= 1;
+
+    mailbox->slots = (void **)calloc( size, sizeof(void *) );
+    if( mailbox->slots == NULL )
+        return false;
+
+    mailbox->mask = size - 1;
+    mailbox->head = 0;
+    mailbox->tail_cache = 0;
+    mailbox->tail = 0;
+    mailbox->head_cache = 0;
+    return true;
+}
+
+void mailbox_destroy( mailbox_t * mailbox ) {
+    free( mailbox->slots );
+    mailbox->slots = NULL;
+}
+
+bool mailbox_push( mailbox_t * mailbox, void * item ) {
+    size_t tail = mailbox->tail;
+
+    // Only re-read the consumer's index when our cached copy says we are full
+    if( tail - mailbox->head_cache > mailbox->mask ) {
+        mailbox->head_cache = __atomic_load_n( &mailbox->head, __ATOMIC_ACQUIRE );
+        if( tail - mailbox->head_cache > mailbox->mask )
+            return false;
+    }
+
+    mailbox->slots[tail & mailbox->mask] = item;
+    __atomic_store_n( &mailbox->tail, tail + 1, __ATOMIC_RELEASE );
+    return true;
+}
+
+void * mailbox_pop( mailbox_t * mailbox ) {
+    size_t head = mailbox->head;
+
+    if( head == mailbox->tail_cache ) {
+        mailbox->tail_cache = __atomic_load_n( &mailbox->tail, __ATOMIC_ACQUIRE );
+        if( head == mailbox->tail_cache )
+            return NULL;
+    }
+
+    void * item = mailbox->slots[head & mailbox->mask];
+    __atomic_store_n( &mailbox->head, head + 1, __ATOMIC_RELEASE );
+    return item;
+}
+
+size_t mailbox_length( mailbox_t * mailbox ) {
+    return __atomic_load_n( &mailbox->tail, __ATOMIC_ACQUIRE ) - __atomic_load_n( &mailbox->head, __ATOMIC_ACQUIRE );
+}
@@ -0,0 +1,84 @@
+/*
+ * GraphIPC
+ * Copyright (C) 2017  John Vidler (john@johnvidler.co.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/*
+ * A bounded, lock-free, single-producer/single-consumer queue of pointers.
+ *
+ * Exactly one thread may push and exactly one (other) thread may pop. The head and tail
+ * live on separate cache lines, and each side keeps a private copy of the other's index,
+ * so the shared lines are only touched when the cached view says the queue is full/empty.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define MAILBOX_CACHE_LINE 64
+
+typedef struct {
+    void ** slots;
+    size_t mask;
+
+    // Consumer side
+    size_t head __attribute__((aligned(MAILBOX_CACHE_LINE)));
+    size_t tail_cache;
+
+    // Producer side
+    size_t tail __attribute__((aligned(MAILBOX_CACHE_LINE)));
+    size_t head_cache;
+} mailbox_t;
+
+/**
+ * Sets up an empty mailbox.
+ *
+ * @param mailbox The mailbox to initialise
+ * @param capacity The number of slots, rounded up to a power of two
+ * @return True on success, false if the slots could not be allocated
+ */
+bool mailbox_init( mailbox_t * mailbox, size_t capacity );
+
+/**
+ * Releases the slot storage. Any items still queued are <strong>not</strong> freed.
+ *
+ * @param mailbox The mailbox to destroy
+ */
+void mailbox_destroy( mailbox_t * mailbox );
+
+/**
+ * Producer only. Queues 'item' at the tail.
+ *
+ * @param mailbox The mailbox to push to
+ * @param item The item to queue, must not be NULL
+ * @return True if the item was queued, false if the mailbox is full
+ */
+bool mailbox_push( mailbox_t * mailbox, void * item );
+
+/**
+ * Consumer only. Removes the item at the head.
+ *
+ * @param mailbox The mailbox to pop from
+ * @return The oldest item, or NULL if the mailbox is empty
+ */
+void * mailbox_pop( mailbox_t * mailbox );
+
+/**
+ * @param mailbox The mailbox to inspect
+ * @return The number of queued items, only a snapshot if called while the other side is active
+ */
+size_t mailbox_length( mailbox_t * mailbox );
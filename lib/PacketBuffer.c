@@ -0,0 +1,136 @@
+/*
+ * GraphIPC
+ * Copyright (C) 2017  John Vidler (john@johnvidler.co.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "PacketBuffer.h"
+#include "BufferPool.h"
+#include "packet.h"
+
+gnw_buf_t * gnw_buf_alloc( size_t length ) {
+    gnw_buf_t * buf = (gnw_buf_t *)bufpool_alloc( sizeof(gnw_buf_t) + GNW_BUF_HEADROOM + length );
+    if( buf == NULL )
+        return NULL;
+
+    // Whatever the size class rounded up to is usable
+    buf->capacity = (uint32_t)(bufpool_capacity( buf ) - sizeof(gnw_buf_t));
+    buf->refs = 1;
+    buf->offset = GNW_BUF_HEADROOM;
+    buf->length = 0;
+    return buf;
+}
+
+gnw_buf_t * gnw_buf_copy( const uint8_t * data, size_t length ) {
+    gnw_buf_t * buf = gnw_buf_alloc( length );
+    if( buf == NULL )
+        return NULL;
+
+    memcpy( gnw_buf_put( buf, length ), data, length );
+    return buf;
+}
+
+uint8_t * gnw_buf_put( gnw_buf_t * buf, size_t length ) {
+    if( buf->offset + buf->length + length > buf->capacity )
+        return NULL;
+
+    uint8_t * tail = gnw_buf_data( buf ) + buf->length;
+    buf->length += length;
+    return tail;
+}
+
+uint8_t * gnw_buf_push( gnw_buf_t * buf, size_t length ) {
+    if( length > buf->offset )
+        return NULL;
+
+    buf->offset -= length;
+    buf->length += length;
+    return gnw_buf_data( buf );
+}
+
+void gnw_buf_push_header( gnw_buf_t * buf, uint8_t type, gnw_address_t source ) {
+    uint32_t length = buf->length;
+
+    uint8_t * ptr = gnw_buf_push( buf, GNW_HEADER_SIZE );
+    ptr = packet_write_u8( ptr, GNW_MAGIC );
+    ptr = packet_write_u8( ptr, GNW_VERSION );
+    ptr = packet_write_u8( ptr, type );
+    ptr = packet_write_u32( ptr, source );
+    ptr = packet_write_u32( ptr, length );
+}
+
+gnw_buf_t * gnw_buf_ref( gnw_buf_t * buf ) {
+    __atomic_add_fetch( &buf->refs, 1, __ATOMIC_RELAXED );
+    return buf;
+}
+
+void gnw_buf_release( gnw_buf_t * buf ) {
+    if( buf == NULL )
+        return;
+
+    // Everything written through other references has to be finished with before the storage is reused
+    if( __atomic_sub_fetch( &buf->refs, 1, __ATOMIC_ACQ_REL ) != 0 )
+        return;
+
+    bufpool_free( buf );
+}
+
+/**
+ * @return True if the stream's fragments each carry its number
+ */
+static bool gnw_stream_sequenced( const gnw_stream_t * stream ) {
+    return GNW_FRAME_TYPE( stream->type ) == GNW_DATA && (stream->type & GNW_SEQUENCED);
+}
+
+size_t gnw_stream_start( gnw_stream_t * stream, uint8_t * data, size_t length ) {
+    if( length < GNW_HEADER_SIZE )
+        return 0;
+
+    gnw_header_t header;
+    uint8_t * payload = gnw_parse_header( data, &header );
+    stream->source = header.source;
+    stream->type = header.type;
+
+    size_t stamp = gnw_stream_sequenced( stream ) ? sizeof(uint32_t) : 0;
+    if( length < GNW_HEADER_SIZE + stamp || header.length < stamp )
+        return 0;
+
+    if( stamp > 0 )
+        packet_read_u32( payload, &stream->sequence );
+    stream->remaining = header.length - stamp;
+    return GNW_HEADER_SIZE + stamp;
+}
+
+size_t gnw_stream_next( const gnw_stream_t * stream ) {
+    // Room is left for the number, so no fragment comes out bigger than one sent whole would be
+    size_t limit = gnw_stream_sequenced( stream ) ? GNW_FRAGMENT_SIZE - sizeof(uint32_t) : GNW_FRAGMENT_SIZE;
+    return stream->remaining < limit ? stream->remaining : limit;
+}
+
+gnw_buf_t * gnw_stream_fragment( gnw_stream_t * stream, uint8_t * data ) {
+    size_t fragment = gnw_stream_next( stream );
+    gnw_buf_t * buf = gnw_buf_copy( data, fragment );
+    if( buf == NULL )
+        return NULL;
+
+    stream->remaining -= fragment;
+    if( gnw_stream_sequenced( stream ) )
+        packet_write_u32( gnw_buf_push( buf, sizeof(uint32_t) ), stream->sequence );
+
+    uint8_t type = stream->remaining > 0 ? GNW_DATA | GNW_MORE | (stream->type & GNW_SEQUENCED) : stream->type;
+    gnw_buf_push_header( buf, type, stream->source );
+    return buf;
+}
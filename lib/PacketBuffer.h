@@ -0,0 +1,146 @@
+/*
+ * GraphIPC
+ * Copyright (C) 2017  John Vidler (john@johnvidler.co.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/*
+ * Reference counted packet buffers.
+ *
+ * A frame is copied into a gnw_buf at most once, then every queue, shard or target that needs
+ * to hold on to it takes a reference rather than a copy. The last reference to go hands the
+ * storage back to the buffer pool. Each buffer keeps headroom in front of its data, so a
+ * payload can have its header written in front of it without moving.
+ *
+ * References may be taken and dropped from any thread.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include "GraphNetwork.h"
+
+// Room in front of the data for a frame header
+#define GNW_BUF_HEADROOM 16
+
+typedef struct gnw_buf {
+    uint32_t refs;
+    uint32_t capacity;    // Size of storage[]
+    uint32_t offset;      // Start of the data within storage[]
+    uint32_t length;      // Length of the data
+    uint8_t storage[];
+} gnw_buf_t;
+
+/**
+ * @return The start of the buffer's data
+ */
+static inline uint8_t * gnw_buf_data( gnw_buf_t * buf ) {
+    return buf->storage + buf->offset;
+}
+
+/**
+ * Fetch an empty buffer with room for at least 'length' bytes of data behind the headroom.
+ *
+ * @param length The space needed
+ * @return A buffer with a single reference, owned by the caller
+ */
+gnw_buf_t * gnw_buf_alloc( size_t length );
+
+/**
+ * Fetch a buffer holding a copy of 'data'.
+ *
+ * @param data The bytes to copy
+ * @param length The number of bytes
+ * @return A buffer with a single reference, owned by the caller
+ */
+gnw_buf_t * gnw_buf_copy( const uint8_t * data, size_t length );
+
+/**
+ * Extend the data at the end.
+ *
+ * @param buf The buffer to extend
+ * @param length The number of bytes to add
+ * @return Where to write the new bytes, or NULL if there isn't room
+ */
+uint8_t * gnw_buf_put( gnw_buf_t * buf, size_t length );
+
+/**
+ * Extend the data at the front, into the headroom.
+ *
+ * @param buf The buffer to extend
+ * @param length The number of bytes to add
+ * @return Where to write the new bytes (the new start of the data), or NULL if there isn't room
+ */
+uint8_t * gnw_buf_push( gnw_buf_t * buf, size_t length );
+
+/**
+ * Turn the buffer's data into a complete frame, by writing a header for it into the headroom.
+ *
+ * @param buf The buffer holding the payload
+ * @param type GNW_DATA, GNW_COMMAND or GNW_REPLY
+ * @param source The source address (0xFFFFFFFF for commands and replies)
+ */
+void gnw_buf_push_header( gnw_buf_t * buf, uint8_t type, gnw_address_t source );
+
+/**
+ * Take another reference.
+ *
+ * @param buf The buffer
+ * @return The same buffer, for convenience
+ */
+gnw_buf_t * gnw_buf_ref( gnw_buf_t * buf );
+
+/**
+ * Drop a reference, returning the buffer to the pool if it was the last one.
+ *
+ * @param buf The buffer (NULL is ignored)
+ */
+void gnw_buf_release( gnw_buf_t * buf );
+
+/*
+ * A frame too big to ever be held whole, passed on as GNW_MORE fragments as its payload arrives.
+ * A GNW_SEQUENCED data frame's number is taken off its front once, then stamped on every
+ * fragment, so whatever puts them back in order downstream finds each one numbered.
+ */
+typedef struct gnw_stream {
+    uint32_t remaining;      // Payload bytes still to come
+    gnw_address_t source;
+    uint8_t type;            // The frame's own type, which goes on the last fragment
+    uint32_t sequence;       // Its number, if GNW_SEQUENCED data
+} gnw_stream_t;
+
+/**
+ * Start streaming the frame at the front of 'data', taking its header (and number) off.
+ *
+ * @param stream The stream to start
+ * @param data The start of the frame
+ * @param length The bytes of it that have arrived
+ * @return The bytes taken off the front, or 0 if not enough has arrived yet
+ */
+size_t gnw_stream_start( gnw_stream_t * stream, uint8_t * data, size_t length );
+
+/**
+ * @return The payload bytes that go in the next fragment
+ */
+size_t gnw_stream_next( const gnw_stream_t * stream );
+
+/**
+ * Make the next fragment into a frame of its own.
+ *
+ * @param stream The stream it belongs to
+ * @param data The fragment's payload, gnw_stream_next() bytes of it
+ * @return A buffer holding the complete frame, owned by the caller, or NULL if there wasn't one to be had
+ */
+gnw_buf_t * gnw_stream_fragment( gnw_stream_t * stream, uint8_t * data );
@@ -0,0 +1,230 @@
+/*
+ * GraphIPC
+ * Copyright (C) 2017  John Vidler (john@johnvidler.co.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "Reactor.h"
+#include "klib/kvec.h"
+
+#ifdef REACTOR_USE_POLL
+#include <poll.h>
+
+struct reactor {
+    kvec_t( struct pollfd ) slots; // Densely packed, so poll() never walks empty entries
+    kvec_t( int ) index;           // fd -> slot, -1 if not monitored
+};
+
+static short reactor_to_poll( uint32_t events ) {
+    short out = 0;
+    if( events & REACTOR_READ )  out |= POLLIN;
+    if( events & REACTOR_WRITE ) out |= POLLOUT;
+    return out;
+}
+
+static uint32_t reactor_from_poll( short revents ) {
+    uint32_t out = 0;
+    if( revents & POLLIN )              out |= REACTOR_READ;
+    if( revents & POLLOUT )             out |= REACTOR_WRITE;
+    if( revents & POLLHUP )             out |= REACTOR_HANGUP;
+    if( revents & (POLLERR | POLLNVAL) ) out |= REACTOR_ERROR;
+    return out;
+}
+
+reactor_t * reactor_create() {
+    reactor_t * reactor = (reactor_t *)malloc( sizeof(reactor_t) );
+    if( reactor == NULL )
+        return NULL;
+
+    kv_init( reactor->slots );
+    kv_init( reactor->index );
+    return reactor;
+}
+
+void reactor_destroy( reactor_t * reactor ) {
+    if( reactor == NULL )
+        return;
+
+    kv_destroy( reactor->slots );
+    kv_destroy( reactor->index );
+    free( reactor );
+}
+
+int reactor_add( reactor_t * reactor, int fd, uint32_t events ) {
+    if( fd < 0 ) {
+        errno = EBADF;
+        return -1;
+    }
+
+    // Grow the fd index to cover this fd, marking any new space as unmonitored
+    while( kv_size( reactor->index ) <= (size_t)fd )
+        kv_push( int, reactor->index, -1 );
+
+    if( kv_A( reactor->index, fd ) != -1 ) {
+        errno = EEXIST;
+        return -1;
+    }
+
+    struct pollfd slot = { .fd = fd, .events = reactor_to_poll( events ), .revents = 0 };
+    kv_push( struct pollfd, reactor->slots, slot );
+    kv_A( reactor->index, fd ) = (int)kv_size( reactor->slots ) - 1;
+
+    return 0;
+}
+
+int reactor_modify( reactor_t * reactor, int fd, uint32_t events ) {
+    if( fd < 0 || (size_t)fd >= kv_size( reactor->index ) || kv_A( reactor->index, fd ) == -1 ) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    kv_A( reactor->slots, kv_A( reactor->index, fd ) ).events = reactor_to_poll( events );
+    return 0;
+}
+
+int reactor_remove( reactor_t * reactor, int fd ) {
+    if( fd < 0 || (size_t)fd >= kv_size( reactor->index ) || kv_A( reactor->index, fd ) == -1 ) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    // Swap the last slot into the hole, so the poll list stays dense
+    int slot = kv_A( reactor->index, fd );
+    struct pollfd last = kv_pop( reactor->slots );
+    if( (size_t)slot < kv_size( reactor->slots ) ) {
+        kv_A( reactor->slots, slot ) = last;
+        kv_A( reactor->index, last.fd ) = slot;
+    }
+    kv_A( reactor->index, fd ) = -1;
+
+    return 0;
+}
+
+int reactor_wait( reactor_t * reactor, reactor_event_t * events, int max_events, int timeout ) {
+    int ready = poll( reactor->slots.a, kv_size( reactor->slots ), timeout );
+    if( ready < 1 )
+        return ready;
+
+    int count = 0;
+    for( size_t i = 0; i < kv_size( reactor->slots ) && count < max_events; i++ ) {
+        struct pollfd * slot = &kv_A( reactor->slots, i );
+        if( slot->revents == 0 )
+            continue;
+
+        events[count].fd = slot->fd;
+        events[count].events = reactor_from_poll( slot->revents );
+        slot->revents = 0;
+        count++;
+    }
+
+    return count;
+}
+
+const char * reactor_backend() {
+    return "poll";
+}
+
+#else
+#include <sys/epoll.h>
+
+struct reactor {
+    int epoll_fd;
+    struct epoll_event * ready;
+    int ready_length;
+};
+
+static uint32_t reactor_to_epoll( uint32_t events ) {
+    uint32_t out = EPOLLRDHUP;
+    if( events & REACTOR_READ )  out |= EPOLLIN;
+    if( events & REACTOR_WRITE ) out |= EPOLLOUT;
+    if( !(events & REACTOR_LEVEL) )
+        out |= EPOLLET;
+    return out;
+}
+
+static uint32_t reactor_from_epoll( uint32_t events ) {
+    uint32_t out = 0;
+    if( events & EPOLLIN )                  out |= REACTOR_READ;
+    if( events & EPOLLOUT )                 out |= REACTOR_WRITE;
+    if( events & (EPOLLHUP | EPOLLRDHUP) )  out |= REACTOR_HANGUP;
+    if( events & EPOLLERR )                 out |= REACTOR_ERROR;
+    return out;
+}
+
+reactor_t * reactor_create() {
+    reactor_t * reactor = (reactor_t *)malloc( sizeof(reactor_t) );
+    if( reactor == NULL )
+        return NULL;
+
+    reactor->epoll_fd = epoll_create1( EPOLL_CLOEXEC );
+    if( reactor->epoll_fd == -1 ) {
+        free( reactor );
+        return NULL;
+    }
+
+    reactor->ready = NULL;
+    reactor->ready_length = 0;
+    return reactor;
+}
+
+void reactor_destroy( reactor_t * reactor ) {
+    if( reactor == NULL )
+        return;
+
+    close( reactor->epoll_fd );
+    free( reactor->ready );
+    free( reactor );
+}
+
+int reactor_add( reactor_t * reactor, int fd, uint32_t events ) {
+    struct epoll_event event = { .events = reactor_to_epoll( events ), .data.fd = fd };
+    return epoll_ctl( reactor->epoll_fd, EPOLL_CTL_ADD, fd, &event );
+}
+
+int reactor_modify( reactor_t * reactor, int fd, uint32_t events ) {
+    struct epoll_event event = { .events = reactor_to_epoll( events ), .data.fd = fd };
+    return epoll_ctl( reactor->epoll_fd, EPOLL_CTL_MOD, fd, &event );
+}
+
+int reactor_remove( reactor_t * reactor, int fd ) {
+    return epoll_ctl( reactor->epoll_fd, EPOLL_CTL_DEL, fd, NULL );
+}
+
+int reactor_wait( reactor_t * reactor, reactor_event_t * events, int max_events, int timeout ) {
+    if( reactor->ready_length < max_events ) {
+        struct epoll_event * ready = (struct epoll_event *)realloc( reactor->ready, sizeof(struct epoll_event) * max_events );
+        if( ready == NULL )
+            return -1;
+        reactor->ready = ready;
+        reactor->ready_length = max_events;
+    }
+
+    int count = epoll_wait( reactor->epoll_fd, reactor->ready, max_events, timeout );
+    for( int i = 0; i < count; i++ ) {
+        events[i].fd = reactor->ready[i].data.fd;
+        events[i].events = reactor_from_epoll( reactor->ready[i].events );
+    }
+
+    return count;
+}
+
+const char * reactor_backend() {
+    return "epoll";
+}
+
+#endif
@@ -0,0 +1,102 @@
+/*
+ * GraphIPC
+ * Copyright (C) 2017  John Vidler (john@johnvidler.co.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Interest/readiness flags, OR'd together
+#define REACTOR_READ    0x01
+#define REACTOR_WRITE   0x02
+#define REACTOR_HANGUP  0x04
+#define REACTOR_ERROR   0x08
+
+// Request level-triggered notification for this fd (default is edge-triggered where supported)
+#define REACTOR_LEVEL   0x80
+
+typedef struct {
+    int      fd;
+    uint32_t events;
+} reactor_event_t;
+
+typedef struct reactor reactor_t;
+
+/**
+ * Builds a new, empty reactor using the compiled-in backend (epoll, unless built with REACTOR_USE_POLL).
+ *
+ * @return The new reactor, or NULL if the backend could not be initialised
+ */
+reactor_t * reactor_create();
+
+/**
+ * Releases the reactor. Any monitored file descriptors are <strong>not</strong> closed.
+ *
+ * @param reactor The reactor to destroy
+ */
+void reactor_destroy( reactor_t * reactor );
+
+/**
+ * Starts monitoring 'fd' for the supplied interest flags.
+ *
+ * On the epoll backend notifications are edge-triggered unless REACTOR_LEVEL is set, so
+ * callers must always drain a descriptor until it would block before waiting again.
+ *
+ * @param reactor The reactor to add to
+ * @param fd The file descriptor to monitor
+ * @param events REACTOR_READ and/or REACTOR_WRITE, optionally with REACTOR_LEVEL
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int reactor_add( reactor_t * reactor, int fd, uint32_t events );
+
+/**
+ * Replaces the interest flags for an already monitored fd.
+ *
+ * @param reactor The reactor to modify
+ * @param fd The monitored file descriptor
+ * @param events The new interest flags
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int reactor_modify( reactor_t * reactor, int fd, uint32_t events );
+
+/**
+ * Stops monitoring 'fd'. Must be called before the fd is closed.
+ *
+ * @param reactor The reactor to remove from
+ * @param fd The file descriptor to forget
+ * @return 0 on success, -1 if the fd was not being monitored
+ */
+int reactor_remove( reactor_t * reactor, int fd );
+
+/**
+ * Waits for up to 'timeout' milliseconds for readiness on any monitored fd.
+ *
+ * Only descriptors that are actually ready are reported, so the cost of a wakeup is
+ * proportional to the number of active descriptors on the epoll backend.
+ *
+ * @param reactor The reactor to wait on
+ * @param events Array to fill with ready descriptors
+ * @param max_events The length of the 'events' array
+ * @param timeout Timeout in milliseconds, -1 to block indefinitely, 0 to return immediately
+ * @return The number of events written, 0 on timeout, or -1 on error
+ */
+int reactor_wait( reactor_t * reactor, reactor_event_t * events, int max_events, int timeout );
+
+/**
+ * @return A printable name for the compiled-in backend
+ */
+const char * reactor_backend();
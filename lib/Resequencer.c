@@ -0,0 +1,149 @@
+/*
+ * GraphIPC
+ * Copyright (C) 2017  John Vidler (john@johnvidler.co.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "Resequencer.h"
+
+bool reseq_init( reseq_t * reseq, uint32_t window, void (*release)( void * part ) ) {
+    memset( reseq, 0, sizeof(reseq_t) );
+    reseq->slots = (reseq_slot_t *)calloc( window, sizeof(reseq_slot_t) );
+    if( reseq->slots == NULL )
+        return false;
+
+    reseq->window = window;
+    reseq->release = release;
+    return true;
+}
+
+/**
+ * Drop whatever a slot holds, keeping its storage for the next message.
+ */
+static void reseq_clear( reseq_t * reseq, reseq_slot_t * slot ) {
+    for( size_t i = 0; i < slot->count; i++ )
+        reseq->release( slot->parts[i] );
+    slot->count = 0;
+    slot->complete = false;
+}
+
+void reseq_destroy( reseq_t * reseq ) {
+    for( uint32_t i = 0; i < reseq->window; i++ ) {
+        // The head's parts before 'popped' have already been handed out
+        reseq_slot_t * slot = &reseq->slots[i];
+        size_t from = i == reseq->head ? reseq->popped : 0;
+        for( size_t j = from; j < slot->count; j++ )
+            reseq->release( slot->parts[j] );
+        free( slot->parts );
+    }
+    free( reseq->slots );
+    memset( reseq, 0, sizeof(reseq_t) );
+}
+
+/**
+ * Move the window on by one number.
+ */
+static void reseq_advance( reseq_t * reseq ) {
+    reseq->next++;
+    reseq->head = reseq->head + 1 == reseq->window ? 0 : reseq->head + 1;
+}
+
+int reseq_insert( reseq_t * reseq, uint32_t sequence, void * part, bool last ) {
+    int32_t distance = (int32_t)(sequence - reseq->next);
+
+    if( distance < 0 ) {
+        if( distance < -(int64_t)reseq->window )
+            return RESEQ_RESTART;
+        reseq->late++;
+        return RESEQ_LATE;
+    }
+
+    if( (uint32_t)distance >= reseq->window ) {
+        if( reseq->held > 0 )
+            return RESEQ_AHEAD;
+
+        // Nothing to wait for, so just jump
+        reseq->skipped += (uint32_t)distance;
+        reseq->next = sequence;
+        distance = 0;
+    }
+
+    reseq_slot_t * slot = &reseq->slots[(reseq->head + (uint32_t)distance) % reseq->window];
+
+    // A second copy of a message that is already whole is as good as late
+    if( slot->complete ) {
+        reseq->late++;
+        return RESEQ_LATE;
+    }
+
+    if( slot->count == slot->capacity ) {
+        size_t capacity = slot->capacity == 0 ? 4 : slot->capacity * 2;
+        void ** parts = (void **)realloc( slot->parts, capacity * sizeof(void *) );
+        if( parts == NULL ) {
+            // Dropped like a late part, rather than wedging the caller
+            reseq->late++;
+            return RESEQ_LATE;
+        }
+        slot->parts = parts;
+        slot->capacity = capacity;
+    }
+
+    if( slot->count == 0 )
+        reseq->held++;
+    slot->parts[slot->count++] = part;
+    slot->complete = last;
+    return RESEQ_HELD;
+}
+
+void * reseq_pop( reseq_t * reseq ) {
+    reseq_slot_t * slot = &reseq->slots[reseq->head];
+    if( !slot->complete )
+        return NULL;
+
+    void * part = slot->parts[reseq->popped++];
+    if( reseq->popped == slot->count ) {
+        slot->count = 0;
+        slot->complete = false;
+        reseq->popped = 0;
+        reseq->held--;
+        reseq->released++;
+        reseq_advance( reseq );
+    }
+    return part;
+}
+
+uint32_t reseq_skip( reseq_t * reseq ) {
+    if( reseq->held == 0 || reseq->slots[reseq->head].complete )
+        return 0;
+
+    uint32_t skipped = 0;
+    do {
+        reseq_slot_t * slot = &reseq->slots[reseq->head];
+        if( slot->count > 0 ) {
+            reseq_clear( reseq, slot );
+            reseq->held--;
+        }
+        reseq_advance( reseq );
+        skipped++;
+    } while( reseq->held > 0 && reseq->slots[reseq->head].count == 0 );
+
+    reseq->skipped += skipped;
+    return skipped;
+}
+
+void reseq_restart( reseq_t * reseq, uint32_t sequence ) {
+    reseq->next = sequence;
+}
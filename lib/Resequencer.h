@@ -0,0 +1,125 @@
+/*
+ * GraphIPC
+ * Copyright (C) 2017  John Vidler (john@johnvidler.co.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/*
+ * Puts numbered messages back in order.
+ *
+ * Messages are inserted as they arrive, stamped with a sequence number, and come back out of
+ * reseq_pop() strictly in sequence. A message may arrive as several parts (fragments), all with
+ * the same number, and is only released once its last part is in. Only 'window' numbers past the
+ * one due next can be held; the owner decides when a missing number is given up on, by calling
+ * reseq_skip(), whether that's on a timeout or to make room.
+ *
+ * Numbers are 32 bit and wrap, so the window must be well under 2^31.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// reseq_insert() results
+#define RESEQ_HELD    0 // Taken, to be released in its turn
+#define RESEQ_LATE    1 // Its number was already released or given up on, the caller keeps the part
+#define RESEQ_AHEAD   2 // Too far past the window, the caller keeps the part and has to reseq_skip() to make room
+#define RESEQ_RESTART 3 // So far behind that the sender must have started counting again, see reseq_restart()
+
+/** One sequence number's message, as much of it as has arrived */
+typedef struct {
+    void ** parts;
+    size_t count;
+    size_t capacity;
+    bool complete;  // The last part is in
+} reseq_slot_t;
+
+typedef struct {
+    reseq_slot_t * slots;
+    uint32_t window;
+    uint32_t head;    // The slot of the number due next
+    uint32_t next;    // The number due next
+    uint32_t held;    // Slots holding anything, complete or not
+    size_t popped;    // Parts of the head message already handed out
+    void (*release)( void * part );
+
+    uint64_t released; // Messages handed out in order
+    uint64_t skipped;  // Numbers given up on
+    uint64_t late;     // Parts that arrived after their number was released or given up on
+} reseq_t;
+
+/**
+ * Sets up an empty resequencer, expecting 0 first.
+ *
+ * @param reseq The resequencer to initialise
+ * @param window How many numbers may be held, counting from the one due next
+ * @param release Frees a part that is dropped, when an unfinished message is given up on or on destroy
+ * @return True on success, false if the slots could not be allocated
+ */
+bool reseq_init( reseq_t * reseq, uint32_t window, void (*release)( void * part ) );
+
+/**
+ * Releases every part still held.
+ *
+ * @param reseq The resequencer to destroy
+ */
+void reseq_destroy( reseq_t * reseq );
+
+/**
+ * Hold one part of a message until its turn.
+ *
+ * If nothing at all is held, a number past the window just moves the window up to it, giving up
+ * on everything in between.
+ *
+ * @param reseq The resequencer
+ * @param sequence The message's number
+ * @param part The part, owned by the resequencer if this returns RESEQ_HELD
+ * @param last True if this is the message's last part
+ * @return RESEQ_HELD, RESEQ_LATE, RESEQ_AHEAD or RESEQ_RESTART
+ */
+int reseq_insert( reseq_t * reseq, uint32_t sequence, void * part, bool last );
+
+/**
+ * Take the next part due out, if the message it belongs to is complete.
+ *
+ * @param reseq The resequencer
+ * @return The part, now owned by the caller, or NULL if the number due next isn't complete yet
+ */
+void * reseq_pop( reseq_t * reseq );
+
+/**
+ * Give up on the number due next, and every missing number after it, up to the next that has
+ * something held. Any parts of an unfinished message given up on are released.
+ *
+ * @param reseq The resequencer
+ * @return The count of numbers given up on, 0 if nothing is held or the next message is ready to pop
+ */
+uint32_t reseq_skip( reseq_t * reseq );
+
+/**
+ * Start counting again from 'sequence'. Only valid once nothing is held.
+ *
+ * @param reseq The resequencer
+ * @param sequence The number due next
+ */
+void reseq_restart( reseq_t * reseq, uint32_t sequence );
+
+/**
+ * @return True if messages are held behind a number that hasn't arrived (or finished arriving)
+ */
+static inline bool reseq_waiting( reseq_t * reseq ) {
+    return reseq->held > 0 && !reseq->slots[reseq->head].complete;
+}
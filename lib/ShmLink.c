@@ -0,0 +1,254 @@
+/*
+ * GraphIPC
+ * Copyright (C) 2017  John Vidler (john@johnvidler.co.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include "ShmLink.h"
+
+#define SHMLINK_MAGIC 0x4c574e47 // "GNWL"
+#define SHMLINK_HEADER_SIZE 4096
+
+// Once sealed, the memfd can never change size, so neither end can be made to fault on its mapping
+#define SHMLINK_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+
+/** Lives at the start of the memfd, the two rings' data follows it */
+typedef struct {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t capacity;
+    shmlink_control_t ring[2];
+} shmlink_header_t;
+
+static void shmlink_ring_bell( int fd ) {
+    eventfd_write( fd, 1 );
+}
+
+static void shmlink_map_rings( shmlink_t * link, int tx ) {
+    shmlink_header_t * header = (shmlink_header_t *)link->mapping;
+    uint8_t * data = (uint8_t *)link->mapping + SHMLINK_HEADER_SIZE;
+
+    link->tx.control = &header->ring[tx];
+    link->tx.data = data + (tx * header->capacity);
+    link->tx.mask = header->capacity - 1;
+    link->tx.cache = 0;
+
+    link->rx.control = &header->ring[1 - tx];
+    link->rx.data = data + ((1 - tx) * header->capacity);
+    link->rx.mask = header->capacity - 1;
+    link->rx.cache = 0;
+}
+
+int shmlink_create( shmlink_t * link, size_t capacity ) {
+    size_t size = 4096;
+    while( size < capacity )
+        size <<= 1;
+
+    memset( link, 0, sizeof(shmlink_t) );
+    link->bell = link->peer_bell = -1;
+    link->mapping_size = SHMLINK_HEADER_SIZE + (2 * size);
+
+    link->memfd = memfd_create( "graphipc-link", MFD_CLOEXEC | MFD_ALLOW_SEALING );
+    if( link->memfd == -1 )
+        return -errno;
+
+    link->bell = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    link->peer_bell = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    if( link->bell == -1 || link->peer_bell == -1 || ftruncate( link->memfd, link->mapping_size ) == -1 ||
+        fcntl( link->memfd, F_ADD_SEALS, SHMLINK_SEALS ) == -1 ) {
+        int error = errno;
+        shmlink_destroy( link );
+        return -error;
+    }
+
+    link->mapping = mmap( NULL, link->mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, link->memfd, 0 );
+    if( link->mapping == MAP_FAILED ) {
+        int error = errno;
+        link->mapping = NULL;
+        shmlink_destroy( link );
+        return -error;
+    }
+
+    shmlink_header_t * header = (shmlink_header_t *)link->mapping;
+    header->magic = SHMLINK_MAGIC;
+    header->capacity = size;
+
+    // Both readers start idle, so the very first write on each side rings
+    header->ring[0].reader_idle = 1;
+    header->ring[1].reader_idle = 1;
+
+    shmlink_map_rings( link, 0 );
+    return 0;
+}
+
+int shmlink_attach( shmlink_t * link, int memfd, int bell, int peer_bell ) {
+    memset( link, 0, sizeof(shmlink_t) );
+    link->memfd = memfd;
+    link->bell = bell;
+    link->peer_bell = peer_bell;
+
+    // The peer could otherwise truncate the file under our mapping, and the next ring access would take SIGBUS
+    int seals = fcntl( memfd, F_GET_SEALS );
+    if( seals == -1 || (seals & SHMLINK_SEALS) != SHMLINK_SEALS ) {
+        shmlink_destroy( link );
+        return -EPERM;
+    }
+
+    struct stat info;
+    if( fstat( memfd, &info ) == -1 ) {
+        int error = errno;
+        shmlink_destroy( link );
+        return -error;
+    }
+
+    link->mapping_size = (size_t)info.st_size;
+    if( link->mapping_size < SHMLINK_HEADER_SIZE ) {
+        shmlink_destroy( link );
+        return -EINVAL;
+    }
+
+    link->mapping = mmap( NULL, link->mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0 );
+    if( link->mapping == MAP_FAILED ) {
+        int error = errno;
+        link->mapping = NULL;
+        shmlink_destroy( link );
+        return -error;
+    }
+
+    // The peer built this, so check it describes exactly what we mapped
+    shmlink_header_t * header = (shmlink_header_t *)link->mapping;
+    uint64_t capacity = header->capacity;
+    if( header->magic != SHMLINK_MAGIC || capacity == 0 || (capacity & (capacity - 1)) != 0 ||
+        SHMLINK_HEADER_SIZE + (2 * capacity) != link->mapping_size ) {
+        shmlink_destroy( link );
+        return -EINVAL;
+    }
+
+    shmlink_map_rings( link, 1 );
+    return 0;
+}
+
+void shmlink_destroy( shmlink_t * link ) {
+    if( link->mapping != NULL )
+        munmap( link->mapping, link->mapping_size );
+    link->mapping = NULL;
+
+    if( link->memfd != -1 )
+        close( link->memfd );
+    if( link->bell != -1 )
+        close( link->bell );
+    if( link->peer_bell != -1 )
+        close( link->peer_bell );
+    link->memfd = link->bell = link->peer_bell = -1;
+}
+
+ssize_t shmlink_write( shmlink_t * link, const void * buffer, size_t length ) {
+    shmlink_ring_t * ring = &link->tx;
+    shmlink_control_t * control = ring->control;
+    uint64_t capacity = ring->mask + 1;
+    uint64_t tail = control->tail;
+
+    if( tail - ring->cache > capacity || capacity - (tail - ring->cache) < length )
+        ring->cache = __atomic_load_n( &control->head, __ATOMIC_ACQUIRE );
+
+    if( tail - ring->cache > capacity )
+        return -1;
+
+    uint64_t space = capacity - (tail - ring->cache);
+    if( space < length ) {
+        // It won't all fit, so ask to be rung once the reader moves, then look again in case it already has
+        __atomic_store_n( &control->writer_blocked, 1, __ATOMIC_RELAXED );
+        __atomic_thread_fence( __ATOMIC_SEQ_CST );
+        ring->cache = __atomic_load_n( &control->head, __ATOMIC_ACQUIRE );
+
+        if( tail - ring->cache > capacity )
+            return -1;
+
+        space = capacity - (tail - ring->cache);
+        if( space == 0 )
+            return 0;
+    }
+
+    if( length > space )
+        length = space;
+
+    size_t offset = tail & ring->mask;
+    size_t first = capacity - offset < length ? capacity - offset : length;
+    memcpy( ring->data + offset, buffer, first );
+    memcpy( ring->data, (const uint8_t *)buffer + first, length - first );
+
+    __atomic_store_n( &control->tail, tail + length, __ATOMIC_RELEASE );
+
+    // Pairs with the fence in shmlink_read, one of us is guaranteed to see the other
+    __atomic_thread_fence( __ATOMIC_SEQ_CST );
+    if( __atomic_load_n( &control->reader_idle, __ATOMIC_RELAXED ) && __atomic_exchange_n( &control->reader_idle, 0, __ATOMIC_ACQ_REL ) )
+        shmlink_ring_bell( link->peer_bell );
+
+    return length;
+}
+
+ssize_t shmlink_read( shmlink_t * link, void * buffer, size_t length ) {
+    shmlink_ring_t * ring = &link->rx;
+    shmlink_control_t * control = ring->control;
+    uint64_t capacity = ring->mask + 1;
+    uint64_t head = control->head;
+
+    if( ring->cache == head )
+        ring->cache = __atomic_load_n( &control->tail, __ATOMIC_ACQUIRE );
+
+    if( ring->cache == head ) {
+        // Mark ourselves idle so the next write rings, then look again in case it already happened
+        __atomic_store_n( &control->reader_idle, 1, __ATOMIC_RELAXED );
+        __atomic_thread_fence( __ATOMIC_SEQ_CST );
+        ring->cache = __atomic_load_n( &control->tail, __ATOMIC_ACQUIRE );
+
+        if( ring->cache == head )
+            return 0;
+
+        __atomic_store_n( &control->reader_idle, 0, __ATOMIC_RELAXED );
+    }
+
+    uint64_t available = ring->cache - head;
+    if( available > capacity )
+        return -1;
+
+    if( length > available )
+        length = available;
+
+    size_t offset = head & ring->mask;
+    size_t first = capacity - offset < length ? capacity - offset : length;
+    memcpy( buffer, ring->data + offset, first );
+    memcpy( (uint8_t *)buffer + first, ring->data, length - first );
+
+    __atomic_store_n( &control->head, head + length, __ATOMIC_RELEASE );
+
+    __atomic_thread_fence( __ATOMIC_SEQ_CST );
+    if( __atomic_load_n( &control->writer_blocked, __ATOMIC_RELAXED ) && __atomic_exchange_n( &control->writer_blocked, 0, __ATOMIC_ACQ_REL ) )
+        shmlink_ring_bell( link->peer_bell );
+
+    return length;
+}
+
+void shmlink_clear( shmlink_t * link ) {
+    eventfd_t count;
+    eventfd_read( link->bell, &count );
+}
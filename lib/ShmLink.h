@@ -0,0 +1,125 @@
+/*
+ * GraphIPC
+ * Copyright (C) 2017  John Vidler (john@johnvidler.co.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/*
+ * A bidirectional shared-memory link between two processes on the same host.
+ *
+ * One memfd holds a single-producer/single-consumer byte ring per direction, so each side
+ * reads and writes a plain byte stream, exactly as it would a stream socket. Every side
+ * also owns an eventfd 'bell' that the peer rings, but only when it has to: a reader that
+ * found its ring empty is marked idle and gets rung on the next write, and a writer that
+ * found its ring full gets rung once the reader frees some space. A busy link makes no
+ * syscalls at all.
+ *
+ * The creating side passes the memfd and both bells to its peer (over SCM_RIGHTS), and the
+ * peer attaches with the rings swapped.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define SHMLINK_CACHE_LINE 64
+#define SHMLINK_DEFAULT_CAPACITY (1024*1024)
+
+/** The shared control block for one direction; each index sits on its own cache line */
+typedef struct {
+    uint64_t head __attribute__((aligned(SHMLINK_CACHE_LINE))); // Advanced by the reader
+    uint32_t writer_blocked;                                      // Writer found the ring full, ring it on progress
+    uint64_t tail __attribute__((aligned(SHMLINK_CACHE_LINE))); // Advanced by the writer
+    uint32_t reader_idle;                                         // Reader found the ring empty, ring it on the next write
+} shmlink_control_t;
+
+/** One side's private view of one direction */
+typedef struct {
+    shmlink_control_t * control;
+    uint8_t * data;
+    uint64_t mask;
+    uint64_t cache; // Last seen index of the other end, so its cache line is only touched when needed
+} shmlink_ring_t;
+
+typedef struct {
+    int memfd;
+    int bell;      // Rung by the peer, wait on this for readability
+    int peer_bell; // Rung by us to wake the peer
+
+    void * mapping;
+    size_t mapping_size;
+
+    shmlink_ring_t tx;
+    shmlink_ring_t rx;
+} shmlink_t;
+
+/**
+ * Builds a new link, with a fresh memfd and a pair of bells.
+ *
+ * @param link The link to initialise
+ * @param capacity The size of each ring in bytes, rounded up to a power of two
+ * @return 0 on success, or -errno on failure
+ */
+int shmlink_create( shmlink_t * link, size_t capacity );
+
+/**
+ * Attaches to a link built by the peer, taking ownership of the descriptors.
+ *
+ * The ring the creator writes is the one we read, and vice versa.
+ *
+ * @param link The link to initialise
+ * @param memfd The shared memory the creator passed over
+ * @param bell The bell we wait on (the creator's peer_bell)
+ * @param peer_bell The bell we ring (the creator's bell)
+ * @return 0 on success, or -errno on failure (the descriptors are still closed)
+ */
+int shmlink_attach( shmlink_t * link, int memfd, int bell, int peer_bell );
+
+/**
+ * Unmaps the link and closes every descriptor it holds.
+ *
+ * @param link The link to destroy
+ */
+void shmlink_destroy( shmlink_t * link );
+
+/**
+ * Copies as much of 'buffer' into the outgoing ring as will fit, ringing the peer if it was idle.
+ *
+ * @param link The link to write to
+ * @param buffer The bytes to send
+ * @param length The number of bytes to send
+ * @return The number of bytes written, or -1 if the ring is corrupt. If that is short of 'length' the ring
+ *         filled up, and the peer rings us once it drains some.
+ */
+ssize_t shmlink_write( shmlink_t * link, const void * buffer, size_t length );
+
+/**
+ * Copies up to 'length' bytes out of the incoming ring, ringing the peer if it was blocked on space.
+ *
+ * @param link The link to read from
+ * @param buffer Where to copy to
+ * @param length The space available in 'buffer'
+ * @return The number of bytes read (0 if the ring is empty, the peer rings us on its next write), or -1 if the ring is corrupt
+ */
+ssize_t shmlink_read( shmlink_t * link, void * buffer, size_t length );
+
+/**
+ * Resets our bell after a wakeup, so the next ring is seen as a fresh event.
+ *
+ * @param link The link whose bell to clear
+ */
+void shmlink_clear( shmlink_t * link );
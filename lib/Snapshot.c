@@ -0,0 +1,125 @@
+/*
+ * GraphIPC
+ * Copyright (C) 2017  John Vidler (john@johnvidler.co.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "Snapshot.h"
+
+bool snapshot_init( snapshot_t * snapshot, size_t readers, void (*release)( void * value ) ) {
+    memset( snapshot, 0, sizeof(snapshot_t) );
+
+    void * slots = NULL;
+    if( posix_memalign( &slots, SNAPSHOT_CACHE_LINE, sizeof(snapshot_reader_t) * (readers > 0 ? readers : 1) ) != 0 )
+        return false;
+    memset( slots, 0, sizeof(snapshot_reader_t) * (readers > 0 ? readers : 1) );
+
+    snapshot->readers = (snapshot_reader_t *)slots;
+    snapshot->reader_count = readers;
+    snapshot->release = release;
+    return true;
+}
+
+void snapshot_destroy( snapshot_t * snapshot ) {
+    while( snapshot->retired != NULL ) {
+        snapshot_retired_t * retired = snapshot->retired;
+        snapshot->retired = retired->next;
+        snapshot->release( retired->value );
+        free( retired );
+    }
+
+    if( snapshot->current != NULL )
+        snapshot->release( snapshot->current );
+    snapshot->current = NULL;
+
+    free( snapshot->readers );
+    snapshot->readers = NULL;
+}
+
+void snapshot_publish( snapshot_t * snapshot, void * value ) {
+    void * previous = snapshot->current;
+    uint64_t generation = snapshot->generation + 1;
+
+    // The pointer goes first, so a reader that sees the new generation is sure to see this copy (or a later one).
+    // The sequence is odd in between, so a reader can't pair this copy with the generation before it.
+    __atomic_store_n( &snapshot->sequence, snapshot->sequence + 1, __ATOMIC_RELAXED );
+    __atomic_store_n( &snapshot->current, value, __ATOMIC_RELEASE );
+    __atomic_store_n( &snapshot->generation, generation, __ATOMIC_RELEASE );
+    __atomic_store_n( &snapshot->sequence, snapshot->sequence + 1, __ATOMIC_RELEASE );
+
+    if( previous != NULL ) {
+        snapshot_retired_t * retired = (snapshot_retired_t *)malloc( sizeof(snapshot_retired_t) );
+        if( retired == NULL ) {
+            // Better to leak one copy than free it under a reader
+            return;
+        }
+        retired->value = previous;
+        retired->generation = generation;
+        retired->next = snapshot->retired;
+        snapshot->retired = retired;
+    }
+
+    snapshot_reclaim( snapshot );
+}
+
+size_t snapshot_reclaim( snapshot_t * snapshot ) {
+    if( snapshot->retired == NULL )
+        return 0;
+
+    uint64_t oldest = snapshot->generation;
+    for( size_t i = 0; i < snapshot->reader_count; i++ ) {
+        uint64_t seen = __atomic_load_n( &snapshot->readers[i].generation, __ATOMIC_ACQUIRE );
+        if( seen < oldest )
+            oldest = seen;
+    }
+
+    size_t waiting = 0;
+    snapshot_retired_t ** link = &snapshot->retired;
+    while( *link != NULL ) {
+        snapshot_retired_t * retired = *link;
+
+        // Every reader has fetched the copy that replaced this one, or something newer
+        if( retired->generation <= oldest ) {
+            *link = retired->next;
+            snapshot->release( retired->value );
+            free( retired );
+            continue;
+        }
+
+        waiting++;
+        link = &retired->next;
+    }
+
+    return waiting;
+}
+
+void * snapshot_acquire( snapshot_t * snapshot, size_t reader ) {
+    uint64_t generation;
+    void * value;
+    uint64_t sequence;
+
+    // The copy and its generation have to match: reporting an older one would pin the copy we hold until the next
+    // publish, and a newer one would let the writer free it under us. So retry if a publish was part way through.
+    do {
+        sequence = __atomic_load_n( &snapshot->sequence, __ATOMIC_ACQUIRE );
+        value = __atomic_load_n( &snapshot->current, __ATOMIC_ACQUIRE );
+        generation = __atomic_load_n( &snapshot->generation, __ATOMIC_ACQUIRE );
+    } while( (sequence & 1) != 0 || __atomic_load_n( &snapshot->sequence, __ATOMIC_ACQUIRE ) != sequence );
+
+    // Everything we did with older copies is finished before the writer can see this
+    __atomic_store_n( &snapshot->readers[reader].generation, generation, __ATOMIC_RELEASE );
+    return value;
+}
@@ -0,0 +1,113 @@
+/*
+ * GraphIPC
+ * Copyright (C) 2017  John Vidler (john@johnvidler.co.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/*
+ * A pointer published by one writer thread to a fixed set of reader threads, read-copy-update style.
+ *
+ * The writer builds a fresh copy of whatever the pointer refers to, and swaps it in. Readers pick
+ * up the latest copy with one load whenever they choose to, and may use it without any locking
+ * until they next do so - fetching the pointer again is a reader's promise that it has finished
+ * with anything older. The writer holds each replaced copy until every reader has made that
+ * promise, then hands it to 'release'.
+ *
+ * A reader that never fetches again holds every copy published since, so readers should fetch
+ * at least once per pass of their event loop.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define SNAPSHOT_CACHE_LINE 64
+
+/** The generation a reader last fetched, each on its own cache line */
+typedef struct {
+    uint64_t generation __attribute__((aligned(SNAPSHOT_CACHE_LINE)));
+} snapshot_reader_t;
+
+/** A replaced copy, waiting for the readers to move past it */
+typedef struct snapshot_retired {
+    void * value;
+    uint64_t generation; // Free once every reader has fetched this generation or later
+    struct snapshot_retired * next;
+} snapshot_retired_t;
+
+typedef struct {
+    void * current;
+    uint64_t generation; // Of 'current', counting from 1
+    uint64_t sequence;   // Odd while a publish is between swapping 'current' and bumping 'generation'
+
+    snapshot_reader_t * readers;
+    size_t reader_count;
+
+    snapshot_retired_t * retired; // Writer only, newest first
+    void (*release)( void * value );
+} snapshot_t;
+
+/**
+ * Sets up a snapshot with nothing published.
+ *
+ * @param snapshot The snapshot to initialise
+ * @param readers The number of reader threads, each of which is given an index below this
+ * @param release Frees a copy once no reader can be using it
+ * @return True on success, false if the reader slots could not be allocated
+ */
+bool snapshot_init( snapshot_t * snapshot, size_t readers, void (*release)( void * value ) );
+
+/**
+ * Releases the current copy and everything retired, whatever the readers are doing.
+ * Only call once the readers have stopped.
+ *
+ * @param snapshot The snapshot to destroy
+ */
+void snapshot_destroy( snapshot_t * snapshot );
+
+/**
+ * Writer only. Replace the current copy, retiring the old one.
+ *
+ * @param snapshot The snapshot to update
+ * @param value The new copy, which must not be changed again once published
+ */
+void snapshot_publish( snapshot_t * snapshot, void * value );
+
+/**
+ * Writer only. Release every retired copy that no reader can still be using.
+ *
+ * @param snapshot The snapshot to tidy
+ * @return The number of copies still waiting on a reader
+ */
+size_t snapshot_reclaim( snapshot_t * snapshot );
+
+/**
+ * Reader only. Fetch the current copy, giving up any copy fetched before.
+ *
+ * @param snapshot The snapshot to read
+ * @param reader This reader's index
+ * @return The current copy, or NULL if nothing has been published yet
+ */
+void * snapshot_acquire( snapshot_t * snapshot, size_t reader );
+
+/**
+ * @param snapshot The snapshot to inspect
+ * @return The generation of the current copy, 0 if nothing has been published yet. Cheap enough
+ *         for a reader to poll, to see whether snapshot_acquire() would return anything new.
+ */
+static inline uint64_t snapshot_generation( snapshot_t * snapshot ) {
+    return __atomic_load_n( &snapshot->generation, __ATOMIC_ACQUIRE );
+}
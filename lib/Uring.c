@@ -0,0 +1,301 @@
+/*
+ * GraphIPC
+ * Copyright (C) 2017  John Vidler (john@johnvidler.co.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include "Uring.h"
+
+static int uring_setup( unsigned entries, struct io_uring_params * params ) {
+    int fd = (int)syscall( __NR_io_uring_setup, entries, params );
+    return fd < 0 ? -errno : fd;
+}
+
+static int uring_enter( int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void * arg, size_t arg_size ) {
+    int result = (int)syscall( __NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size );
+    return result < 0 ? -errno : result;
+}
+
+static int uring_register( int fd, unsigned opcode, const void * arg, unsigned count ) {
+    int result = (int)syscall( __NR_io_uring_register, fd, opcode, arg, count );
+    return result < 0 ? -errno : result;
+}
+
+int uring_init( uring_t * ring, unsigned entries ) {
+    memset( ring, 0, sizeof(uring_t) );
+
+    struct io_uring_params params;
+    memset( &params, 0, sizeof(params) );
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+
+    int fd = uring_setup( entries, &params );
+    if( fd < 0 )
+        return fd;
+
+    ring->ring_fd = fd;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    // Newer kernels share one mapping between both rings
+    if( params.features & IORING_FEAT_SINGLE_MMAP ) {
+        if( ring->cq_ring_size > ring->sq_ring_size )
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap( NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING );
+    if( ring->sq_ring == MAP_FAILED ) {
+        int error = -errno;
+        close( fd );
+        return error;
+    }
+
+    if( params.features & IORING_FEAT_SINGLE_MMAP )
+        ring->cq_ring = ring->sq_ring;
+    else {
+        ring->cq_ring = mmap( NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING );
+        if( ring->cq_ring == MAP_FAILED ) {
+            int error = -errno;
+            munmap( ring->sq_ring, ring->sq_ring_size );
+            close( fd );
+            return error;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap( NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES );
+    if( ring->sqes == MAP_FAILED ) {
+        int error = -errno;
+        uring_exit( ring );
+        return error;
+    }
+
+    uint8_t * sq = (uint8_t *)ring->sq_ring;
+    ring->sq_head  = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail  = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask  = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+
+    uint8_t * cq = (uint8_t *)ring->cq_ring;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes    = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // We never reorder SQEs, so the indirection array is a fixed identity mapping
+    for( unsigned i = 0; i < params.sq_entries; i++ )
+        ring->sq_array[i] = i;
+
+    return 0;
+}
+
+void uring_exit( uring_t * ring ) {
+    if( ring->sqes != NULL && ring->sqes != MAP_FAILED )
+        munmap( ring->sqes, ring->sqes_size );
+    if( ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring )
+        munmap( ring->cq_ring, ring->cq_ring_size );
+    if( ring->sq_ring != NULL )
+        munmap( ring->sq_ring, ring->sq_ring_size );
+    if( ring->ring_fd > 0 )
+        close( ring->ring_fd );
+
+    memset( ring, 0, sizeof(uring_t) );
+    ring->ring_fd = -1;
+}
+
+struct io_uring_sqe * uring_get_sqe( uring_t * ring ) {
+    unsigned head = __atomic_load_n( ring->sq_head, __ATOMIC_ACQUIRE );
+
+    // Full? Push what we have to the kernel and try again
+    if( ring->sqe_tail - head > *ring->sq_mask ) {
+        if( uring_submit( ring, 0, 0 ) < 0 )
+            return NULL;
+        head = __atomic_load_n( ring->sq_head, __ATOMIC_ACQUIRE );
+        if( ring->sqe_tail - head > *ring->sq_mask )
+            return NULL;
+    }
+
+    struct io_uring_sqe * sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+    ring->sqe_tail++;
+
+    memset( sqe, 0, sizeof(struct io_uring_sqe) );
+    return sqe;
+}
+
+int uring_submit( uring_t * ring, unsigned wait_nr, int timeout ) {
+    unsigned to_submit = ring->sqe_tail - ring->sqe_head;
+    ring->sqe_head = ring->sqe_tail;
+
+    __atomic_store_n( ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE );
+
+    if( to_submit == 0 && wait_nr == 0 )
+        return 0;
+
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+
+    // Bounded waits go through the extended argument, so we don't need a timeout SQE per wait
+    struct __kernel_timespec ts = { .tv_sec = timeout / 1000, .tv_nsec = (timeout % 1000) * 1000000L };
+    struct io_uring_getevents_arg arg;
+    memset( &arg, 0, sizeof(arg) );
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+
+    int result;
+    do {
+        if( wait_nr > 0 && timeout > -1 )
+            result = uring_enter( ring->ring_fd, to_submit, wait_nr, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg) );
+        else
+            result = uring_enter( ring->ring_fd, to_submit, wait_nr, flags, NULL, 0 );
+
+        // Anything consumed on the first attempt must not be counted again
+        if( result == -EINTR )
+            to_submit = 0;
+    } while( result == -EINTR );
+
+    return result;
+}
+
+struct io_uring_cqe * uring_peek_cqe( uring_t * ring ) {
+    unsigned head = *ring->cq_head;
+    if( head == __atomic_load_n( ring->cq_tail, __ATOMIC_ACQUIRE ) )
+        return NULL;
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen( uring_t * ring ) {
+    __atomic_store_n( ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE );
+}
+
+int uring_register_buffers( uring_t * ring, const struct iovec * iov, unsigned count ) {
+    return uring_register( ring->ring_fd, IORING_REGISTER_BUFFERS, iov, count );
+}
+
+int uring_buf_ring_init( uring_t * ring, uring_buf_ring_t * buf_ring, uint16_t group, unsigned entries, size_t buffer_size ) {
+    memset( buf_ring, 0, sizeof(uring_buf_ring_t) );
+
+    buf_ring->ring_size = entries * sizeof(struct io_uring_buf);
+    buf_ring->ring = mmap( NULL, buf_ring->ring_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0 );
+    if( buf_ring->ring == MAP_FAILED )
+        return -errno;
+
+    buf_ring->buffers = (uint8_t *)malloc( entries * buffer_size );
+    if( buf_ring->buffers == NULL ) {
+        munmap( buf_ring->ring, buf_ring->ring_size );
+        return -ENOMEM;
+    }
+
+    buf_ring->buffer_size = buffer_size;
+    buf_ring->entries = entries;
+    buf_ring->group = group;
+
+    struct io_uring_buf_reg reg;
+    memset( &reg, 0, sizeof(reg) );
+    reg.ring_addr = (uint64_t)(uintptr_t)buf_ring->ring;
+    reg.ring_entries = entries;
+    reg.bgid = group;
+
+    int result = uring_register( ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1 );
+    if( result < 0 ) {
+        free( buf_ring->buffers );
+        munmap( buf_ring->ring, buf_ring->ring_size );
+        return result;
+    }
+
+    for( unsigned bid = 0; bid < entries; bid++ )
+        uring_buf_ring_recycle( buf_ring, (uint16_t)bid );
+
+    return 0;
+}
+
+void uring_buf_ring_exit( uring_t * ring, uring_buf_ring_t * buf_ring ) {
+    struct io_uring_buf_reg reg;
+    memset( &reg, 0, sizeof(reg) );
+    reg.bgid = buf_ring->group;
+    uring_register( ring->ring_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1 );
+
+    free( buf_ring->buffers );
+    munmap( buf_ring->ring, buf_ring->ring_size );
+    memset( buf_ring, 0, sizeof(uring_buf_ring_t) );
+}
+
+uint8_t * uring_buf_ring_get( uring_buf_ring_t * buf_ring, uint16_t bid ) {
+    return buf_ring->buffers + (bid * buf_ring->buffer_size);
+}
+
+void uring_buf_ring_recycle( uring_buf_ring_t * buf_ring, uint16_t bid ) {
+    struct io_uring_buf * buf = &buf_ring->ring->bufs[buf_ring->tail & (buf_ring->entries - 1)];
+    buf->addr = (uint64_t)(uintptr_t)uring_buf_ring_get( buf_ring, bid );
+    buf->len = (uint32_t)buf_ring->buffer_size;
+    buf->bid = bid;
+
+    buf_ring->tail++;
+    __atomic_store_n( &buf_ring->ring->tail, buf_ring->tail, __ATOMIC_RELEASE );
+}
+
+void uring_prep_accept_multishot( struct io_uring_sqe * sqe, int fd, uint64_t user_data ) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_recv_multishot( struct io_uring_sqe * sqe, int fd, uint16_t group, uint64_t user_data ) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = group;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_send( struct io_uring_sqe * sqe, int fd, const void * buffer, size_t length, uint64_t user_data ) {
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = (uint32_t)length;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_write_fixed( struct io_uring_sqe * sqe, int fd, const void * buffer, size_t length, uint16_t buf_index, uint64_t user_data ) {
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = fd;
+    sqe->off = (uint64_t)-1; // Sockets have no file position, use the stream
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = (uint32_t)length;
+    sqe->buf_index = buf_index;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_poll_multishot( struct io_uring_sqe * sqe, int fd, uint32_t events, uint64_t user_data ) {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = events;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_cancel( struct io_uring_sqe * sqe, uint64_t target_user_data, uint64_t user_data ) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target_user_data;
+    sqe->user_data = user_data;
+}
@@ -0,0 +1,159 @@
+/*
+ * GraphIPC
+ * Copyright (C) 2017  John Vidler (john@johnvidler.co.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/*
+ * A minimal io_uring wrapper, built directly on the kernel interface so we don't need liburing.
+ * Only the handful of operations the router data path actually uses are provided.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+typedef struct {
+    int ring_fd;
+
+    // Submission queue
+    unsigned * sq_head;
+    unsigned * sq_tail;
+    unsigned * sq_mask;
+    unsigned * sq_array;
+    struct io_uring_sqe * sqes;
+    unsigned sqe_head;  // Local; SQEs handed out but not yet published to the kernel
+    unsigned sqe_tail;
+
+    // Completion queue
+    unsigned * cq_head;
+    unsigned * cq_tail;
+    unsigned * cq_mask;
+    struct io_uring_cqe * cqes;
+
+    // Mappings, for teardown
+    void * sq_ring;
+    size_t sq_ring_size;
+    void * cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} uring_t;
+
+/** A kernel-provided buffer ring, used for multishot receives */
+typedef struct {
+    struct io_uring_buf_ring * ring;
+    size_t ring_size;
+    uint8_t * buffers;
+    size_t buffer_size;
+    unsigned entries;
+    uint16_t group;
+    uint16_t tail;
+} uring_buf_ring_t;
+
+/**
+ * Sets up a new ring with 'entries' submission slots, and four times as many completion slots
+ * (multishot operations can post many completions per submission).
+ *
+ * @param ring The ring structure to initialise
+ * @param entries The submission queue depth, must be a power of two
+ * @return 0 on success, or -errno on failure
+ */
+int uring_init( uring_t * ring, unsigned entries );
+
+/**
+ * Unmaps and closes the ring. Outstanding operations are abandoned.
+ *
+ * @param ring The ring to tear down
+ */
+void uring_exit( uring_t * ring );
+
+/**
+ * Fetch a blank SQE to fill in. If the submission queue is full, pending entries are
+ * submitted first to make room.
+ *
+ * @param ring The ring to use
+ * @return A zeroed SQE, or NULL if no space could be made
+ */
+struct io_uring_sqe * uring_get_sqe( uring_t * ring );
+
+/**
+ * Publishes every SQE handed out since the last call, and optionally waits for completions.
+ * This is the only place a syscall is made, so an entire batch costs one io_uring_enter().
+ *
+ * @param ring The ring to submit on
+ * @param wait_nr The minimum number of completions to wait for (0 to not wait)
+ * @param timeout Maximum time to wait in milliseconds, or -1 to wait indefinitely
+ * @return The number of SQEs consumed, -ETIME on timeout, or -errno on failure
+ */
+int uring_submit( uring_t * ring, unsigned wait_nr, int timeout );
+
+/**
+ * @param ring The ring to inspect
+ * @return The next available completion, or NULL if the completion queue is empty
+ */
+struct io_uring_cqe * uring_peek_cqe( uring_t * ring );
+
+/**
+ * Marks the completion last returned by uring_peek_cqe as consumed.
+ *
+ * @param ring The ring to advance
+ */
+void uring_cqe_seen( uring_t * ring );
+
+/**
+ * Registers fixed buffers for use with uring_prep_write_fixed.
+ *
+ * @param ring The ring to register against
+ * @param iov The buffer list
+ * @param count The number of entries in 'iov'
+ * @return 0 on success, or -errno on failure
+ */
+int uring_register_buffers( uring_t * ring, const struct iovec * iov, unsigned count );
+
+/**
+ * Allocates and registers a provided buffer ring, pre-filled with every buffer.
+ *
+ * @param ring The ring to register against
+ * @param buf_ring The buffer ring structure to initialise
+ * @param group The buffer group ID receives will select from
+ * @param entries The number of buffers, must be a power of two
+ * @param buffer_size The size of each buffer
+ * @return 0 on success, or -errno on failure
+ */
+int uring_buf_ring_init( uring_t * ring, uring_buf_ring_t * buf_ring, uint16_t group, unsigned entries, size_t buffer_size );
+
+/**
+ * Unregisters and frees a provided buffer ring.
+ */
+void uring_buf_ring_exit( uring_t * ring, uring_buf_ring_t * buf_ring );
+
+/**
+ * @return A pointer to the data for buffer 'bid'
+ */
+uint8_t * uring_buf_ring_get( uring_buf_ring_t * buf_ring, uint16_t bid );
+
+/**
+ * Hands buffer 'bid' back to the kernel once we are finished with its contents.
+ */
+void uring_buf_ring_recycle( uring_buf_ring_t * buf_ring, uint16_t bid );
+
+void uring_prep_accept_multishot( struct io_uring_sqe * sqe, int fd, uint64_t user_data );
+void uring_prep_recv_multishot( struct io_uring_sqe * sqe, int fd, uint16_t group, uint64_t user_data );
+void uring_prep_send( struct io_uring_sqe * sqe, int fd, const void * buffer, size_t length, uint64_t user_data );
+void uring_prep_write_fixed( struct io_uring_sqe * sqe, int fd, const void * buffer, size_t length, uint16_t buf_index, uint64_t user_data );
+void uring_prep_poll_multishot( struct io_uring_sqe * sqe, int fd, uint32_t events, uint64_t user_data );
+void uring_prep_cancel( struct io_uring_sqe * sqe, uint64_t target_user_data, uint64_t user_data );
@@ -0,0 +1,144 @@
+/*
+ * GraphIPC
+ * Copyright (C) 2017  John Vidler (john@johnvidler.co.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <linux/errqueue.h>
+#include "ZeroCopy.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+bool zerocopy_enable( zerocopy_t * zerocopy, int fd ) {
+    memset( zerocopy, 0, sizeof(zerocopy_t) );
+
+    int flag = 1;
+    zerocopy->enabled = setsockopt( fd, SOL_SOCKET, SO_ZEROCOPY, &flag, sizeof flag ) == 0;
+    return zerocopy->enabled;
+}
+
+ssize_t zerocopy_sendmsg( zerocopy_t * zerocopy, int fd, struct msghdr * message, int flags ) {
+    ssize_t sent = sendmsg( fd, message, flags | MSG_ZEROCOPY );
+
+    // A send that fails outright hands its number back
+    if( sent > 0 )
+        zerocopy->sent++;
+    return sent;
+}
+
+/**
+ * Mark sends low to high (inclusive) as complete, holding the range back if an earlier one is still outstanding.
+ */
+static void zerocopy_done( zerocopy_t * zerocopy, uint32_t low, uint32_t high ) {
+    if( (int32_t)(low - zerocopy->completed) > 0 ) {
+        if( zerocopy->deferred_count < ZEROCOPY_DEFERRED ) {
+            zerocopy->deferred[zerocopy->deferred_count].low = low;
+            zerocopy->deferred[zerocopy->deferred_count].high = high;
+            zerocopy->deferred_count++;
+        }
+        // With no room, the range is only picked up if a later one covers it, so the buffers are held a little longer
+        return;
+    }
+
+    if( (int32_t)(high + 1 - zerocopy->completed) > 0 )
+        zerocopy->completed = high + 1;
+
+    // Anything held back may follow on now
+    bool progress = true;
+    while( progress ) {
+        progress = false;
+        for( int i = 0; i < zerocopy->deferred_count; i++ ) {
+            if( (int32_t)(zerocopy->deferred[i].low - zerocopy->completed) > 0 )
+                continue;
+
+            if( (int32_t)(zerocopy->deferred[i].high + 1 - zerocopy->completed) > 0 )
+                zerocopy->completed = zerocopy->deferred[i].high + 1;
+            zerocopy->deferred[i] = zerocopy->deferred[--zerocopy->deferred_count];
+            progress = true;
+            break;
+        }
+    }
+}
+
+int zerocopy_reap( zerocopy_t * zerocopy, int fd ) {
+    uint32_t before = zerocopy->completed;
+
+    while( true ) {
+        union {
+            struct cmsghdr align;
+            uint8_t space[CMSG_SPACE( sizeof(struct sock_extended_err) + sizeof(struct sockaddr_storage) )];
+        } control;
+        struct msghdr message = { .msg_control = &control, .msg_controllen = sizeof control };
+
+        if( recvmsg( fd, &message, MSG_ERRQUEUE | MSG_DONTWAIT ) == -1 ) {
+            if( errno == EINTR )
+                continue;
+            if( errno == EAGAIN || errno == EWOULDBLOCK )
+                break;
+            return -1;
+        }
+
+        for( struct cmsghdr * cmsg = CMSG_FIRSTHDR( &message ); cmsg != NULL; cmsg = CMSG_NXTHDR( &message, cmsg ) ) {
+            struct sock_extended_err error;
+            memcpy( &error, CMSG_DATA( cmsg ), sizeof error );
+
+            if( error.ee_origin != SO_EE_ORIGIN_ZEROCOPY ) {
+                if( error.ee_errno != 0 ) {
+                    errno = (int)error.ee_errno;
+                    return -1;
+                }
+                continue;
+            }
+
+            zerocopy_done( zerocopy, error.ee_info, error.ee_data );
+
+            if( error.ee_code & SO_EE_CODE_ZEROCOPY_COPIED ) {
+                zerocopy->copied += error.ee_data - error.ee_info + 1;
+                if( zerocopy->copied >= ZEROCOPY_GIVE_UP )
+                    zerocopy->enabled = false;
+            }
+            else
+                zerocopy->copied = 0;
+        }
+    }
+
+    return (int)(zerocopy->completed - before);
+}
+
+bool zerocopy_wait( zerocopy_t * zerocopy, int fd ) {
+    while( zerocopy_pending( zerocopy ) > 0 ) {
+        // Completions show up as an error condition, which poll() always reports
+        struct pollfd wait = { .fd = fd, .events = 0 };
+        if( poll( &wait, 1, 100 ) == -1 && errno != EINTR )
+            return false;
+
+        if( zerocopy_reap( zerocopy, fd ) == -1 || (wait.revents & (POLLHUP | POLLNVAL)) )
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,117 @@
+/*
+ * GraphIPC
+ * Copyright (C) 2017  John Vidler (john@johnvidler.co.uk)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/*
+ * MSG_ZEROCOPY sends over TCP.
+ *
+ * A zero-copy send pins the caller's pages rather than copying them into the kernel, so the
+ * buffer has to be left untouched until the kernel says it is done with it. Completions come
+ * back on the socket's error queue as ranges of send numbers (the kernel counts every
+ * successful zero-copy send, from 0), and are reaped with zerocopy_reap(). A socket with
+ * completions waiting reports an error condition to poll()/epoll, which is not a failure.
+ *
+ * When the kernel has to copy anyway (loopback, or a device without scatter-gather) it says
+ * so in the completion. Zero-copy then only costs extra, so a socket that sees nothing but
+ * copies for ZEROCOPY_GIVE_UP sends in a row is switched back to ordinary sends.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+// Consecutive copied completions before zero-copy is given up on
+#define ZEROCOPY_GIVE_UP 64
+
+// Completions that arrived ahead of an earlier, still outstanding, range
+#define ZEROCOPY_DEFERRED 16
+
+typedef struct {
+    bool enabled;
+    uint32_t sent;      // Zero-copy sends made so far, the number of the next one
+    uint32_t completed; // Every send numbered below this has completed
+    uint32_t copied;    // Consecutive completions where the kernel copied after all
+
+    struct {            // Out of order ranges, held until 'completed' catches up with them
+        uint32_t low;
+        uint32_t high;
+    } deferred[ZEROCOPY_DEFERRED];
+    int deferred_count;
+} zerocopy_t;
+
+/**
+ * Turn on SO_ZEROCOPY for a socket.
+ *
+ * @param zerocopy The tracking state to initialise
+ * @param fd A TCP socket
+ * @return True if the socket supports zero-copy sends
+ */
+bool zerocopy_enable( zerocopy_t * zerocopy, int fd );
+
+/**
+ * sendmsg() with MSG_ZEROCOPY, numbering the send if anything went.
+ *
+ * Everything 'message' points at must stay unchanged until zerocopy_complete() is true for
+ * the send's number, which is zerocopy->sent - 1 after a successful call.
+ *
+ * @param zerocopy The socket's tracking state
+ * @param fd The socket
+ * @param message The message to send
+ * @param flags Any other send flags
+ * @return As sendmsg(). ENOBUFS means too many completions are outstanding, send it normally.
+ */
+ssize_t zerocopy_sendmsg( zerocopy_t * zerocopy, int fd, struct msghdr * message, int flags );
+
+/**
+ * Read every completion waiting on the socket's error queue, without blocking.
+ *
+ * @param zerocopy The socket's tracking state
+ * @param fd The socket
+ * @return The number of sends newly completed, or -1 if the error queue held a real error (errno is set)
+ */
+int zerocopy_reap( zerocopy_t * zerocopy, int fd );
+
+/**
+ * Block until every send so far has completed.
+ *
+ * @param zerocopy The socket's tracking state
+ * @param fd The socket
+ * @return False if the socket failed first, in which case the kernel may still hold the pages
+ */
+bool zerocopy_wait( zerocopy_t * zerocopy, int fd );
+
+/**
+ * @return The number of sends still waiting on their completion
+ */
+static inline uint32_t zerocopy_pending( zerocopy_t * zerocopy ) {
+    return zerocopy->sent - zerocopy->completed;
+}
+
+/**
+ * @param zerocopy The socket's tracking state
+ * @param send A send number
+ * @return True if the kernel is finished with that send's buffers
+ */
+static inline bool zerocopy_complete( zerocopy_t * zerocopy, uint32_t send ) {
+    return (int32_t)(zerocopy->completed - send) > 0;
+}